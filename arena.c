@@ -0,0 +1,146 @@
+#include "arena.h"
+#include "pool.h"
+#include "report.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The header takes a whole cache line so the data after it stays aligned
+struct Arena_Block {
+    Arena_Block *prev;
+    size_t size;  // usable bytes after the header
+    size_t used;
+    size_t dirty; // bytes from the start that may not be zero
+};
+
+#define BLOCK_HEADER                                                           \
+    ((sizeof(Arena_Block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static inline size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static inline uint8_t *block_data(Arena_Block *block) {
+    return (uint8_t *)block + BLOCK_HEADER;
+}
+
+static Arena_Block *block_new(Arena *arena, size_t size) {
+    size = align_up(size);
+    bool zeroed = false;
+    Arena_Block *block = pool_alloc(BLOCK_HEADER + size, &zeroed);
+    if (!block) {
+        report_error("Error: Arena could not allocate %zu bytes.\n", size);
+        return NULL;
+    }
+    block->prev = NULL;
+    block->size = size;
+    block->used = 0;
+    // Fresh pages from the pool need no clearing by arena_calloc
+    block->dirty = zeroed ? 0 : size;
+    arena->block_count++;
+    return block;
+}
+
+void arena_init(Arena *arena) {
+    arena->block = NULL;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->block_count = 0;
+}
+
+// 'dirty' is how many bytes at the start of the allocation may not be zero
+static void *bump(Arena *arena, size_t byte_count, size_t *dirty) {
+    if (!arena) {
+        report_error("Error: No arena for a %zu byte buffer.\n",
+                byte_count);
+        return NULL;
+    }
+    // align_up would wrap
+    if (byte_count > SIZE_MAX / 2) {
+        report_error("Error: Arena request of %zu bytes is too large.\n",
+                byte_count);
+        return NULL;
+    }
+    size_t size = align_up(byte_count ? byte_count : 1);
+    Arena_Block *block = arena->block;
+
+    if (!block || block->size - block->used < size) {
+        Arena_Block *fresh =
+            block_new(arena, size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+        if (!fresh) {
+            return NULL;
+        }
+        fresh->prev = block;
+        arena->block = block = fresh;
+    }
+
+    void *p = block_data(block) + block->used;
+    *dirty = block->dirty > block->used ? block->dirty - block->used : 0;
+    block->used += size;
+    if (block->dirty < block->used) {
+        block->dirty = block->used;
+    }
+    arena->used += size;
+    return p;
+}
+
+void *arena_alloc(Arena *arena, size_t byte_count) {
+    size_t dirty;
+    return bump(arena, byte_count, &dirty);
+}
+
+void *arena_calloc(Arena *arena, size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    size_t byte_count = count * size;
+    size_t dirty = 0;
+    void *p = bump(arena, byte_count, &dirty);
+    if (p) {
+        memset(p, 0, dirty < byte_count ? dirty : byte_count);
+    }
+    return p;
+}
+
+char *arena_strdup(Arena *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = arena_alloc(arena, len);
+    if (copy) {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+void arena_reset(Arena *arena) {
+    if (arena->used > arena->peak) {
+        arena->peak = arena->used;
+    }
+    arena->used = 0;
+
+    Arena_Block *block = arena->block;
+    if (block && block->prev) {
+        // More than one block: replace them with one that holds the whole
+        // job, the next job of this size is a single bump per buffer.
+        size_t total = 0;
+        while (block) {
+            Arena_Block *prev = block->prev;
+            total += block->size;
+            pool_release(block);
+            block = prev;
+        }
+        arena->block = block_new(arena, total);
+    } else if (block) {
+        block->used = 0;
+    }
+}
+
+void arena_free(Arena *arena) {
+    Arena_Block *block = arena->block;
+    while (block) {
+        Arena_Block *prev = block->prev;
+        pool_release(block);
+        block = prev;
+    }
+    arena->block = NULL;
+    arena->used = 0;
+}
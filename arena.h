@@ -0,0 +1,48 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump allocator for the buffers of one image job: pixel data, row
+// pointers, colour tables, histograms, scratch planes and the filename
+// strings. Nothing is freed on its own, arena_reset drops everything at
+// once when the job is done. After a reset the blocks are merged into one
+// block the size of everything the job used, so running the next job of
+// the same size (batch or daemon use) needs no malloc at all. Blocks come
+// from the buffer pool (pool.h) and go back to it, so arenas of different
+// jobs or threads share memory too.
+//
+// Not thread-safe, allocate outside parallel regions.
+
+// Every allocation starts on a cache line
+#define ARENA_ALIGN 64
+// Smallest block, allocations larger than this get a block of their own
+#define ARENA_BLOCK_SIZE (1u << 20)
+
+typedef struct Arena_Block Arena_Block;
+
+typedef struct {
+    Arena_Block *block;   // current block, older ones are chained behind it
+    size_t used;          // bytes handed out since the last reset
+    size_t peak;          // largest 'used' seen by a reset
+    uint32_t block_count; // blocks taken from the pool since arena_init
+} Arena;
+
+void arena_init(Arena *arena);
+
+// ARENA_ALIGN aligned, contents undefined. NULL if out of memory.
+void *arena_alloc(Arena *arena, size_t byte_count);
+
+// Zeroed, like calloc
+void *arena_calloc(Arena *arena, size_t count, size_t size);
+
+char *arena_strdup(Arena *arena, const char *s);
+
+// Forget every allocation, keep the memory for the next job
+void arena_reset(Arena *arena);
+
+// Give all the memory back
+void arena_free(Arena *arena);
+
+#endif
@@ -0,0 +1,477 @@
+// Quantizer and dither speed/quality benchmark.
+// make bench && ./bench [width height]
+// Builds a synthetic photo-like 24-bit image (gradients, soft blobs and
+// noise), reduces it with every quantizer at 16 and 256 colours and prints
+// the time and the error against the original. Then runs every error
+// diffusion kernel to 1-bit mono and to a 16 colour palette. Last, a
+// chain of blurs over the whole image op by op against the same chain on
+// cache sized tiles, with the last level and L1 data cache misses of each
+// where the hardware counters can be read.
+
+#include "box_blur.h"
+#include "dither.h"
+#include "pool.h"
+#include "reduce_colors_24.h"
+#include "tile.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static double now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static uint8_t to_byte(float v) {
+    return (uint8_t)(v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v));
+}
+
+// Padded BGR rows, like a BMP pixel array
+static uint8_t *make_image(uint32_t width, uint32_t height, uint32_t stride) {
+    uint8_t *buf = calloc((size_t)stride * height, 1);
+    if (!buf) {
+        return NULL;
+    }
+    srand(12345);
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = buf + (size_t)y * stride;
+        float v = (float)y / height;
+        for (uint32_t x = 0; x < width; x++) {
+            float u = (float)x / width;
+            // sky to ground gradient with two soft blobs
+            float b = 200.0f * (1.0f - v) + 40.0f * u;
+            float g = 120.0f + 80.0f * sinf(3.0f * u) * v;
+            float r = 60.0f + 150.0f * v * v;
+            float d1 = (u - 0.3f) * (u - 0.3f) + (v - 0.4f) * (v - 0.4f);
+            float d2 = (u - 0.7f) * (u - 0.7f) + (v - 0.6f) * (v - 0.6f);
+            r += 180.0f * expf(-d1 * 40.0f);
+            g += 90.0f * expf(-d2 * 25.0f);
+            float noise = (float)(rand() % 17 - 8);
+            row[x * 3 + 0] = to_byte(b + noise);
+            row[x * 3 + 1] = to_byte(g + noise);
+            row[x * 3 + 2] = to_byte(r + noise);
+        }
+    }
+    return buf;
+}
+
+static double mse(const uint8_t *buf, uint32_t width, uint32_t height,
+                  uint32_t stride, const uint8_t *idx, const Color *pal) {
+    double err = 0.0;
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = buf + (size_t)y * stride;
+        for (uint32_t x = 0; x < width; x++) {
+            Color c = pal[idx[(size_t)y * width + x]];
+            int dr = row[x * 3 + 0] - c.r;
+            int dg = row[x * 3 + 1] - c.g;
+            int db = row[x * 3 + 2] - c.b;
+            err += dr * dr + dg * dg + db * db;
+        }
+    }
+    return err / (3.0 * width * height);
+}
+
+// Dithering trades per pixel error for tone, so besides the plain PSNR
+// compare the means of BLOCK x BLOCK blocks, what the eye sees at a
+// distance.
+#define BLOCK 4
+
+static double psnr(double mse) {
+    return 10.0 * log10(255.0 * 255.0 / (mse > 0.0 ? mse : 1e-9));
+}
+
+// Mean squared error of one 8-bit plane against another, per pixel and
+// per block mean
+static void plane_error(const uint8_t *a, const uint8_t *b, uint32_t width,
+                        uint32_t height, double *pixel_mse,
+                        double *block_mse) {
+    double err = 0.0, block_err = 0.0;
+    for (uint32_t i = 0; i < width * height; i++) {
+        double d = (double)a[i] - b[i];
+        err += d * d;
+    }
+    uint32_t blocks = 0;
+    for (uint32_t by = 0; by + BLOCK <= height; by += BLOCK) {
+        for (uint32_t bx = 0; bx + BLOCK <= width; bx += BLOCK) {
+            int sa = 0, sb = 0;
+            for (uint32_t y = by; y < by + BLOCK; y++) {
+                for (uint32_t x = bx; x < bx + BLOCK; x++) {
+                    sa += a[y * width + x];
+                    sb += b[y * width + x];
+                }
+            }
+            double d = (double)(sa - sb) / (BLOCK * BLOCK);
+            block_err += d * d;
+            blocks++;
+        }
+    }
+    *pixel_mse = err / ((double)width * height);
+    *block_mse = blocks ? block_err / blocks : 0.0;
+}
+
+static void bench_diffusion(const uint8_t *buf, uint32_t width,
+                            uint32_t height, uint32_t stride) {
+    size_t npix = (size_t)width * height;
+    uint8_t *lum = malloc(npix);
+    uint8_t *out = malloc(npix);
+    uint8_t *flat = malloc(npix * 3);
+    if (!lum || !out || !flat) {
+        fprintf(stderr, "Error: Could not allocate the dither buffers.\n");
+        free(lum);
+        free(out);
+        free(flat);
+        return;
+    }
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = buf + (size_t)y * stride;
+        for (uint32_t x = 0; x < width; x++) {
+            lum[(size_t)y * width + x] =
+                (uint8_t)(0.114f * row[x * 3 + 0] + 0.587f * row[x * 3 + 1] +
+                          0.299f * row[x * 3 + 2] + 0.5f);
+        }
+    }
+
+    printf("\n%-10s %10s %8s %8s   %10s %8s %8s\n", "dither", "mono ms",
+           "psnr", "tone", "16 col ms", "psnr", "tone");
+    for (int mode = DITHER_FS; mode <= DITHER_SIERRA; mode++) {
+        for (int serpentine = 0; serpentine < 2; serpentine++) {
+            double start = now_ms();
+            dither_diffuse_mono(lum, width, out, width, width, height,
+                                (Dither_Mode)mode, serpentine);
+            double mono_ms = now_ms() - start;
+            double mono_mse, mono_block;
+            plane_error(lum, out, width, height, &mono_mse, &mono_block);
+
+            uint8_t *idx = NULL;
+            Color *pal = NULL;
+            uint16_t psize = 0;
+            uint8_t flag = (uint8_t)mode | (serpentine ? DITHER_SERPENTINE : 0);
+            start = now_ms();
+            convert_24_to_indexed_tight(buf, width, height, stride, 4, 0, flag,
+                                        QUANT_MEDIAN, &idx, &pal, &psize);
+            double pal_ms = now_ms() - start;
+
+            // Per channel planes of the original and the result
+            double pal_mse = 0.0, pal_block = 0.0;
+            for (int c = 0; c < 3; c++) {
+                uint8_t *orig = flat, *mapped = flat + npix;
+                for (uint32_t y = 0; y < height; y++) {
+                    const uint8_t *row = buf + (size_t)y * stride;
+                    for (uint32_t x = 0; x < width; x++) {
+                        size_t i = (size_t)y * width + x;
+                        Color p = pal[idx[i]];
+                        orig[i] = row[x * 3 + c];
+                        mapped[i] = c == 0 ? p.r : (c == 1 ? p.g : p.b);
+                    }
+                }
+                double m, b;
+                plane_error(orig, mapped, width, height, &m, &b);
+                pal_mse += m / 3.0;
+                pal_block += b / 3.0;
+            }
+            pool_release(idx);
+            free(pal);
+
+            char name[32];
+            snprintf(name, sizeof(name), "%s%s", dither_name(mode),
+                     serpentine ? "/s" : "");
+            printf("%-10s %10.1f %8.2f %8.2f   %10.1f %8.2f %8.2f\n", name,
+                   mono_ms, psnr(mono_mse), psnr(mono_block), pal_ms,
+                   psnr(pal_mse), psnr(pal_block));
+        }
+    }
+
+    free(lum);
+    free(out);
+    free(flat);
+}
+
+// Hardware cache counters of this process, read with perf_event_open:
+// last level cache misses and L1 data cache read misses. Each is -1 where
+// it cannot be opened (not Linux, no PMU in a VM, perf_event_paranoid),
+// and cache_counter_error says why.
+enum { COUNTER_LLC, COUNTER_L1D, COUNTER_COUNT };
+
+typedef struct {
+    int fd[COUNTER_COUNT];
+} Cache_Counters;
+
+static char cache_counter_error[128];
+
+#ifdef __linux__
+static int cache_counter_open(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.inherit = 1; // the OpenMP threads as well
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0 && !cache_counter_error[0]) {
+        snprintf(cache_counter_error, sizeof(cache_counter_error),
+                 "perf_event_open: %s", strerror(errno));
+    }
+    return fd;
+}
+#endif
+
+static void cache_counter_start(Cache_Counters *counters) {
+#ifdef __linux__
+    counters->fd[COUNTER_LLC] =
+        cache_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    counters->fd[COUNTER_L1D] = cache_counter_open(
+        PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters->fd[i] >= 0) {
+            ioctl(counters->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        counters->fd[i] = -1;
+    }
+    snprintf(cache_counter_error, sizeof(cache_counter_error),
+             "perf_event_open is Linux only");
+#endif
+}
+
+static void cache_counter_stop(Cache_Counters *counters,
+                               long long count[COUNTER_COUNT]) {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        count[i] = -1;
+#ifdef __linux__
+        int fd = counters->fd[i];
+        if (fd < 0) {
+            continue;
+        }
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count[i], sizeof(count[i])) != sizeof(count[i])) {
+            count[i] = -1;
+        }
+        close(fd);
+#endif
+    }
+}
+
+#define TILE_BLURS 4
+#define TILE_RUNS 5
+
+static bool blur_tile(void *level, const Tile *tile) {
+    return box_blur_level(tile->rows, tile->width, tile->height,
+                          tile->channels, *(uint16_t *)level);
+}
+
+static void format_count(char *text, size_t size, long long count) {
+    if (count >= 0) {
+        snprintf(text, size, "%lld", count);
+    } else {
+        snprintf(text, size, "n/a");
+    }
+}
+
+static void print_tile_row(const char *name, double ms,
+                           const long long misses[COUNTER_COUNT],
+                           double traffic_mb) {
+    char llc[32];
+    char l1d[32];
+    format_count(llc, sizeof(llc), misses[COUNTER_LLC]);
+    format_count(l1d, sizeof(l1d), misses[COUNTER_L1D]);
+    printf("%-10s %10.1f %14s %14s %12.1f\n", name, ms, llc, l1d,
+           traffic_mb);
+}
+
+// Fastest of TILE_RUNS, with the counts of that run. reset puts the input
+// back before each run and is not timed.
+typedef struct {
+    double ms;
+    long long misses[COUNTER_COUNT];
+} Tile_Run;
+
+static void whole_blurs(uint8_t **rows, uint32_t width, uint32_t height,
+                        uint8_t *whole, const uint8_t *src, size_t bytes,
+                        Tile_Run *best) {
+    best->ms = INFINITY;
+    for (int run = 0; run < TILE_RUNS; run++) {
+        memcpy(whole, src, bytes);
+        Cache_Counters counters;
+        long long misses[COUNTER_COUNT];
+        cache_counter_start(&counters);
+        double start = now_ms();
+        for (int i = 0; i < TILE_BLURS; i++) {
+            box_blur_level(rows, width, height, 3, 1);
+        }
+        double ms = now_ms() - start;
+        cache_counter_stop(&counters, misses);
+        if (ms < best->ms) {
+            best->ms = ms;
+            memcpy(best->misses, misses, sizeof(misses));
+        }
+    }
+}
+
+static bool tiled_blurs(Tile_Chain *chain, Tile_Run *best) {
+    best->ms = INFINITY;
+    for (int run = 0; run < TILE_RUNS; run++) {
+        Cache_Counters counters;
+        long long misses[COUNTER_COUNT];
+        cache_counter_start(&counters);
+        double start = now_ms();
+        bool ok = tile_run(chain);
+        double ms = now_ms() - start;
+        cache_counter_stop(&counters, misses);
+        if (!ok) {
+            return false;
+        }
+        if (ms < best->ms) {
+            best->ms = ms;
+            memcpy(best->misses, misses, sizeof(misses));
+        }
+    }
+    return true;
+}
+
+// Tiled over whole, as a percentage change
+static void print_change(const char *what, double whole, double tiled) {
+    if (whole > 0 && tiled >= 0) {
+        printf("  %-14s %+6.1f%%\n", what, 100.0 * (tiled - whole) / whole);
+    }
+}
+
+// TILE_BLURS level 1 blurs, each over the whole image, then as one chain
+// on tiles, the fastest of TILE_RUNS each. The counters give the measured
+// misses. The modelled traffic is what goes to and from memory when an
+// image does not fit the cache and a tile does: each whole image pass
+// reads and writes the image, a chain reads each tile with its halo once
+// and writes it once.
+static void bench_tiles(const uint8_t *buf, uint32_t width, uint32_t height,
+                        uint32_t stride) {
+    size_t row_bytes = (size_t)width * 3;
+    size_t bytes = row_bytes * height;
+    uint8_t *whole = malloc(bytes);
+    uint8_t *tiled = malloc(bytes);
+    uint8_t **whole_rows = malloc(height * sizeof(uint8_t *));
+    uint8_t **src_rows = malloc(height * sizeof(uint8_t *));
+    uint8_t **dst_rows = malloc(height * sizeof(uint8_t *));
+    uint8_t *src = malloc(bytes);
+    if (!whole || !tiled || !whole_rows || !src_rows || !dst_rows || !src) {
+        fprintf(stderr, "Error: Could not allocate the tile buffers.\n");
+        goto done;
+    }
+    for (uint32_t y = 0; y < height; y++) {
+        memcpy(src + y * row_bytes, buf + (size_t)y * stride, row_bytes);
+        whole_rows[y] = whole + y * row_bytes;
+        src_rows[y] = src + y * row_bytes;
+        dst_rows[y] = tiled + y * row_bytes;
+    }
+    double image_mb = bytes / (1024.0 * 1024.0);
+
+    uint16_t level = 1;
+    Tile_Chain chain = {.src = src_rows, .dst = dst_rows,
+                        .width = width, .height = height, .channels = 3};
+    Tile_Op op = {.shape = TILE_STENCIL, .halo = box_blur_halo(level),
+                  .run = blur_tile, .context = &level};
+    for (int i = 0; i < TILE_BLURS; i++) {
+        tile_chain_add(&chain, &op);
+    }
+    uint32_t rows = tile_rows(&chain);
+    uint32_t halo = tile_chain_halo(&chain);
+
+    Tile_Run whole_run;
+    Tile_Run tiled_run;
+    whole_blurs(whole_rows, width, height, whole, src, bytes, &whole_run);
+    bool ok = tiled_blurs(&chain, &tiled_run);
+
+    printf("\n%-10s %10s %14s %14s %12s\n", "blur x4", "ms", "LLC misses",
+           "L1D misses", "model MB");
+    print_tile_row("whole", whole_run.ms, whole_run.misses,
+                   2.0 * TILE_BLURS * image_mb);
+    char name[32];
+    snprintf(name, sizeof(name), "tiles %u", rows);
+    print_tile_row(name, tiled_run.ms, tiled_run.misses,
+                   image_mb * (2.0 + 2.0 * halo / rows));
+    printf("tiles of %u rows, halo %u, fastest of %d runs, result %s\n",
+           rows, halo, TILE_RUNS,
+           ok && !memcmp(whole, tiled, bytes) ? "same" : "DIFFERENT");
+    printf("tiles against whole:\n");
+    print_change("time", whole_run.ms, tiled_run.ms);
+    if (cache_counter_error[0]) {
+        printf("  hardware cache counters unavailable (%s),\n"
+               "  they need a PMU and kernel.perf_event_paranoid <= 2: "
+               "only the times are measured\n",
+               cache_counter_error);
+    }
+    print_change("LLC misses", (double)whole_run.misses[COUNTER_LLC],
+                 (double)tiled_run.misses[COUNTER_LLC]);
+    print_change("L1D misses", (double)whole_run.misses[COUNTER_L1D],
+                 (double)tiled_run.misses[COUNTER_L1D]);
+
+done:
+    free(whole);
+    free(tiled);
+    free(whole_rows);
+    free(src_rows);
+    free(dst_rows);
+    free(src);
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t width = 1920, height = 1080;
+    if (argc == 3) {
+        width = (uint32_t)atoi(argv[1]);
+        height = (uint32_t)atoi(argv[2]);
+    }
+    if (!width || !height) {
+        fprintf(stderr, "Usage: %s [width height]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    uint32_t stride = (width * 3 + 3) & ~3u;
+    uint8_t *buf = make_image(width, height, stride);
+    if (!buf) {
+        fprintf(stderr, "Error: Could not allocate the test image.\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%ux%u synthetic image\n", width, height);
+    printf("%-8s %7s %10s %10s %8s\n", "quant", "colors", "ms", "mse",
+           "psnr");
+
+    const uint8_t bits[] = {4, 8};
+    for (int b = 0; b < 2; b++) {
+        for (int q = QUANT_MEDIAN; q <= QUANT_KMEANS; q++) {
+            uint8_t *idx = NULL;
+            Color *pal = NULL;
+            uint16_t psize = 0;
+            double start = now_ms();
+            convert_24_to_indexed_tight(buf, width, height, stride, bits[b],
+                                        0, 0, (Quantizer)q, &idx, &pal,
+                                        &psize);
+            double elapsed = now_ms() - start;
+            double e = mse(buf, width, height, stride, idx, pal);
+            printf("%-8s %7u %10.1f %10.2f %8.2f\n",
+                   quantizer_name((Quantizer)q), psize, elapsed, e, psnr(e));
+            pool_release(idx);
+            free(pal);
+        }
+    }
+
+    bench_diffusion(buf, width, height, stride);
+    bench_tiles(buf, width, height, stride);
+
+    free(buf);
+    return EXIT_SUCCESS;
+}
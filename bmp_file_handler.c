@@ -1,7 +1,15 @@
 
+// 64-bit off_t for fseeko and ftello on 32-bit Linux
+#define _FILE_OFFSET_BITS 64
+
 #include "bmp_file_handler.h"
+#include "checked.h"
+#include "dither.h"
 #include "image_data_handler.h"
+#include "pool.h"
 #include "reduce_colors_24.h"
+#include "repack.h"
+#include "report.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,30 +17,175 @@
 
 // Image_Data _img;
 
+// Pixel data moves in pieces of at most this many bytes. Some C libraries
+// fail single stdio calls of 2 or 4 GB and more, and a short read or write
+// can say how far it got.
+#define BMP_IO_CHUNK ((size_t)64 << 20)
+
+// 64-bit file offsets, long is 32 bits on Windows
+static int file_seek(FILE *file, uint64_t offset) {
+#if defined(_WIN32)
+    return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static uint64_t file_tell(FILE *file) {
+#if defined(_WIN32)
+    __int64 position = _ftelli64(file);
+#else
+    off_t position = ftello(file);
+#endif
+    return position > 0 ? (uint64_t)position : 0;
+}
+
+// Both return the bytes moved, byte_count unless the file ends or fails
+static size_t read_chunked(FILE *file, uint8_t *dst, size_t byte_count) {
+    size_t done = 0;
+    while (done < byte_count) {
+        size_t chunk = byte_count - done;
+        chunk = chunk < BMP_IO_CHUNK ? chunk : BMP_IO_CHUNK;
+        size_t got = fread(dst + done, 1, chunk, file);
+        done += got;
+        if (got != chunk) {
+            break;
+        }
+    }
+    return done;
+}
+
+static size_t write_chunked(FILE *file, const uint8_t *src,
+                            size_t byte_count) {
+    size_t done = 0;
+    while (done < byte_count) {
+        size_t chunk = byte_count - done;
+        chunk = chunk < BMP_IO_CHUNK ? chunk : BMP_IO_CHUNK;
+        size_t put = fwrite(src + done, 1, chunk, file);
+        done += put;
+        if (put != chunk) {
+            break;
+        }
+    }
+    return done;
+}
+
+// What a BMP is read from: a stream, where offset 0 is the stream position
+// it was handed over at, or a buffer
+typedef struct {
+    FILE *file;
+    uint64_t base;
+    const uint8_t *data;
+    size_t size;
+    size_t position;
+} Bmp_Source;
+
+static int source_seek(Bmp_Source *src, uint64_t offset) {
+    if (src->file) {
+        return file_seek(src->file, src->base + offset);
+    }
+    if (offset > src->size) {
+        return -1;
+    }
+    src->position = (size_t)offset;
+    return 0;
+}
+
+static size_t source_read(Bmp_Source *src, void *dst, size_t byte_count) {
+    if (src->file) {
+        return read_chunked(src->file, dst, byte_count);
+    }
+    size_t left = src->size - src->position;
+    byte_count = byte_count < left ? byte_count : left;
+    memcpy(dst, src->data + src->position, byte_count);
+    src->position += byte_count;
+    return byte_count;
+}
+
+static uint64_t source_length(Bmp_Source *src) {
+    if (!src->file) {
+        return src->size;
+    }
+#if defined(_WIN32)
+    _fseeki64(src->file, 0, SEEK_END);
+#else
+    fseeko(src->file, 0, SEEK_END);
+#endif
+    uint64_t end = file_tell(src->file);
+    source_seek(src, 0);
+    return end > src->base ? end - src->base : 0;
+}
+
+// Where write_bitmap puts the result: a stream, or a buffer in the job's
+// arena that grows as needed
+typedef struct {
+    FILE *file;
+    Arena *arena;
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} Bmp_Sink;
+
+static bool sink_reserve(Bmp_Sink *sink, size_t byte_count) {
+    if (sink->file || sink->capacity - sink->size >= byte_count) {
+        return true;
+    }
+    size_t capacity = sink->capacity ? sink->capacity * 2 : 4096;
+    while (capacity - sink->size < byte_count) {
+        capacity *= 2;
+    }
+    uint8_t *data = arena_alloc(sink->arena, capacity);
+    if (!data) {
+        return false;
+    }
+    if (sink->size) {
+        memcpy(data, sink->data, sink->size);
+    }
+    sink->data = data;
+    sink->capacity = capacity;
+    return true;
+}
+
+// false unless all of it was written
+static bool sink_write(Bmp_Sink *sink, const void *src, size_t byte_count) {
+    if (sink->file) {
+        return write_chunked(sink->file, src, byte_count) == byte_count;
+    }
+    if (!sink_reserve(sink, byte_count)) {
+        return false;
+    }
+    memcpy(sink->data + sink->size, src, byte_count);
+    sink->size += byte_count;
+    return true;
+}
+
 uint32_t pad_width(int32_t width, uint8_t bit_depth) {
 
     if (bit_depth <= 8) {
         // Calculate unpadded row size in bits
-        size_t bits_per_row = bit_depth * width;
+        uint64_t bits_per_row = (uint64_t)bit_depth * width;
 
         // Convert bits to bytes and round up to nearest byte
-        size_t bytes_per_row = (bits_per_row + 7) / 8;
+        uint64_t bytes_per_row = (bits_per_row + 7) / 8;
 
         // Align to the newrest multiple of 4 bytes
-        return (bytes_per_row + 3) & ~3;
+        return (uint32_t)((bytes_per_row + 3) & ~3ull);
     } else if (bit_depth == 24) {
-        return (3 * width + 3) & ~3;
+        return (uint32_t)((3 * (uint64_t)width + 3) & ~3ull);
     }
-    fprintf(stderr,
+    // check_geometry only lets the depths above through
+    report_error(
             "Error: Trying to pad width for unsupported colorMode;\n"
             "width: %d, depth:%d \n",
             width, bit_depth);
-    exit(EXIT_FAILURE);
+    return 0;
 }
 
 // inserts a suffix in the filename before the . extension, preserves the last .
-// and extension if there is no dot extension it just adds the suffix
-char *create_filename_with_suffix(char *filename, char *suffix) {
+// and extension if there is no dot extension it just adds the suffix. The
+// new name lives in the job's arena.
+char *create_filename_with_suffix(Arena *arena, char *filename,
+                                  char *suffix) {
     // Find the last position of the last '.' in the filename
     char *last_dot = strrchr(filename, '.');
     size_t base_len =
@@ -41,9 +194,9 @@ char *create_filename_with_suffix(char *filename, char *suffix) {
         base_len + strlen(suffix) + (last_dot ? strlen(last_dot) : 0) + 1;
 
     // Allocate memory for new string.
-    char *new_filename = malloc(new_len);
+    char *new_filename = arena_alloc(arena, new_len);
     if (!new_filename) {
-        fprintf(stderr, "Error: Filename memory allocation failed.\n");
+        report_error("Error: Filename memory allocation failed.\n");
         return NULL;
     }
 
@@ -60,14 +213,6 @@ char *create_filename_with_suffix(char *filename, char *suffix) {
     return new_filename;
 }
 
-const char *get_basename(const char *path) {
-    const char *slash = strrchr(path, '/');
-    const char *backslash = strrchr(path, '\\');
-
-    const char *last = slash > backslash ? slash : backslash;
-    return last ? last + 1 : path;
-}
-
 
 void init_bitmap(Bitmap *bmp) {
     if (!bmp)
@@ -101,82 +246,218 @@ void init_bitmap(Bitmap *bmp) {
     bmp->file_size_read = 0;
     bmp->row_size_bytes = 0;
     bmp->image_bytes_calculated = 0;
+    bmp->crop_row_bytes = 0;
     bmp->ct_byte_count = 0;
     bmp->colors_used_actual = 0;
     bmp->image_data = NULL;
 }
 
-int load_bitmap(Bitmap *bmp, char *filename_in) {
-    if (!bmp) {
-        fprintf(stderr, "Error: Unitialized bmp sent to load_bitmap.\n");
-        return EXIT_FAILURE;
+// Header geometry, before anything is sized from it. Sets row_size_bytes
+// and image_bytes_calculated. Past this a row fits in 32 bits and the
+// pixel array in size_t, and products of the two need no more checks.
+static Imagecopy_Status check_geometry(Bitmap *bmp) {
+    int32_t width = bmp->info_header.bi_width_pixels;
+    int32_t height = bmp->info_header.bi_height_pixels;
+    uint16_t depth = bmp->info_header.bi_bit_depth;
+
+    // Negative heights are top-down files, not supported
+    if (width <= 0 || height <= 0) {
+        report_error("Error: Image size %dx%d not supported.\n", width,
+                height);
+        return IMAGECOPY_ERROR_FORMAT;
     }
-    // If filename_in is supplied, overwrite the existing one properly
-    if (filename_in) {
-        if (bmp->filename_in) {
-            free(bmp->filename_in); // Free previously allocated filename
-        }
-        bmp->filename_in = strdup(filename_in); // Copy the new filename
+    if (depth != 1 && depth != 2 && depth != 4 && depth != 8 &&
+        depth != 24) {
+        report_error("Error: Bitdepth not supported - %d\n", depth);
+        return IMAGECOPY_ERROR_UNSUPPORTED;
     }
 
-    // Validate filename input
-    if (!bmp->filename_in || !*bmp->filename_in) {
-        fprintf(stderr, "Error: No filename supplied to load_bitmap\n");
-        return EXIT_FAILURE;
+    uint64_t row_size = (((uint64_t)width * depth + 31) / 32) * 4;
+    uint64_t image_bytes = 0;
+    size_t image_size = 0;
+    if (row_size > UINT32_MAX ||
+        !checked_mul_u64(row_size, (uint64_t)height, &image_bytes) ||
+        !checked_size(image_bytes, &image_size) || image_size > SIZE_MAX / 2) {
+        report_error(
+                "Error: A %dx%d %d-bit image is too large to load here.\n",
+                width, height, depth);
+        return IMAGECOPY_ERROR_MEMORY;
     }
+    bmp->row_size_bytes = (uint32_t)row_size;
+    bmp->image_bytes_calculated = image_size;
+    return IMAGECOPY_OK;
+}
 
-    fprintf(stderr, "\n");
+// The whole pixel array. A file that ends early keeps zeros for the rest.
+static Imagecopy_Status read_pixels(Bitmap *bmp, Bmp_Source *src) {
+    size_t byte_count = bmp->image_bytes_calculated;
+    bmp->pixel_data = arena_alloc(bmp->image_data->arena, byte_count);
+    if (!bmp->pixel_data) {
+        report_error("Error: Memory allocation failed for pixel data.\n");
+        return IMAGECOPY_ERROR_MEMORY;
+    }
 
-    // Open binary file for reading.
-    FILE *file = fopen(bmp->filename_in, "rb");
+    size_t got = 0;
+    if (source_seek(src, bmp->file_header.offset_bytes) == 0) {
+        got = source_read(src, bmp->pixel_data, byte_count);
+    }
+    if (got != byte_count) {
+        DEBUG_LOG("Could not read image data, got %zu of %zu bytes.\n", got,
+                  byte_count);
+        memset(bmp->pixel_data + got, 0, byte_count - got);
+    }
+    return IMAGECOPY_OK;
+}
 
-    if (!file) {
-        fprintf(stderr, "Error opening file \"%s\"\n", bmp->filename_in);
-        return 1;
+// --crop: read only the rows of the window, and of each row only the bytes
+// it covers. 24 and 8-bit rows, and 1 and 4-bit ones that start on a byte,
+// are read straight into place. Others go through a band buffer that
+// view_copy shifts into place. The file is bottom-up, so the window is the
+// file rows height - y - crop_height to height - 1 - y.
+static Imagecopy_Status read_crop(Bitmap *bmp, Bmp_Source *src) {
+    Image_Data *img = bmp->image_data;
+    uint32_t width = (uint32_t)bmp->info_header.bi_width_pixels;
+    uint32_t height = (uint32_t)bmp->info_header.bi_height_pixels;
+    uint8_t depth = (uint8_t)bmp->info_header.bi_bit_depth;
+    uint32_t x = img->crop_x, y = img->crop_y;
+
+    if (x >= width || y >= height) {
+        report_error("Error: Crop origin %u,%u is outside the %ux%u image.\n",
+                x, y, width, height);
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    uint32_t crop_width = img->crop_width, crop_height = img->crop_height;
+    if (crop_width > width - x || crop_height > height - y) {
+        crop_width = (crop_width > width - x) ? width - x : crop_width;
+        crop_height = (crop_height > height - y) ? height - y : crop_height;
+        DEBUG_LOG("Crop clipped to %ux%u.\n", crop_width, crop_height);
     }
 
-    // *bmp = malloc(sizeof(Bitmap));
-    // if (!*bmp) {
-    //     fprintf(stderr, "Error: Memory allocation failed.\n");
-    //     return 1;
-    // }
+    uint64_t first_bit = (uint64_t)x * depth;
+    uint32_t first_byte = (uint32_t)(first_bit / 8);
+    uint8_t bit_offset = (uint8_t)(first_bit % 8);
+    uint32_t span =
+        (uint32_t)((first_bit + (uint64_t)crop_width * depth + 7) / 8) -
+        first_byte;
+    uint32_t row_size = pad_width(crop_width, depth);
+    uint32_t first_row = height - y - crop_height;
+
+    uint8_t *pixels = arena_alloc(img->arena, (size_t)row_size * crop_height);
+    bool direct = depth >= 8 || bit_offset == 0;
+    uint8_t *band =
+        direct ? NULL : arena_alloc(img->arena, (size_t)span * crop_height);
+    if (!pixels || (!direct && !band)) {
+        report_error("Error: Memory allocation failed for the crop.\n");
+        return IMAGECOPY_ERROR_MEMORY;
+    }
+
+    // A file that ends early keeps zeros for the rest, as in read_pixels
+    if (x == 0 && span == bmp->row_size_bytes) {
+        // Full rows, one read
+        size_t byte_count = (size_t)row_size * crop_height;
+        size_t got = 0;
+        if (source_seek(src, bmp->file_header.offset_bytes +
+                                 (uint64_t)first_row * bmp->row_size_bytes) ==
+            0) {
+            got = source_read(src, pixels, byte_count);
+        }
+        if (got != byte_count) {
+            DEBUG_LOG("Could not read image data, got %zu of %zu bytes.\n",
+                      got, byte_count);
+            memset(pixels + got, 0, byte_count - got);
+        }
+    } else {
+        uint8_t *end = direct ? pixels + (size_t)row_size * crop_height
+                              : band + (size_t)span * crop_height;
+        for (uint32_t i = 0; i < crop_height; i++) {
+            uint64_t offset = bmp->file_header.offset_bytes +
+                              (uint64_t)(first_row + i) * bmp->row_size_bytes +
+                              first_byte;
+            uint8_t *dst = direct ? pixels + (size_t)i * row_size
+                                  : band + (size_t)i * span;
+            size_t got = 0;
+            if (source_seek(src, offset) == 0) {
+                got = source_read(src, dst, span);
+            }
+            if (got != span) {
+                DEBUG_LOG("Could not read image data, row %u of %u.\n", i,
+                          crop_height);
+                memset(dst + got, 0, (size_t)(end - dst) - got);
+                break;
+            }
+        }
+    }
 
-    // Initialize the bmp's image struct.
-    // Image_Data *img = bmp->image_data;
+    // Padding, and the bits past the window in the last byte
+    Image_View window = {
+        .base = (direct ? pixels : band) +
+                (size_t)(crop_height - 1) * (direct ? row_size : span),
+        .stride = -(ptrdiff_t)(direct ? row_size : span),
+        .x = x,
+        .y = y,
+        .width = crop_width,
+        .height = crop_height,
+        .bit_depth = depth,
+        .bit_offset = direct ? 0 : bit_offset,
+    };
+    view_copy(&window, pixels, row_size);
+
+    DEBUG_LOG("Crop: %ux%u at %u,%u, read %u rows of %u bytes.\n", crop_width,
+           crop_height, x, y, crop_height, span);
+    bmp->crop_row_bytes = span;
+
+    bmp->pixel_data = pixels;
+    bmp->info_header.bi_width_pixels = (int32_t)crop_width;
+    bmp->info_header.bi_height_pixels = (int32_t)crop_height;
+    bmp->row_size_bytes = row_size;
+    bmp->image_bytes_calculated = (size_t)row_size * crop_height;
+    bmp->info_header.bi_image_byte_count =
+        bmp->image_bytes_calculated <= UINT32_MAX
+            ? (uint32_t)bmp->image_bytes_calculated
+            : 0;
+    return IMAGECOPY_OK;
+}
 
-    if (bmp->image_data == NULL) {
-        fprintf(stderr, "Error: image_data not initialized in load image\n");
-        // init_image(bmp->image_data);
+// The three loaders below set up the source and share the rest
+static Imagecopy_Status load_from(Bitmap *bmp, Bmp_Source *src) {
+    if (bmp->image_data == NULL || bmp->image_data->arena == NULL) {
+        report_error("Error: image_data not initialized in load image\n");
+        return IMAGECOPY_ERROR_ARGUMENT;
     }
-    fseek(file, 0, SEEK_END);
-    bmp->file_size_read = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    bmp->file_size_read = source_length(src);
     // Read File Header 14 bytes
-    fread(&bmp->file_header, sizeof(File_Header), 1, file);
-
-    // 0x4D42 == "BM" in ASCII
-    // char first = bmp->file_header.type & 0xFF;         // least significant
-    // byte char second = (bmp->file_header.type >> 8) & 0xFF; // most
-    // significant byte
+    if (source_read(src, &bmp->file_header, sizeof(File_Header)) !=
+        sizeof(File_Header)) {
+        report_error("Error: File is too short for a BMP header.\n");
+        return IMAGECOPY_ERROR_FORMAT;
+    }
 
     // Print BMP file type
-    printf("Input file\n---\n");
-    printf("Type field (hex): %04X\n", bmp->file_header.type);
-    printf("Type field (ASCII): %c%c\n", bmp->file_header.type & 0xFF,
+    DEBUG_LOG("Input file\n---\n");
+    DEBUG_LOG("Type field (hex): %04X\n", bmp->file_header.type);
+    DEBUG_LOG("Type field (ASCII): %c%c\n", bmp->file_header.type & 0xFF,
            (bmp->file_header.type >> 8) & 0xFF);
-    printf("File size read: %d\n", bmp->file_size_read);
-    printf("File size field: %d\n", bmp->file_header.file_size_field);
-    printf("Offset to pixel array: %d\n", bmp->file_header.offset_bytes);
-    // Validate BMP file type
+    DEBUG_LOG("File size read: %llu\n",
+           (unsigned long long)bmp->file_size_read);
+    DEBUG_LOG("File size field: %d\n", bmp->file_header.file_size_field);
+    DEBUG_LOG("Offset to pixel array: %d\n", bmp->file_header.offset_bytes);
+    // Validate BMP file type, 0x4D42 == "BM" in ASCII
     if (bmp->file_header.type != 0x4D42) {
-        fprintf(stderr, "Error: File %s is not a valid BMP file.\n",
-                filename_in);
-        fclose(file);
-        return 3;
+        report_error("Error: File %s is not a valid BMP file.\n",
+                bmp->filename_in ? bmp->filename_in : "in memory");
+        return IMAGECOPY_ERROR_FORMAT;
     }
 
     // Read info header 40 bytes
-    fread(&bmp->info_header, sizeof(Info_Header), 1, file);
+    if (source_read(src, &bmp->info_header, sizeof(Info_Header)) !=
+        sizeof(Info_Header)) {
+        report_error("Error: File is too short for a BMP info header.\n");
+        return IMAGECOPY_ERROR_FORMAT;
+    }
+    Imagecopy_Status geometry_error = check_geometry(bmp);
+    if (geometry_error) {
+        return geometry_error;
+    }
     // Read color table size or calculate if missing
 
     // For bit_depth <= 8, colors are stored in and referenced from the
@@ -192,107 +473,84 @@ int load_bitmap(Bitmap *bmp, char *filename_in) {
         uint16_t ct_colors_max = bmp->image_data->ct_max_color_count =
             ct_max_color_count(bmp->info_header.bi_bit_depth);
 
+        // More colors than the depth can index would run past the table
+        if (bmp->info_header.bi_colors_used_count > ct_colors_max) {
+            report_error("Error: %u colors used for a %d-bit image, at most "
+                         "%u.\n",
+                         bmp->info_header.bi_colors_used_count,
+                         bmp->info_header.bi_bit_depth, ct_colors_max);
+            return IMAGECOPY_ERROR_FORMAT;
+        }
         if (bmp->info_header.bi_colors_used_count == 0) {
             bmp->colors_used_actual = ct_colors_max;
         } else {
             bmp->colors_used_actual = bmp->info_header.bi_colors_used_count;
         }
 
-        printf("Colors used actual: %d\n", bmp->colors_used_actual);
+        DEBUG_LOG("Colors used actual: %d\n", bmp->colors_used_actual);
         // Each color table entry is 4 bytes
         bmp->ct_byte_count = ct_colors_max * 4;
 
         // Allocate color table
         bmp->color_table = NULL;
-        printf("COLOR TABLE BYTE COUNT: %d\n", bmp->ct_byte_count);
-        bmp->color_table = calloc(bmp->ct_byte_count, 1);
+        DEBUG_LOG("COLOR TABLE BYTE COUNT: %d\n", bmp->ct_byte_count);
+        bmp->color_table =
+            arena_calloc(bmp->image_data->arena, bmp->ct_byte_count, 1);
         if (!bmp->color_table) {
-            fprintf(stderr,
+            report_error(
                     "Error: Memory allocation failed for color table.\n");
-            fclose(file);
             free_bitmap(bmp);
-            return 4;
+            return IMAGECOPY_ERROR_MEMORY;
         }
 
         // Read color table
-        if (fread(bmp->color_table, 1, bmp->ct_byte_count, file) !=
+        if (source_read(src, bmp->color_table, bmp->ct_byte_count) !=
             bmp->ct_byte_count) {
-            fclose(file);
-            fprintf(stderr, "Error: Failed to read complete color table\n");
-            free(bmp->color_table);
+            report_error("Error: Failed to read complete color table\n");
             bmp->color_table = NULL;
             free_bitmap(bmp);
-            return 5;
+            return IMAGECOPY_ERROR_FORMAT;
         }
-
-        // Calculate unpadded row size in bits
-        /*
-        size_t bits_per_row =
-         * bmp->info_header.bit_depthbmp->info_header.width;
-
-        // Convert bits to bytes and round up to nearest byte
-        size_t bytes_per_row = (bits_per_row + 7) / 8;
-
-        // Align to the newrest multiple of 4 bytes
-        bmp->row_size_bytes = (bytes_per_row + 3) & ~3;
-       */
     } else if (bmp->info_header.bi_bit_depth == 24) {
         bmp->image_data->colorMode = RGB24;
-    } else {
-        fprintf(stderr, "Error: Bitdepth not supported - %d",
-                bmp->info_header.bi_bit_depth);
     }
 
-    if (bmp->file_header.file_size_field != bmp->file_size_read) {
-        fprintf(stderr,
-                "Corrected File Size field from %d bytes to %d bytes.\n",
-                bmp->file_header.file_size_field, bmp->file_size_read);
-        bmp->file_header.file_size_field = bmp->file_size_read;
+    // Both size fields are 32 bits, 0 stands for sizes past 4 GB
+    uint32_t file_size_field = bmp->file_size_read <= UINT32_MAX
+                                   ? (uint32_t)bmp->file_size_read
+                                   : 0;
+    if (bmp->file_header.file_size_field != file_size_field) {
+        DEBUG_LOG("Corrected File Size field from %u bytes to %u bytes.\n",
+                  bmp->file_header.file_size_field, file_size_field);
+        bmp->file_header.file_size_field = file_size_field;
     }
 
-    bmp->row_size_bytes = pad_width(bmp->info_header.bi_width_pixels,
-                                    bmp->info_header.bi_bit_depth);
-
-    // Total image size in bytes
-    bmp->image_bytes_calculated =
-        bmp->row_size_bytes * bmp->info_header.bi_height_pixels;
-
     // Validate image size field with calculated image size
-    if (bmp->info_header.bi_image_byte_count != bmp->image_bytes_calculated) {
-        fprintf(
-            stderr, "Corrected Image Size field from %d bytes to %d bytes.\n",
-            bmp->info_header.bi_image_byte_count, bmp->image_bytes_calculated);
-        bmp->info_header.bi_image_byte_count = bmp->image_bytes_calculated;
+    uint32_t image_size_field = bmp->image_bytes_calculated <= UINT32_MAX
+                                    ? (uint32_t)bmp->image_bytes_calculated
+                                    : 0;
+    if (bmp->info_header.bi_image_byte_count != image_size_field) {
+        DEBUG_LOG("Corrected Image Size field from %u bytes to %u bytes.\n",
+                  bmp->info_header.bi_image_byte_count, image_size_field);
+        bmp->info_header.bi_image_byte_count = image_size_field;
     }
 
-    // Create pixel data buffer
-    // bmp->pixel_data = NULL; // already initialized to NULL
-    bmp->pixel_data = malloc(bmp->info_header.bi_image_byte_count);
-    if (!bmp->pixel_data) {
-        fprintf(stderr, "Error: Memory allocation failed for pixel data.\n");
-        fclose(file);
-        return 6;
-    }
-
-    // Read pixel data
-    fseek(file, bmp->file_header.offset_bytes, SEEK_SET);
-    if (bmp->info_header.bi_image_byte_count !=
-        fread(bmp->pixel_data, 1, bmp->info_header.bi_image_byte_count, file)) {
-        fprintf(stderr, "Error: Could not read image data.\n");
+    Imagecopy_Status read_error = bmp->image_data->crop
+                                      ? read_crop(bmp, src)
+                                      : read_pixels(bmp, src);
+    if (read_error) {
+        return read_error;
     }
-    fclose(file);
 
     /*
      * Update image data.
      */
-    // set_image_data_variables(Bitmap *bmp);
     bmp->image_data->width = bmp->info_header.bi_width_pixels;
     bmp->image_data->height = bmp->info_header.bi_height_pixels;
     bmp->image_data->row_size_bytes = bmp->row_size_bytes;
-    bmp->image_data->row_size_bytes = bmp->row_size_bytes;
-    bmp->image_data->image_byte_count = bmp->info_header.bi_image_byte_count;
+    bmp->image_data->image_byte_count = bmp->image_bytes_calculated;
     bmp->image_data->image_pixel_count =
-        bmp->info_header.bi_height_pixels * bmp->info_header.bi_height_pixels;
+        (uint64_t)bmp->image_data->width * bmp->image_data->height;
     bmp->image_data->bit_depth_in = bmp->info_header.bi_bit_depth;
     bmp->image_data->colors_used_actual = bmp->colors_used_actual;
 
@@ -304,21 +562,64 @@ int load_bitmap(Bitmap *bmp, char *filename_in) {
         bmp->image_data->colorTable = bmp->color_table;
         bmp->image_data->pixel_data = bmp->pixel_data;
     } else if (bmp->image_data->colorMode == RGB24) {
-
-        // create_buffer3(&bmp->pixelDataRows, bmp->info_header.height,
-        // bmp->row_size_bytes);
-
-        //    pixel_data_to_buffer3(bmp->pixel_data,
-        //    &bmp->image_data->pixelDataRows,
-        //       bmp->info_header.height, bmp->row_size_bytes);
-
         bmp->image_data->pixel_data = bmp->pixel_data;
         bmp->image_data->pixelDataRows = pixel_data_to_buffer3(
-            bmp->pixel_data, bmp->info_header.bi_width_pixels,
+            bmp->image_data->arena, bmp->pixel_data, bmp->info_header.bi_width_pixels,
             bmp->info_header.bi_height_pixels);
+        if (!bmp->image_data->pixelDataRows) {
+            return IMAGECOPY_ERROR_MEMORY;
+        }
+    }
+
+    return IMAGECOPY_OK;
+}
+
+Imagecopy_Status load_bitmap(Bitmap *bmp, char *filename_in) {
+    if (!bmp || !bmp->image_data) {
+        report_error("Error: Unitialized bmp sent to load_bitmap.\n");
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    // If filename_in is supplied, overwrite the existing one properly
+    if (filename_in) {
+        // Copy the new filename, the old one goes with the arena
+        bmp->filename_in = arena_strdup(bmp->image_data->arena, filename_in);
+    }
+
+    // Validate filename input
+    if (!bmp->filename_in || !*bmp->filename_in) {
+        report_error("Error: No filename supplied to load_bitmap\n");
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+
+    // Open binary file for reading.
+    FILE *file = fopen(bmp->filename_in, "rb");
+    if (!file) {
+        report_error("Error opening file \"%s\"\n", bmp->filename_in);
+        return IMAGECOPY_ERROR_IO;
+    }
+    Bmp_Source src = {.file = file};
+    Imagecopy_Status status = load_from(bmp, &src);
+    fclose(file);
+    return status;
+}
+
+Imagecopy_Status load_bitmap_stream(Bitmap *bmp, FILE *file) {
+    if (!bmp || !bmp->image_data || !file) {
+        report_error("Error: Unitialized bmp sent to load_bitmap.\n");
+        return IMAGECOPY_ERROR_ARGUMENT;
     }
+    Bmp_Source src = {.file = file, .base = file_tell(file)};
+    return load_from(bmp, &src);
+}
 
-    return EXIT_SUCCESS;
+Imagecopy_Status load_bitmap_memory(Bitmap *bmp, const void *data,
+                                    size_t size) {
+    if (!bmp || !bmp->image_data || !data) {
+        report_error("Error: Unitialized bmp sent to load_bitmap.\n");
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    Bmp_Source src = {.data = data, .size = size};
+    return load_from(bmp, &src);
 }
 
 void change_extension(char *filename, char *ext) {
@@ -340,18 +641,25 @@ void reload_bmp_fields(Bitmap *bmp) {
     bmp->file_header.offset_bytes =
         sizeof(File_Header) + sizeof(Info_Header) + bmp->ct_byte_count;
 
+    // 0 in either size field for files past 4 GB
+    uint64_t file_bytes = bmp->file_header.offset_bytes +
+                          (uint64_t)bmp->image_data->image_byte_count;
     bmp->file_header.file_size_field =
-        bmp->file_header.offset_bytes + bmp->image_data->image_byte_count;
+        file_bytes <= UINT32_MAX ? (uint32_t)file_bytes : 0;
 
     bmp->info_header.bi_width_pixels = bmp->image_data->width;
     bmp->info_header.bi_height_pixels = bmp->image_data->height;
     bmp->info_header.bi_bit_depth = bit_depth;
-    bmp->info_header.bi_image_byte_count = bmp->image_data->image_byte_count;
+    bmp->info_header.bi_image_byte_count =
+        bmp->image_data->image_byte_count <= UINT32_MAX
+            ? (uint32_t)bmp->image_data->image_byte_count
+            : 0;
+    // Flips and rotations of 24-bit images make a new pixel buffer too
+    bmp->pixel_data = bmp->image_data->pixel_data;
 
     if (bit_depth <= 8) {
         bmp->color_table = bmp->image_data->colorTable;
-        bmp->pixel_data = bmp->image_data->pixel_data;
-        printf("reload_bmp_fields ct:\n");
+        DEBUG_LOG("reload_bmp_fields ct:\n");
         printColorTable(bmp->color_table, 2);
 
         // 0 means all colors are used and all are important.
@@ -389,10 +697,15 @@ void reduce_24_to_indexed(Bitmap *bmp) {
     //  width,hgt : dimensions
     //  bits      : target bits (1…8)
     //  dither    : 0=no dithering, 1=Floyd–Steinberg
-    //  out_idx   : *malloc’d output indices [w*h]
+    //  out_idx   : *pool_alloc’d output indices [w*h]
     //  out_pal   : *malloc’d palette [1<<bits]
     //  out_psize : actual palette size
-    printf("First 4 pixel data: ");
+    DEBUG_LOG("First 4 pixel data: ");
+    uint8_t dither_mode =
+        bmp->image_data->dither ? bmp->image_data->dither_mode : DITHER_OFF;
+    if (bmp->image_data->dither_serpentine) {
+        dither_mode |= DITHER_SERPENTINE;
+    }
     convert_24_to_indexed_tight(
         bmp->image_data->pixel_data,         // const uint8_t *rgb_buf,
         bmp->image_data->width,              // uint32_t width,
@@ -400,21 +713,29 @@ void reduce_24_to_indexed(Bitmap *bmp) {
         bmp->image_data->row_size_bytes,     // uint32_t row_stride,
         bmp->image_data->bit_depth_out,      // uint8_t bits,
         bmp->image_data->output_color_count, // uint16_t max_colors,
-        bmp->image_data->dither,             // uint8_t dither_flag,
-        &out_idx,    // out_idx   : *malloc’d output indices [w*h]
+        dither_mode,                         // uint8_t dither_flag,
+        (Quantizer)bmp->image_data->quantizer, // Quantizer quantizer,
+        &out_idx,    // out_idx   : *pool_alloc’d output indices [w*h]
         &out_pal,    // out_pal   : *malloc’d palette [1<<bits]
         &out_psize); // out_psize : actual palette size
+    if (!out_idx) {
+        image_fail(bmp->image_data, IMAGECOPY_ERROR_MEMORY,
+                   "Error: Could not reduce the colors.\n");
+        return;
+    }
 
     bmp->image_data->colors_used_actual = out_psize;
-    printf("Out pallet size: %d\n", out_psize);
+    DEBUG_LOG("Out pallet size: %d\n", out_psize);
 
     // convert_color_to_pallet
-    bmp->image_data->colorTable =
-        create_buffer1(ct_byte_count(bmp->image_data->bit_depth_out));
+    bmp->image_data->colorTable = create_buffer1(
+        bmp->image_data->arena, ct_byte_count(bmp->image_data->bit_depth_out));
     if (!bmp->image_data->colorTable) {
         free(out_pal);
-        free(out_idx);
-        return; // or handle error
+        pool_release(out_idx);
+        image_fail(bmp->image_data, IMAGECOPY_ERROR_MEMORY,
+                   "Error: Could not allocate the color table.\n");
+        return;
     }
 
     for (int i = 0; i < out_psize; i++) {
@@ -422,7 +743,7 @@ void reduce_24_to_indexed(Bitmap *bmp) {
         bmp->image_data->colorTable[i * 4 + 1] = out_pal[i].g;
         bmp->image_data->colorTable[i * 4 + 2] = out_pal[i].b;
         bmp->image_data->colorTable[i * 4 + 3] = 0; // reserved
-        printf("r: %d g: %d b: %d a:%d  \n",
+        DEBUG_LOG("r: %d g: %d b: %d a:%d  \n",
                bmp->image_data->colorTable[i * 4 + 0],
                bmp->image_data->colorTable[i * 4 + 1],
                bmp->image_data->colorTable[i * 4 + 2],
@@ -431,212 +752,293 @@ void reduce_24_to_indexed(Bitmap *bmp) {
     free(out_pal);
     out_pal = NULL;
 
-    uint8_t *output = pad_indexed_buffer(out_idx, bmp->image_data->width,
-                                         bmp->image_data->height,
-                                         &bmp->image_data->row_size_bytes);
+    // Tight indices to 4-byte aligned BMP rows
+    uint32_t width = bmp->image_data->width;
+    uint32_t height = bmp->image_data->height;
+    bmp->image_data->row_size_bytes = (width + 3) & ~3u;
+    uint8_t *output = arena_alloc(bmp->image_data->arena,
+                                  (size_t)bmp->image_data->row_size_bytes *
+                                      height);
+    if (!output) {
+        pool_release(out_idx);
+        image_fail(bmp->image_data, IMAGECOPY_ERROR_MEMORY,
+                   "Error: Could not allocate the indexed pixels.\n");
+        return;
+    }
+    repack_rows(out_idx, width, 8, output, bmp->image_data->row_size_bytes, 8,
+                width, height, NULL);
 
 // for(size_t i = 0; i < 100; i++){
-//             printf("%d ", out_idx[i]);
+//             DEBUG_LOG("%d ", out_idx[i]);
 //         }
 
 
 
-    free(out_idx);
+    pool_release(out_idx);
     out_idx = NULL;
-    free(bmp->image_data->pixel_data);
     bmp->image_data->pixel_data = output;
 
+    // The data is now 8-bit indices, convert_bit_depth_if_color_count_matches
+    // packs them to 4 or 1-bit
+    bmp->image_data->pixelDataRows = NULL;
+    bmp->image_data->bit_depth_in = 8;
+    bmp->image_data->colorMode = INDEXED;
+    bmp->image_data->image_byte_count =
+        (size_t)bmp->image_data->row_size_bytes * bmp->image_data->height;
+
         
 
 
 
 }
 
-void process_bmp(Bitmap *bmp) {
-    process_image(bmp->image_data);
-    reduce_24_to_indexed(bmp);
+// Each step is skipped once one has failed, the first failure is returned
+Imagecopy_Status process_bmp(Bitmap *bmp) {
+    Image_Data *img = bmp->image_data;
+    uint8_t bit_depth_in = img->bit_depth_in;
 
-    convert_bit_depth_if_color_count_matches(bmp->image_data);
+    process_image(img);
+    if (!img->status && img->optimize_depth) {
+        optimize_bit_depth(img);
+    }
+    if (!img->status) {
+        reduce_24_to_indexed(bmp);
+    }
+    if (!img->status) {
+        convert_bit_depth_if_color_count_matches(img);
+    }
+    if (img->status) {
+        return img->status;
+    }
     reload_bmp_fields(bmp);
+
+    if (img->optimize_depth) {
+        uint64_t file_bytes_in = bmp->file_size_read;
+        uint64_t file_bytes_out = bmp->file_header.offset_bytes +
+                                  (uint64_t)img->image_byte_count;
+        int64_t saved = (int64_t)file_bytes_in - (int64_t)file_bytes_out;
+        DEBUG_LOG("Optimize depth: %d-bit -> %d-bit, %llu -> %llu bytes, saved "
+               "%lld bytes (%.1f%%)\n",
+               bit_depth_in, img->bit_depth_out,
+               (unsigned long long)file_bytes_in,
+               (unsigned long long)file_bytes_out, (long long)saved,
+               file_bytes_in ? 100.0 * saved / file_bytes_in : 0.0);
+    }
+    return IMAGECOPY_OK;
 }
 
-int write_bitmap(Bitmap *bmp, char *filename_out) {
+// One line of the 24-bit histogram, red, green and blue
+static int histogram3_line(const Image_Data *img, int i, bool normalized,
+                           char *line, size_t size) {
+    const int order[3] = {2, 1, 0}; // histogram3 is in BGR order
+    int length = 0;
+    for (int k = 0; k < 3; k++) {
+        int c = order[k];
+        uint64_t count = img->histogram3[c][i];
+        const char *separator = k < 2 ? " " : "\n";
+        length +=
+            normalized
+                ? snprintf(line + length, size - length, "%f%s",
+                           img->hist_max_value3[c]
+                               ? (float_t)count /
+                                     (float_t)img->hist_max_value3[c]
+                               : 0.0f,
+                           separator)
+                : snprintf(line + length, size - length, "%llu%s",
+                           (unsigned long long)count, separator);
+    }
+    return length;
+}
 
-    if (!bmp) {
-        fprintf(stderr, "Error: Unitialized bmp sent to load_bitmap.\n");
-        return EXIT_FAILURE;
+// Histogram modes, one value per line. 24-bit images have three columns,
+// red, green and blue.
+static Imagecopy_Status write_histogram(Bitmap *bmp, Bmp_Sink *sink) {
+    Image_Data *img = bmp->image_data;
+    bool normalized = img->mode == HIST_N;
+    bool rgb = img->histogram3 != NULL;
+    if (!rgb && (normalized ? !img->histogram_n : !img->histogram1)) {
+        report_error("Error: No histogram to write for a %d-bit image.\n",
+                img->bit_depth_in);
+        return IMAGECOPY_ERROR_UNSUPPORTED;
     }
-    // If filename_out is supplied to the function, overwrite the existing one
-    if (filename_out) {
-        if (bmp->filename_out) {
-            free(bmp->filename_out); // Free previously allocated filename
+    for (int i = 0; i < img->HIST_RANGE_MAX; i++) {
+        char line[128];
+        int length =
+            rgb ? histogram3_line(img, i, normalized, line, sizeof(line))
+            : normalized
+                ? snprintf(line, sizeof(line), "%f\n", img->histogram_n[i])
+                : snprintf(line, sizeof(line), "%llu\n",
+                           (unsigned long long)img->histogram1[i]);
+        if (!sink_write(sink, line, (size_t)length)) {
+            report_error("Error: Failed to write the histogram.\n");
+            return IMAGECOPY_ERROR_IO;
         }
-        bmp->filename_out = strdup(filename_out); // Copy the new filename
     }
+    return IMAGECOPY_OK;
+}
 
-    // Validate filename output
-    if (!bmp->filename_out || !*bmp->filename_out) {
-        fprintf(stderr, "Error: No filename supplied to write_bitmap\n");
-        return EXIT_FAILURE;
+static Imagecopy_Status write_to(Bitmap *bmp, Bmp_Sink *sink) {
+    if (bmp->image_data->mode == HIST || bmp->image_data->mode == HIST_N) {
+        return write_histogram(bmp, sink);
     }
 
-    // printf("filename out in write bitmap: %s \n", bmp->filename_out);
+    bmp->info_header.bi_byte_count = sizeof(Info_Header);
+    DEBUG_LOG("Info Header size: %d\n", bmp->info_header.bi_byte_count);
 
-    // Confirm filename_in is also set
-    if (!bmp->filename_in) {
-        fprintf(stderr, "Error: filename_in not set for write_bitmap.\n");
-        return 1;
+    bmp->file_header.offset_bytes =
+        sizeof(File_Header) + sizeof(Info_Header) + bmp->ct_byte_count;
+    DEBUG_LOG("File header bytes: %zu\n", sizeof(File_Header));
+    DEBUG_LOG("Info header bytes: %zu\n", sizeof(Info_Header));
+    DEBUG_LOG("Color table bytes: %d\n", bmp->ct_byte_count);
+    DEBUG_LOG("Offset bytes: %d\n", bmp->file_header.offset_bytes);
+    DEBUG_LOG("Image size bytes: %zu\n", bmp->image_data->image_byte_count);
+
+    DEBUG_LOG("File size field bytes: %d\n", bmp->file_header.file_size_field);
+
+    // The pixel array must be the rows the header describes, or the file
+    // would end early or carry stray bytes
+    const Image_Data *img = bmp->image_data;
+    uint64_t row_size =
+        (((uint64_t)img->width * bmp->info_header.bi_bit_depth + 31) / 32) *
+        4;
+    if (img->image_byte_count != row_size * img->height) {
+        report_error("Error: %zu bytes of pixels for a %ux%u %d-bit "
+                     "header, which needs %llu.\n",
+                     img->image_byte_count, img->width, img->height,
+                     bmp->info_header.bi_bit_depth,
+                     (unsigned long long)(row_size * img->height));
+        return IMAGECOPY_ERROR_FORMAT;
     }
-    // Image_Data *img = bmp->image_data;
-
-    FILE *file = NULL;
-    bool write_succesful = false;
 
-    // If the mode is histogram or histogram normalized [0..1)
-    // and the filename has not been supplied by filename_out,
-    // create a filename based on filename_in and change the extension
-    // to txt
-
-    if (!bmp->filename_out) {
-        bmp->filename_out = create_filename_with_suffix(
-            bmp->filename_in, bmp->image_data->mode_suffix);
+    // One buffer of the final size for a memory sink
+    if (!sink_reserve(sink, bmp->file_header.offset_bytes +
+                                bmp->image_data->image_byte_count)) {
+        report_error("Error: Could not allocate the output buffer.\n");
+        return IMAGECOPY_ERROR_MEMORY;
     }
 
-    // Open file for writing
-    if (bmp->image_data->mode == HIST) {
-        change_extension(bmp->filename_out, "txt");
-        for (int i = 0; i < bmp->image_data->HIST_RANGE_MAX; i++) {
-            fprintf(file, "%hhu\n", bmp->image_data->histogram1[i]);
-            fclose(file);
-            return write_succesful = true;
-        }
-        // TODO: write out hist3
-    } else if (bmp->image_data->mode == HIST_N) {
+    // Write file header, check that it successfully wrote 1 struct
+    if (!sink_write(sink, &bmp->file_header, sizeof(File_Header))) {
+        report_error("Error: Failed to write file header.\n");
+        return IMAGECOPY_ERROR_IO;
+    }
 
-        change_extension(bmp->filename_out, "txt");
-        file = fopen(bmp->filename_out, "w");
-        for (int i = 0; i < bmp->image_data->HIST_RANGE_MAX; i++) {
-            fprintf(file, "%f\n", bmp->image_data->histogram_n[i]);
-            fclose(file);
-            return write_succesful = true;
-        }
-    } else {
+    // Write info header, check that it successfully wrote 1 struct
+    if (!sink_write(sink, &bmp->info_header, sizeof(Info_Header))) {
+        report_error("Error: Failed to write info header.\n");
+        return IMAGECOPY_ERROR_IO;
+    }
 
-        file = fopen(bmp->filename_out, "wb");
-        if (file == NULL) {
-            fprintf(stderr, "Error: failed to open output file %s\n",
-                    bmp->filename_out);
-            exit(EXIT_FAILURE);
+    // Write color table, bit <= 8
+    if (bmp->info_header.bi_bit_depth <= 8) {
+        DEBUG_LOG("Color table bytes: %d\n", bmp->ct_byte_count);
+        if (bmp->color_table &&
+            !sink_write(sink, bmp->color_table, bmp->ct_byte_count)) {
+            report_error("Error: Failed to write color table.\n");
+            return IMAGECOPY_ERROR_IO;
         }
+    }
+    // Write pixel data
+    if (!sink_write(sink, bmp->pixel_data,
+                    bmp->image_data->image_byte_count)) {
+        report_error("Error: Failed to write image data.\n");
+        return IMAGECOPY_ERROR_IO;
+    }
+    return IMAGECOPY_OK;
+}
 
-        // Image *img = bmp->image;
-
-        bmp->info_header.bi_byte_count = sizeof(Info_Header);
-        printf("Info Header size: %d\n", bmp->info_header.bi_byte_count);
-
-        bmp->file_header.offset_bytes =
-            sizeof(File_Header) + sizeof(Info_Header) + bmp->ct_byte_count;
-        printf("File header bytes: %llu\n", sizeof(File_Header));
-        printf("Info header bytes: %llu\n", sizeof(Info_Header));
-        printf("Color table bytes: %d\n", bmp->ct_byte_count);
-        printf("Offset bytes: %d\n", bmp->file_header.offset_bytes);
-        printf("Image size bytes: %d\n", bmp->info_header.bi_image_byte_count);
+Imagecopy_Status write_bitmap(Bitmap *bmp, char *filename_out) {
 
-        printf("File size field bytes: %d\n", bmp->file_header.file_size_field);
-        // Processing
+    if (!bmp || !bmp->image_data) {
+        report_error("Error: Unitialized bmp sent to write_bitmap.\n");
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    // If filename_out is supplied to the function, overwrite the existing one
+    if (filename_out) {
+        // Copy the new filename, the old one goes with the arena
+        bmp->filename_out =
+            arena_strdup(bmp->image_data->arena, filename_out);
+    }
 
-        // Write file header, check that it successfully wrote 1 struct
-        if (fwrite(&bmp->file_header, sizeof(File_Header), 1, file) != 1) {
-            fprintf(stderr, "Error: Failed to write file header.\n");
-            fclose(file);
-            return 3;
-        }
+    // No name given, one from filename_in and the mode suffix
+    if ((!bmp->filename_out || !*bmp->filename_out) && bmp->filename_in &&
+        bmp->image_data->mode_suffix) {
+        bmp->filename_out = create_filename_with_suffix(
+            bmp->image_data->arena, bmp->filename_in,
+            bmp->image_data->mode_suffix);
+    }
 
-        // Write info header, check that it successfully wrote 1 struct
-        // fwrite(&bmp->info_header, sizeof(Info_Header), 1, file);
-        if (fwrite(&bmp->info_header, sizeof(Info_Header), 1, file) != 1) {
-            fprintf(stderr, "Error: Failed to write info header.\n");
-            fclose(file);
-            return 4;
-        }
+    // Validate filename output
+    if (!bmp->filename_out || !*bmp->filename_out) {
+        report_error("Error: No filename supplied to write_bitmap\n");
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
 
-        // Write color table, bit <= 8
-        if (bmp->info_header.bi_bit_depth <= 8) {
-            printf("Color table bytes: %d\n", bmp->ct_byte_count);
-            if (bmp->color_table) {
-                // for (size_t i = 0; i < bmp->ct_byte_count; i++) {
-                //  fwrite(&bmp->color_table, size_t Size, size_t Count, FILE
-                //  *restrict File)
-                if (fwrite(bmp->color_table, 1, bmp->ct_byte_count, file) !=
-                    bmp->ct_byte_count) {
-                    fprintf(stderr, "Error: Failed to write color table.\n");
-                    fclose(file);
-                    return 5;
-                }
-            }
-        }
-        // Write pixel data
-        // for (int i = 0; i < bmp->info_header.image_size_field_bytes; i++) {
-        if (fwrite(bmp->pixel_data, 1, bmp->info_header.bi_image_byte_count,
-                   file) != bmp->info_header.bi_image_byte_count) {
-            fprintf(stderr, "Error: Failed to write image data.\n");
-            fclose(file);
-            return 6;
-        }
+    // Histograms are text, in a .txt file
+    bool text = bmp->image_data->mode == HIST || bmp->image_data->mode == HIST_N;
+    if (text) {
+        change_extension(bmp->filename_out, "txt");
     }
 
-    fclose(file);
-    return 0;
+    // Open file for writing
+    FILE *file = fopen(bmp->filename_out, text ? "w" : "wb");
+    if (file == NULL) {
+        report_error("Error: failed to open output file %s\n",
+                bmp->filename_out);
+        return IMAGECOPY_ERROR_IO;
+    }
+    Bmp_Sink sink = {.file = file};
+    Imagecopy_Status status = write_to(bmp, &sink);
+    if (fclose(file) != 0 && status == IMAGECOPY_OK) {
+        report_error("Error: Failed to write %s\n", bmp->filename_out);
+        status = IMAGECOPY_ERROR_IO;
+    }
+    return status;
 }
 
-void free_bitmap(Bitmap *bmp) {
-    if (!bmp) {
-        printf("[free_bitmap] Bitmap is NULL — nothing to free.\n");
-        return;
+Imagecopy_Status write_bitmap_stream(Bitmap *bmp, FILE *file) {
+    if (!bmp || !bmp->image_data || !file) {
+        report_error("Error: Unitialized bmp sent to write_bitmap.\n");
+        return IMAGECOPY_ERROR_ARGUMENT;
     }
-
-    if (bmp->filename_in) {
-        free(bmp->filename_in);
-        bmp->filename_in = NULL;
-        printf("[free_bitmap] Freed filename_in.\n");
+    Bmp_Sink sink = {.file = file};
+    Imagecopy_Status status = write_to(bmp, &sink);
+    if (status == IMAGECOPY_OK && fflush(file) != 0) {
+        report_error("Error: Failed to flush the output.\n");
+        status = IMAGECOPY_ERROR_IO;
     }
+    return status;
+}
 
-    if (bmp->filename_out) {
-        free(bmp->filename_out);
-        bmp->filename_out = NULL;
-        printf("[free_bitmap] Freed filename_out.\n");
+Imagecopy_Status write_bitmap_memory(Bitmap *bmp, const uint8_t **data,
+                                     size_t *size) {
+    if (!bmp || !bmp->image_data || !data || !size) {
+        report_error("Error: Unitialized bmp sent to write_bitmap.\n");
+        return IMAGECOPY_ERROR_ARGUMENT;
     }
+    Bmp_Sink sink = {.arena = bmp->image_data->arena};
+    Imagecopy_Status status = write_to(bmp, &sink);
+    *data = status == IMAGECOPY_OK ? sink.data : NULL;
+    *size = status == IMAGECOPY_OK ? sink.size : 0;
+    return status;
+}
 
-    if (bmp->pixel_data) {
-        free(bmp->pixel_data);
-        bmp->pixel_data = NULL;
-        printf("[free_bitmap] Freed pixel_data.\n");
+// Every buffer of the job is in its arena, and the Bitmap and Image_Data
+// belong to the caller, so this only drops the pointers. arena_reset or
+// arena_free releases the memory.
+void free_bitmap(Bitmap *bmp) {
+    if (!bmp) {
+        DEBUG_LOG("[free_bitmap] Bitmap is NULL — nothing to free.\n");
+        return;
     }
 
-    if (bmp->color_table) {
-        free(bmp->color_table);
-        bmp->color_table = NULL;
-        printf("[free_bitmap] Freed color_table.\n");
-    }
+    bmp->filename_in = NULL;
+    bmp->filename_out = NULL;
+    bmp->pixel_data = NULL;
+    bmp->color_table = NULL;
 
     if (bmp->image_data) {
-        if (bmp->image_data->pixel_data) {
-            free(bmp->image_data->pixel_data);
-            bmp->image_data->pixel_data = NULL;
-            printf("[free_bitmap] Freed pixel_data.\n");
-        }
-
-        if (bmp->image_data->pixelDataRows) {
-            free(bmp->image_data->pixelDataRows);
-            bmp->image_data->pixelDataRows = NULL;
-            printf("[free_bitmap] Freed pixelDataRows.\n");
-        }
-
-        free(bmp->image_data);
-        bmp->image_data = NULL;
-        printf("[free_bitmap] Freed image_data structure.\n");
+        free_img(bmp->image_data);
     }
-
-    free(bmp);
-    printf("[free_bitmap] Freed Bitmap structure.\n");
+    DEBUG_LOG("[free_bitmap] Released the bitmap buffers.\n");
 }
@@ -18,6 +18,7 @@ data (like in BMP V4 or V5), this data is also included in the size.
 
 #include "image_data_handler.h"
 #include <stdint.h>
+#include <stdio.h>
 
 #define BMP_FILE_HEADER_BYTES 14
 
@@ -83,9 +84,10 @@ typedef struct {
     uint16_t colors_used_actual;
     char* filename_in;
     char *filename_out;
-    uint32_t file_size_read;
+    uint64_t file_size_read;
     uint32_t row_size_bytes;
-    uint32_t image_bytes_calculated;
+    size_t image_bytes_calculated;
+    uint32_t crop_row_bytes; // --crop: bytes read from each file row
     //uint8_t type;
     // uint8_t *pixel_data;
     // uint8_t **pixelDataRows;
@@ -98,13 +100,21 @@ typedef struct {
 
 // Function prototypes
 uint32_t pad_width(int32_t width, uint8_t bit_depth);
-char *create_filename_with_suffix(char *filename, char *suffix);
-const char *get_basename(const char *path);
+char *create_filename_with_suffix(Arena *arena, char *filename, char *suffix);
 void init_bitmap(Bitmap *bmp );
 void print_header_fields(Bitmap *bmp);
-int load_bitmap(Bitmap *bmp, char *filename);
-void process_bmp(Bitmap *bmp);
-int write_bitmap(Bitmap *bmp, char *filename_out);
+// Loads into bmp->image_data, which must have its arena set. A stream is
+// read from its current position and left open.
+Imagecopy_Status load_bitmap(Bitmap *bmp, char *filename);
+Imagecopy_Status load_bitmap_stream(Bitmap *bmp, FILE *file);
+Imagecopy_Status load_bitmap_memory(Bitmap *bmp, const void *data,
+                                    size_t size);
+Imagecopy_Status process_bmp(Bitmap *bmp);
+// The BMP, or the histogram text. The memory result is in the job's arena.
+Imagecopy_Status write_bitmap(Bitmap *bmp, char *filename_out);
+Imagecopy_Status write_bitmap_stream(Bitmap *bmp, FILE *file);
+Imagecopy_Status write_bitmap_memory(Bitmap *bmp, const uint8_t **data,
+                                     size_t *size);
 void free_bitmap(Bitmap *bmp);
 
 #endif // BMP_FILE_HANDLER_H
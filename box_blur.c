@@ -0,0 +1,251 @@
+#include "box_blur.h"
+#include "report.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of samples in [center - radius, center + radius] inside [0, size)
+static inline uint32_t window_count(int64_t center, uint32_t radius,
+                                    uint32_t size) {
+    int64_t lo = center - radius;
+    int64_t hi = center + radius;
+    if (lo < 0)
+        lo = 0;
+    if (hi > (int64_t)size - 1)
+        hi = (int64_t)size - 1;
+    return (uint32_t)(hi - lo + 1);
+}
+
+// Horizontal sliding window, one row at a time through a copy of the row.
+// 'load' (may be NULL) runs on each row before it is copied.
+static void box_pass_h(uint8_t **rows, uint32_t width, uint32_t height,
+                       uint8_t channels, uint32_t radius, uint8_t *row_copy,
+                       Box_Row_Fn load, void *load_context) {
+    const size_t row_bytes = (size_t)width * channels;
+
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = rows[y];
+        if (load) {
+            load(row, width, load_context);
+        }
+        memcpy(row_copy, row, row_bytes);
+
+        for (uint8_t c = 0; c < channels; c++) {
+            const uint8_t *src = row_copy + c;
+            uint32_t sum = 0;
+            for (uint32_t x = 0; x <= radius && x < width; x++) {
+                sum += src[(size_t)x * channels];
+            }
+
+            for (uint32_t x = 0; x < width; x++) {
+                uint32_t count = window_count(x, radius, width);
+                row[(size_t)x * channels + c] =
+                    (uint8_t)((sum + count / 2) / count);
+
+                // slide: add the sample entering on the right and drop the
+                // one leaving on the left
+                int64_t enter = (int64_t)x + radius + 1;
+                int64_t leave = (int64_t)x - radius;
+                if (enter < width)
+                    sum += src[(size_t)enter * channels];
+                if (leave >= 0)
+                    sum -= src[(size_t)leave * channels];
+            }
+        }
+    }
+}
+
+// Vertical sliding window with one running sum per column. The source
+// rows that still have to leave the window are kept in a ring of
+// radius + 1 row copies, everything else is overwritten in place. Once row
+// y is written the pass never reads it again, so 'store' (may be NULL) can
+// change it right away.
+static void box_pass_v(uint8_t **rows, uint32_t width, uint32_t height,
+                       uint8_t channels, uint32_t radius, uint32_t *col_sum,
+                       uint8_t *ring, Box_Row_Fn store, void *store_context) {
+    const size_t row_bytes = (size_t)width * channels;
+    const uint32_t ring_rows = radius + 1;
+
+    memset(col_sum, 0, row_bytes * sizeof(uint32_t));
+    for (uint32_t y = 0; y <= radius && y < height; y++) {
+        for (size_t i = 0; i < row_bytes; i++) {
+            col_sum[i] += rows[y][i];
+        }
+    }
+
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = rows[y];
+        uint8_t *saved = ring + (size_t)(y % ring_rows) * row_bytes;
+        memcpy(saved, row, row_bytes);
+
+        uint32_t count = window_count(y, radius, height);
+        uint32_t half = count / 2;
+        for (size_t i = 0; i < row_bytes; i++) {
+            row[i] = (uint8_t)((col_sum[i] + half) / count);
+        }
+        if (store) {
+            store(row, width, store_context);
+        }
+
+        int64_t enter = (int64_t)y + radius + 1;
+        int64_t leave = (int64_t)y - radius;
+        if (enter < height) {
+            const uint8_t *in = rows[enter];
+            for (size_t i = 0; i < row_bytes; i++) {
+                col_sum[i] += in[i];
+            }
+        }
+        if (leave >= 0) {
+            const uint8_t *out =
+                ring + (size_t)(leave % ring_rows) * row_bytes;
+            for (size_t i = 0; i < row_bytes; i++) {
+                col_sum[i] -= out[i];
+            }
+        }
+    }
+}
+
+// One box with the load hook of 'hooks' on its horizontal pass and the
+// store hook on its vertical one
+static bool box_blur_pass(uint8_t **rows, uint32_t width, uint32_t height,
+                          uint8_t channels, uint32_t radius,
+                          const Box_Hooks *hooks) {
+    if (!rows || !width || !height) {
+        return true;
+    }
+    if (!radius) {
+        for (uint32_t y = 0; y < height; y++) {
+            if (hooks->load) {
+                hooks->load(rows[y], width, hooks->load_context);
+            }
+            if (hooks->store) {
+                hooks->store(rows[y], width, hooks->store_context);
+            }
+        }
+        return true;
+    }
+    // A window wider than the image is the same as one that just covers it.
+    uint32_t max_side = width > height ? width : height;
+    if (radius > max_side) {
+        radius = max_side;
+    }
+
+    const size_t row_bytes = (size_t)width * channels;
+    uint32_t ring_rows = (radius + 1 < height) ? radius + 1 : height;
+
+    uint8_t *row_copy = malloc(row_bytes);
+    uint32_t *col_sum = malloc(row_bytes * sizeof(uint32_t));
+    uint8_t *ring = malloc(row_bytes * ((size_t)ring_rows + 1));
+    if (!row_copy || !col_sum || !ring) {
+        report_error("Error: Could not allocate blur buffers.\n");
+        free(row_copy);
+        free(col_sum);
+        free(ring);
+        return false;
+    }
+
+    box_pass_h(rows, width, height, channels, radius, row_copy, hooks->load,
+               hooks->load_context);
+    box_pass_v(rows, width, height, channels, radius < height ? radius : height,
+               col_sum, ring, hooks->store, hooks->store_context);
+
+    free(row_copy);
+    free(col_sum);
+    free(ring);
+    return true;
+}
+
+bool box_blur_radius(uint8_t **rows, uint32_t width, uint32_t height,
+                     uint8_t channels, uint32_t radius) {
+    const Box_Hooks none = {0};
+    if (!radius) {
+        return true;
+    }
+    return box_blur_pass(rows, width, height, channels, radius, &none);
+}
+
+// Box radii whose summed variance matches `variance`, using three boxes of
+// two neighbouring odd widths.
+static void boxes_for_variance(float variance, uint32_t radius[3]) {
+    const int n = 3;
+    float ideal = sqrtf(12.0f * variance / n + 1.0f);
+    int wl = (int)floorf(ideal);
+    if (wl % 2 == 0)
+        wl--;
+    if (wl < 1)
+        wl = 1;
+    int wu = wl + 2;
+    float m_ideal = (12.0f * variance - n * wl * wl - 4 * n * wl - 3 * n) /
+                    (-4.0f * wl - 4.0f);
+    int m = (int)lroundf(m_ideal);
+    for (int i = 0; i < n; i++) {
+        int w = (i < m) ? wl : wu;
+        radius[i] = (uint32_t)((w - 1) / 2);
+    }
+}
+
+bool box_blur_level(uint8_t **rows, uint32_t width, uint32_t height,
+                    uint8_t channels, uint16_t level) {
+    return box_blur_level_hooked(rows, width, height, channels, level, NULL);
+}
+
+// The boxes of a blur level, returns how many
+static uint16_t level_boxes(uint16_t level, uint32_t radius[3]) {
+    radius[0] = radius[1] = radius[2] = 1;
+    if (level <= 3) {
+        return level;
+    }
+    // A 3x3 average has variance 2/3 along each axis, variances add.
+    boxes_for_variance(2.0f * level / 3.0f, radius);
+    return 3;
+}
+
+uint32_t box_blur_halo(uint16_t level) {
+    uint32_t radius[3];
+    uint16_t box_count = level_boxes(level, radius);
+    if (level > 3) {
+        DEBUG_LOG("Blur level %d as boxes of radius %u, %u, %u\n", level,
+                  radius[0], radius[1], radius[2]);
+    }
+    uint32_t halo = 0;
+    for (uint16_t i = 0; i < box_count; i++) {
+        halo += radius[i];
+    }
+    return halo;
+}
+
+bool box_blur_level_hooked(uint8_t **rows, uint32_t width, uint32_t height,
+                           uint8_t channels, uint16_t level,
+                           const Box_Hooks *hooks) {
+    uint32_t radius[3];
+    uint16_t box_count = level_boxes(level, radius);
+
+    // The load hook goes with the first box, the store hook with the last
+    const Box_Hooks none = {0};
+    if (!box_count) {
+        return box_blur_pass(rows, width, height, channels, 0,
+                             hooks ? hooks : &none);
+    }
+    Box_Hooks first = none;
+    Box_Hooks last = none;
+    if (hooks) {
+        first.load = hooks->load;
+        first.load_context = hooks->load_context;
+        last.store = hooks->store;
+        last.store_context = hooks->store_context;
+    }
+    if (box_count == 1) {
+        first.store = last.store;
+        first.store_context = last.store_context;
+    }
+    for (uint16_t i = 0; i < box_count; i++) {
+        const Box_Hooks *box_hooks =
+            (i == 0) ? &first : (i == box_count - 1) ? &last : &none;
+        if (!box_blur_pass(rows, width, height, channels, radius[i],
+                           box_hooks)) {
+            return false;
+        }
+    }
+    return true;
+}
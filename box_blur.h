@@ -0,0 +1,51 @@
+#ifndef BOX_BLUR_H
+#define BOX_BLUR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Running sum box blur. Every pass costs the same per pixel whatever the
+// radius, using integer accumulators. Windows are clipped at the image
+// border and averaged over the pixels that are inside, like the original
+// 3x3 blur.
+//
+// rows     : row pointers, each row holds width * channels bytes
+// channels : 1 for 8-bit gray/indexed, 3 for 24-bit BGR
+
+// One (2 * radius + 1) square box average, in place. Both return false if
+// the scratch buffers could not be allocated, the rows are then unchanged
+// or partly blurred.
+bool box_blur_radius(uint8_t **rows, uint32_t width, uint32_t height,
+                     uint8_t channels, uint32_t radius);
+
+// Equivalent of `level` iterated 3x3 averages. Up to 3 levels are run
+// exactly, beyond that three boxes with the same total variance
+// approximate the (near Gaussian) result, so any level costs at most three
+// passes.
+bool box_blur_level(uint8_t **rows, uint32_t width, uint32_t height,
+                    uint8_t channels, uint16_t level);
+
+// Pointwise work fused into the passes of a blur, so it costs no pass of
+// its own. 'load' runs on each row just before the blur first reads it,
+// 'store' on each row as soon as it holds its final result. Both get the
+// image row itself and may also touch its padding. Either can be NULL.
+typedef void (*Box_Row_Fn)(uint8_t *row, uint32_t width, void *context);
+
+typedef struct {
+    Box_Row_Fn load;
+    void *load_context;
+    Box_Row_Fn store;
+    void *store_context;
+} Box_Hooks;
+
+// Rows above and below a pixel that its level blur reads, the sum of the
+// radii of the boxes. A band of rows blurred on its own is exact but for
+// this many rows at each end that is not an end of the image.
+uint32_t box_blur_halo(uint16_t level);
+
+// box_blur_level with hooks, NULL hooks for none
+bool box_blur_level_hooked(uint8_t **rows, uint32_t width, uint32_t height,
+                           uint8_t channels, uint16_t level,
+                           const Box_Hooks *hooks);
+
+#endif
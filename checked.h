@@ -0,0 +1,42 @@
+#ifndef CHECKED_H
+#define CHECKED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Overflow-checked size arithmetic. Image geometry comes from the file
+// header, so a size derived from it goes through these before it is used
+// to allocate, to seek or to index. Each returns false and leaves *out
+// alone if the result does not fit.
+
+static inline bool checked_mul_u64(uint64_t a, uint64_t b, uint64_t *out) {
+#if defined(__GNUC__)
+    return !__builtin_mul_overflow(a, b, out);
+#else
+    if (b && a > UINT64_MAX / b) {
+        return false;
+    }
+    *out = a * b;
+    return true;
+#endif
+}
+
+static inline bool checked_add_u64(uint64_t a, uint64_t b, uint64_t *out) {
+    if (a > UINT64_MAX - b) {
+        return false;
+    }
+    *out = a + b;
+    return true;
+}
+
+// A 64-bit byte count as a size_t, false past SIZE_MAX on 32-bit builds
+static inline bool checked_size(uint64_t n, size_t *out) {
+    if (n > SIZE_MAX) {
+        return false;
+    }
+    *out = (size_t)n;
+    return true;
+}
+
+#endif
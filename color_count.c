@@ -0,0 +1,194 @@
+#include "color_count.h"
+#include "report.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DENSE_SIZE (1u << 24)
+
+// Hash entries with count 0 are empty.
+typedef struct {
+    ColorCount *slots;
+    uint32_t mask;   // slot count - 1, slot count is a power of two
+    uint32_t used;
+    uint64_t *dense; // non-NULL once switched to the dense table
+} Counter;
+
+int cmp_colorcount(const void *a, const void *b) {
+    const ColorCount *A = a;
+    const ColorCount *B = b;
+    if (A->count != B->count) {
+        return (B->count > A->count) - (B->count < A->count);
+    }
+    return (A->color > B->color) - (A->color < B->color);
+}
+
+static inline uint32_t slot_of(uint32_t color, uint32_t mask) {
+    return (color * 0x9E3779B1u >> 8) & mask;
+}
+
+static ColorCount *find_slot(ColorCount *slots, uint32_t mask,
+                             uint32_t color) {
+    uint32_t s = slot_of(color, mask);
+    while (slots[s].count && slots[s].color != color) {
+        s = (s + 1) & mask;
+    }
+    return &slots[s];
+}
+
+static bool counter_grow(Counter *counter) {
+    uint32_t new_mask = counter->mask * 2 + 1;
+    ColorCount *slots = calloc((size_t)new_mask + 1, sizeof(ColorCount));
+    if (!slots) {
+        return false;
+    }
+    for (uint32_t s = 0; s <= counter->mask; s++) {
+        if (counter->slots[s].count) {
+            *find_slot(slots, new_mask, counter->slots[s].color) =
+                counter->slots[s];
+        }
+    }
+    free(counter->slots);
+    counter->slots = slots;
+    counter->mask = new_mask;
+    return true;
+}
+
+static bool counter_to_dense(Counter *counter) {
+    counter->dense = calloc(DENSE_SIZE, sizeof(uint64_t));
+    if (!counter->dense) {
+        return false;
+    }
+    for (uint32_t s = 0; s <= counter->mask; s++) {
+        if (counter->slots[s].count) {
+            counter->dense[counter->slots[s].color] = counter->slots[s].count;
+        }
+    }
+    free(counter->slots);
+    counter->slots = NULL;
+    return true;
+}
+
+ColorCount *count_colors(const uint8_t *buf, uint32_t width, uint32_t height,
+                         uint32_t row_stride, uint32_t *out_unique) {
+    Counter counter = {NULL, 1023, 0, NULL};
+    counter.slots = calloc(counter.mask + 1, sizeof(ColorCount));
+    if (!counter.slots) {
+        return NULL;
+    }
+
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = buf + (size_t)y * row_stride;
+        uint32_t x = 0;
+
+        // Hash until there are too many colors for it to pay off
+        for (; !counter.dense && x < width; x++) {
+            uint32_t b = row[x * 3 + 0];
+            uint32_t g = row[x * 3 + 1];
+            uint32_t r = row[x * 3 + 2];
+            uint32_t key = (r << 16) | (g << 8) | b;
+
+            ColorCount *slot = find_slot(counter.slots, counter.mask, key);
+            if (slot->count == 0) {
+                slot->color = key;
+                counter.used++;
+            }
+            slot->count++;
+
+            // Keep the load at or below 1/2
+            if (counter.used * 2 > counter.mask) {
+                bool ok = (counter.used >= COLOR_COUNT_DENSE_AT)
+                              ? counter_to_dense(&counter)
+                              : counter_grow(&counter);
+                if (!ok) {
+                    report_error("Error: Could not grow color counts.\n");
+                    free(counter.slots);
+                    return NULL;
+                }
+            }
+        }
+
+        for (; x < width; x++) {
+            uint32_t b = row[x * 3 + 0];
+            uint32_t g = row[x * 3 + 1];
+            uint32_t r = row[x * 3 + 2];
+            counter.dense[(r << 16) | (g << 8) | b]++;
+        }
+    }
+
+    // Compact into (color, count) pairs
+    ColorCount *pairs = NULL;
+    uint32_t n = 0;
+    if (counter.dense) {
+        uint32_t unique = 0;
+        for (uint32_t c = 0; c < DENSE_SIZE; c++) {
+            unique += counter.dense[c] != 0;
+        }
+        pairs = malloc(((size_t)unique + 1) * sizeof(ColorCount));
+        for (uint32_t c = 0; pairs && c < DENSE_SIZE; c++) {
+            if (counter.dense[c]) {
+                pairs[n].color = c;
+                pairs[n].count = counter.dense[c];
+                n++;
+            }
+        }
+        free(counter.dense);
+    } else {
+        pairs = malloc(((size_t)counter.used + 1) * sizeof(ColorCount));
+        for (uint32_t s = 0; pairs && s <= counter.mask; s++) {
+            if (counter.slots[s].count) {
+                pairs[n++] = counter.slots[s];
+            }
+        }
+        free(counter.slots);
+    }
+    if (!pairs) {
+        return NULL;
+    }
+
+    qsort(pairs, n, sizeof(ColorCount), cmp_colorcount);
+    if (out_unique) {
+        *out_unique = n;
+    }
+    return pairs;
+}
+
+uint32_t count_colors_upto(const uint8_t *buf, uint32_t width,
+                           uint32_t height, uint32_t row_stride,
+                           uint32_t limit) {
+    // At most half full with limit + 1 colors
+    uint32_t mask = 15;
+    while (mask + 1 < 2 * (limit + 1)) {
+        mask = mask * 2 + 1;
+    }
+    ColorCount *slots = calloc((size_t)mask + 1, sizeof(ColorCount));
+    if (!slots) {
+        return 0;
+    }
+
+    uint32_t used = 0;
+    uint32_t last = UINT32_MAX; // not a 24-bit color
+    for (uint32_t y = 0; y < height && used <= limit; y++) {
+        const uint8_t *row = buf + (size_t)y * row_stride;
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t key = ((uint32_t)row[x * 3 + 2] << 16) |
+                           ((uint32_t)row[x * 3 + 1] << 8) | row[x * 3 + 0];
+            // runs of one color are the common case
+            if (key == last) {
+                continue;
+            }
+            last = key;
+            ColorCount *slot = find_slot(slots, mask, key);
+            if (slot->count == 0) {
+                slot->color = key;
+                slot->count = 1;
+                if (++used > limit) {
+                    break;
+                }
+            }
+        }
+    }
+    free(slots);
+    return used;
+}
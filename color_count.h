@@ -0,0 +1,34 @@
+#ifndef COLOR_COUNT_H
+#define COLOR_COUNT_H
+
+#include <stdint.h>
+
+// Simple structure to hold a color and its count
+typedef struct {
+    uint32_t color; // 0xRRGGBB
+    uint64_t count;
+} ColorCount;
+
+// Compare function for sorting descending by count, ties by color
+int cmp_colorcount(const void *a, const void *b);
+
+// Count the distinct colors of padded 24-bit BGR rows. Small and medium
+// images only touch an open-addressing hash sized to the colors actually
+// found. Past COLOR_COUNT_DENSE_AT distinct colors the counts move to a
+// dense 2^24 table, which is cheaper than a hash that large.
+// Returns the (color, count) pairs sorted by cmp_colorcount, malloc'd,
+// with the number of pairs in *out_unique. NULL on allocation failure.
+#define COLOR_COUNT_DENSE_AT (1u << 21)
+
+ColorCount *count_colors(const uint8_t *buf, uint32_t width, uint32_t height,
+                         uint32_t row_stride, uint32_t *out_unique);
+
+// Number of distinct colors of padded 24-bit BGR rows, but stop counting
+// as soon as there are more than 'limit' and return limit + 1. Only a hash
+// sized to the limit is touched, and a photo checked against 256 colors
+// is rejected within its first rows. 0 on allocation failure.
+uint32_t count_colors_upto(const uint8_t *buf, uint32_t width,
+                           uint32_t height, uint32_t row_stride,
+                           uint32_t limit);
+
+#endif
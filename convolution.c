@@ -3,6 +3,10 @@
 
 #include "convolution.h"
 #include "clamp.h"
+#include "fft.h"
+#include "report.h"
+#include <ctype.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -66,7 +70,7 @@ extern char **get_filter_name_list(Kernel *kernel_list, uint8_t *name_count) {
     // Allocate memory for the array of string pointers
     char **names = (char **)malloc(count * sizeof(char *));
     if (!names) {
-        perror("Failed to allocate memory.\n");
+        report_error("Failed to allocate memory.\n");
         return NULL;
     }
 
@@ -84,27 +88,341 @@ extern char **get_filter_name_list(Kernel *kernel_list, uint8_t *name_count) {
 }
 
 int32_t get_kernel_weight(Kernel *kernel) {
-    printf("Inside kernel weight\n");
+    DEBUG_LOG("Inside kernel weight\n");
     if (!kernel) {
-        fprintf(stderr, "Error: get_kernel_weight - NULL Kernel.\n");
-        exit(EXIT_FAILURE);
+        report_error("Error: get_kernel_weight - NULL Kernel.\n");
+        return 0;
     } else if (!kernel->array) {
-        fprintf(stderr, "Error: get_kernel_weight - NULL Kernel array.\n");
-        exit(EXIT_FAILURE);
+        report_error("Error: get_kernel_weight - NULL Kernel array.\n");
+        return 0;
     }
     uint8_t size = kernel->size;
     size = size * size;
     int32_t weight = 0;
     for (int i = 0; i < size; i++) {
         weight += kernel->array[i];
-        printf("W: %d", weight);
+        DEBUG_LOG("W: %d", weight);
     }
-    printf("\n");
+    DEBUG_LOG("\n");
     return weight;
 }
 
-// Convolution function
-void conv1(Convolution *conv) {
+// Greatest common divisor, always >= 0
+static int32_t gcd_int(int32_t a, int32_t b) {
+    a = a < 0 ? -a : a;
+    b = b < 0 ? -b : b;
+    while (b) {
+        int32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Exact integer rank-1 factoring, done once per kernel. The row factor is
+// the first non-zero kernel row divided by the gcd of its entries, so if
+// the kernel is rank 1 every row is a whole multiple of it and the column
+// factor comes out integer too. Anything that does not reproduce the
+// kernel exactly stays on the direct path.
+bool kernel_factor(Kernel *kernel) {
+    if (!kernel || !kernel->array) {
+        return false;
+    }
+    if (kernel->factored) {
+        return kernel->separable;
+    }
+    kernel->factored = true;
+    kernel->separable = false;
+
+    const int8_t *k = kernel->array;
+    uint8_t n = kernel->size;
+    if (n == 0 || n > KERNEL_MAX_SIZE) {
+        return false;
+    }
+
+    int pivot = -1;
+    for (int i = 0; i < n * n; i++) {
+        if (k[i] != 0) {
+            pivot = i;
+            break;
+        }
+    }
+    if (pivot < 0) {
+        return false;
+    }
+    int py = pivot / n;
+    int px = pivot % n;
+
+    int32_t g = 0;
+    for (int x = 0; x < n; x++) {
+        g = gcd_int(g, k[py * n + x]);
+    }
+    if (k[pivot] < 0) {
+        g = -g;
+    }
+    for (int x = 0; x < n; x++) {
+        kernel->row[x] = k[py * n + x] / g;
+    }
+
+    for (int y = 0; y < n; y++) {
+        if (k[y * n + px] % kernel->row[px] != 0) {
+            return false;
+        }
+        kernel->column[y] = k[y * n + px] / kernel->row[px];
+    }
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            if (kernel->column[y] * kernel->row[x] != k[y * n + x]) {
+                return false;
+            }
+        }
+    }
+
+    kernel->separable = true;
+    DEBUG_LOG("Kernel %s is separable\n", kernel->name);
+    return true;
+}
+
+// --- User kernels ---
+
+static bool kernel_factor_weights(Kernel *kernel);
+
+// Whole file, or NULL if spec is not a readable file.
+static char *read_text_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = (length >= 0) ? malloc((size_t)length + 1) : NULL;
+    if (!text) {
+        fclose(file);
+        return NULL;
+    }
+    size_t read = fread(text, 1, (size_t)length, file);
+    text[read] = '\0';
+    fclose(file);
+    return text;
+}
+
+static bool parse_float_token(const char *token, float *value) {
+    char *end = NULL;
+    *value = strtof(token, &end);
+    return end != token && *end == '\0' && isfinite(*value);
+}
+
+Kernel *kernel_load(const char *spec) {
+    if (!spec || *spec == '\0') {
+        report_error("Error: Empty kernel.\n");
+        return NULL;
+    }
+    bool from_file = true;
+    char *text = read_text_file(spec);
+    if (!text) {
+        from_file = false;
+        text = strdup(spec);
+        if (!text) {
+            return NULL;
+        }
+    }
+
+    // Comments run to the end of the line.
+    for (char *c = text; *c; c++) {
+        if (*c == '#') {
+            while (*c && *c != '\n') {
+                *c++ = ' ';
+            }
+            if (!*c) {
+                break;
+            }
+        }
+    }
+
+    size_t capacity = 64;
+    size_t count = 0;
+    float *values = malloc(sizeof(float) * capacity);
+    float divisor = 0.0f;
+    float bias = 0.0f;
+    bool ok = values != NULL;
+
+    // strtok keeps its place in a static, this runs on any thread
+    const char *separators = " \t\r\n,;[]";
+    char *next = text;
+    while (ok) {
+        next += strspn(next, separators);
+        if (!*next) {
+            break;
+        }
+        char *token = next;
+        next += strcspn(next, separators);
+        if (*next) {
+            *next++ = '\0';
+        }
+        float value = 0.0f;
+        if (strncmp(token, "divisor=", 8) == 0) {
+            ok = parse_float_token(token + 8, &divisor) && divisor != 0.0f;
+        } else if (strncmp(token, "bias=", 5) == 0) {
+            ok = parse_float_token(token + 5, &bias);
+        } else if (parse_float_token(token, &value)) {
+            if (count == capacity) {
+                capacity *= 2;
+                float *grown = realloc(values, sizeof(float) * capacity);
+                if (!grown) {
+                    ok = false;
+                    break;
+                }
+                values = grown;
+            }
+            values[count++] = value;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            report_error("Error: Kernel token \"%s\" is not valid.\n",
+                    token);
+        }
+    }
+    free(text);
+
+    uint32_t size = 0;
+    while ((size + 1) * (size + 1) <= count) {
+        size++;
+    }
+    if (ok && (size * size != count || size % 2 == 0 || size > 255)) {
+        report_error(
+                "Error: Kernel needs an odd N x N block of weights, got %zu "
+                "values.\n",
+                count);
+        ok = false;
+    }
+    if (!ok) {
+        free(values);
+        return NULL;
+    }
+
+    if (divisor == 0.0f) {
+        for (size_t i = 0; i < count; i++) {
+            divisor += values[i];
+        }
+        if (fabsf(divisor) < 1e-6f) {
+            divisor = 1.0f;
+        }
+    }
+
+    // The weights are written top row first, the rows of a BMP are stored
+    // bottom row first and conv1 pairs weight row j with memory row y + j.
+    // Flipped here, the kernel lies on the image the way it reads.
+    for (uint32_t y = 0; y < size / 2; y++) {
+        float *top = values + (size_t)y * size;
+        float *bottom = values + (size_t)(size - 1 - y) * size;
+        for (uint32_t x = 0; x < size; x++) {
+            float t = top[x];
+            top[x] = bottom[x];
+            bottom[x] = t;
+        }
+    }
+
+    Kernel *kernel = calloc(1, sizeof(Kernel));
+    if (!kernel) {
+        free(values);
+        return NULL;
+    }
+    kernel->name = from_file ? spec : "kernel";
+    kernel->size = (uint8_t)size;
+    kernel->weights = values;
+    kernel->divisor = divisor;
+    kernel->bias = bias;
+    // Factored now, so the kernel is read only while it is in use and
+    // threads or tiles can share it
+    kernel_factor_weights(kernel);
+
+    DEBUG_LOG("Kernel %ux%u, divisor %g, bias %g\n", size, size, divisor, bias);
+    return kernel;
+}
+
+void kernel_free(Kernel *kernel) {
+    if (!kernel) {
+        return;
+    }
+    free(kernel->weights);
+    free(kernel->column_weights);
+    free(kernel->row_weights);
+    free(kernel);
+}
+
+// Float rank-1 factoring around the largest weight. Accepted when the outer
+// product reproduces every weight to within float rounding.
+static bool kernel_factor_weights(Kernel *kernel) {
+    if (kernel->factored) {
+        return kernel->separable;
+    }
+    kernel->factored = true;
+    kernel->separable = false;
+
+    const float *w = kernel->weights;
+    uint32_t n = kernel->size;
+    uint32_t pivot = 0;
+    for (uint32_t i = 1; i < n * n; i++) {
+        if (fabsf(w[i]) > fabsf(w[pivot])) {
+            pivot = i;
+        }
+    }
+    float peak = fabsf(w[pivot]);
+    if (peak == 0.0f) {
+        return false;
+    }
+    uint32_t py = pivot / n;
+    uint32_t px = pivot % n;
+
+    float *column = malloc(sizeof(float) * n);
+    float *row = malloc(sizeof(float) * n);
+    if (!column || !row) {
+        free(column);
+        free(row);
+        return false;
+    }
+    for (uint32_t x = 0; x < n; x++) {
+        row[x] = w[py * n + x];
+    }
+    for (uint32_t y = 0; y < n; y++) {
+        column[y] = w[y * n + px] / w[pivot];
+    }
+    for (uint32_t y = 0; y < n; y++) {
+        for (uint32_t x = 0; x < n; x++) {
+            if (fabsf(column[y] * row[x] - w[y * n + x]) > 1e-5f * peak) {
+                free(column);
+                free(row);
+                return false;
+            }
+        }
+    }
+
+    kernel->column_weights = column;
+    kernel->row_weights = row;
+    kernel->separable = true;
+    DEBUG_LOG("Kernel %s is separable\n", kernel->name);
+    return true;
+}
+
+// Normalize and clamp the result
+static inline uint8_t conv_normalize(int32_t sum, int32_t kernel_weight) {
+    sum = (kernel_weight != 0) ? sum / kernel_weight : sum;
+    return (uint8_t)clamp_int(sum, 0, 255);
+}
+
+// The stored value, through the fused map if there is one
+static inline uint8_t conv_map(const Convolution *conv, uint8_t value) {
+    return conv->map ? conv->map[value] : value;
+}
+
+static inline ptrdiff_t conv_stride(const Convolution *conv) {
+    return conv->stride ? conv->stride : (ptrdiff_t)conv->width;
+}
+
+// Direct k x k taps, used for kernels that do not factor.
+static void conv1_direct(Convolution *conv, int32_t kernel_weight) {
     uint8_t *input = conv->input;   // Input buffer (grayscale)
     uint8_t *output = conv->output; // Output buffer
     uint32_t height = conv->height; // Image height
@@ -112,8 +430,7 @@ void conv1(Convolution *conv) {
     const int8_t *kernel =
         conv->kernel->array; // Convolution kernel (flattened 2D array)
     uint8_t kernel_size = conv->kernel->size; // Kernel width or height
-    int32_t kernel_weight = get_kernel_weight(conv->kernel);
-    printf("kw:%d \n", kernel_weight);
+    ptrdiff_t stride = conv_stride(conv);     // Bytes per row
 
     // Half-size of the kernel
     uint8_t kernel_radius = kernel_size / 2;
@@ -133,7 +450,8 @@ void conv1(Convolution *conv) {
                     // Boundary check: skip out-of-bounds pixels
                     if (pixel_y >= 0 && pixel_y < height && pixel_x >= 0 &&
                         pixel_x < width) {
-                        int image_index = pixel_y * width + pixel_x;
+                        size_t image_index =
+                            (ptrdiff_t)pixel_y * stride + pixel_x;
                         int kernel_index = (y1 + kernel_radius) * kernel_size +
                                            (x1 + kernel_radius);
 
@@ -143,16 +461,338 @@ void conv1(Convolution *conv) {
                 }
             }
 
-            // Normalize and clamp the result
-            // printf("Kernel weight: %d\n", kernel_weight);
-            sum = (kernel_weight !=0) ? sum / kernel_weight : sum;
-            // printf("kw:%d ", kernel_weight);
-            //sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
-            sum = clamp_int(sum, 0 , 255);
             // Write the result to the output buffer
-            output[y * width + x] = (uint8_t)sum;
+            output[(ptrdiff_t)y * stride + x] =
+                conv_map(conv, conv_normalize(sum, kernel_weight));
+        }
+    }
+}
+
+// Two 1D passes for separable kernels, 2k taps per pixel instead of k*k.
+// The horizontal pass stores its sums transposed (one column per row of
+// the intermediate) so the vertical pass reads contiguous memory. Sums stay
+// integer until the end, so the result matches the direct path exactly,
+// including the zero padding at the borders.
+static bool conv1_separable(Convolution *conv, int32_t kernel_weight) {
+    const uint8_t *input = conv->input;
+    uint8_t *output = conv->output;
+    int32_t height = conv->height;
+    int32_t width = conv->width;
+    const int32_t *row = conv->kernel->row;
+    const int32_t *column = conv->kernel->column;
+    int32_t radius = conv->kernel->size / 2;
+    ptrdiff_t stride = conv_stride(conv);
+
+    int32_t *transposed = malloc(sizeof(int32_t) * (size_t)width * height);
+    if (!transposed) {
+        report_error("Error: Could not allocate convolution buffer.\n");
+        return false;
+    }
+
+    // Horizontal, taps clipped to the row instead of tested one by one.
+    for (int32_t y = 0; y < height; y++) {
+        const uint8_t *in = input + (ptrdiff_t)y * stride;
+        for (int32_t x = 0; x < width; x++) {
+            int32_t lo = (x < radius) ? -x : -radius;
+            int32_t hi = (x + radius >= width) ? width - 1 - x : radius;
+            int32_t sum = 0;
+            for (int32_t k = lo; k <= hi; k++) {
+                sum += in[x + k] * row[k + radius];
+            }
+            transposed[(size_t)x * height + y] = sum;
+        }
+    }
+
+    // Vertical
+    for (int32_t x = 0; x < width; x++) {
+        const int32_t *col = transposed + (size_t)x * height;
+        for (int32_t y = 0; y < height; y++) {
+            int32_t lo = (y < radius) ? -y : -radius;
+            int32_t hi = (y + radius >= height) ? height - 1 - y : radius;
+            int32_t sum = 0;
+            for (int32_t k = lo; k <= hi; k++) {
+                sum += col[y + k] * column[k + radius];
+            }
+            output[(ptrdiff_t)y * stride + x] =
+                conv_map(conv, conv_normalize(sum, kernel_weight));
+        }
+    }
+
+    free(transposed);
+    return true;
+}
+
+// --- Float engine for user kernels ---
+
+static inline uint8_t conv_store(float sum, const Kernel *kernel) {
+    float v = sum / kernel->divisor + kernel->bias;
+    v = clamp_float(v, 0.0f, 255.0f);
+    return (uint8_t)(v + 0.5f);
+}
+
+static void conv1_weights_direct(Convolution *conv) {
+    const uint8_t *input = conv->input;
+    int32_t height = conv->height;
+    int32_t width = conv->width;
+    const float *w = conv->kernel->weights;
+    int32_t n = conv->kernel->size;
+    int32_t radius = n / 2;
+    ptrdiff_t stride = conv_stride(conv);
+
+    for (int32_t y = 0; y < height; y++) {
+        int32_t y_lo = (y < radius) ? -y : -radius;
+        int32_t y_hi = (y + radius >= height) ? height - 1 - y : radius;
+        for (int32_t x = 0; x < width; x++) {
+            int32_t x_lo = (x < radius) ? -x : -radius;
+            int32_t x_hi = (x + radius >= width) ? width - 1 - x : radius;
+            float sum = 0.0f;
+            for (int32_t j = y_lo; j <= y_hi; j++) {
+                const uint8_t *in = input + (ptrdiff_t)(y + j) * stride + x;
+                const float *k = w + (size_t)(j + radius) * n + radius;
+                for (int32_t i = x_lo; i <= x_hi; i++) {
+                    sum += in[i] * k[i];
+                }
+            }
+            conv->output[(ptrdiff_t)y * stride + x] =
+                conv_map(conv, conv_store(sum, conv->kernel));
+        }
+    }
+}
+
+// Same layout as conv1_separable, float sums.
+static bool conv1_weights_separable(Convolution *conv) {
+    const uint8_t *input = conv->input;
+    int32_t height = conv->height;
+    int32_t width = conv->width;
+    const float *row = conv->kernel->row_weights;
+    const float *column = conv->kernel->column_weights;
+    int32_t radius = conv->kernel->size / 2;
+    ptrdiff_t stride = conv_stride(conv);
+
+    float *transposed = malloc(sizeof(float) * (size_t)width * height);
+    if (!transposed) {
+        report_error("Error: Could not allocate convolution buffer.\n");
+        return false;
+    }
+
+    for (int32_t y = 0; y < height; y++) {
+        const uint8_t *in = input + (ptrdiff_t)y * stride;
+        for (int32_t x = 0; x < width; x++) {
+            int32_t lo = (x < radius) ? -x : -radius;
+            int32_t hi = (x + radius >= width) ? width - 1 - x : radius;
+            float sum = 0.0f;
+            for (int32_t k = lo; k <= hi; k++) {
+                sum += in[x + k] * row[k + radius];
+            }
+            transposed[(size_t)x * height + y] = sum;
+        }
+    }
+
+    for (int32_t x = 0; x < width; x++) {
+        const float *col = transposed + (size_t)x * height;
+        for (int32_t y = 0; y < height; y++) {
+            int32_t lo = (y < radius) ? -y : -radius;
+            int32_t hi = (y + radius >= height) ? height - 1 - y : radius;
+            float sum = 0.0f;
+            for (int32_t k = lo; k <= hi; k++) {
+                sum += col[y + k] * column[k + radius];
+            }
+            conv->output[(ptrdiff_t)y * stride + x] =
+                conv_map(conv, conv_store(sum, conv->kernel));
+        }
+    }
+
+    free(transposed);
+    return true;
+}
+
+// Overlap-add on tile x tile FFT blocks. Each block of the image holds
+// tile - size + 1 pixels so its linear convolution with the kernel fits the
+// tile without wrapping. The input is real, so two blocks share one complex
+// transform: one in the real part, one in the imaginary part. The kernel
+// is flipped because conv1 correlates rather than convolves.
+static bool conv1_weights_fft(Convolution *conv, uint32_t tile) {
+    const uint8_t *input = conv->input;
+    int32_t height = conv->height;
+    int32_t width = conv->width;
+    const float *w = conv->kernel->weights;
+    int32_t n = conv->kernel->size;
+    int32_t radius = n / 2;
+    int32_t block = tile - n + 1;
+    size_t tile_area = (size_t)tile * tile;
+    ptrdiff_t stride = conv_stride(conv);
+
+    Fft_Plan plan;
+    if (!fft_plan_init(&plan, tile)) {
+        return false;
+    }
+    float *kernel_re = calloc(tile_area, sizeof(float));
+    float *kernel_im = calloc(tile_area, sizeof(float));
+    float *re = malloc(tile_area * sizeof(float));
+    float *im = malloc(tile_area * sizeof(float));
+    float *sums = calloc((size_t)width * height, sizeof(float));
+    if (!kernel_re || !kernel_im || !re || !im || !sums) {
+        report_error("Error: Could not allocate FFT buffers.\n");
+        fft_plan_free(&plan);
+        free(kernel_re);
+        free(kernel_im);
+        free(re);
+        free(im);
+        free(sums);
+        return false;
+    }
+
+    for (int32_t y = 0; y < n; y++) {
+        for (int32_t x = 0; x < n; x++) {
+            kernel_re[(size_t)y * tile + x] =
+                w[(size_t)(n - 1 - y) * n + (n - 1 - x)];
         }
     }
+    fft2(&plan, kernel_re, kernel_im, false);
+
+    int32_t blocks_x = (width + block - 1) / block;
+    int32_t blocks_y = (height + block - 1) / block;
+    int32_t block_count = blocks_x * blocks_y;
+
+    for (int32_t b = 0; b < block_count; b += 2) {
+        memset(re, 0, tile_area * sizeof(float));
+        memset(im, 0, tile_area * sizeof(float));
+
+        // Block b goes in the real part, block b + 1 in the imaginary part
+        for (int32_t part = 0; part < 2 && b + part < block_count; part++) {
+            float *dst = part ? im : re;
+            int32_t y0 = ((b + part) / blocks_x) * block;
+            int32_t x0 = ((b + part) % blocks_x) * block;
+            for (int32_t y = 0; y < block && y0 + y < height; y++) {
+                const uint8_t *in = input + (ptrdiff_t)(y0 + y) * stride + x0;
+                for (int32_t x = 0; x < block && x0 + x < width; x++) {
+                    dst[(size_t)y * tile + x] = in[x];
+                }
+            }
+        }
+
+        fft2(&plan, re, im, false);
+        for (size_t i = 0; i < tile_area; i++) {
+            float a = re[i];
+            float c = im[i];
+            re[i] = a * kernel_re[i] - c * kernel_im[i];
+            im[i] = a * kernel_im[i] + c * kernel_re[i];
+        }
+        fft2(&plan, re, im, true);
+
+        // Add back the part of each result that lands on the image. Full
+        // convolution index p maps to output p - radius.
+        for (int32_t part = 0; part < 2 && b + part < block_count; part++) {
+            const float *src = part ? im : re;
+            int32_t y0 = ((b + part) / blocks_x) * block - radius;
+            int32_t x0 = ((b + part) % blocks_x) * block - radius;
+            for (int32_t y = 0; y < (int32_t)tile; y++) {
+                int32_t oy = y0 + y;
+                if (oy < 0 || oy >= height) {
+                    continue;
+                }
+                float *out = sums + (size_t)oy * width;
+                for (int32_t x = 0; x < (int32_t)tile; x++) {
+                    int32_t ox = x0 + x;
+                    if (ox >= 0 && ox < width) {
+                        out[ox] += src[(size_t)y * tile + x];
+                    }
+                }
+            }
+        }
+    }
+
+    for (int32_t y = 0; y < height; y++) {
+        const float *sum = sums + (size_t)y * width;
+        uint8_t *out = conv->output + (ptrdiff_t)y * stride;
+        for (int32_t x = 0; x < width; x++) {
+            out[x] = conv_map(conv, conv_store(sum[x], conv->kernel));
+        }
+    }
+
+    fft_plan_free(&plan);
+    free(kernel_re);
+    free(kernel_im);
+    free(re);
+    free(im);
+    free(sums);
+    return true;
+}
+
+// Cost model in nanoseconds, measured with the default (unoptimized)
+// Makefile build on an x86-64 core: one tap of the direct or separable
+// loop, one radix-2 butterfly including the fft2 column copies, and the
+// per element work around each pair of transforms (clear, load, spectrum
+// multiply, add back). Only the ratios matter for picking a path.
+#define COST_TAP_NS 3.6
+#define COST_BUTTERFLY_NS 16.0
+#define COST_FFT_POINT_NS 75.0
+#define FFT_TILE_MAX 1024
+
+static bool conv1_weights(Convolution *conv) {
+    Kernel *kernel = conv->kernel;
+    double pixels = (double)conv->width * conv->height;
+    double n = kernel->size;
+
+    bool separable = kernel_factor_weights(kernel);
+    double direct_cost = pixels * n * n * COST_TAP_NS;
+    double separable_cost =
+        separable ? pixels * 2.0 * n * COST_TAP_NS : INFINITY;
+
+    // Best power of two tile: a 2D transform of T x T is T * T * log2(T)
+    // butterflies, and two blocks share each forward/inverse pair.
+    double fft_cost = INFINITY;
+    uint32_t fft_tile = 0;
+    for (uint32_t tile = 4, bits = 2; tile <= FFT_TILE_MAX; tile *= 2, bits++) {
+        if (tile < 2 * kernel->size) {
+            continue;
+        }
+        double block = tile - n + 1;
+        double blocks = ceil(conv->width / block) * ceil(conv->height / block);
+        double area = (double)tile * tile;
+        double cost =
+            ceil(blocks / 2.0) * (2.0 * area * bits * COST_BUTTERFLY_NS +
+                                  area * COST_FFT_POINT_NS);
+        if (cost < fft_cost) {
+            fft_cost = cost;
+            fft_tile = tile;
+        }
+    }
+
+    DEBUG_LOG("Convolution cost estimate (ms): direct %.1f, separable %.1f, "
+           "fft %.1f\n",
+           direct_cost / 1e6, separable_cost / 1e6, fft_cost / 1e6);
+
+    if (separable_cost <= direct_cost && separable_cost <= fft_cost) {
+        DEBUG_LOG("Convolution: separable\n");
+        return conv1_weights_separable(conv);
+    } else if (fft_cost < direct_cost) {
+        DEBUG_LOG("Convolution: fft, %ux%u tiles\n", fft_tile, fft_tile);
+        return conv1_weights_fft(conv, fft_tile);
+    }
+    DEBUG_LOG("Convolution: direct\n");
+    conv1_weights_direct(conv);
+    return true;
+}
+
+// Convolution function
+bool conv1(Convolution *conv) {
+    if (!conv->kernel || (!conv->kernel->weights && !conv->kernel->array)) {
+        report_error("Error: Convolution without a kernel.\n");
+        return false;
+    }
+    if (conv->kernel->weights) {
+        return conv1_weights(conv);
+    }
+
+    int32_t kernel_weight = get_kernel_weight(conv->kernel);
+    DEBUG_LOG("kw:%d \n", kernel_weight);
+
+    if (kernel_factor(conv->kernel)) {
+        return conv1_separable(conv, kernel_weight);
+    }
+    conv1_direct(conv, kernel_weight);
+    return true;
 }
 
 #endif
\ No newline at end of file
@@ -1,12 +1,30 @@
 #ifndef CONVOLUTION_H
 #define CONVOLUTION_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-typedef struct {
+// Largest kernel side that is checked for a separable factoring.
+#define KERNEL_MAX_SIZE 31
+
+typedef struct Kernel {
     const char *name;
     const int8_t *array;
-    const uint8_t size;
+    uint8_t size;
+    // Filled in once by kernel_factor(). A separable kernel is the outer
+    // product column x row, array[y * size + x] == column[y] * row[x].
+    bool factored;
+    bool separable;
+    int32_t column[KERNEL_MAX_SIZE];
+    int32_t row[KERNEL_MAX_SIZE];
+    // User kernels from kernel_load() carry float weights instead of array
+    // and any odd size. Each output is sum / divisor + bias.
+    float *weights;
+    float divisor;
+    float bias;
+    float *column_weights; // Separable factoring of weights, or NULL
+    float *row_weights;
 } Kernel;
 
 typedef struct {
@@ -14,7 +32,16 @@ typedef struct {
     uint8_t *output; // Pointer to the output image buffer
     uint32_t height;      // Image height
     uint32_t width;       // Image width
+    // Bytes from one row to the next in input and output, 0 for width
+    // (rows without padding). Padding bytes are not written. Row 0 is the
+    // bottom row of the image, as BMP stores it: rows stored top-down are
+    // passed from their last row with a negative stride, so a kernel lies
+    // on the image the same way either way.
+    ptrdiff_t stride;
     Kernel *kernel;   // Pointer to the convolution kernel
+    // Pointwise map of each result as it is stored (pointwise ops fused
+    // into the filter), NULL for none
+    const uint8_t *map;
     //    int kernel_size;      // Size of the kernel (eg., 3 for a 3x3 kernel)
     //    int kernel_weight;    // Normalization factor (sum of kernel elements)
 } Convolution;
@@ -27,6 +54,20 @@ extern Kernel kernel_list[];
 
 extern char **get_filter_name_list(Kernel *kernel_list, uint8_t *name_count);
 
-void conv1(Convolution *conv);
+bool kernel_factor(Kernel *kernel);
+
+// Kernel from a file name or an inline string: size * size numbers
+// (integer or float) separated by spaces, commas or semicolons, plus the
+// optional tokens divisor=<f> and bias=<f>. # starts a comment. size must
+// be odd. The divisor defaults to the sum of the weights (1 if that is 0).
+// The weights are in reading order, as the kernel lies on the image: the
+// first row is the one above the output pixel, the first column the one
+// to its left. "0 1 0; 0 0 0; 0 0 0" moves the image down by one pixel.
+Kernel *kernel_load(const char *spec);
+void kernel_free(Kernel *kernel);
+
+// false if a scratch buffer could not be allocated, the output is then
+// incomplete
+bool conv1(Convolution *conv);
 
 #endif
\ No newline at end of file
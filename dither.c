@@ -0,0 +1,622 @@
+#include "dither.h"
+#include "pool.h"
+#include "report.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DITHER_X86 1
+#include <immintrin.h>
+#endif
+
+// --- Diffusion kernels ---
+// {dx, dy, weight}, the current pixel is at (0, 0)
+
+static const Diffusion_Kernel fs_kernel = {
+    4, 16, {{1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}}};
+
+static const Diffusion_Kernel atkinson_kernel = {
+    6, 8, {{1, 0, 1}, {2, 0, 1},
+           {-1, 1, 1}, {0, 1, 1}, {1, 1, 1},
+           {0, 2, 1}}};
+
+static const Diffusion_Kernel jarvis_kernel = {
+    12, 48, {{1, 0, 7}, {2, 0, 5},
+             {-2, 1, 3}, {-1, 1, 5}, {0, 1, 7}, {1, 1, 5}, {2, 1, 3},
+             {-2, 2, 1}, {-1, 2, 3}, {0, 2, 5}, {1, 2, 3}, {2, 2, 1}}};
+
+static const Diffusion_Kernel stucki_kernel = {
+    12, 42, {{1, 0, 8}, {2, 0, 4},
+             {-2, 1, 2}, {-1, 1, 4}, {0, 1, 8}, {1, 1, 4}, {2, 1, 2},
+             {-2, 2, 1}, {-1, 2, 2}, {0, 2, 4}, {1, 2, 2}, {2, 2, 1}}};
+
+static const Diffusion_Kernel sierra_kernel = {
+    10, 32, {{1, 0, 5}, {2, 0, 3},
+             {-2, 1, 2}, {-1, 1, 4}, {0, 1, 5}, {1, 1, 4}, {2, 1, 2},
+             {-1, 2, 2}, {0, 2, 3}, {1, 2, 2}}};
+
+// --- Threshold tiles ---
+// Bayer index M of an n x n matrix becomes the threshold (M + 0.5) * 256 / n^2,
+// so a flat value v turns on the same fraction of the tile as v / 256.
+
+static const uint8_t bayer2[2 * 2] = {
+     32, 160,
+    224,  96,
+};
+
+static const uint8_t bayer4[4 * 4] = {
+      8, 136,  40, 168,
+    200,  72, 232, 104,
+     56, 184,  24, 152,
+    248, 120, 216,  88,
+};
+
+static const uint8_t bayer8[8 * 8] = {
+      2, 130,  34, 162,  10, 138,  42, 170,
+    194,  66, 226,  98, 202,  74, 234, 106,
+     50, 178,  18, 146,  58, 186,  26, 154,
+    242, 114, 210,  82, 250, 122, 218,  90,
+     14, 142,  46, 174,   6, 134,  38, 166,
+    206,  78, 238, 110, 198,  70, 230, 102,
+     62, 190,  30, 158,  54, 182,  22, 150,
+    254, 126, 222,  94, 246, 118, 214,  86,
+};
+
+// Generated offline with void-and-cluster (Ulichney 1993): 64x64 torus,
+// Gaussian sigma 1.5, 10% initial pattern from srand(1). Rank r became the
+// threshold (2r + 1) * 256 / 8192, raised to at least 1.
+static const uint8_t blue_noise64[64 * 64] = {
+    208, 12,190,219, 91, 58,123,233, 37,154, 61,124, 47, 15,213,112,
+    225,123,236, 53,171, 73, 34,139,192, 65,231,125,172,247, 40,208,
+     88,252, 74,186, 27,224,137,246,107, 20,230, 89,218, 64,  4,231,
+    124, 16, 96,225, 59,187, 82,235, 63,194,110,146,176,133, 61,110,
+     37,131, 71,142,  2,161,203, 74,170,217, 91,251,198, 98,155, 55,
+    167,  1,146, 97,202,129,106,167,244, 97, 41, 10, 69,107,192, 59,
+    135, 19,220, 99,160, 56, 93, 33, 72,147,122,176, 38,143,210,164,
+     56,150,205,167,138,242, 30,116,178, 19,246, 31,211, 10,254,164,
+    226,103,172,245, 39,223,137, 25,109,  4,179, 31,147, 77,239, 34,
+    201, 85,189, 29,250, 13,222, 54, 22,153,216,184,226,146, 14,231,
+    156,111,171,  7,240,116,212,190,167,215,  5, 68,253,114, 87, 34,
+    106,234, 75,  1, 89, 46,160,210,141, 51,163, 71, 98,120,188, 76,
+    202, 16, 57,194,118, 99, 55,187,229,142, 71,115,218,  7,176,106,
+    134,244, 46,165, 66,149,185, 84,201,112, 74,130, 49, 90,168, 77,
+     33,215, 51,203,144, 78, 20,125, 49,241,102,195,159, 17,182,244,
+    195, 22,179,119,199,220,103, 13, 77,230,124,197,224, 55, 28,147,
+     48,233,154, 77, 23,176,251, 88, 44,196,242, 51,190,127, 62,224,
+     16, 73,120,230, 90,115, 42,234,137,  1,176,251, 23,212,118,243,
+    183, 93,128, 70, 37,176,254,153, 91, 27,139, 41, 80,223, 52,132,
+     72,141, 48,246, 27,134, 65,247,192, 92,  3, 39,144,173,242, 94,
+    182,107,127,239,209,144,  9,163,121, 17, 98,166, 21,246, 90,156,
+    183,204,144,  9,179,208, 25,163, 60,211, 38,159,104,186,  4, 52,
+    144, 21,248,190,106,217,  1, 62,203,178,235,119,202,148,103,  5,
+    171,222,105,157, 81,186,166, 40,114,155,178,251, 80,110,  6,136,
+     31,216, 11, 45, 95, 62,218, 74,236,138,207, 79,150, 43,209, 26,
+     56, 98, 37,217, 55,130,254,104, 86,240,123, 81, 61,233,133,202,
+     72,220,153, 14,164, 82,133,229,115, 76,  8,165, 59, 29,233,209,
+     91, 33,197, 60,234,  6,123,224, 21,216, 51,132, 25,221,199, 70,
+    168, 84,188,157,200,129, 33,106,183, 57, 34,233,104,187,115,139,
+    250,168,237,108,156, 77,  5,196,145, 22,180,203,149, 32, 85,164,
+    104, 41,119, 60,238, 44,193, 29,160, 47,214, 98,249,175,138, 65,
+    125,251, 15,145, 93,203, 50, 85,145, 70,102,208,184, 59,151,238,
+    130, 57,253,110, 18,173,247,149,  1,222,171,130,  8, 64,227, 82,
+      2,127, 65, 17,191,228,176, 40,224,111, 54,  8,226,114,254, 14,
+    210,176,228, 90,202,112,149, 93,246,188,134, 22, 81,114, 12,183,
+     42,162,112,180, 37,135,254,168,189,242, 14,162, 83,118, 15, 96,
+    227,  3,138, 68,232, 82, 50,195, 89,115, 76,198,255,160, 31,177,
+    215, 89,198,148, 47, 96,124, 63,160, 78,213,137,171, 50,187, 63,
+    140, 29,131,  6,160, 23,226, 60, 10,107,154,225,196, 48,239,202,
+     87,225, 73,207,230,103, 64, 10,112, 43,126,228, 34,248,174, 44,
+    107,184,206, 36,150,216,119, 27,240,162, 20, 47, 93,119,196, 52,
+    145, 39,225,114,245, 28,143,237, 12,189,249, 91, 29,101,154,215,
+     88,242, 69,184,252, 76,132,170,217, 78, 36, 64,121,163, 99,145,
+     19,131, 52,  2,156, 27,195,141,218, 90,203,149, 57,198,139,212,
+    155, 28, 86,169,105, 10,181,140, 62,205,132,219,148, 17, 78,236,
+    102,171, 21, 77,161,211, 84,199,117, 35,127, 66,205,239,  1,119,
+     43,193,109,146, 36,103,202, 42,116,193,253,172,  2,229, 35, 67,
+    212,178,245, 88,119,173, 81,238, 30,179, 68,  1,112, 88, 23, 72,
+     53,247,122,221, 54,200, 77,231,103, 38,185, 68,242,174,211,129,
+      7,250,137,187, 59,  1,171, 45, 99,177,152, 16,180,135, 80,230,
+    170, 12,224, 57,214,177,  3,241,158, 18, 94,139,207, 84,155,251,
+    113, 32,143,196,233, 45,208,107, 56,130,251,158,231,177,124,236,
+    102,175,  7, 74,237,131, 43,156, 17,249,114,  4,100, 56, 30,162,
+     64,204, 42,108,218,127,252, 70,207,242, 53,226,112, 37,196, 60,
+    130, 92,159, 23,126, 65,144, 85, 51,131,222, 24, 59,185,128,  8,
+    170, 57,101, 17, 65,136,  6,153,172, 23,191, 79, 44,215, 13,192,
+     34,211,140,159, 25,178, 94,215,175, 83,145,165,200,137,232,115,
+     93,181, 82,234, 18, 93,150, 25,133,  5, 87,166, 70,252,155, 18,
+    209,248, 73,192,244, 99,228,184,205, 70,178,112,243, 42,101,224,
+     82,205,238,161,187,221, 75,245, 94,222,117, 16,102,134, 61,148,
+    227, 92, 51,196,105,253,  2,120, 58,221, 44,238, 25, 83,186, 45,
+    241, 13,134,158,201, 53,180,214,107,191,144,217, 20, 93,185,108,
+     36,145,116, 47,169, 18, 39,109,  9,248, 34,142, 77,201,157, 30,
+    189,118, 39, 79,109, 29,122,198, 42, 66,145,240,205,169,255, 78,
+    130, 19,117,220, 36, 69,149,200, 29,134,185, 67,108,223,  8,146,
+    210,166, 35, 70,119,239, 34, 80,228, 61, 36,124,202, 49,137,233,
+     64,183,  6,234, 83,133,217,165,124,151, 89,219,171, 11,235, 69,
+    140, 12,219,151,254, 56,181,141, 10,214,180, 32, 54, 89,  3,186,
+    162,246, 75,182,134,229,172, 77,236, 93,  9,123,204,155, 59,125,
+     75,102,253,182, 22,100,168,135, 10,161,238,102,172,243,  3, 84,
+    162,222, 99,206,150,197, 56, 77,230, 46,185, 20,121, 58,133,104,
+    248,164, 53,131,  1,163, 91,229,112,162, 80,128,197,158,115, 44,
+     64,201,149,  5, 98, 53, 15,107,144,211,168,254, 30, 95,173,228,
+     18,190, 50,128,222,196, 58,247,112,186, 83, 13, 67,151,113,210,
+     27,121, 43, 69, 13,107,255, 24,102,203, 66,241, 95,213,188, 37,
+    180, 86,203, 98,189,212, 22, 73, 47,251, 19,104,238, 27,229,209,
+     15,107, 40,233,163,212,186,247, 48, 20, 72,141, 51,192,244, 40,
+    114,215, 86,155,  2, 75,143, 21,206, 51,146,198,221, 36,188, 57,
+    173,140,237,161,183, 37,146,190,168,  1,134,161, 40,148,  5,226,
+     64, 22,241, 35, 64,117,240,155,192,133,204, 58,151, 76,139, 94,
+    240,136,191, 60,120, 87, 33,125,159,193,109,226, 86,  2,135, 73,
+    167,141, 28,230,108,164,214, 97, 37,130,255, 24,119, 77,229, 97,
+    252, 12, 81,211,119,228, 61,127, 81,235,107,208, 80,253,116, 92,
+    152,129,108,177,223,143, 43,106,  4, 89,174,220, 14,191, 49,171,
+     32, 79,169,252, 20,146,225, 62, 92,237, 38,177,214,160,107,209,
+     12,249, 63,195, 38,243, 54,179,232, 79,170, 96,182,143, 17,129,
+     42,196,104, 52, 19, 88,197, 13,215, 53, 32,177, 16,192, 51,173,
+    206,232,  6,158, 81, 24,200,166,231, 68, 35,122,100,250,126,212,
+    113,222,  8,100,205, 76,173,  1,210,138, 13,121, 66, 27,239, 53,
+    187, 97,125,175, 85,132, 15,109,151,  3, 60,212, 46,245,161,202,
+     73,150,181,246,138,159,237,100,152,121,244,144, 62,129,218, 19,
+     40, 71,192, 52,135,249, 92, 55,207,144,244,158, 43,178,  1, 67,
+    188,146, 54,128,160, 47,243,105,181, 80, 54,250,142,174, 89,131,
+    154, 36,235,  7,152,204, 68,224,190,121,239,136, 10, 88, 59,109,
+    218,  2,122, 33,214, 72, 45,175, 27,188, 75, 98,230,159,104, 82,
+    144,117,245,100,213, 16,185,128, 29,110,  9,195, 80,228, 96,159,
+     40, 89,244,194, 24,218,132, 38,150,232,204, 95,194, 43,230, 20,
+    202, 77,216, 56,114,248,168, 27, 87, 42,199,104,166,188,236, 22,
+    170,231, 66, 94,171,  5,129,249, 59,224, 18,202, 41,  2,246,194,
+    224,161, 11,180, 43,118,159, 70,238,173, 93,217, 58,141, 26,239,
+    199, 12,172, 71,116, 91,188, 68, 17,115, 30,159,  6,110,212, 67,
+    118,164, 99,182, 21, 80, 46,142,213,163, 72, 26,220,124, 37,145,
+     86, 44,134,194,235,111,207, 83,141,105,165,123,181, 70,116, 50,
+     29, 92, 63,137,226, 85,196, 11,211, 48,137, 32,114,169,207,124,
+    106,140,221, 35,237, 14,156,255,201,172, 71,129,244, 79,140,178,
+      3,251, 33,132,230,194,125,234,101, 12,249,140, 50, 78,213,115,
+    242,201,155, 21, 52,148, 36,183,  9,214, 49,252, 87,213,170,136,
+    184,209,240,167, 29, 58,255, 99,151, 78,227,181,252, 16, 76, 50,
+    248, 62, 86,163,135,206, 55,124, 86, 45,227,186, 50,165, 31,236,
+     55,147,207, 64,156, 95,  1,180, 54,122,187, 92,237,157, 10,175,
+     69, 14,100,253, 75,191, 96,232,160, 78,136, 12,149, 32,229, 10,
+     78,124, 18,104,200,126,144, 41,177,120,  2, 65,152,103,219,176,
+    157, 27,213,110, 46,180,102,  3,218,142,104, 11,215,121,199,102,
+     82,184,108, 17,220, 41,252, 74,150,225, 40,169, 20,201, 97, 54,
+    189,127,219,164,117,216, 23, 63,122, 34,236,192,113, 64, 99,158,
+    253, 54,152, 76,236,  5,186,216, 23,245,197, 90,205, 45,131,  4,
+    235,118,194,  8,246, 79,232,164,188, 25,249,154, 92, 66, 24,221,
+    131, 38,239, 75,175,138,111,200, 28, 83,207,110, 67,125,226,147,
+    246, 31, 82, 46, 10,174,140,250,180,208, 91, 54,161,241,198, 42,
+    112,187,221, 38,173,114, 65, 86,109, 55,163,126, 18,228,186, 94,
+    144, 47,166, 67,151, 24,139, 41, 67,122, 79, 38,183,241,149,172,
+     10,195,160,124,204, 56, 16,161,239,131,  5,153,252,174, 42,  1,
+    111,167,206,132,239, 71,103, 49,  1,108,168, 23,215, 14,136, 84,
+    214,  1,132, 97,208, 48,242,166,225,141, 34,235, 60,149, 78, 31,
+     71,218, 99,227,190, 91,211,109,202,233,165,210,132, 15,113, 53,
+    254, 97, 47,  6, 87,244,189, 95, 63,178,221, 59, 31, 88,199, 70,
+    217, 94, 59,152,194, 29,223,202,151, 66,227,139, 73,118,181, 30,
+    166, 66,247, 23,158,139, 26,200,  7, 73,191, 97,175,110,254,203,
+    172, 16,135, 36,122, 55,251, 15,150, 51,  5,106, 60,222, 87,206,
+     73,142,211,233,154,117, 35,218,121, 44,101,192,135,236,116,143,
+    182, 24,234,  6, 85,121,165, 82,128,244, 41,195, 97,245, 50,233,
+    146,108,179, 86,231, 72,124, 94,156,116,247, 22,211, 43, 11,125,
+    243, 84,179,238,  1,168,133, 72,181, 96,194,247,147, 32,187,157,
+     18,180,110, 68, 25,174, 79,145, 10,156,241, 78, 11,166, 22,224,
+     46,125,199,110,179,248, 44, 12,189, 26,116,173,  5,153,203, 92,
+     12,225, 40,203, 14,186,250, 35,219, 48,169, 83,131,155,193, 56,
+    152, 44,200, 64,100,220,197, 32,237,130, 23, 82,170,118,231, 44,
+    129,219, 35,138,194,223, 52,253,184,206, 33,141,216,107, 62, 84,
+    155,255, 71, 39,147, 62,205,102,157,215, 87, 61,221, 36, 69,125,
+    173, 62,141,122, 53,109,169, 61,194,128,  9,223, 62,237, 92,115,
+     28,224,112,159,137, 46, 83,116,158, 61,222, 46,204,  1, 69,103,
+    247, 58, 90,240,  2,101,124, 28, 90, 69,113,175, 53,194,241,178,
+      4, 99,169,218, 15,227,139, 73,238, 50,143,252,129,100,190,249,
+     32,198, 88,219,152,228,  2,142, 83,242,103,188, 33,167,  4,216,
+    176, 89, 12,253, 22,183,241,  7,209,102,184,135, 94,239,143,175,
+     11,154,200,170, 74,152,210,169,133,227,  4,250, 94, 35,143,118,
+    208, 31,132,192, 88,114, 21,185,123,  7,176, 23,206,162, 19,145,
+    111,236,  5,177, 31, 72, 98,210, 25,158, 68,147,117,205, 75,141,
+     60,126,195, 74,214, 95,149, 55,175, 17,250, 31,163, 55,194, 79,
+    212,118, 28,128, 45,230, 17, 62,199, 39,189,157,126, 17,231, 47,
+     77,243, 60,156, 49,236,170, 39,213, 91,197,110, 77, 54,228, 85,
+     50,162, 68,105,254,190,128,234,178, 45,219, 17,253, 48,105,244,
+     39,230,144, 49,162, 29,126,231, 89,142, 75,120,220, 19,125, 32,
+    232, 98, 68,249,178, 88,116,244, 99,146, 56, 79,220,173, 90,199,
+    166,111,222,  7,126,200, 70,104,247, 61,149, 42,241,123,178, 11,
+    204,119,193,139, 45,161, 16, 57, 87,119,197, 93,132,182, 22,199,
+    167,  8,100,181,113,243, 66,198, 41,215,171, 60,200,106,254,160,
+     49,185,208, 20,137,193, 35,160, 11,232,120, 25,197, 63,131,  9,
+    148, 26,180,100,251, 28,141,159, 16,126,225,171,  4,215, 95,153,
+    247, 34,217, 19, 91,205,114,152,249,  8,169, 60,229, 82,149,115,
+    220, 80,247, 34,206,  3,170,101, 23,113,240,  4,148, 83,183, 67,
+    135,  6,152,108, 56,216, 75,127,213, 85,166,243,107, 38,249,217,
+     55, 87,207, 66,163, 83,215, 52,184,207, 28, 84,137,193, 35, 70,
+    134, 99, 61,168,243, 71,225, 37,189,136,222, 36,162,  1,240, 63,
+    131,202,151, 64,129, 83,223,138,189,153, 48, 96,230, 40, 13,216,
+    113,242, 81,229,167,  4,255,179, 63, 42,187,  2,140,161, 97,185,
+    117,241,136, 38,189,116,  9,241, 88,112, 64,254,104, 58,164,224,
+     22,185,233,122,145, 11,174, 64,100, 24, 75,114,206,103,191, 28,
+     44,109, 14,186,234,158, 55, 15,253, 70,210,174,123,193,155, 94,
+    178, 43,200, 30, 92,148,103, 24,204,149, 95,223, 74,210, 14, 67,
+     35,168,  1,230, 57,220,132,171, 38,150,201,161, 20,235,116,197,
+     81,151,  1, 47, 86,198,111,142,242,201,156,238, 52,139, 77,158,
+    175, 85,219, 48, 98, 27,201,125, 92, 33,133, 15, 72,245, 58,224,
+     21,145, 65,125,193,237, 51,139,113,234, 32,123, 51,174,129,237,
+    150,199, 79,105,153, 24, 93, 65,229,  2,123, 47,182,142,  7, 49,
+    251,105,208,179,222, 31, 54,219,  5, 85,126, 27,183, 12,244,214,
+     19,255,140,166,122,241, 74,177,218,161,233,197,105, 27,141,117,
+     84,252,160,218, 14, 74,172,220,  8, 68,167,196,252, 27, 84,217,
+    101, 21,253,128,205,182,248,138,179,210, 94,240, 75,217, 95,177,
+    130, 29, 72,117,155,253,130,184,159, 44,177, 67,223, 94,120, 60,
+    195,116, 68,  5,210, 43,145,103,  1, 59, 85, 39,165,213,181, 48,
+    198,  1,106, 46,181,118, 34, 84,187,244,101, 15,151,111,182, 44,
+    142, 63,177, 30, 49, 76, 11,111, 33, 59,165, 25,112, 39,203, 63,
+    221,165,234, 14, 57, 99, 21, 70, 96,206,250,107,151,205, 33,147,
+     97, 37,179,231, 90,192, 20,247,195,117,148,250,127, 79, 13,238,
+    131,174,229, 89,140,246,208,157,128, 40,142, 81,209, 59,231, 13,
+    195,118,214,160, 95,231,147,217, 84,245,127,188,226,153,121, 11,
+    143, 43, 88,176,197,143,212,240,121, 30,136,  3, 47, 80,171,235,
+     72,208,124, 57,150,113, 69,164, 45,222,178, 10, 56,230, 97,154,
+     61, 30, 73,193, 17, 55,101, 13,228, 58,216,176, 29,134,157, 95,
+    245, 81,  4,238,113,195, 40,163,192,  7,148, 67, 17, 81,168,248,
+    101,206,120,243, 74, 41,169,  8,188, 61,231,167,199,246,130,  8,
+    226,160, 14,250, 30,174,230,129, 95, 29, 72,104,193,162, 37,201,
+    121,248,158,113,223,147,199, 72,115,163,  1,105,242, 76,213, 51,
+    165, 36,148, 55,136, 15, 69,123,100, 54,233,106,206,238, 33,191,
+     70, 24,154,  6,136,229,111, 81,146,215, 89,116, 67, 26,104,184,
+     39, 90,136,194, 80,209, 13, 58,200,143,240,211,138, 23,111,225,
+     84,  9,209, 37, 65,175, 26,251,185, 86,235,190, 41,120,  8,191,
+    128,227,186, 85,210,170,221,254, 26,210,167, 42,138, 93, 57,115,
+    227,182, 52,214,100, 26,200, 49,165, 16, 40,193,154,223, 52,146,
+    237, 65,219,109, 48,137,102,243,157,  7,120, 41, 84,255,187, 49,
+    145,179, 99,135,243, 90,126, 41,149, 21,132, 64,150,173,255,101,
+     25, 69,106,249, 28, 48, 91,144,181, 80,132, 10,195,176,150,  2,
+    135, 85,255,172, 66,152,244,130,225,105,254,131, 11, 83,205,118,
+    188, 29,177, 20,163,227,184, 37, 81,219,180, 63,164,  3,130, 74,
+     19,222, 53,189,  5,160,216,108,228, 52,200, 93,221, 28, 83,145,
+    211,175,  7,153,127,188,113,  1, 61,229,109,246, 75, 25,232,212,
+    165, 35,108,128, 42,179, 87, 22, 71,183, 58,169,235,110,164,  1,
+     98,152,122,245, 91,  4, 66,117,170, 25,106,204,236, 96,212,175,
+    246,157,123, 80,232, 24, 61,196, 79,173,248, 18,113,202, 60,231,
+     47,118,204, 62,227, 74,239,201,156, 28,174, 46,207,123,101, 44,
+     76,198, 15,208,234,  1,195,118,212,150, 95, 27,196, 38, 67,250,
+     45,204, 75, 53,214,151,201,252,133,234, 49,142, 31,154, 56,111,
+     38, 93, 25,204,140,103,181, 31,142,  4,125,162, 45,177,130,  9,
+    162,241, 92, 39,164, 14,135, 41, 98,213,129, 88,156, 62,251,186,
+    130,238,156, 71, 95,142, 57,248, 43,  7,239,123, 80,143,215,127,
+     87,225,  9,185,127, 32, 99, 51, 15, 89,187, 74,122,191, 18,218,
+    137,194,242, 48,169, 74,254,115,214, 96, 57,237, 78,226, 97,193,
+     73, 19,136,189,108,211, 85,179,250, 66,  6,237,182, 20,146,  9,
+     96, 60, 30,183,121,222,159,101,172,134,202, 50,227,182, 20,172,
+     32,134,162,105,236, 78,183,163,209,146,223,  6,250, 90,232, 76,
+    168,  1, 69,112,220,  8,154, 46,234,184,151,206, 11,147, 33,245,
+    110,152,218, 26,248, 52,153, 18,119,148,191, 39,111,221, 81,213,
+    172,226,147,249, 46, 16, 80, 30,192, 65, 89,162, 10,100, 61,235,
+    197, 67,255, 43,148, 20,229,111, 69, 39,117,174, 59,158,127, 47,
+    105,235,153,185, 36,133,209, 87, 19, 72, 30,102,121,190, 63,168,
+    209, 54, 86,173, 71,127,225,199, 49, 79,227,134, 57,165, 31,126,
+     48,114,  7, 90,196,167,211,238,114,223, 26,252,138,205,150,115,
+    167, 97, 14,190, 63,212,133,  1,245,157, 98,213, 34,203, 11,180,
+    207, 31,126, 90,243, 65,192,122,169,138,198,251, 51,220, 88,  5,
+    131, 34,227,120,  3,186, 35,102,164,211, 25, 91,246,189,102,240,
+    193, 75,207,139, 65,103,136, 59,  4,151,182,106, 71, 38,243,  3,
+    223,139,208,125, 94,170, 46, 87,189, 26,232, 78,141,108,245,148,
+     87, 62,224, 17,166,103, 13,247, 57,225, 89,166, 18,140,181,105,
+    253,157,196,101,241,147, 83,236,  8,115,180,155,  1, 69,143, 16,
+    154, 35,174,221, 21,245, 38,184,126, 82, 44,212,128,191, 90, 53,
+    181, 40, 82,226, 23,247,153,204,120, 58,171, 18,191, 50, 73, 26,
+    237,139,190, 48,216,144, 40,182,110,  2, 41,128, 71,234, 45,203,
+     76, 16, 67, 42,166, 58,203,137, 68,255, 53,104,198,233, 45,210,
+     92,251,106, 53,121,191,154, 91,205,242,167, 13,232, 24,155,110,
+    249, 19,158, 56,183,112, 70, 32,228,138, 92,254,120,217,169,198,
+    106,  6,163,117, 68,199,234, 78,159,213,188,240,108,171, 28,147,
+    122,232,185,133,214, 15,117, 32,191,146,219, 33,136, 82,119,178,
+     62,133,  3,161,229, 73, 12,232, 24, 56,141,101, 66,174,217, 73,
+    119,201, 98,235,135,  7,216,105,164,  9,184, 43,153,  3, 94,129,
+     52,219, 84,252, 24, 95,123, 21,133, 63, 96,149,  9,195, 93,216,
+     52,165, 82, 22, 98,249,170,228, 96, 12, 76,172,207, 13,161,228,
+     23,217,197, 88, 33,140,100,170,120, 78,190,250,124, 41,138,  8,
+     55,140,176, 28, 76,196,148, 50,243, 77,209,107, 71,233, 37,248,
+    152,179, 36,137,187,154, 50,221,176,255, 30, 54,223,134, 66,239,
+      1,109,204,236,153, 65, 86, 45,156,126,240,109, 51,248, 97, 39,
+    111,147, 68,175,209,255, 49,198,220, 34,159,  1,203, 96,186,224,
+     85,242, 46,114,168,253, 19, 96,190,132, 21,226,173,135,185, 81,
+     21, 69,207,108,  9,239,206, 86,  6,113,157,201, 86, 22,158,119,
+    180, 36,143, 47,120,197,  3,177,208, 58,187, 26,156,129,193, 76,
+    183,246, 42,127, 18,109,155,  6,134, 91,226, 50, 79,235, 26,157,
+};
+
+static const uint8_t *dither_tile(Dither_Mode mode, uint32_t *size) {
+    switch (mode) {
+    case DITHER_BAYER2:
+        *size = 2;
+        return bayer2;
+    case DITHER_BAYER4:
+        *size = 4;
+        return bayer4;
+    case DITHER_BAYER8:
+        *size = 8;
+        return bayer8;
+    case DITHER_BLUENOISE:
+        *size = 64;
+        return blue_noise64;
+    default:
+        *size = 0;
+        return NULL;
+    }
+}
+
+static const char *dither_names[] = {
+    "off",    "fs",     "atkinson", "jarvis", "stucki",
+    "sierra", "bayer2", "bayer4",   "bayer8", "bluenoise"};
+
+const char *dither_name(Dither_Mode mode) {
+    if (mode > DITHER_BLUENOISE) {
+        return "off";
+    }
+    return dither_names[mode];
+}
+
+int dither_from_name(const char *name) {
+    for (int mode = DITHER_FS; name && mode <= DITHER_BLUENOISE; mode++) {
+        if (strcmp(name, dither_names[mode]) == 0) {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+bool dither_is_ordered(Dither_Mode mode) {
+    return mode >= DITHER_BAYER2 && mode <= DITHER_BLUENOISE;
+}
+
+bool dither_is_diffusion(Dither_Mode mode) {
+    return mode >= DITHER_FS && mode <= DITHER_SIERRA;
+}
+
+void dither_pattern_row(Dither_Mode mode, uint8_t threshold, uint32_t y,
+                        uint8_t *pattern) {
+    uint32_t size = 0;
+    const uint8_t *tile = dither_tile(mode, &size);
+    if (!tile) {
+        memset(pattern, threshold, DITHER_PATTERN);
+        return;
+    }
+    const uint8_t *row = tile + (size_t)(y & (size - 1)) * size;
+    for (uint32_t x = 0; x < DITHER_PATTERN; x++) {
+        pattern[x] = row[x & (size - 1)];
+    }
+}
+
+// --- Error diffusion ---
+// Errors are int16 with ERR_SHIFT fractional bits, one row per kernel row
+// in a ring, padded by DIFFUSION_MAX_DX on both sides so taps past the
+// edge land in the padding instead of needing a bounds check. Values are
+// clamped to [0, 255] before quantizing, so no error exceeds 255 and no
+// sum of errors overflows.
+
+#define ERR_SHIFT 4
+#define ERR_ONE   (1 << ERR_SHIFT)
+#define ERR_MAX   (255 << ERR_SHIFT)
+#define ERR_PAD   DIFFUSION_MAX_DX
+#define ERR_ROWS  (DIFFUSION_MAX_DY + 1)
+
+static inline int clamp_err(int v) {
+    return v < 0 ? 0 : (v > ERR_MAX ? ERR_MAX : v);
+}
+
+// One row in direction dir (1 or -1). Always inlined into one wrapper per
+// kernel and channel count below, so the compiler sees constant taps and a
+// constant direction and unrolls the propagation. A NULL palette means one
+// channel quantized to 0 / 255.
+static inline __attribute__((always_inline)) void
+diffuse_row(const Diffusion_Kernel *kernel, const int channels, const int dir,
+            const uint8_t *in, uint8_t *out, int16_t **rows, uint32_t width,
+            const Dither_Palette *palette) {
+    long x = dir > 0 ? 0 : (long)width - 1;
+    for (uint32_t n = 0; n < width; n++, x += dir) {
+        int e[3];
+        if (channels == 1) {
+            int v = clamp_err((in[x] << ERR_SHIFT) + rows[0][x]);
+            int q = -(v >= (128 << ERR_SHIFT)) & 255;
+            out[x] = (uint8_t)q;
+            e[0] = v - (q << ERR_SHIFT);
+        } else {
+            int v[3];
+            uint8_t c[3];
+            for (int ch = 0; ch < 3; ch++) {
+                v[ch] = clamp_err((in[x * 3 + ch] << ERR_SHIFT) +
+                                  rows[0][x * 3 + ch]);
+                c[ch] = (uint8_t)((v[ch] + ERR_ONE / 2) >> ERR_SHIFT);
+            }
+            uint8_t index = palette->nearest(palette->ctx, c);
+            const uint8_t *chosen = palette->colors + index * 3;
+            out[x] = index;
+            for (int ch = 0; ch < 3; ch++) {
+                e[ch] = v[ch] - (chosen[ch] << ERR_SHIFT);
+            }
+        }
+
+        for (int t = 0; t < kernel->tap_count; t++) {
+            const Diffusion_Tap tap = kernel->taps[t];
+            int16_t *cell = rows[tap.dy] + (x + tap.dx * dir) * channels;
+            for (int ch = 0; ch < channels; ch++) {
+                cell[ch] += (int16_t)(e[ch] * tap.weight / kernel->divisor);
+            }
+        }
+    }
+}
+
+static inline __attribute__((always_inline)) void
+diffuse(const Diffusion_Kernel *kernel, const int channels,
+        const uint8_t *src, ptrdiff_t src_stride, uint8_t *dst,
+        ptrdiff_t dst_stride, uint32_t width, uint32_t height,
+        bool serpentine, const Dither_Palette *palette) {
+    const size_t row_len = ((size_t)width + 2 * ERR_PAD) * channels;
+    int16_t *err = pool_calloc(ERR_ROWS * row_len, sizeof(int16_t));
+    if (!err) {
+        report_error("Error: Could not allocate the error rows.\n");
+        return;
+    }
+
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *in = src + (ptrdiff_t)y * src_stride;
+        uint8_t *out = dst + (ptrdiff_t)y * dst_stride;
+        int16_t *rows[ERR_ROWS];
+        for (int r = 0; r < ERR_ROWS; r++) {
+            rows[r] = err + ((y + r) % ERR_ROWS) * row_len + ERR_PAD * channels;
+        }
+
+        if (serpentine && (y & 1)) {
+            diffuse_row(kernel, channels, -1, in, out, rows, width, palette);
+        } else {
+            diffuse_row(kernel, channels, 1, in, out, rows, width, palette);
+        }
+
+        // Row y is done, its errors become row y + ERR_ROWS
+        memset(rows[0] - ERR_PAD * channels, 0, row_len * sizeof(int16_t));
+    }
+    pool_release(err);
+}
+
+typedef void (*Diffuse_Mono)(const uint8_t *, ptrdiff_t, uint8_t *,
+                             ptrdiff_t, uint32_t, uint32_t, bool);
+typedef void (*Diffuse_Palette)(const uint8_t *, ptrdiff_t, uint8_t *,
+                                ptrdiff_t, uint32_t, uint32_t, bool,
+                                const Dither_Palette *);
+
+#define DIFFUSE_KERNEL(NAME)                                                   \
+    static void diffuse_mono_##NAME(                                           \
+        const uint8_t *src, ptrdiff_t src_stride, uint8_t *dst,                \
+        ptrdiff_t dst_stride, uint32_t width, uint32_t height,                 \
+        bool serpentine) {                                                     \
+        diffuse(&NAME##_kernel, 1, src, src_stride, dst, dst_stride, width,    \
+                height, serpentine, NULL);                                     \
+    }                                                                          \
+    static void diffuse_palette_##NAME(                                        \
+        const uint8_t *src, ptrdiff_t src_stride, uint8_t *dst,                \
+        ptrdiff_t dst_stride, uint32_t width, uint32_t height,                 \
+        bool serpentine, const Dither_Palette *palette) {                      \
+        diffuse(&NAME##_kernel, 3, src, src_stride, dst, dst_stride, width,    \
+                height, serpentine, palette);                                  \
+    }
+
+DIFFUSE_KERNEL(fs)
+DIFFUSE_KERNEL(atkinson)
+DIFFUSE_KERNEL(jarvis)
+DIFFUSE_KERNEL(stucki)
+DIFFUSE_KERNEL(sierra)
+#undef DIFFUSE_KERNEL
+
+// Indexed by mode - DITHER_FS
+static const Diffusion_Kernel *const diffusion_kernels[] = {
+    &fs_kernel, &atkinson_kernel, &jarvis_kernel, &stucki_kernel,
+    &sierra_kernel};
+static const Diffuse_Mono diffuse_mono_by_mode[] = {
+    diffuse_mono_fs, diffuse_mono_atkinson, diffuse_mono_jarvis,
+    diffuse_mono_stucki, diffuse_mono_sierra};
+static const Diffuse_Palette diffuse_palette_by_mode[] = {
+    diffuse_palette_fs, diffuse_palette_atkinson, diffuse_palette_jarvis,
+    diffuse_palette_stucki, diffuse_palette_sierra};
+
+const Diffusion_Kernel *dither_kernel(Dither_Mode mode) {
+    return dither_is_diffusion(mode) ? diffusion_kernels[mode - DITHER_FS]
+                                     : NULL;
+}
+
+void dither_diffuse_mono(const uint8_t *src, ptrdiff_t src_stride,
+                         uint8_t *dst, ptrdiff_t dst_stride, uint32_t width,
+                         uint32_t height, Dither_Mode mode, bool serpentine) {
+    if (!dither_is_diffusion(mode)) {
+        mode = DITHER_FS;
+    }
+    diffuse_mono_by_mode[mode - DITHER_FS](src, src_stride, dst, dst_stride,
+                                           width, height, serpentine);
+}
+
+void dither_diffuse_palette(const uint8_t *src, ptrdiff_t src_stride,
+                            uint8_t *dst, ptrdiff_t dst_stride,
+                            uint32_t width, uint32_t height, Dither_Mode mode,
+                            bool serpentine, const Dither_Palette *palette) {
+    if (!dither_is_diffusion(mode)) {
+        mode = DITHER_FS;
+    }
+    diffuse_palette_by_mode[mode - DITHER_FS](src, src_stride, dst,
+                                              dst_stride, width, height,
+                                              serpentine, palette);
+}
+
+// --- Compare kernels ---
+// v >= t is max(v, t) == v for unsigned bytes, and the compare mask is
+// already the 0 / 255 output.
+
+#ifdef DITHER_X86
+
+__attribute__((target("avx2"))) static uint32_t
+threshold_avx2(const uint8_t *value, uint8_t *out, uint32_t width,
+               const uint8_t *pattern) {
+    const __m256i t0 = _mm256_loadu_si256((const __m256i *)(pattern + 0));
+    const __m256i t1 = _mm256_loadu_si256((const __m256i *)(pattern + 32));
+
+    uint32_t x = 0;
+    for (; x + DITHER_PATTERN <= width; x += DITHER_PATTERN) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(value + x));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(value + x + 32));
+        v0 = _mm256_cmpeq_epi8(_mm256_max_epu8(v0, t0), v0);
+        v1 = _mm256_cmpeq_epi8(_mm256_max_epu8(v1, t1), v1);
+        _mm256_storeu_si256((__m256i *)(out + x), v0);
+        _mm256_storeu_si256((__m256i *)(out + x + 32), v1);
+    }
+    return x;
+}
+
+// movemask takes the top bit of byte i as bit i, BMP wants the first pixel
+// in the top bit. Reversing each group of 8 bytes first makes every mask
+// byte one packed output byte.
+__attribute__((target("avx2"))) static uint32_t
+pack_avx2(const uint8_t *mono, uint8_t *packed, uint32_t width) {
+    const __m256i reverse8 =
+        _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                         7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+
+    uint32_t x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(mono + x));
+        uint32_t bits =
+            (uint32_t)_mm256_movemask_epi8(_mm256_shuffle_epi8(v, reverse8));
+        memcpy(packed + x / 8, &bits, sizeof(bits));
+    }
+    return x;
+}
+
+#endif // DITHER_X86
+
+void dither_pack_row(const uint8_t *mono, uint8_t *packed, uint32_t width) {
+    uint32_t x = 0;
+#ifdef DITHER_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = pack_avx2(mono, packed, width);
+    }
+#endif
+    for (; x < width; x += 8) {
+        uint8_t byte = 0;
+        for (uint32_t bit = 0; bit < 8; bit++) {
+            uint8_t v = (x + bit < width) ? mono[x + bit] : 0;
+            byte |= (uint8_t)((v & 1) << (7 - bit));
+        }
+        packed[x / 8] = byte;
+    }
+}
+
+void dither_threshold_row(const uint8_t *value, uint8_t *out, uint32_t width,
+                          const uint8_t *pattern) {
+    uint32_t x = 0;
+#ifdef DITHER_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = threshold_avx2(value, out, width, pattern);
+    }
+#endif
+    for (; x < width; x++) {
+        out[x] = (uint8_t)-(value[x] >= pattern[x % DITHER_PATTERN]);
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Dithering for -d / --dither=<name>. The error diffusion modes push the
+// quantization error of each pixel onto its unvisited neighbours and run
+// in scan order. The ordered modes compare every pixel against a repeating
+// threshold tile, pixels do not depend on each other, so rows can run in
+// any order and on any thread.
+typedef enum {
+    DITHER_OFF = 0,
+    DITHER_FS,        // Floyd–Steinberg, the -d default
+    DITHER_ATKINSON,  // diffuses 3/4 of the error, keeps highlights clean
+    DITHER_JARVIS,    // Jarvis, Judice and Ninke, 12 taps
+    DITHER_STUCKI,    // 12 taps, sharper than Jarvis
+    DITHER_SIERRA,    // Sierra-3, 10 taps
+    DITHER_BAYER2,    // ordered, 2x2 Bayer matrix
+    DITHER_BAYER4,    // ordered, 4x4 Bayer matrix
+    DITHER_BAYER8,    // ordered, 8x8 Bayer matrix
+    DITHER_BLUENOISE  // ordered, 64x64 blue-noise tile
+} Dither_Mode;
+
+// OR'd into a diffusion mode where it is passed as a plain byte
+// (convert_24_to_indexed_tight): scan odd rows right to left.
+#define DITHER_SERPENTINE 0x80
+#define DITHER_MODE_MASK  0x7F
+
+const char *dither_name(Dither_Mode mode);
+int dither_from_name(const char *name); // -1 if unknown
+bool dither_is_ordered(Dither_Mode mode);
+bool dither_is_diffusion(Dither_Mode mode);
+
+// --- Error diffusion ---
+
+// One neighbour of the current pixel, dx is mirrored on right to left rows
+typedef struct {
+    int8_t dx;
+    int8_t dy; // 0 or more rows down, at most DIFFUSION_MAX_DY
+    uint8_t weight;
+} Diffusion_Tap;
+
+#define DIFFUSION_MAX_TAPS 12
+#define DIFFUSION_MAX_DX   2
+#define DIFFUSION_MAX_DY   2
+
+// Each tap gets error * weight / divisor. The weights need not add up to
+// the divisor (Atkinson drops 2/8 of the error).
+typedef struct {
+    uint8_t tap_count;
+    uint8_t divisor;
+    Diffusion_Tap taps[DIFFUSION_MAX_TAPS];
+} Diffusion_Kernel;
+
+// Kernel of a diffusion mode, NULL for any other mode
+const Diffusion_Kernel *dither_kernel(Dither_Mode mode);
+
+// Palette for dither_diffuse_palette. colors holds 3 bytes per entry in
+// the byte order of the pixels. nearest returns the index of the closest
+// entry to a 3 byte colour.
+typedef struct {
+    const uint8_t *colors;
+    uint8_t (*nearest)(void *ctx, const uint8_t *color);
+    void *ctx;
+} Dither_Palette;
+
+// Diffuse an 8-bit plane to 0 / 255 (mid-gray threshold). src and dst may
+// be the same buffer. Strides may be negative, for bottom-up BMP rows.
+void dither_diffuse_mono(const uint8_t *src, ptrdiff_t src_stride,
+                         uint8_t *dst, ptrdiff_t dst_stride, uint32_t width,
+                         uint32_t height, Dither_Mode mode, bool serpentine);
+
+// Diffuse 3 byte per pixel rows to indices into 'palette'
+void dither_diffuse_palette(const uint8_t *src, ptrdiff_t src_stride,
+                            uint8_t *dst, ptrdiff_t dst_stride,
+                            uint32_t width, uint32_t height, Dither_Mode mode,
+                            bool serpentine, const Dither_Palette *palette);
+
+// --- Ordered ---
+
+// Threshold rows are expanded to DITHER_PATTERN bytes, every tile width
+// divides it, so pattern[x % DITHER_PATTERN] is the threshold of column x.
+#define DITHER_PATTERN 64
+
+// Thresholds for row y. Ordered modes take the row of their tile, any
+// other mode gets the flat 'threshold'. Tile thresholds are 1 to 255, so
+// 0 always dithers to black and 255 to white.
+void dither_pattern_row(Dither_Mode mode, uint8_t threshold, uint32_t y,
+                        uint8_t *pattern);
+
+// out[x] = (value[x] >= pattern[x % DITHER_PATTERN]) ? 255 : 0
+// value and out may be the same buffer.
+void dither_threshold_row(const uint8_t *value, uint8_t *out, uint32_t width,
+                          const uint8_t *pattern);
+
+// Pack a row of 0 / 255 bytes into 1-bit pixels, most significant bit
+// first as in BMP rows. Writes (width + 7) / 8 bytes.
+void dither_pack_row(const uint8_t *mono, uint8_t *packed, uint32_t width);
+
+#endif
@@ -0,0 +1,124 @@
+#include "fft.h"
+#include "report.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+bool fft_plan_init(Fft_Plan *plan, uint32_t size) {
+    if (!plan || size < 2 || (size & (size - 1)) != 0) {
+        report_error("Error: FFT size %u is not a power of two.\n", size);
+        return false;
+    }
+    plan->size = size;
+    plan->bitrev = malloc(sizeof(uint32_t) * size);
+    plan->cos_table = malloc(sizeof(float) * size / 2);
+    plan->sin_table = malloc(sizeof(float) * size / 2);
+    plan->column_re = malloc(sizeof(float) * size);
+    plan->column_im = malloc(sizeof(float) * size);
+    if (!plan->bitrev || !plan->cos_table || !plan->sin_table ||
+        !plan->column_re || !plan->column_im) {
+        report_error("Error: Could not allocate FFT plan.\n");
+        fft_plan_free(plan);
+        return false;
+    }
+
+    uint32_t bits = 0;
+    while ((1u << bits) < size) {
+        bits++;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t r = 0;
+        for (uint32_t b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1u) << (bits - 1 - b);
+        }
+        plan->bitrev[i] = r;
+    }
+    for (uint32_t k = 0; k < size / 2; k++) {
+        double angle = 2.0 * M_PI * k / size;
+        plan->cos_table[k] = (float)cos(angle);
+        plan->sin_table[k] = (float)sin(angle);
+    }
+    return true;
+}
+
+void fft_plan_free(Fft_Plan *plan) {
+    if (!plan) {
+        return;
+    }
+    free(plan->bitrev);
+    free(plan->cos_table);
+    free(plan->sin_table);
+    free(plan->column_re);
+    free(plan->column_im);
+    plan->bitrev = NULL;
+    plan->cos_table = plan->sin_table = NULL;
+    plan->column_re = plan->column_im = NULL;
+    plan->size = 0;
+}
+
+void fft1(const Fft_Plan *plan, float *re, float *im, bool inverse) {
+    const uint32_t n = plan->size;
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t j = plan->bitrev[i];
+        if (j > i) {
+            float t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    // Forward uses e^(-i angle), inverse e^(+i angle)
+    const float sign = inverse ? 1.0f : -1.0f;
+    for (uint32_t len = 2; len <= n; len <<= 1) {
+        uint32_t half = len / 2;
+        uint32_t step = n / len;
+        for (uint32_t i = 0; i < n; i += len) {
+            for (uint32_t j = 0; j < half; j++) {
+                float wr = plan->cos_table[j * step];
+                float wi = sign * plan->sin_table[j * step];
+                uint32_t a = i + j;
+                uint32_t b = a + half;
+                float xr = re[b] * wr - im[b] * wi;
+                float xi = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - xr;
+                im[b] = im[a] - xi;
+                re[a] += xr;
+                im[a] += xi;
+            }
+        }
+    }
+
+    if (inverse) {
+        const float scale = 1.0f / n;
+        for (uint32_t i = 0; i < n; i++) {
+            re[i] *= scale;
+            im[i] *= scale;
+        }
+    }
+}
+
+void fft2(const Fft_Plan *plan, float *re, float *im, bool inverse) {
+    const uint32_t n = plan->size;
+
+    for (uint32_t y = 0; y < n; y++) {
+        fft1(plan, re + (size_t)y * n, im + (size_t)y * n, inverse);
+    }
+
+    float *col_re = plan->column_re;
+    float *col_im = plan->column_im;
+    for (uint32_t x = 0; x < n; x++) {
+        for (uint32_t y = 0; y < n; y++) {
+            col_re[y] = re[(size_t)y * n + x];
+            col_im[y] = im[(size_t)y * n + x];
+        }
+        fft1(plan, col_re, col_im, inverse);
+        for (uint32_t y = 0; y < n; y++) {
+            re[(size_t)y * n + x] = col_re[y];
+            im[(size_t)y * n + x] = col_im[y];
+        }
+    }
+}
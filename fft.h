@@ -0,0 +1,27 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Radix-2 complex FFT on split real / imaginary float arrays. Used by the
+// convolution engine for large kernels.
+typedef struct {
+    uint32_t size;     // Transform length, a power of two
+    uint32_t *bitrev;  // Bit reversed index of every position
+    float *cos_table;  // cos(2 pi k / size), k < size / 2
+    float *sin_table;  // sin(2 pi k / size), k < size / 2
+    float *column_re;  // Scratch for the column pass of fft2
+    float *column_im;
+} Fft_Plan;
+
+bool fft_plan_init(Fft_Plan *plan, uint32_t size);
+void fft_plan_free(Fft_Plan *plan);
+
+// In place, length plan->size. The inverse is scaled by 1 / size.
+void fft1(const Fft_Plan *plan, float *re, float *im, bool inverse);
+
+// In place 2D transform of a size x size row-major block.
+void fft2(const Fft_Plan *plan, float *re, float *im, bool inverse);
+
+#endif
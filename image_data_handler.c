@@ -1,8 +1,21 @@
 #include "image_data_handler.h"
+#include "box_blur.h"
+#include "color_count.h"
 #include "convolution.h"
+#include "dither.h"
+#include "lut.h"
+#include "op_kernels.h"
+#include "palette.h"
+#include "planar.h"
+#include "pointwise.h"
+#include "pool.h"
 #include "reduce_colors_24.h"
+#include "repack.h"
+#include "report.h"
+#include "tile.h"
 // #include "reduce_colors_24.h"
 #include <assert.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -27,7 +40,7 @@ void printColorTable(uint8_t *colorTable, size_t numColors) {
         uint8_t red = colorTable[offset + 2];
         uint8_t reserved = colorTable[offset + 3];
 
-        printf("Color %zu: R=%3u G=%3u B=%3u Reserved=%3u\n", i, red, green,
+        DEBUG_LOG("Color %zu: R=%3u G=%3u B=%3u Reserved=%3u\n", i, red, green,
                blue, reserved);
     }
 }
@@ -45,6 +58,8 @@ void init_image(Image_Data *img) {
     img->colorMode = 0;
     img->mono_threshold = 0.0f;
     img->dither = false;
+    img->dither_mode = DITHER_FS;
+    img->dither_serpentine = false;
     img->brightness_mode = false;
     img->bright_value = 0;
     img->bright_percent = 0.0f;
@@ -66,167 +81,902 @@ void init_image(Image_Data *img) {
     img->mode = NO_MODE;
     img->filter_name = NULL;
     img->filter_index = -1;
+    img->kernel = NULL;
     img->mode_suffix = NULL;
 
     img->colors_used_actual = 0;
     img->output_color_count = 0;
+    img->quantizer = QUANT_MEDIAN;
+    img->optimize_depth = false;
+    img->arena = NULL;
+    img->layout = LAYOUT_INTERLEAVED;
+    img->planes[0] = img->planes[1] = img->planes[2] = NULL;
+    img->plane_stride = 0;
+    img->plane_bytes = 0;
+    img->crop = false;
+    img->crop_x = img->crop_y = img->crop_width = img->crop_height = 0;
+    img->tone_step_count = 0;
+    img->step_count = 0;
+    img->spare = NULL;
+    img->spare_bytes = 0;
+    img->spare_rows = NULL;
+    img->spare_row_count = 0;
+    img->status = IMAGECOPY_OK;
 }
-// Process image
-void process_image(Image_Data *img) {
-    printf("Output mode: %s\n", get_mode_string(img->mode));
-    // aka if (bmp->bit_depth <= 8), checked earlier
-    if (img->colorMode == INDEXED) {
 
-        printf("\n");
-        printf("INDEXED\n");
-
-        if (img->brightness_mode) {
-            bright134(img);
-        }
-
-        if (img->mode == COPY) {
-            copy13(img);
-        } else if (img->mode == GRAY) {
-            gray13(img);
-        } else if (img->mode == MONO) {
-            mono1(img);
-        } else if (img->mode == DITHER) {
-            assert(img->dither == true);
-            mono1(img);
-        } else if (img->mode == HIST) {
-            hist1(img);
-        } else if (img->mode == HIST_N) {
-            hist1_normalized(img);
-        } else if (img->mode == EQUAL) {
-            equal1(img);
-        } else if (img->mode == INV) {
-            inv1(img);
-        } else if (img->mode == ROT) {
-            rot13(img);
-        } else if (img->mode == FLIP) {
-            flip13(img);
-        } else if (img->mode == BLUR) {
-            blur1(img);
-        } else if (img->mode == FILTER) {
-            filter1(img);
+void image_fail(Image_Data *img, Imagecopy_Status status, const char *format,
+                ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    report_error("%s", message);
+    if (img->status == IMAGECOPY_OK) {
+        img->status = status;
+    }
+}
+// Layouts each 24-bit op can run on, LAYOUT_MASK bits. Every op takes BGR
+// rows. Table, histogram, blur and filter ops handle each channel on its
+// own and also run on planes, as contiguous byte loops. Ops that mix the channels
+// of a pixel (gray, mono, sepia, HSV invert, a tone chain ending in mono)
+// or move pixels around (rotate, flip) only take rows.
+#define LAYOUT_MASK(layout) (1u << (layout))
+
+static unsigned op_layouts(const Image_Data *img) {
+    const unsigned both =
+        LAYOUT_MASK(LAYOUT_INTERLEAVED) | LAYOUT_MASK(LAYOUT_PLANAR);
+    switch (img->mode) {
+    case HIST:
+    case HIST_N:
+    case EQUAL:
+    case INV:
+    case INV_RGB:
+    case BLUR:
+    case FILTER:
+        return both;
+    case TONE:
+        return (img->tone_step_count &&
+                img->tone_steps[img->tone_step_count - 1].op == TONE_MONO)
+                   ? LAYOUT_MASK(LAYOUT_INTERLEAVED)
+                   : both;
+    default:
+        return LAYOUT_MASK(LAYOUT_INTERLEAVED);
+    }
+}
+
+// Convert 24-bit pixels to 'layout' unless they are in it already. The
+// planes are allocated once, a later split of an image of the same size
+// reuses them.
+void image_set_layout(Image_Data *img, enum Layout layout) {
+    if (img->colorMode != RGB24 || img->layout == layout) {
+        return;
+    }
+    if (layout == LAYOUT_PLANAR) {
+        uint32_t stride = planar_stride(img->width);
+        size_t bytes = (size_t)stride * img->height;
+        if (bytes > img->plane_bytes) {
+            for (int c = 0; c < 3; c++) {
+                img->planes[c] = arena_alloc(img->arena, bytes);
+                if (!img->planes[c]) {
+                    DEBUG_LOG("Could not allocate the planes, staying "
+                              "interleaved.\n");
+                    img->plane_bytes = 0;
+                    return;
+                }
+            }
+            img->plane_bytes = bytes;
+        }
+        img->plane_stride = stride;
+        planar_split(img->pixelDataRows, img->width, img->height, img->planes,
+                     stride);
+    } else {
+        planar_merge(img->planes, img->plane_stride, img->width, img->height,
+                     img->pixelDataRows);
+    }
+    img->layout = layout;
+}
+
+// One table per plane, padding included
+static void apply_lut_planes(Image_Data *img, const Lut3 *lut3) {
+    size_t plane_size = (size_t)img->plane_stride * img->height;
+    for (int c = 0; c < 3; c++) {
+        apply_lut1(img->planes[c], plane_size, lut3->channel[c]);
+    }
+}
+
+Image_View image_view(const Image_Data *img) {
+    uint32_t row_size = img->row_size_bytes;
+    Image_View view = {
+        .base = img->pixel_data + (size_t)(img->height - 1) * row_size,
+        .stride = -(ptrdiff_t)row_size,
+        .x = 0,
+        .y = 0,
+        .width = img->width,
+        .height = img->height,
+        .bit_depth = img->bit_depth_in,
+        .bit_offset = 0,
+    };
+    return view;
+}
+
+bool view_crop(const Image_View *view, uint32_t x, uint32_t y, uint32_t width,
+               uint32_t height, Image_View *out) {
+    if (!width || !height || x >= view->width || y >= view->height ||
+        width > view->width - x || height > view->height - y) {
+        return false;
+    }
+    uint64_t bit = (uint64_t)view->bit_offset + (uint64_t)x * view->bit_depth;
+    *out = *view;
+    out->base = view_row(view, y) + bit / 8;
+    out->x = view->x + x;
+    out->y = view->y + y;
+    out->width = width;
+    out->height = height;
+    out->bit_offset = (uint8_t)(bit % 8);
+    return true;
+}
+
+void view_copy(const Image_View *view, uint8_t *dst, uint32_t dst_row_size) {
+    const uint32_t used = (uint32_t)(((uint64_t)view->width * view->bit_depth +
+                                      7) / 8);
+    const uint8_t shift = view->bit_offset;
+    // Bits of the last used byte that belong to the window
+    const uint32_t tail_bits = (uint32_t)(((uint64_t)view->width *
+                                           view->bit_depth) % 8);
+    const uint8_t tail_mask =
+        tail_bits ? (uint8_t)(0xFF << (8 - tail_bits)) : 0xFF;
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < (int)view->height; y++) {
+        const uint8_t *src = view_row(view, y);
+        uint8_t *row = dst + (size_t)(view->height - 1 - y) * dst_row_size;
+        if (!shift) {
+            memcpy(row, src, used);
         } else {
-            fprintf(stderr, "%s mode not available for 1 channel grayscale.\n",
-                    get_mode_string(img->mode));
-            exit(EXIT_FAILURE);
-        }
-
-    } else if (img->colorMode == RGB24) {
-        printf("RGB_CHANNEL\n");
-        
-        if (img->brightness_mode) {
-            bright134(img);
-        }
-        
-        if (img->mode == COPY) {
-            printf("C3\n");
-            copy13(img);
-        } else if (img->mode == GRAY) {
-            printf("G3\n");
-            gray13(img);
-        } else if (img->mode == MONO) {
-            printf("M3\n");
-            mono3(img);
-        } else if (img->mode == DITHER) {
-            assert(img->dither == true);
-            mono3(img);
-        } else if (img->mode == EQUAL) {
-            printf("E3\n");
-            equal3(img);
-        } else if (img->mode == INV_RGB) {
-            printf("I3_RGB\n");
-            inv_rgb3(img);
-        } else if (img->mode == INV_HSV) {
-            printf("I3_HSV\n");
-            inv_hsv3(img);
-        } else if (img->mode == ROT) {
-            printf("R3\n");
-            rot13(img);
-        } else if (img->mode == FLIP) {
-            printf("R3\n");
-            flip13(img);
-        } else if (img->mode == BLUR) {
-            printf("L3\n");
-            blur3(img);
-        } else if (img->mode == SEPIA) {
-            printf("S3\n");
-            sepia3(img);
+            // Pixels start mid-byte, move them up to the top bits. The
+            // last byte may need nothing from the byte after it.
+            uint32_t src_bytes = (uint32_t)((shift + (uint64_t)view->width *
+                                             view->bit_depth + 7) / 8);
+            for (uint32_t i = 0; i < used; i++) {
+                uint8_t next = (i + 1 < src_bytes) ? src[i + 1] : 0;
+                row[i] = (uint8_t)((src[i] << shift) | (next >> (8 - shift)));
+            }
+        }
+        row[used - 1] &= tail_mask;
+        memset(row + used, 0, dst_row_size - used);
+    }
+}
+
+// --- Op table ---
+// The op for each (mode, bit depth) pair. Every op is written for the
+// depths it has an entry at, a missing entry is a combination that is not
+// supported, and plan_ops fails the job on it before any pixel changes.
+// Indexed ops at sub-byte depths work on the color table or on whole
+// bytes. Rotate, flip, blur and filter move or mix single indices, so they
+// need 8-bit ones.
+
+enum Depth_Slot {
+    DEPTH_1 = 0,
+    DEPTH_2,
+    DEPTH_4,
+    DEPTH_8,
+    DEPTH_24,
+    DEPTH_SLOTS
+};
+
+typedef void (*Op_Fn)(Image_Data *img);
+
+#define OP_INDEXED(fn)                                                         \
+    [DEPTH_1] = fn, [DEPTH_2] = fn, [DEPTH_4] = fn, [DEPTH_8] = fn
+#define OP_ANY(fn) {OP_INDEXED(fn), [DEPTH_24] = fn}
+
+static const Op_Fn op_table[TONE + 1][DEPTH_SLOTS] = {
+    [COPY] = OP_ANY(copy13),
+    [GRAY] = OP_ANY(gray13),
+    [MONO] = {[DEPTH_2] = mono1, [DEPTH_4] = mono1, [DEPTH_8] = mono1,
+              [DEPTH_24] = mono3},
+    [DITHER] = {[DEPTH_2] = mono1, [DEPTH_4] = mono1, [DEPTH_8] = mono1,
+                [DEPTH_24] = mono3},
+    [INV] = {OP_INDEXED(inv1), [DEPTH_24] = inv_rgb3},
+    [INV_RGB] = {[DEPTH_24] = inv_rgb3},
+    [INV_HSV] = {[DEPTH_24] = inv_hsv3},
+    [HIST] = {OP_INDEXED(hist1), [DEPTH_24] = hist3},
+    [HIST_N] = {OP_INDEXED(hist1_normalized), [DEPTH_24] = hist3},
+    [EQUAL] = {OP_INDEXED(equal1), [DEPTH_24] = equal3},
+    [ROT] = OP_ANY(rot13),
+    [FLIP] = OP_ANY(flip13),
+    [BLUR] = {[DEPTH_8] = blur1, [DEPTH_24] = blur3},
+    [SEPIA] = {OP_INDEXED(sepia1), [DEPTH_24] = sepia3},
+    [FILTER] = {[DEPTH_8] = filter1, [DEPTH_24] = filter3},
+    [TONE] = OP_ANY(tone13),
+};
+
+static int depth_slot(uint8_t depth) {
+    switch (depth) {
+    case 1:
+        return DEPTH_1;
+    case 2:
+        return DEPTH_2;
+    case 4:
+        return DEPTH_4;
+    case 8:
+        return DEPTH_8;
+    case 24:
+        return DEPTH_24;
+    default:
+        return -1;
+    }
+}
+
+// NULL if the mode has no op for the depth
+static Op_Fn op_for(enum Mode mode, uint8_t depth) {
+    int slot = depth_slot(depth);
+    if ((unsigned)mode > TONE || slot < 0) {
+        return NULL;
+    }
+    return op_table[mode][slot];
+}
+
+static void fail_unsupported(Image_Data *img, enum Mode mode, uint8_t depth) {
+    // A mode with no op at any depth of the color mode keeps the message
+    // it always had
+    bool indexed = depth <= 8;
+    bool other_depth = false;
+    if ((unsigned)mode <= TONE) {
+        int first = indexed ? DEPTH_1 : DEPTH_24;
+        int last = indexed ? DEPTH_8 : DEPTH_24;
+        for (int slot = first; slot <= last; slot++) {
+            other_depth = other_depth || op_table[mode][slot];
+        }
+    }
+    if (!other_depth) {
+        image_fail(img, IMAGECOPY_ERROR_UNSUPPORTED,
+                   indexed ? "%s mode not available for 1 channel grayscale.\n"
+                           : "%s mode not available for 3 channel/RGB\n",
+                   get_mode_string(mode));
+    } else {
+        image_fail(img, IMAGECOPY_ERROR_UNSUPPORTED,
+                   "Error: %s is not available for %d-bit images.\n",
+                   get_mode_string(mode), depth);
+    }
+}
+
+// Every op of the job against the table, before anything runs. An op sees
+// the depth the ops before it leave, which only changes when mono or
+// dither of a 24-bit image goes straight to 1 bit (--set-depth 1).
+static bool plan_ops(Image_Data *img) {
+    uint8_t depth = img->bit_depth_in;
+    uint8_t count = img->step_count ? img->step_count : 1;
+    for (uint8_t i = 0; i < count; i++) {
+        enum Mode mode = img->step_count ? img->steps[i].mode : img->mode;
+        if (!op_for(mode, depth)) {
+            fail_unsupported(img, mode, depth);
+            return false;
+        }
+        if (depth == 24 && (mode == MONO || mode == DITHER) &&
+            img->bit_depth_out == 1) {
+            depth = 1;
+        }
+    }
+    return true;
+}
+
+// Run img->mode on the image as it is, plan_ops has checked it
+static void run_op(Image_Data *img) {
+    DEBUG_LOG("Output mode: %s, %d-bit\n", get_mode_string(img->mode),
+              img->bit_depth_in);
+    Op_Fn op = op_for(img->mode, img->bit_depth_in);
+    if (!op) {
+        fail_unsupported(img, img->mode, img->bit_depth_in);
+        return;
+    }
+    if (img->colorMode == RGB24 &&
+        !(op_layouts(img) & LAYOUT_MASK(img->layout))) {
+        // Convert only when the op cannot run on the layout it is given. A
+        // split and merge of the whole image costs more than one table or
+        // blur pass gains from planes, so the pixels stay as they are
+        // while the ops in a row can take them.
+        image_set_layout(img, LAYOUT_INTERLEAVED);
+    }
+    // a tone chain applies its own brightness steps in order
+    if (img->brightness_mode && img->mode != TONE) {
+        bright134(img);
+    }
+    op(img);
+}
+
+// Settings of a pipeline step into the fields its op reads
+static void load_step(Image_Data *img, const Op_Step *step) {
+    img->mode = step->mode;
+    img->mono_threshold = step->mono_threshold;
+    img->degrees = step->degrees;
+    img->direction = step->direction;
+    img->blur_level = step->blur_level;
+    img->filter_index = step->filter_index;
+    img->filter_name = step->mode == FILTER
+                           ? (char *)kernel_list[step->filter_index].name
+                           : NULL;
+    memcpy(img->tone_steps, step->tone_steps, sizeof(img->tone_steps));
+    img->tone_step_count = step->tone_step_count;
+}
+
+// --- Pipeline stages ---
+// Nothing of a pipeline runs before process_image. The steps are the nodes
+// of the job's op graph, a chain, and a planner cuts it into stages just
+// before each one runs, on the image as the stages before left it. Each
+// step declares how it touches the image (step_shape, tile.h): pointwise,
+// a stencil with a halo, or a barrier that needs the whole image. The
+// steps between two barriers are one stage.
+//
+// Pointwise steps next to each other become one pass. A blur takes the
+// pointwise steps on either side of it into its own passes, the ones
+// before as it loads a row and the ones after as it stores one, and a
+// filter stores its results through the steps after it. A stage with a
+// blur or filter runs on the tile engine, each tile through all of the
+// stage before the next, so what one step hands to the next stays in
+// cache. A barrier (rotate, flip, equalize, dither, a histogram, 1-bit
+// mono) is a stage of its own and runs as a single op.
+//
+// Stages fuse on 24-bit and 8-bit indexed images. The pointwise steps of
+// an indexed image change its color table and at most map each index to
+// another, so a run of them is the table changes, made while planning, and
+// one composed index map.
+
+typedef struct {
+    uint8_t first, end;    // steps[first] to steps[end - 1]
+    uint8_t stencil_count; // blur and filter steps among them
+} Stage;
+
+// A blur or filter step as an op of a tile chain
+typedef struct {
+    enum Mode mode;
+    uint16_t blur_level;
+    Box_Hooks hooks;    // blur: the pointwise steps fused into its passes
+    Kernel kernel;      // filter, factored before the tiles share it
+    const uint8_t *map; // filter: index map of the results, NULL for none
+} Stencil;
+
+// A stage on the tile engine: the chain and what its ops point to. The
+// fused pointwise work comes in runs, one before each stencil and one
+// after the last, a pixel program or an index map each.
+typedef struct {
+    Tile_Chain chain;
+    Stencil stencils[OP_STEPS_MAX];
+    Pixel_Program *programs; // 24-bit
+    uint8_t (*maps)[LUT_SIZE]; // indexed
+    uint8_t pad_map[LUT_SIZE]; // indexed, all maps in order, for padding
+} Stage_Chain;
+
+static void gray_index_map(Image_Data *img, uint8_t *map);
+static void mono_index_map(const Image_Data *img, uint8_t threshold,
+                           uint8_t *map);
+static void set_mono_palette(Image_Data *img);
+static void tone_lut3(Image_Data *img, Lut3 *plan);
+static void tone_index_map(Image_Data *img, uint8_t *plan);
+static void run_chain(Image_Data *img, Tile_Chain *chain,
+                      const uint8_t *pad_map);
+
+static bool image_fusable(const Image_Data *img) {
+    return img->colorMode == RGB24 ||
+           (img->colorMode == INDEXED && img->bit_depth_in == 8);
+}
+
+// How a step touches the image as it is now. Pointwise: each pixel (or
+// index) of the result depends on that of the input only.
+static Tile_Shape step_shape(const Image_Data *img, const Op_Step *step) {
+    bool rgb = img->colorMode == RGB24;
+    switch (step->mode) {
+    case COPY:
+    case GRAY:
+    case SEPIA:
+        return TILE_POINTWISE;
+    case MONO:
+        // --set-depth 1 makes a 24-bit result 1-bit right away
+        return (!rgb || img->bit_depth_out != 1) ? TILE_POINTWISE
+                                                 : TILE_BARRIER;
+    case INV:
+        return TILE_POINTWISE;
+    case INV_RGB:
+    case INV_HSV:
+        return rgb ? TILE_POINTWISE : TILE_BARRIER;
+    case TONE:
+        // Equalize needs the histogram of the whole image first
+        for (uint8_t i = 0; i < step->tone_step_count; i++) {
+            enum ToneOp op = step->tone_steps[i].op;
+            if (op == TONE_EQUAL ||
+                (op == TONE_MONO && i + 1 < step->tone_step_count)) {
+                return TILE_BARRIER;
+            }
+        }
+        return TILE_POINTWISE;
+    case BLUR:
+        return TILE_STENCIL;
+    case FILTER:
+        // The tiles convolve one byte per pixel, a 24-bit filter runs on
+        // the planes of the whole image
+        return rgb ? TILE_BARRIER : TILE_STENCIL;
+    default:
+        return TILE_BARRIER;
+    }
+}
+
+static uint8_t threshold_of(const Image_Data *img) {
+    return (uint8_t)(WHITE * img->mono_threshold + 0.5f);
+}
+
+// The loaded step as pixel ops
+static void plan_pixel_step(Image_Data *img, Pixel_Program *program) {
+    Lut3 lut;
+    switch (img->mode) {
+    case GRAY:
+        pixel_program_add(program, PIXEL_GRAY, 0);
+        break;
+    case SEPIA:
+        pixel_program_add(program, PIXEL_SEPIA, 0);
+        break;
+    case INV_HSV:
+        pixel_program_add(program, PIXEL_INV_HSV, 0);
+        break;
+    case INV:
+    case INV_RGB:
+        lut_invert(lut.channel[0]);
+        lut3_from_lut(&lut, lut.channel[0]);
+        pixel_program_add_lut(program, &lut);
+        break;
+    case MONO:
+        pixel_program_add(program, PIXEL_THRESHOLD, threshold_of(img));
+        img->colors_used_actual = 2;
+        break;
+    case TONE:
+        tone_lut3(img, &lut);
+        pixel_program_add_lut(program, &lut);
+        if (img->tone_step_count &&
+            img->tone_steps[img->tone_step_count - 1].op == TONE_MONO) {
+            pixel_program_add(program, PIXEL_THRESHOLD, threshold_of(img));
+            img->colors_used_actual = 2;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// The loaded step's color table changes, made now, and its index map
+// composed into 'map'
+static void plan_index_step(Image_Data *img, uint8_t *map) {
+    uint8_t step_map[LUT_SIZE];
+    switch (img->mode) {
+    case GRAY:
+        gray_index_map(img, step_map);
+        lut_compose(map, step_map);
+        break;
+    case MONO:
+        mono_index_map(img, threshold_of(img), step_map);
+        lut_compose(map, step_map);
+        set_mono_palette(img);
+        break;
+    case TONE:
+        tone_index_map(img, step_map);
+        lut_compose(map, step_map);
+        break;
+    case INV:
+        inv1(img);
+        break;
+    case SEPIA:
+        sepia1(img);
+        break;
+    default:
+        break;
+    }
+}
+
+// Steps from 'first' on up to the next barrier
+static void plan_stage(const Image_Data *img, uint8_t first, Stage *stage) {
+    stage->first = first;
+    stage->stencil_count = 0;
+    uint8_t i = first;
+    for (; i < img->step_count; i++) {
+        Tile_Shape shape = step_shape(img, &img->steps[i]);
+        if (shape == TILE_BARRIER) {
+            break;
+        }
+        stage->stencil_count += shape == TILE_STENCIL;
+    }
+    stage->end = i;
+}
+
+static bool lut_is_identity(const uint8_t *lut) {
+    for (int v = 0; v < LUT_SIZE; v++) {
+        if (lut[v] != v) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// --- Tile ops of the stages ---
+
+static void index_map_row(uint8_t *row, uint32_t width, void *map) {
+    apply_lut1(row, width, map);
+}
+
+static bool program_tile(void *program, const Tile *tile) {
+    for (uint32_t y = 0; y < tile->height; y++) {
+        pixel_program_row(tile->rows[y], tile->width, program);
+    }
+    return true;
+}
+
+static bool map_tile(void *map, const Tile *tile) {
+    apply_lut1(tile->rows[0], (size_t)tile->width * tile->height, map);
+    return true;
+}
+
+static bool blur_tile(void *context, const Tile *tile) {
+    Stencil *stencil = context;
+    return box_blur_level_hooked(tile->rows, tile->width, tile->height,
+                                 tile->channels, stencil->blur_level,
+                                 &stencil->hooks);
+}
+
+static bool filter_tile(void *context, const Tile *tile) {
+    Stencil *stencil = context;
+    Convolution conv = {
+        .input = tile->rows[0],
+        .output = tile->out[0],
+        .height = tile->height,
+        .width = tile->width,
+        .stride = tile->width, // tile rows are contiguous
+        .kernel = &stencil->kernel,
+        .map = stencil->map,
+    };
+    return conv1(&conv);
+}
+
+// The tile op of a stencil step, loaded into img
+static Tile_Op stencil_op(const Image_Data *img, Stencil *stencil) {
+    Tile_Op op = {.shape = TILE_STENCIL, .context = stencil};
+    stencil->mode = img->mode;
+    if (img->mode == BLUR) {
+        stencil->blur_level = img->blur_level;
+        op.halo = box_blur_halo(img->blur_level);
+        op.run = blur_tile;
+    } else {
+        // Factored here, the tiles then only read the kernel. A --kernel
+        // was factored as it was loaded, the copy shares its weights.
+        stencil->kernel =
+            img->kernel ? *img->kernel : kernel_list[img->filter_index];
+        kernel_factor(&stencil->kernel);
+        op.halo = stencil->kernel.size / 2;
+        op.out_of_place = true;
+        op.run = filter_tile;
+    }
+    return op;
+}
+
+// Pointwise run 'run' (non-empty) goes after 'last', the stencil before
+// it, or before 'next', or is an op of its own
+static void attach_run(Stage_Chain *sc, bool rgb, uint8_t run,
+                       Stencil *last, Stencil *next) {
+    void *work = rgb ? (void *)&sc->programs[run] : (void *)sc->maps[run];
+    Box_Row_Fn row_fn = rgb ? pixel_program_row : index_map_row;
+    if (last && last->mode == BLUR) {
+        last->hooks.store = row_fn;
+        last->hooks.store_context = work;
+    } else if (last) {
+        last->map = sc->maps[run];
+    } else if (next && next->mode == BLUR) {
+        next->hooks.load = row_fn;
+        next->hooks.load_context = work;
+    } else {
+        // The convolution reads each input many times, the steps before
+        // it are an op of their own
+        Tile_Op op = {
+            .shape = TILE_POINTWISE,
+            .run = rgb ? program_tile : map_tile,
+            .context = work,
+        };
+        tile_chain_add(&sc->chain, &op);
+    }
+}
+
+// Load each step of the stage in order and turn it into the stage's chain
+static bool plan_chain(Image_Data *img, const Stage *stage, Stage_Chain *sc) {
+    bool rgb = img->colorMode == RGB24;
+    uint8_t run_count = stage->stencil_count + 1;
+    memset(&sc->chain, 0, sizeof(sc->chain));
+    memset(sc->stencils, 0, sizeof(sc->stencils));
+    sc->programs = NULL;
+    sc->maps = NULL;
+    if (rgb) {
+        sc->programs =
+            arena_alloc(img->arena, run_count * sizeof(Pixel_Program));
+    } else {
+        sc->maps = arena_alloc(img->arena, run_count * LUT_SIZE);
+    }
+    if (!sc->programs && !sc->maps) {
+        return false;
+    }
+
+    uint8_t run = 0;
+    uint8_t stencil_count = 0;
+    Stencil *last = NULL;
+    for (uint8_t r = 0; r < run_count; r++) {
+        if (rgb) {
+            pixel_program_init(&sc->programs[r]);
         } else {
-            printf("CHANNEL FAIL\n");
-            fprintf(stderr, "%s mode not available for 3 channel/RGB\n",
-                    get_mode_string(img->mode));
-            exit(EXIT_FAILURE);
+            lut_identity(sc->maps[r]);
+        }
+    }
+
+    for (uint8_t i = stage->first; i < stage->end; i++) {
+        load_step(img, &img->steps[i]);
+        if (step_shape(img, &img->steps[i]) == TILE_POINTWISE) {
+            if (rgb) {
+                plan_pixel_step(img, &sc->programs[run]);
+            } else {
+                plan_index_step(img, sc->maps[run]);
+            }
+            continue;
+        }
+        Stencil *stencil = &sc->stencils[stencil_count++];
+        Tile_Op op = stencil_op(img, stencil);
+        bool pending = rgb ? sc->programs[run].count > 0
+                           : !lut_is_identity(sc->maps[run]);
+        if (pending) {
+            attach_run(sc, rgb, run, last, stencil);
         }
+        tile_chain_add(&sc->chain, &op);
+        last = stencil;
+        run++;
     }
+    bool pending = rgb ? sc->programs[run].count > 0
+                       : !lut_is_identity(sc->maps[run]);
+    if (pending) {
+        attach_run(sc, rgb, run, last, NULL);
+    }
+
+    if (!rgb) {
+        lut_identity(sc->pad_map);
+        for (uint8_t r = 0; r < run_count; r++) {
+            lut_compose(sc->pad_map, sc->maps[r]);
+        }
+    }
+    return true;
+}
+
+// Pointwise steps only, one pass over the rows in place
+static void run_pointwise_stage(Image_Data *img, const Stage *stage) {
+    if (img->colorMode == RGB24) {
+        Pixel_Program program;
+        pixel_program_init(&program);
+        for (uint8_t i = stage->first; i < stage->end; i++) {
+            load_step(img, &img->steps[i]);
+            plan_pixel_step(img, &program);
+        }
+        image_set_layout(img, LAYOUT_INTERLEAVED);
+        pixel_program_run(&program, img->pixelDataRows, img->width,
+                          img->height);
+    } else {
+        uint8_t map[LUT_SIZE];
+        lut_identity(map);
+        for (uint8_t i = stage->first; i < stage->end; i++) {
+            load_step(img, &img->steps[i]);
+            plan_index_step(img, map);
+        }
+        if (!lut_is_identity(map)) {
+            apply_lut1(img->pixel_data, img->image_byte_count, map);
+        }
+    }
+}
+
+static void run_stage(Image_Data *img, const Stage *stage) {
+    if (!stage->stencil_count) {
+        run_pointwise_stage(img, stage);
+    } else {
+        Stage_Chain *sc = arena_alloc(img->arena, sizeof(Stage_Chain));
+        if (!sc || !plan_chain(img, stage, sc)) {
+            image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                       "Error: Could not allocate the stage.\n");
+            return;
+        }
+        image_set_layout(img, LAYOUT_INTERLEAVED);
+        run_chain(img, &sc->chain,
+                  img->colorMode == RGB24 ? NULL : sc->pad_map);
+    }
+    // The fields as the last step left them
+    load_step(img, &img->steps[stage->end - 1]);
+}
+
+// A pipeline, each stage on the image the one before left in memory.
+// Brightness goes first, as it does before a single op. Dithering is a
+// setting of the job for the reduction to indexed colour, a DITHER step
+// has its own and the job's is put back afterwards.
+static void run_steps(Image_Data *img) {
+    bool brightness_mode = img->brightness_mode;
+    bool dither = img->dither;
+    uint8_t dither_mode = img->dither_mode;
+
+    if (img->brightness_mode) {
+        bright134(img);
+        img->brightness_mode = false;
+    }
+    uint8_t i = 0;
+    while (i < img->step_count && !img->status) {
+        Stage stage;
+        // A histogram is of the image the stage gets, not an earlier one
+        img->histogram1 = NULL;
+        img->histogram3 = NULL;
+        img->histogram_n = NULL;
+        img->dither = false;
+        img->dither_mode = dither_mode;
+
+        if (image_fusable(img)) {
+            plan_stage(img, i, &stage);
+        } else {
+            stage.end = i;
+        }
+        if (stage.end - i > 1) {
+            DEBUG_LOG("Steps %d to %d of %d as one stage, %d blur or "
+                      "filter\n",
+                      i + 1, stage.end, img->step_count,
+                      stage.stencil_count);
+            run_stage(img, &stage);
+            i = stage.end;
+            continue;
+        }
+
+        const Op_Step *step = &img->steps[i];
+        DEBUG_LOG("Step %d of %d: %s\n", i + 1, img->step_count,
+                  get_mode_string(step->mode));
+        load_step(img, step);
+        img->dither = step->mode == DITHER;
+        img->dither_mode = img->dither ? step->dither_mode : dither_mode;
+        run_op(img);
+        i++;
+    }
+    img->brightness_mode = brightness_mode;
+    img->dither = dither;
+    img->dither_mode = dither_mode;
+}
+
+// Process image
+void process_image(Image_Data *img) {
+    if (!plan_ops(img)) {
+        return;
+    }
+    if (img->step_count) {
+        run_steps(img);
+    } else {
+        run_op(img);
+    }
+    if (img->status) {
+        return;
+    }
+    // Everything after this (bit depth, writing) reads BGR rows
+    image_set_layout(img, LAYOUT_INTERLEAVED);
 
     img->mode_suffix = get_suffix(img);
 }
 
-// Returns dynamically allocated string suffix
+// Suffix for a tone chain, the suffixes of its steps joined in order.
+// Brightness only shows up when it is the whole chain, as before.
+static char *get_tone_suffix(Image_Data *img) {
+    char suffix[TONE_OPS_MAX * 8 + 8] = "";
+    for (uint8_t i = 0; i < img->tone_step_count; i++) {
+        switch (img->tone_steps[i].op) {
+        case TONE_EQUAL:
+            strcat(suffix, "_equal");
+            break;
+        case TONE_INV:
+            strcat(suffix, "_inv");
+            break;
+        case TONE_MONO:
+            strcat(suffix, "_mono");
+            break;
+        default:
+            break;
+        }
+    }
+    if (suffix[0] == '\0') {
+        strcpy(suffix, "_bright");
+    }
+    return arena_strdup(img->arena, suffix);
+}
+
+// Suffix of a pipeline, the suffixes of its steps joined in order. A blur
+// has its level, as the file name of a single blur has.
+static char *get_steps_suffix(Image_Data *img) {
+    char suffix[OP_STEPS_MAX * 32] = "";
+    Image_Data step_img = *img;
+    step_img.step_count = 0;
+    for (uint8_t i = 0; i < img->step_count; i++) {
+        load_step(&step_img, &img->steps[i]);
+        char *step_suffix = get_suffix(&step_img);
+        if (!step_suffix) {
+            return NULL;
+        }
+        size_t len = strlen(suffix);
+        if (step_img.mode == BLUR) {
+            snprintf(suffix + len, sizeof(suffix) - len, "%s_%d", step_suffix,
+                     step_img.blur_level);
+        } else {
+            snprintf(suffix + len, sizeof(suffix) - len, "%s", step_suffix);
+        }
+    }
+    return arena_strdup(img->arena, suffix);
+}
+
+// Returns the suffix as a string in the image's arena
 char *get_suffix(Image_Data *img) {
     size_t len;
+    if (img->step_count) {
+        return get_steps_suffix(img);
+    }
     switch (img->mode) {
     case NO_MODE:
-        return strdup("_none"); // not used currently besides initializaton
+        return arena_strdup(img->arena, "_none"); // not used currently besides initializaton
         break;
     case COPY:
-        return strdup("_copy");
+        return arena_strdup(img->arena, img->crop ? "_crop" : "_copy");
         break;
     case GRAY:
-        return strdup("_gray");
+        return arena_strdup(img->arena, "_gray");
         break;
     case MONO:
-        return strdup("_mono");
+        return arena_strdup(img->arena, "_mono");
         break;
     case DITHER:
-        return strdup("_dither");
+        return arena_strdup(img->arena, "_dither");
         break;
     case INV:
-        return strdup("_inv");
+        return arena_strdup(img->arena, "_inv");
         break;
     case INV_RGB:
-        return strdup("_inv_rgb");
+        return arena_strdup(img->arena, "_inv_rgb");
         break;
     case INV_HSV:
-        return strdup("_inv_hsv");
+        return arena_strdup(img->arena, "_inv_hsv");
         break;
     case BRIGHT:
-        return strdup("_bright");
+        return arena_strdup(img->arena, "_bright");
         break;
     case HIST:
-        return strdup("_hist_256");
+        return arena_strdup(img->arena, "_hist_256");
         break;
     case HIST_N:
-        return strdup("_hist_0_1");
+        return arena_strdup(img->arena, "_hist_0_1");
         break;
     case EQUAL:
-        return strdup("_equal");
+        return arena_strdup(img->arena, "_equal");
         break;
     case ROT:
-        return strdup("_rot");
+        return arena_strdup(img->arena, "_rot");
         break;
     case FLIP:
-        return strdup("_flip");
+        return arena_strdup(img->arena, "_flip");
         break;
     case BLUR:
-        return strdup("_blur");
+        return arena_strdup(img->arena, "_blur");
         break;
     case SEPIA:
-        return strdup("_sepia");
+        return arena_strdup(img->arena, "_sepia");
         break;
     case FILTER:
         len = strlen(img->filter_name);
-        img->mode_suffix = (char *)malloc((len + 2) * sizeof(char));
-        strcpy(img->mode_suffix, "_");
-        strcat(img->mode_suffix, img->filter_name);
+        img->mode_suffix = arena_alloc(img->arena, len + 2);
+        if (img->mode_suffix) {
+            strcpy(img->mode_suffix, "_");
+            strcat(img->mode_suffix, img->filter_name);
+        }
         return img->mode_suffix;
         break;
+    case TONE:
+        return get_tone_suffix(img);
+        break;
     default:
-        return strdup("_suffix");
+        return arena_strdup(img->arena, "_suffix");
     }
 }
 
@@ -277,33 +1027,37 @@ char *get_mode_string(enum Mode mode) {
     case DITHER:
         return "Mono Dither";
         break;
+    case TONE:
+        return "Tone Chain";
+        break;
     default:
         return "default: mode string not found";
     }
 }
 
-uint8_t *create_buffer1(uint32_t image_byte_count) {
+// Zeroed buffer in the job's arena
+uint8_t *create_buffer1(Arena *arena, size_t image_byte_count) {
     if (!image_byte_count) {
-        fprintf(stderr,
+        report_error(
                 "Error: Buffer creation failed, byte size not defined.\n");
         return NULL;
     }
-    uint8_t *buf1 = (uint8_t *)calloc(image_byte_count, sizeof(uint8_t));
+    uint8_t *buf1 = arena_calloc(arena, image_byte_count, sizeof(uint8_t));
     if (buf1 == NULL) {
-        fprintf(stderr, "Error: Failed to allocate memory for image buffer.\n");
+        report_error("Error: Failed to allocate memory for image buffer.\n");
         return NULL;
     }
-    printf("Size created: %u\n", image_byte_count);
+    DEBUG_LOG("Size created: %zu\n", image_byte_count);
 
     // img->pixel_data = buf1;
     return buf1;
 }
 
-uint32_t calculate_buffer1_byte_count(uint32_t width, uint32_t height,
-                                      uint16_t bit_depth) {
+size_t calculate_buffer1_byte_count(uint32_t width, uint32_t height,
+                                    uint16_t bit_depth) {
     const char *function_name = "calculate_buffer1_byte_count";
     if (!(width && height && bit_depth)) {
-        fprintf(stderr,
+        report_error(
                 "Error: [%s] - Zero argument value:\n"
                 "Width: %u Height: %u Bit_Depth: %u\n",
                 function_name, width, height, bit_depth);
@@ -311,72 +1065,41 @@ uint32_t calculate_buffer1_byte_count(uint32_t width, uint32_t height,
     }
 
     // Calculate padded row size in bytes
-    uint32_t row_size = ((width * bit_depth + 31) / 32) * 4;
-    uint32_t total_size = row_size * height;
+    size_t row_size = (((uint64_t)width * bit_depth + 31) / 32) * 4;
+    size_t total_size = row_size * height;
 
-    printf("Buf1 size calculated: %u bytes\n", total_size);
+    DEBUG_LOG("Buf1 size calculated: %zu bytes\n", total_size);
     return total_size;
 }
 
-void buffer1_to_2D(uint8_t *buf1D, uint8_t ***buf2D, uint32_t rows,
-                   uint32_t cols) {
-    if (!buf1D) {
-        fprintf(stderr,
-                "Error: 2D array initialization error. 1D array is empty.");
-        exit(EXIT_FAILURE);
-    }
+// *buf2D is NULL if it fails
+void buffer1_to_2D(Arena *arena, uint8_t *buf1D, uint8_t ***buf2D,
+                   uint32_t rows, uint32_t cols) {
     if (!(buf2D)) {
-        fprintf(stderr,
+        report_error(
                 "Error: 2D array initialization error. 2D address is empty.");
-        exit(EXIT_FAILURE);
+        return;
+    }
+    *buf2D = NULL;
+    if (!buf1D) {
+        report_error(
+                "Error: 2D array initialization error. 1D array is empty.");
+        return;
     }
-    *buf2D = (uint8_t **)malloc(sizeof(uint8_t *) * rows);
+    *buf2D = arena_alloc(arena, sizeof(uint8_t *) * rows);
     if (!(*buf2D)) {
-        fprintf(stderr,
+        report_error(
                 "Error: Failed to allocate memory for 2D image buffer.\n");
-        exit(EXIT_FAILURE);
-    }
-    for (int r = 0; r < rows; r++) {
-        (*buf2D)[r] = &buf1D[r * cols];
-    }
-}
-
-void create_buffer3(uint8_t ***buffer, uint32_t rows, uint32_t cols) {
-    printf("Buffer_create3\n");
-
-    *buffer = (uint8_t **)malloc(rows * sizeof(uint8_t *));
-    if (*buffer == NULL) {
-        fprintf(stderr, "Error: Failed to allocate memory for image buffer.\n");
-        exit(EXIT_FAILURE);
-    }
-
-    for (uint32_t r = 0; r < rows; r++) {
-        (*buffer)[r] = (uint8_t *)calloc(cols, sizeof(uint8_t));
-    }
-    if ((*buffer) == NULL) {
-        fprintf(stderr, "Error: Failed to allocate memory for image buffer.");
-        exit(EXIT_FAILURE);
+        return;
     }
-}
-
-void buffer3_to_3D(uint8_t **buffer1D, uint8_t ****buffer3D, uint32_t rows,
-                   uint32_t cols) {
-    buffer3D = (uint8_t ****)malloc(rows * sizeof(uint8_t **));
     for (uint32_t r = 0; r < rows; r++) {
-        (*buffer3D)[r] = (uint8_t **)malloc(cols * sizeof(uint8_t *));
-        if ((buffer3D)[r] == NULL) {
-            fprintf(stderr, "Error: Failed to allocate memory for columns.\n");
-            exit(EXIT_FAILURE);
-        }
-        for (int32_t c = 0; c < cols; c += 3) {
-            (*buffer3D)[r][c] = &buffer1D[r][cols + c * 3];
-        }
+        (*buf2D)[r] = &buf1D[(size_t)r * cols];
     }
 }
 
 // Return an array of row pointers into the pixel buffer
-uint8_t **get_pixel_rows(uint8_t *pixel_data, uint32_t width, uint32_t height,
-                         uint8_t bit_depth) {
+uint8_t **get_pixel_rows(Arena *arena, uint8_t *pixel_data, uint32_t width,
+                         uint32_t height, uint8_t bit_depth) {
     if (!pixel_data || width <= 0 || height <= 0 ||
         (bit_depth != 1 && bit_depth != 2 && bit_depth != 4 && bit_depth != 8 &&
          bit_depth != 24)) {
@@ -384,18 +1107,17 @@ uint8_t **get_pixel_rows(uint8_t *pixel_data, uint32_t width, uint32_t height,
     }
 
     // Each row is padded to the next 4-byte boundary
-    uint32_t bits_per_row = width * bit_depth;
-    uint32_t padded_bits = ((bits_per_row + 31) / 32) * 32;
-    uint32_t row_size = padded_bits / 8;
+    uint64_t bits_per_row = (uint64_t)width * bit_depth;
+    size_t row_size = (size_t)((bits_per_row + 31) / 32) * 4;
 
     // Allocate an array of row pointers
-    uint8_t **rows = malloc(height * sizeof(uint8_t *));
+    uint8_t **rows = arena_alloc(arena, (size_t)height * sizeof(uint8_t *));
     if (!rows)
         return NULL;
 
     // Populate the row pointers (BMP stores rows bottom-up)
     for (uint32_t i = 0; i < height; ++i) {
-        rows[i] = pixel_data + (height - 1 - i) * row_size;
+        rows[i] = pixel_data + (size_t)(height - 1 - i) * row_size;
     }
 
     return rows;
@@ -406,190 +1128,93 @@ uint8_t **get_pixel_rows(uint8_t *pixel_data, uint32_t width, uint32_t height,
 // Create a buffer3 to treat the pixel data from a BMP as a 2D array.
 // Creates a pointer to a "pointer to a row" so that you can access pixels as
 // pixels[row][col]. 3 channel/24 bit
-uint8_t **pixel_data_to_buffer3(uint8_t *pixel_data, uint32_t width,
-                                uint32_t height) {
-    printf("pixel_data_to_buffer3\n");
-    uint8_t **buffer3 = get_pixel_rows(pixel_data, width, height, 24);
+uint8_t **pixel_data_to_buffer3(Arena *arena, uint8_t *pixel_data,
+                                uint32_t width, uint32_t height) {
+    DEBUG_LOG("pixel_data_to_buffer3\n");
+    uint8_t **buffer3 = get_pixel_rows(arena, pixel_data, width, height, 24);
 
     if (buffer3 == NULL) {
-        fprintf(stderr, "Failed to get rows in buffer3.\n");
+        report_error("Failed to get rows in buffer3.\n");
     }
     return buffer3;
 }
 
-uint8_t **buffer3_to_2D(uint8_t *buf1, uint32_t rows, uint32_t cols) {
-    uint8_t **array2D = (uint8_t **)malloc(sizeof(uint8_t *) * rows);
-    for (int r = 0; r < rows; r++) {
-        array2D[r] = &buf1[r * cols];
+// Drop the image's buffers. They belong to img->arena, the memory itself
+// goes back when the owner resets the arena.
+void free_img(Image_Data *img) {
+    if (!img) {
+        return;
     }
-    return array2D;
+    img->histogram1 = NULL;
+    img->histogram_n = NULL;
+    img->histogram3 = NULL;
+    img->colorTable = NULL;
+    img->pixel_data = NULL;
+    img->pixelDataRows = NULL;
+    img->mode_suffix = NULL;
 }
 
-// free memory allocated for image structs.
-void free_img(Image_Data *img) {
-    if (img) {
-        if (img->histogram1) {
-            free(img->histogram1);
-            img->histogram1 = NULL;
-        }
-        if (img->histogram_n) {
-            free(img->histogram_n);
-            img->histogram_n = NULL;
-        }
-        if (img->histogram3) {
-            for (int i = 0; i < 3; i++) {
-                free(img->histogram3[i]);
-            }
-            free(img->histogram3);
-            img->histogram1 = NULL;
-        }
+void copy13(Image_Data *img) {}
 
-        if (img->pixel_data) {
-            free(img->pixel_data);
-            img->pixel_data = NULL; // Avoid dangling pointer.
-        }
-        if (img->pixelDataRows) {
-            for (int i = 0; i < 3; i++) {
-                free(img->pixelDataRows[i]);
-            }
-            free(img->pixelDataRows);
-        }
-        free(img->pixelDataRows);
-        img->pixelDataRows = NULL; // Avoid dangling pointer.
+// Gray of an indexed image: each entry maps to the gray ramp index nearest
+// below its luminance, and the color table becomes the ramp. Only the
+// table changes here, the pixels still need the map.
+static void gray_index_map(Image_Data *img, uint8_t *map) {
+    uint8_t bit_depth = img->bit_depth_in;
+    unsigned char *colorTable = img->colorTable;
 
-        if (img->mode_suffix) {
-            {
-                free(img->mode_suffix);
-                img->mode_suffix = NULL;
-            }
-        }
+    uint16_t color_table_count = 1 << bit_depth;
+    uint8_t step = (bit_depth == 2) ? 85 : (bit_depth == 4) ? 17 : 1;
+
+    uint8_t lum[256];
+    palette_luminance(colorTable, color_table_count, lum);
+    for (uint16_t i = 0; i < color_table_count; i++) {
+        uint8_t new_index = lum[i] / step;
+        map[i] = (new_index >= color_table_count) ? color_table_count - 1
+                                                  : new_index;
     }
-}
 
-void copy13(Image_Data *img) {}
+    // Build grayscale color table
+    for (uint16_t i = 0; i < color_table_count; i++) {
+        uint8_t gray = i * step;
+        uint32_t offset = i * 4;
+        colorTable[offset + 0] = gray;
+        colorTable[offset + 1] = gray;
+        colorTable[offset + 2] = gray;
+        colorTable[offset + 3] = 0;
+    }
+}
 
 void gray13(Image_Data *img) {
-    printf("Gray13\n");
+    DEBUG_LOG("Gray13\n");
 
     uint8_t bit_depth = img->bit_depth_in;
-    printf("Gray bit depth: %d\n", bit_depth);
-
-    const float r = 0.299f;
-    const float g = 0.587f;
-    const float b = 0.114f;
+    DEBUG_LOG("Gray bit depth: %d\n", bit_depth);
 
     if (bit_depth == 24) {
-        printf("Gray 24-bit\n");
+        DEBUG_LOG("Gray 24-bit\n");
         for (size_t y = 0; y < img->height; y++) {
             for (size_t x = 0; x < img->width * 3; x += 3) {
-                uint8_t blue = img->pixelDataRows[y][x + 0];
-                uint8_t green = img->pixelDataRows[y][x + 1];
-                uint8_t red = img->pixelDataRows[y][x + 2];
-
-                uint8_t gray = (uint8_t)(r * red + g * green + b * blue + 0.5f);
-                img->pixelDataRows[y][x + 0] = gray;
-                img->pixelDataRows[y][x + 1] = gray;
-                img->pixelDataRows[y][x + 2] = gray;
+                pixel_gray(img->pixelDataRows[y] + x);
             }
         }
     } else if (bit_depth == 8 || bit_depth == 4 || bit_depth == 2) {
-        printf("Gray %d-bit indexed\n", bit_depth);
+        DEBUG_LOG("Gray %d-bit indexed\n", bit_depth);
 
         assert(img->colorTable != NULL);
         assert(img->pixel_data != NULL);
 
-        unsigned char *colorTable = img->colorTable;
-        unsigned char *buffer1 = img->pixel_data;
-
-        uint16_t color_table_count = 1 << bit_depth;
-        uint8_t step = (bit_depth == 2) ? 85 : (bit_depth == 4) ? 17 : 1;
-
-        if (bit_depth == 4) {
-            for (size_t i = 0; i < img->image_byte_count; i++) {
-                uint8_t byte = buffer1[i];
-                uint8_t hi = byte >> 4;
-                uint8_t lo = byte & 0x0F;
-
-                uint32_t hi_offset = hi * 4;
-                uint32_t lo_offset = lo * 4;
-
-                uint8_t hi_gray =
-                    (uint8_t)(r * colorTable[hi_offset + 2] +
-                              g * colorTable[hi_offset + 1] +
-                              b * colorTable[hi_offset + 0] + 0.5f);
-                uint8_t lo_gray =
-                    (uint8_t)(r * colorTable[lo_offset + 2] +
-                              g * colorTable[lo_offset + 1] +
-                              b * colorTable[lo_offset + 0] + 0.5f);
-
-                uint8_t hi_index = hi_gray / step;
-                uint8_t lo_index = lo_gray / step;
-                if (hi_index >= color_table_count)
-                    hi_index = color_table_count - 1;
-                if (lo_index >= color_table_count)
-                    lo_index = color_table_count - 1;
-
-                buffer1[i] = (hi_index << 4) | lo_index;
-            }
-        } else if (bit_depth == 2) {
-            for (size_t i = 0; i < img->image_byte_count; i++) {
-                uint8_t byte = buffer1[i];
-                uint8_t p0 = byte & 0x03;
-                uint8_t p1 = (byte >> 2) & 0x03;
-                uint8_t p2 = (byte >> 4) & 0x03;
-                uint8_t p3 = (byte >> 6) & 0x03;
-
-                uint32_t offsets[4] = {p0 * 4, p1 * 4, p2 * 4, p3 * 4};
-                uint8_t grays[4];
-
-                for (int k = 0; k < 4; k++) {
-                    uint8_t blue = colorTable[offsets[k] + 0];
-                    uint8_t green = colorTable[offsets[k] + 1];
-                    uint8_t red = colorTable[offsets[k] + 2];
-
-                    grays[k] =
-                        (uint8_t)(r * red + g * green + b * blue + 0.5f) / step;
-                    if (grays[k] >= color_table_count)
-                        grays[k] = color_table_count - 1;
-                }
-
-                buffer1[i] = (grays[3] << 6) | (grays[2] << 4) |
-                             (grays[1] << 2) | grays[0];
-            }
-        } else {
-            for (size_t i = 0; i < img->image_byte_count; i++) {
-                uint8_t index = buffer1[i];
-                uint32_t offset = index * 4;
-                uint8_t blue = colorTable[offset + 0];
-                uint8_t green = colorTable[offset + 1];
-                uint8_t red = colorTable[offset + 2];
-
-                float gray_f = r * red + g * green + b * blue;
-                uint8_t gray_level = (uint8_t)(gray_f + 0.5f);
-
-                uint8_t new_index = gray_level / step;
-                if (new_index >= color_table_count)
-                    new_index = color_table_count - 1;
-                buffer1[i] = new_index;
-            }
-        }
-
-        // Build grayscale color table
-        for (uint16_t i = 0; i < color_table_count; i++) {
-            uint8_t gray = i * step;
-            uint32_t offset = i * 4;
-            colorTable[offset + 0] = gray;
-            colorTable[offset + 1] = gray;
-            colorTable[offset + 2] = gray;
-            colorTable[offset + 3] = 0;
-        }
-    }
-}
+        // The pixels are remapped in one pass
+        uint8_t map[256];
+        gray_index_map(img, map);
+        palette_remap(img->pixel_data, img->image_byte_count, bit_depth, map);
+    }
+}
 
 // --- Helpers ---
 // Calculate padded row size in bytes
-static uint32_t row_size_bytes(int width_pixels, uint8_t bit_depth) {
-    size_t bits = width_pixels * bit_depth;
+static uint32_t row_size_bytes(uint32_t width_pixels, uint8_t bit_depth) {
+    uint64_t bits = (uint64_t)width_pixels * bit_depth;
     return (uint32_t)((bits + 31) / 32) * 4; // bytes
 }
 
@@ -612,40 +1237,13 @@ static uint32_t row_size_bytes(int width_pixels, uint8_t bit_depth) {
  */
 uint8_t read_pixel1(uint8_t *buffer1, int width, int height, int x, int y,
                     uint8_t bit_depth) {
-    // Calculate the number of bytes per row
-    size_t row_size = row_size_bytes(width, bit_depth);
-
-    // Calculate the starting byte index for the row
-    size_t byte_index = row_size * y;
-
-    switch (bit_depth) {
-    case 8:
-        // Direct access for 8-bit pixels
-        return buffer1[byte_index + x];
-
-    case 4: {
-        // Each byte holds two 4-bit pixels
-        uint8_t b = buffer1[byte_index + x / 2];
-        return (x % 2 == 0) ? (b >> 4) & 0x0F : b & 0x0F;
-    }
-
-    case 2: {
-        // Each byte holds four 2-bit pixels
-        uint8_t b = buffer1[byte_index + x / 4];
-        return (b >> (6 - 2 * (x % 4))) & 0x03;
-    }
-
-    case 1: {
-        // Each byte holds eight 1-bit pixels
-        uint8_t b = buffer1[byte_index + x / 8];
-        return (b >> (7 - (x % 8))) & 0x01;
-    }
-
-    default:
-        // Unsupported bit depth
-        assert(0 && "Unsupported bit depth");
+    // The kernel for the depth, op_kernels.h
+    Index_Get get = index_getter(bit_depth);
+    assert(get && "Unsupported bit depth");
+    if (!get) {
         return 0;
     }
+    return get(buffer1 + (size_t)row_size_bytes(width, bit_depth) * y, x);
 }
 
 /**
@@ -663,60 +1261,62 @@ uint8_t read_pixel1(uint8_t *buffer1, int width, int height, int x, int y,
  */
 void write_pixel1(uint8_t *buffer1, int width, int height, int x, int y,
                   uint8_t bit_depth, uint8_t value) {
-    // Calculate the number of bytes per row
-    size_t row_size = row_size_bytes(width, bit_depth);
-
-    // Calculate the starting byte index for the row
-    size_t byte_index = row_size * y;
+    Index_Set set = index_setter(bit_depth);
+    assert(set && "Unsupported bit depth");
+    if (set) {
+        set(buffer1 + (size_t)row_size_bytes(width, bit_depth) * y, x, value);
+    }
+}
 
-    switch (bit_depth) {
-    case 8:
-        // Direct write for 8-bit pixels
-        buffer1[byte_index + x] = value;
-        break;
+static uint8_t get_luminance(uint8_t r, uint8_t g, uint8_t b) {
+    return (uint8_t)(0.299f * r + 0.587f * g + 0.114f * b + 0.5f);
+}
 
-    case 4: {
-        // Each byte holds two 4-bit pixels
-        uint8_t *b = &buffer1[byte_index + x / 2];
-        *b = (x % 2 == 0) ? (*b & 0x0F) | (value << 4)
-                          : (*b & 0xF0) | (value & 0x0F);
-        break;
-    }
+// Replace the color table with black (index 0) and white (index 1).
+static void set_mono_palette(Image_Data *img) {
+    // Update color table: only black and white
+    memset(img->colorTable, 0,
+           img->ct_max_color_count * 4); // Clear all entries
 
-    case 2: {
-        // Each byte holds four 2-bit pixels
-        uint8_t *b = &buffer1[byte_index + x / 4];
-        uint8_t shift = 6 - 2 * (x % 4);
-        *b = (*b & ~(0x03 << shift)) | ((value & 0x03) << shift);
-        break;
-    }
+    // Index 0: black
+    img->colorTable[0] = 0;
+    img->colorTable[1] = 0;
+    img->colorTable[2] = 0;
+    img->colorTable[3] = 0;
 
-    case 1: {
-        // Each byte holds eight 1-bit pixels
-        uint8_t *b = &buffer1[byte_index + x / 8];
-        uint8_t shift = 7 - (x % 8);
-        *b = (*b & ~(1 << shift)) | ((value & 0x01) << shift);
-        break;
-    }
+    // Index 1: white
+    img->colorTable[4] = 255;
+    img->colorTable[5] = 255;
+    img->colorTable[6] = 255;
+    img->colorTable[7] = 0;
 
-    default:
-        // Unsupported bit depth
-        assert(0 && "Unsupported bit depth");
-    }
+    img->colors_used_actual = 2;
 }
 
-static uint8_t get_luminance(uint8_t r, uint8_t g, uint8_t b) {
-    return (uint8_t)(0.299f * r + 0.587f * g + 0.114f * b + 0.5f);
+// Index -> black (0) / white (1) by the luminance of its entry
+static void mono_index_map(const Image_Data *img, uint8_t threshold,
+                           uint8_t *map) {
+    uint8_t index_lum[256];
+    palette_luminance(img->colorTable, 1 << img->bit_depth_in, index_lum);
+    for (int i = 0; i < (1 << img->bit_depth_in); i++) {
+        map[i] = (index_lum[i] >= threshold) ? 1 : 0;
+    }
 }
 
 // --- Main Mono1 ---
 
 void mono1(Image_Data *img) {
-    printf("Converting to monochrome — %s\n",
-           img->dither ? "Dithering enabled" : "Thresholding only");
-
-    assert(img->bit_depth_in == 2 || img->bit_depth_in == 4 ||
-           img->bit_depth_in == 8);
+    DEBUG_LOG("Converting to monochrome — %s%s\n",
+           img->dither ? "Dithering enabled, " : "Thresholding only",
+           img->dither ? dither_name(img->dither_mode) : "");
+
+    if (img->bit_depth_in != 2 && img->bit_depth_in != 4 &&
+        img->bit_depth_in != 8) {
+        image_fail(img, IMAGECOPY_ERROR_UNSUPPORTED,
+                   "Error: Monochrome needs a 2, 4 or 8-bit image, got %d.\n",
+                   img->bit_depth_in);
+        return;
+    }
     assert(img->pixel_data != NULL);
     assert(img->colorTable != NULL);
 
@@ -725,230 +1325,254 @@ void mono1(Image_Data *img) {
     uint32_t height = img->height;
     uint8_t *buffer = img->pixel_data;
     uint8_t threshold = (uint8_t)(255 * img->mono_threshold + 0.5f);
+    Dither_Mode mode = img->dither ? img->dither_mode : DITHER_OFF;
 
-    if (img->dither) {
-        // Allocate brightness buffer
-        float *brightness = calloc(width * height, sizeof(float));
-        if (!brightness) {
-            fprintf(stderr, "Failed to allocate brightness buffer.\n");
-            return;
-        }
+    // Luminance of each palette entry
+    uint8_t index_lum[256];
+    palette_luminance(img->colorTable, 1 << bit_depth, index_lum);
 
-        // Compute luminance for each pixel
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                uint8_t index =
-                    read_pixel1(buffer, width, height, x, y, bit_depth);
-                uint32_t offset = index * 4;
-                uint8_t b = img->colorTable[offset + 0];
-                uint8_t g = img->colorTable[offset + 1];
-                uint8_t r = img->colorTable[offset + 2];
-                brightness[y * width + x] = get_luminance(r, g, b);
-            }
+    if (mode == DITHER_OFF) {
+        // A threshold only depends on the entry, one remap of the indices
+        uint8_t map[256];
+        mono_index_map(img, threshold, map);
+        palette_remap(buffer, img->image_byte_count, bit_depth, map);
+    } else {
+        // Luminance plane, dithered in place to 0 / 255 and packed back
+        uint32_t row_size = row_size_bytes(width, bit_depth);
+        uint8_t *lum = arena_alloc(img->arena, (size_t)width * height);
+        if (!lum) {
+            image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                       "Error: Could not allocate the luminance buffer.\n");
+            return;
         }
+        repack_rows(buffer, row_size, bit_depth, lum, width, 8, width, height,
+                    index_lum);
 
-        // Apply Floyd–Steinberg dithering
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                int i = y * width + x;
-                float old = brightness[i];
-                uint8_t mono = (old >= 128.0f) ? 1 : 0;
-                float new_val = mono * 255.0f;
-                float err = old - new_val;
-
-                brightness[i] = new_val;
-                write_pixel1(buffer, width, height, x, y, bit_depth, mono);
-
-                // Propagate error to neighbors
-                if (x + 1 < width)
-                    brightness[i + 1] += err * 7 / 16;
-                if (y + 1 < height) {
-                    if (x > 0)
-                        brightness[i + width - 1] += err * 3 / 16;
-                    brightness[i + width] += err * 5 / 16;
-                    if (x + 1 < width)
-                        brightness[i + width + 1] += err * 1 / 16;
-                }
+        if (dither_is_diffusion(mode)) {
+            dither_diffuse_mono(lum, width, lum, width, width, height, mode,
+                                img->dither_serpentine);
+        } else {
+            // Ordered dithering, a compare against the tile's threshold
+            // row. Rows are independent.
+#pragma omp parallel for schedule(static)
+            for (int y = 0; y < (int)height; y++) {
+                uint8_t pattern[DITHER_PATTERN];
+                uint8_t *row = lum + (size_t)y * width;
+                dither_pattern_row(mode, threshold, y, pattern);
+                dither_threshold_row(row, row, width, pattern);
             }
         }
 
-        free(brightness);
-    } else {
-        // Simple thresholding
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                uint8_t index =
-                    read_pixel1(buffer, width, height, x, y, bit_depth);
-                uint32_t offset = index * 4;
-                uint8_t b = img->colorTable[offset + 0];
-                uint8_t g = img->colorTable[offset + 1];
-                uint8_t r = img->colorTable[offset + 2];
-                uint8_t lum = get_luminance(r, g, b);
-                uint8_t mono = (lum >= threshold) ? 1 : 0;
-                write_pixel1(buffer, width, height, x, y, bit_depth, mono);
-            }
-        }
+        // 0 / 255 -> index 0 / 1
+        uint8_t to_index[256] = {0};
+        to_index[255] = 1;
+        repack_rows(lum, width, 8, buffer, row_size, bit_depth, width, height,
+                    to_index);
     }
 
-    // Update color table: only black and white
-    memset(img->colorTable, 0,
-           img->ct_max_color_count * 4); // Clear all entries
+    set_mono_palette(img);
 
-    // Index 0: black
-    img->colorTable[0] = 0;
-    img->colorTable[1] = 0;
-    img->colorTable[2] = 0;
-    img->colorTable[3] = 0;
+    DEBUG_LOG("Monochrome conversion complete using %s mode.\n",
+           img->dither ? "dither" : "threshold");
+}
 
-    // Index 1: white
-    img->colorTable[4] = 255;
-    img->colorTable[5] = 255;
-    img->colorTable[6] = 255;
-    img->colorTable[7] = 0;
+// --set-depth 1: threshold or dither straight into packed 1-bit rows with a
+// black / white table, no 24-bit result and no palette reduction. The
+// luminance of each row is written over the start of the row itself, so
+// the 1/24 size output is the only new buffer.
+static void mono3_to_1bit(Image_Data *img) {
+    uint32_t width = img->width;
+    uint32_t height = img->height;
+    uint32_t row_size_new = row_size_bytes(width, 1);
+    uint8_t threshold = (uint8_t)(WHITE * img->mono_threshold + 0.5f);
+    Dither_Mode mode = img->dither ? img->dither_mode : DITHER_OFF;
+
+    uint8_t *packed =
+        create_buffer1(img->arena, (size_t)row_size_new * height);
+    uint8_t *color_table = create_buffer1(img->arena, ct_byte_count(1));
+    if (!packed || !color_table) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                   "Error: Could not allocate the 1-bit image.\n");
+        return;
+    }
 
-    img->colors_used_actual = 2;
-    // img->ct_max_color_count = 0;
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < (int)height; y++) {
+        uint8_t *row = img->pixelDataRows[y];
+        for (uint32_t x = 0; x < width; x++) {
+            row[x] = get_luminance(row[x * 3 + 2], row[x * 3 + 1],
+                                   row[x * 3 + 0]);
+        }
+    }
 
-    printf("Monochrome conversion complete using %s mode.\n",
-           img->dither ? "dither" : "threshold");
+    if (dither_is_diffusion(mode)) {
+        // Top-down, the stride is negative over the bottom-up rows
+        ptrdiff_t stride =
+            (height > 1) ? img->pixelDataRows[1] - img->pixelDataRows[0] : 0;
+        dither_diffuse_mono(img->pixelDataRows[0], stride,
+                            img->pixelDataRows[0], stride, width, height,
+                            mode, img->dither_serpentine);
+    }
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < (int)height; y++) {
+        uint8_t *row = img->pixelDataRows[y];
+        if (!dither_is_diffusion(mode)) {
+            uint8_t pattern[DITHER_PATTERN];
+            dither_pattern_row(mode, threshold, y, pattern);
+            dither_threshold_row(row, row, width, pattern);
+        }
+        // Same bottom-up row order as the 24-bit data
+        dither_pack_row(row, packed + (size_t)(height - 1 - y) * row_size_new,
+                        width);
+    }
+
+    img->pixelDataRows = NULL;
+    img->pixel_data = packed;
+    img->colorTable = color_table;
+
+    img->bit_depth_in = 1;
+    img->colorMode = INDEXED;
+    img->row_size_bytes = row_size_new;
+    img->image_byte_count = (size_t)row_size_new * height;
+    img->ct_max_color_count = ct_max_color_count(1);
+    set_mono_palette(img);
 }
 
 void mono3(Image_Data *img) {
-    printf("Mono3 - %s\n",
-           img->dither ? "Dithering enabled" : "Thresholding only");
+    DEBUG_LOG("Mono3 - %s%s\n",
+           img->dither ? "Dithering enabled, " : "Thresholding only",
+           img->dither ? dither_name(img->dither_mode) : "");
 
     assert(img->bit_depth_in == 24);
     assert(img->pixelDataRows != NULL);
 
+    if (img->bit_depth_out == 1) {
+        mono3_to_1bit(img);
+        return;
+    }
+
     uint32_t width = img->width;
     uint32_t height = img->height;
     // const uint8_t WHITE = 255;
 
-    if (img->dither) {
-        // Allocate luminance buffer
-        float *brightness = calloc(width * height, sizeof(float));
+    Dither_Mode mode = img->dither ? img->dither_mode : DITHER_OFF;
+
+    if (dither_is_diffusion(mode)) {
+        // Luminance plane, diffused in place to 0 / 255
+        uint8_t *lum = arena_alloc(img->arena, (size_t)width * height);
+        if (!lum) {
+            image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                       "Error: Could not allocate the luminance buffer.\n");
+            return;
+        }
         for (uint32_t y = 0; y < height; y++) {
+            const uint8_t *row = img->pixelDataRows[y];
             for (uint32_t x = 0; x < width; x++) {
-                uint8_t r = img->pixelDataRows[y][x * 3 + 0];
-                uint8_t g = img->pixelDataRows[y][x * 3 + 1];
-                uint8_t b = img->pixelDataRows[y][x * 3 + 2];
-                brightness[y * width + x] = get_luminance(r, g, b);
+                lum[(size_t)y * width + x] = get_luminance(
+                    row[x * 3 + 2], row[x * 3 + 1], row[x * 3 + 0]);
             }
         }
 
-        // Apply Floyd–Steinberg dithering with boundary checks
+        dither_diffuse_mono(lum, width, lum, width, width, height, mode,
+                            img->dither_serpentine);
+
         for (uint32_t y = 0; y < height; y++) {
+            uint8_t *row = img->pixelDataRows[y];
             for (uint32_t x = 0; x < width; x++) {
-                size_t i = y * width + x;
-                float old = brightness[i];
-                uint8_t new_pixel = (old >= 128.0f) ? WHITE : BLACK;
-                float error = old - new_pixel;
-                brightness[i] = new_pixel;
-
-                // Set pixel in pixelDataRows
-                for (int c = 0; c < 3; c++) {
-                    img->pixelDataRows[y][x * 3 + c] = new_pixel;
-                }
-
-                // Diffuse error to neighbors if within bounds
-                if (x + 1 < width)
-                    brightness[i + 1] += error * 7 / 16;
-                if (x > 0 && y + 1 < height)
-                    brightness[i + width - 1] += error * 3 / 16;
-                if (y + 1 < height)
-                    brightness[i + width] += error * 5 / 16;
-                if (x + 1 < width && y + 1 < height)
-                    brightness[i + width + 1] += error * 1 / 16;
+                uint8_t v = lum[(size_t)y * width + x];
+                row[x * 3 + 0] = v;
+                row[x * 3 + 1] = v;
+                row[x * 3 + 2] = v;
             }
         }
-
-        free(brightness);
-        brightness = NULL;
     } else {
-        // Threshold-only conversion
+        // Thresholding or ordered dithering, one compare per pixel against
+        // a flat or a tiled threshold row. Rows are independent.
         uint8_t threshold = (uint8_t)(WHITE * img->mono_threshold + 0.5f);
-        for (uint32_t y = 0; y < height; y++) {
-            for (uint32_t x = 0; x < width; x++) {
-                uint8_t r = img->pixelDataRows[y][x * 3 + 0];
-                uint8_t g = img->pixelDataRows[y][x * 3 + 1];
-                uint8_t b = img->pixelDataRows[y][x * 3 + 2];
-                float gray = get_luminance(r, g, b);
-                uint8_t output = (gray >= threshold) ? WHITE : BLACK;
-
-                for (int c = 0; c < 3; c++) {
-                    img->pixelDataRows[y][x * 3 + c] = output;
+        // Set by any thread without its row, reported once after the loop
+        bool lum_failed = false;
+
+#pragma omp parallel
+        {
+            uint8_t *lum = malloc(width ? width : 1);
+            uint8_t pattern[DITHER_PATTERN];
+
+#pragma omp for schedule(static)
+            for (int y = 0; y < (int)height; y++) {
+                if (!lum) {
+                    continue;
+                }
+                uint8_t *row = img->pixelDataRows[y];
+                for (uint32_t x = 0; x < width; x++) {
+                    lum[x] = get_luminance(row[x * 3 + 2], row[x * 3 + 1],
+                                           row[x * 3 + 0]);
                 }
+                dither_pattern_row(mode, threshold, y, pattern);
+                dither_threshold_row(lum, lum, width, pattern);
+                for (uint32_t x = 0; x < width; x++) {
+                    row[x * 3 + 0] = lum[x];
+                    row[x * 3 + 1] = lum[x];
+                    row[x * 3 + 2] = lum[x];
+                }
+            }
+            if (!lum) {
+#pragma omp atomic write
+                lum_failed = true;
             }
+            free(lum);
+        }
+        if (lum_failed) {
+            image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                       "Error: Could not allocate the luminance rows.\n");
+            return;
         }
     }
     img->colors_used_actual = 2;
 }
 
+static void bright_offset134(Image_Data *img, int brightness_offset);
+
 void bright134(Image_Data *img) {
     assert(!!img->bright_value ^ !!img->bright_percent);
 
-    const uint16_t bit_depth = img->bit_depth_in;
-
     int brightness_offset = img->bright_value
                                 ? img->bright_value
                                 : (int)(img->bright_percent * 255.0f);
 
-    int palette_entries = img->colors_used_actual;
+    bright_offset134(img, brightness_offset);
+}
 
-    if (palette_entries == 0) {
-        if (bit_depth == 1)
-            palette_entries = 2;
-        else if (bit_depth == 4)
-            palette_entries = 16;
-        else if (bit_depth == 8)
-            palette_entries = 256;
-        else
-            palette_entries = 0; // 24/32-bit images have no palette
-    }
+static void bright_offset134(Image_Data *img, int brightness_offset) {
+    const uint16_t bit_depth = img->bit_depth_in;
+
+    // The whole table, as inv1 and sepia1 do, never a count taken from the
+    // file. 24-bit images have no palette.
+    int palette_entries =
+        img->colorMode == INDEXED ? ct_max_color_count(bit_depth) : 0;
 
     // -------------------------
     // PALETTE BRIGHTNESS PATH
     // -------------------------
     if (palette_entries > 0) {
-        int total_bytes = palette_entries * 4; // BGRA
-
-        for (int i = 0; i < total_bytes; i++) {
-
-            // Skip alpha channel
-            if ((i % 4) == 3)
-                continue;
-
-            int v = img->colorTable[i] + brightness_offset;
-
-            if (v < 0)
-                v = 0;
-            else if (v > 255)
-                v = 255;
-
-            img->colorTable[i] = (uint8_t)v;
-        }
+        Lut3 brightened;
+        lut_brightness(brightened.channel[0], brightness_offset);
+        lut3_from_lut(&brightened, brightened.channel[0]);
+        palette_apply_lut3(img->colorTable, palette_entries, &brightened);
     }
 
     // -------------------------
     // TRUE-COLOR BRIGHTNESS PATH
     // -------------------------
     else {
-        bool is_24bit = (bit_depth == 24);
-
-        for (int i = 0; i < img->image_byte_count; i++) {
-
-            // Skip alpha in 32-bit images
-            if (is_24bit || !((i % 4) == 3)) {
-
-                int v = img->pixel_data[i] + brightness_offset;
-
-                if (v < 0)
-                    v = 0;
-                else if (v > 255)
-                    v = 255;
-
-                img->pixel_data[i] = (uint8_t)v;
-            }
+        uint8_t brightened[LUT_SIZE];
+        lut_brightness(brightened, brightness_offset);
+        if (img->layout == LAYOUT_PLANAR) {
+            Lut3 brightened3;
+            lut3_from_lut(&brightened3, brightened);
+            apply_lut_planes(img, &brightened3);
+        } else {
+            apply_lut1(img->pixel_data, img->image_byte_count, brightened);
         }
     }
 }
@@ -959,26 +1583,27 @@ void hist1(Image_Data *img) {
     // img->HIST_RANGE_MAX = (1 << img->bit_depth); // 256 for 8 bit images
     img->HIST_RANGE_MAX = 256; // 256 for 8 or less bit images
     img->hist_max_value1 = 0;
-    printf("HIST_RANGE_MAX: %d\n", img->HIST_RANGE_MAX);
-    //  uint_fast8_t *hist_temp = NULL;
+    DEBUG_LOG("HIST_RANGE_MAX: %d\n", img->HIST_RANGE_MAX);
     if (!img->histogram1) {
         img->histogram1 =
-            (uint8_t *)calloc(img->HIST_RANGE_MAX, sizeof(uint8_t));
-        //(uint_fast32_t *)calloc(img->HIST_RANGE_MAX,
-        // sizeof(uint_fast32_t));
+            arena_calloc(img->arena, img->HIST_RANGE_MAX, sizeof(uint64_t));
     } else {
-        fprintf(stderr, "Caution: Histogram already populated.\n");
+        // Counted before an earlier step (equalize) changed the pixels
+        memset(img->histogram1, 0, img->HIST_RANGE_MAX * sizeof(uint64_t));
     }
     if (img->histogram1 == NULL) {
-        fprintf(stderr, "Error: Could not allocate memory for histogram.\n");
-        exit(EXIT_FAILURE);
+        image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                   "Error: Could not allocate memory for histogram.\n");
+        return;
     }
 
     // Create histogram / count pixels
     for (size_t i = 0; i < img->image_byte_count; i++) {
         img->histogram1[img->pixel_data[i]]++;
-        if (img->histogram1[img->pixel_data[i]] > img->hist_max_value1) {
-            img->hist_max_value1 = img->histogram1[img->pixel_data[i]];
+    }
+    for (int i = 0; i < img->HIST_RANGE_MAX; i++) {
+        if (img->histogram1[i] > img->hist_max_value1) {
+            img->hist_max_value1 = img->histogram1[i];
         }
     }
 }
@@ -986,11 +1611,18 @@ void hist1(Image_Data *img) {
 // Creates a Creates a normalized histogram [0.0..1.0], from a histogram
 // [0..255] Takes a histogram or calculates it from img if hist is NULL
 void hist1_normalized(Image_Data *img) {
-    if (!img->histogram1) {
-        hist1(img);
+    hist1(img);
+    if (img->status) {
+        return;
     }
 
-    img->histogram_n = (float_t *)calloc(img->HIST_RANGE_MAX, sizeof(float_t));
+    img->histogram_n =
+        arena_calloc(img->arena, img->HIST_RANGE_MAX, sizeof(float_t));
+    if (!img->histogram_n) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                   "Error: Could not allocate memory for histogram.\n");
+        return;
+    }
     // Normalize [0..1]
     for (int i = 0; i < img->HIST_RANGE_MAX; i++) {
         img->histogram_n[i] =
@@ -999,54 +1631,17 @@ void hist1_normalized(Image_Data *img) {
 }
 
 void equal1(Image_Data *img) {
-    if (!img->histogram1) {
-        hist1(img);
-    }
-    const uint16_t MAX = img->HIST_RANGE_MAX; // 256
-                                              //
-    // cumilative distribution function
-    uint32_t *cdf = (uint32_t *)calloc(MAX, sizeof(uint32_t));
-    uint8_t *equalized = (uint8_t *)calloc(MAX, sizeof(uint8_t));
-    if (!cdf || !equalized) {
-        printf("cdf or equalized not initialized.\n");
-        exit(EXIT_FAILURE);
+    // Counted again, an earlier step may have changed the pixels
+    hist1(img);
+    if (img->status) {
+        return;
     }
 
-    uint16_t i = 0; // index
-    cdf[0] = img->histogram1[0];
-    for (i = 1; i < MAX; i++) {
-        cdf[i] = img->histogram1[i] + cdf[i - 1];
-    }
+    uint8_t equalized[LUT_SIZE];
+    lut_equalize(equalized, img->histogram1);
 
-    // Find the minimum (first) non-zero CDF value
-    uint32_t min_cdf = cdf[0];
-    for (i = 1; min_cdf == 0 && i < MAX; i++) {
-        if (cdf[i] != 0) {
-            min_cdf = cdf[i];
-        }
-    }
-
-    // Normalize the CDF to map the pixel values to [0, 255]
-    for (i = 0; i < MAX; i++) {
-        if (cdf[i] >= min_cdf) {
-            equalized[i] =
-                (uint8_t)(((float_t)(MAX - 1.0) * (cdf[i] - min_cdf)) /
-                          (cdf[MAX - 1] - min_cdf));
-        } else {
-            equalized[i] = 0;
-        }
-    }
-    for (int i = 0; i < img->HIST_RANGE_MAX; i++) {
-    }
     //  Map the equalized values back to image data
-    for (size_t i = 0; i < img->image_byte_count; i++) {
-        img->pixel_data[i] = equalized[img->pixel_data[i]];
-    }
-
-    free(cdf); //(img->histogram)
-    cdf = NULL;
-    free(equalized);
-    equalized = NULL;
+    apply_lut1(img->pixel_data, img->image_byte_count, equalized);
 }
 
 void hist3(Image_Data *img) {
@@ -1056,854 +1651,645 @@ void hist3(Image_Data *img) {
         img->hist_max_value3[2] = 0;
 
     if (!img->histogram3) {
-        create_buffer3(&img->histogram3, 3, img->HIST_RANGE_MAX);
+        img->histogram3 = arena_alloc(img->arena, 3 * sizeof(uint64_t *));
+        if (!img->histogram3) {
+            image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                       "Error: Could not allocate memory for histogram.\n");
+            return;
+        }
+        for (int rgb = 0; rgb < 3; rgb++) {
+            img->histogram3[rgb] = arena_calloc(
+                img->arena, img->HIST_RANGE_MAX, sizeof(uint64_t));
+            if (!img->histogram3[rgb]) {
+                image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                           "Error: Could not allocate memory for histogram.\n");
+                return;
+            }
+        }
+    } else {
+        for (int rgb = 0; rgb < 3; rgb++) {
+            memset(img->histogram3[rgb], 0,
+                   img->HIST_RANGE_MAX * sizeof(uint64_t));
+        }
     }
 
-    uint8_t val = 0;
-
-    for (uint8_t rgb = 0; rgb < 3; rgb++) {
-        // Create histogram / count pixels
+    uint64_t *hist_b = img->histogram3[0];
+    uint64_t *hist_g = img->histogram3[1];
+    uint64_t *hist_r = img->histogram3[2];
 
+    if (img->layout == LAYOUT_PLANAR) {
+        // One contiguous plane per channel
+        for (int rgb = 0; rgb < 3; rgb++) {
+            uint64_t *hist = img->histogram3[rgb];
+            for (size_t y = 0; y < img->height; y++) {
+                const uint8_t *row =
+                    img->planes[rgb] + y * img->plane_stride;
+                for (size_t x = 0; x < img->width; x++) {
+                    hist[row[x]]++;
+                }
+            }
+        }
+    } else {
+        // Create histogram / count pixels, all three channels in one pass
         for (size_t y = 0; y < img->height; y++) {
+            const uint8_t *row = img->pixelDataRows[y];
             for (size_t x = 0; x < 3 * img->width; x += 3) {
+                hist_b[row[x + 0]]++;
+                hist_g[row[x + 1]]++;
+                hist_r[row[x + 2]]++;
+            }
+        }
+    }
 
-                val = img->pixelDataRows[y][x + rgb];
-                img->histogram3[rgb][val]++;
-
-                if (val > img->hist_max_value3[rgb]) {
-                    img->hist_max_value3[rgb] = val;
-                }
+    for (uint8_t rgb = 0; rgb < 3; rgb++) {
+        for (int i = 0; i < img->HIST_RANGE_MAX; i++) {
+            if (img->histogram3[rgb][i] > img->hist_max_value3[rgb]) {
+                img->hist_max_value3[rgb] = img->histogram3[rgb][i];
             }
         }
     }
 }
 
 void equal3(Image_Data *img) {
-    if (!img->histogram3) {
-        hist3(img);
-    }
-    const uint16_t MAX = img->HIST_RANGE_MAX; // 256
-
-    // cumilative distribution function
-    uint32_t *cdf = (uint32_t *)calloc(MAX, sizeof(uint32_t));
-    uint8_t *equalized = (uint8_t *)calloc(MAX, sizeof(uint8_t));
-    if (!cdf || !equalized) {
-        printf("cdf or equalized not initialized.\n");
-        exit(EXIT_FAILURE);
+    // Counted again, an earlier step may have changed the pixels
+    hist3(img);
+    if (img->status) {
+        return;
     }
 
-    uint16_t i; // index
-
+    Lut3 equalized;
     for (uint8_t rgb = 0; rgb < 3; rgb++) {
+        lut_equalize(equalized.channel[rgb], img->histogram3[rgb]);
+    }
 
-        cdf[0] = img->histogram3[rgb][0];
-        for (i = 1; i < MAX; i++) {
-            cdf[i] = img->histogram3[rgb][i] + cdf[i - 1];
-        }
-
-        // Find the minimum (first) non-zero CDF value
-        uint32_t min_cdf = cdf[0];
-        for (i = 1; min_cdf == 0 && i < MAX; i++) {
-            if (cdf[i] != 0) {
-                min_cdf = cdf[i];
-            }
-        }
-
-        // Normalize the CDF to map the pixel values to [0, 255]
-        for (i = 0; i < MAX; i++) {
-            if (cdf[i] >= min_cdf) {
-                equalized[i] =
-                    (uint8_t)(((float_t)(MAX - 1.0) * (cdf[i] - min_cdf)) /
-                              (cdf[MAX - 1] - min_cdf));
-            } else {
-                equalized[i] = 0;
-            }
-        }
-        printf("Equilizer: \n");
-        for (int i = 0; i < img->HIST_RANGE_MAX; i++) {
-            printf("%d ", equalized[i]);
-        }
-        //  Map the equalized values back to image data
-        for (uint32_t y = 0; y < img->height; y++) {
-            for (uint32_t x = 0; x < 3 * img->width; x += 3) {
-                img->pixelDataRows[y][x + rgb] =
-                    equalized[img->pixelDataRows[y][x + rgb]];
-            }
-        }
-    } // end of rgb
-
-    free(cdf); //(img->histogram)
-    cdf = NULL;
-    free(equalized);
-    equalized = NULL;
+    //  Map the equalized values back to image data
+    if (img->layout == LAYOUT_PLANAR) {
+        apply_lut_planes(img, &equalized);
+    } else {
+        apply_lut3(img->pixelDataRows, img->width, img->height, &equalized);
+    }
 }
 
 void inv1(Image_Data *img) {
-    printf("inv13\n");
+    DEBUG_LOG("inv13\n");
 
-    // simple grayscale invert, 255 - color, ignores invert mode setting.
+    // simple invert, 255 - color, ignores invert mode setting. Only the
+    // color table changes, the indices stay.
     if (img->colorMode == INDEXED) {
-        for (int i = 0; i < img->image_byte_count; i++) {
-            img->pixel_data[i] = 255 - img->pixel_data[i];
-        }
+        Lut3 inverted;
+        lut_invert(inverted.channel[0]);
+        lut3_from_lut(&inverted, inverted.channel[0]);
+        palette_apply_lut3(img->colorTable,
+                           ct_max_color_count(img->bit_depth_in), &inverted);
     }
 }
 
+void sepia1(Image_Data *img) {
+    DEBUG_LOG("Sepia, %d-bit indexed\n", img->bit_depth_in);
+    palette_sepia(img->colorTable, ct_max_color_count(img->bit_depth_in));
+}
+
 void inv_rgb3(Image_Data *img) {
     // RGB Simple invert for each RGB value and also the DEFAULT mode.
-    for (int y = 0; y < img->height; y++) {
-        for (int x = 0; x < img->width * 3; x += 3) {
-            for (uint8_t rgb = 0; rgb <= 3; rgb++) {
-                img->pixelDataRows[y][x + rgb] =
-                    255 - img->pixelDataRows[y][x + rgb];
-            }
-        }
+    Lut3 inverted;
+    lut_invert(inverted.channel[0]);
+    lut3_from_lut(&inverted, inverted.channel[0]);
+    if (img->layout == LAYOUT_PLANAR) {
+        apply_lut_planes(img, &inverted);
+    } else {
+        apply_lut3(img->pixelDataRows, img->width, img->height, &inverted);
     }
 
 } // HSV based invert
 
 void inv_hsv3(Image_Data *img) {
-    float r, g, b, max, v, scale;
     for (int y = 0; y < img->height; y++) {
         for (int x = 0; x < img->width * 3; x += 3) {
-
-            r = img->pixelDataRows[y][x + 0] / 255.0;
-            g = img->pixelDataRows[y][x + 1] / 255.0;
-            b = img->pixelDataRows[y][x + 2] / 255.0;
-
-            // Convert RGB to HSV
-            max = fmaxf(fmaxf(r, g), b);
-            // v = max, invert the value v
-            v = 1.0 - max;
-
-            // Convert back to RGB
-            scale = v / max;
-
-            img->pixelDataRows[y][x + 0] = (uint8_t)(r * scale * 255);
-            img->pixelDataRows[y][x + 1] = (uint8_t)(g * scale * 255);
-            img->pixelDataRows[y][x + 2] = (uint8_t)(b * scale * 255);
+            pixel_inv_hsv(img->pixelDataRows[y] + x);
         }
     }
 }
-void flip13(Image_Data *img) {
-
-    enum Dir dir = img->direction;
-
-    uint32_t width = img->width;
-    uint32_t height = img->height;
-    uint32_t image_byte_count = img->image_byte_count;
-    uint32_t rows = height;
-    uint32_t cols = width;
-
-    // height / rows / y / v
-    // width / cols / x / h
-    uint8_t *output_buffer1 = NULL;
-    uint8_t **output_buffer3 = NULL;
-
-    if (img->colorMode == INDEXED) {
-        output_buffer1 = create_buffer1(image_byte_count);
-
-        if (dir == H) {
-            for (int r = 0; r < rows; r++) {
-                for (int c = 0; c < cols; c++) {
-                    output_buffer1[r * cols + (cols - 1 - c)] =
-                        img->pixel_data[r * cols + c];
-                }
-            }
-        } else if (dir == V) {
-            for (int r = 0; r < rows; r++) {
-                for (int c = 0; c < cols; c++) {
-                    output_buffer1[(rows - 1 - r) * cols + c] =
-                        img->pixel_data[r * cols + c];
-                }
+// Output buffer of byte_count bytes for an op that cannot work in place,
+// the spare of the image's ping-pong pair, zeroed if 'zero'. It only
+// grows, the next such op reuses it. For 24-bit images spare_rows are set
+// up for rows of row_size bytes, bottom-up like a loaded image.
+static uint8_t *spare_buffer(Image_Data *img, size_t byte_count,
+                             uint32_t height, uint32_t row_size, bool zero) {
+    if (byte_count > img->spare_bytes) {
+        img->spare = arena_alloc(img->arena, byte_count);
+        img->spare_bytes = img->spare ? byte_count : 0;
+        if (!img->spare) {
+            return NULL;
+        }
+    }
+    if (zero) {
+        memset(img->spare, 0, byte_count);
+    }
+    if (img->colorMode == RGB24) {
+        if (height > img->spare_row_count) {
+            img->spare_rows =
+                arena_alloc(img->arena, (size_t)height * sizeof(uint8_t *));
+            img->spare_row_count = img->spare_rows ? height : 0;
+            if (!img->spare_rows) {
+                return NULL;
             }
         }
+        for (uint32_t y = 0; y < height; y++) {
+            img->spare_rows[y] =
+                img->spare + (size_t)(height - 1 - y) * row_size;
+        }
+    }
+    return img->spare;
+}
 
-        free(img->pixel_data);
-        img->pixel_data = output_buffer1;
+// The spare holds the result: it becomes the image and the old pixels,
+// byte_count bytes in height rows, the next spare
+static void swap_spare(Image_Data *img, size_t byte_count, uint32_t height) {
+    uint8_t *pixels = img->pixel_data;
+    uint8_t **rows = img->pixelDataRows;
+    img->pixel_data = img->spare;
+    if (img->colorMode == RGB24) {
+        img->pixelDataRows = img->spare_rows;
+    }
+    img->spare = pixels;
+    img->spare_bytes = byte_count;
+    img->spare_rows = rows;
+    img->spare_row_count = rows ? height : 0;
+}
 
-    } else if (img->colorMode == RGB24) {
-        create_buffer3(&output_buffer3, height, img->row_size_bytes);
+// Rows of 'row_size' bytes of a buffer in BMP order, top row first like
+// pixelDataRows. NULL if the array could not be allocated.
+static uint8_t **top_down_rows(Arena *arena, uint8_t *buffer,
+                               uint32_t row_size, uint32_t height) {
+    uint8_t **rows = arena_alloc(arena, (size_t)height * sizeof(uint8_t *));
+    if (!rows) {
+        return NULL;
+    }
+    for (uint32_t y = 0; y < height; y++) {
+        rows[y] = buffer + (size_t)(height - 1 - y) * row_size;
+    }
+    return rows;
+}
 
-        if (dir == H) {
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width * 3; x += 3) {
-                    for (int rgb = 0; rgb < 3; rgb++) {
-                        output_buffer3[y][x + rgb] =
-                            img->pixelDataRows[y][img->row_size_bytes -
-                                                  (x + 3) + rgb];
-                    }
-                }
-            }
-        } else if (dir == V) {
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width * 3; x += 3) {
-                    for (int rgb = 0; rgb < 3; rgb++) {
-                        output_buffer3[y][x + rgb] =
-                            img->pixelDataRows[height - (y + 1)][x + rgb];
-                    }
-                }
+// Move the pixels of the image, org_width x org_height in rows of
+// org_row_size bytes as it was before rot13 or flip13 set its new size,
+// into the spare, which then becomes the image. The pixel array is sized
+// again from the new rows. Indexed pixels are moved as 8-bit indices,
+// rows walked by their padded stride. 1, 2 and 4-bit indices are unpacked
+// to a byte each first and packed again after.
+static void move_pixels(Image_Data *img, enum Move move, uint32_t org_width,
+                        uint32_t org_height, uint32_t org_row_size,
+                        const char *error) {
+    bool rgb = img->colorMode == RGB24;
+    uint8_t depth = img->bit_depth_in;
+    Move_Kernel kernel = move_kernel(move, rgb ? 3 : 1);
+    if (!kernel) {
+        image_fail(img, IMAGECOPY_ERROR_UNSUPPORTED, error);
+        return;
+    }
+    size_t org_bytes = img->image_byte_count;
+    img->image_byte_count = (size_t)img->row_size_bytes * img->height;
+    uint8_t **src = img->pixelDataRows;
+    uint8_t **dst = NULL;
+    uint8_t *packed = NULL; // sub-byte: the spare, moved holds the bytes
+    uint8_t *moved = NULL;
+    if (rgb) {
+        // The spare in BMP row order, with the new row size
+        if (spare_buffer(img, img->image_byte_count, img->height,
+                         img->row_size_bytes, true)) {
+            dst = img->spare_rows;
+        }
+    } else {
+        uint8_t *from = img->pixel_data;
+        uint32_t from_row_size = org_row_size;
+        uint32_t to_row_size = img->row_size_bytes;
+        moved = spare_buffer(img, img->image_byte_count, 0, 0, true);
+        if (moved && depth < 8) {
+            packed = moved;
+            from = arena_alloc(img->arena, (size_t)org_width * org_height);
+            moved = arena_alloc(img->arena, (size_t)img->width * img->height);
+            from_row_size = org_width;
+            to_row_size = img->width;
+            if (from && repack_rows(img->pixel_data, org_row_size, depth, from,
+                                    org_width, 8, org_width, org_height,
+                                    NULL) < 0) {
+                from = NULL;
             }
         }
+        src = from ? top_down_rows(img->arena, from, from_row_size,
+                                   org_height)
+                   : NULL;
+        dst = moved ? top_down_rows(img->arena, moved, to_row_size,
+                                    img->height)
+                    : NULL;
+    }
+    if (!src || !dst) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY, error);
+        return;
+    }
 
-        for (int y = 0; y < height; y++) {
-            free(img->pixelDataRows[y]);
-        }
-        free(img->pixelDataRows);
+    kernel(src, dst, org_width, org_height);
+    if (packed && repack_rows(moved, img->width, 8, packed,
+                              img->row_size_bytes, depth, img->width,
+                              img->height, NULL) < 0) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY, error);
+        return;
+    }
+    swap_spare(img, org_bytes, org_height);
+}
 
-        img->pixelDataRows = output_buffer3;
-    } else {
-        fprintf(stderr, "Error: Flip buffer creation.\n");
-        exit(EXIT_FAILURE);
+void flip13(Image_Data *img) {
+    if (img->direction != H && img->direction != V) {
+        return;
     }
+    move_pixels(img, img->direction == H ? MOVE_FLIP_H : MOVE_FLIP_V,
+                img->width, img->height, img->row_size_bytes,
+                "Error: Flip buffer creation.\n");
 }
 
 void rot13(Image_Data *img) {
-
-    uint32_t org_width = 0;
-    uint32_t org_height = 0;
-    uint32_t row_size_bytes = 0;
     const int16_t degrees = img->degrees;
-
-    // if we are rotating into a plane the flips the width and height.
-    // else width and height are the same
-    if (degrees == 90 || degrees == -270 || degrees == 270 || degrees == -90) {
-        org_height = img->height;
-        org_width = img->width;
-        img->width = org_height; // swap width and height dimensions
-        img->height = org_width;
-
-        img->row_size_bytes = row_size_bytes =
-            (img->width * 3 + 3) & ~3; // new padded width
-
-        // Update header with rotated dimensions for output
-        //*(int *)&img->header[18] = (uint32_t)img->width;
-        //*(int *)&img->header[22] = (uint32_t)img->height;
-
+    enum Move move;
+    if (degrees == 90 || degrees == -270) {
+        move = MOVE_ROT_90;
+    } else if (degrees == 270 || degrees == -90) {
+        move = MOVE_ROT_270;
     } else if (degrees == 180 || degrees == -180) {
-        org_width = img->width; // Read in normal values for local variables
-        org_height = img->height;
-        row_size_bytes = img->row_size_bytes;
+        move = MOVE_ROT_180;
     } else {
         return;
     }
-    // For transformation algorithm, pre-transform.
-    uint32_t image_size = img->image_byte_count;
-    uint32_t rows = org_height;
-    uint32_t cols = org_width;
 
-    // height / rows / y
-    // width / cols / x
-    uint8_t *output_buffer1 = NULL;
-    uint8_t **output_buffer3 = NULL;
+    const uint32_t org_width = img->width;
+    const uint32_t org_height = img->height;
+    const uint32_t org_row_size = img->row_size_bytes;
+    if (move != MOVE_ROT_180) {
+        // A quarter turn swaps width and height, the rows are padded for
+        // the new width
+        img->width = org_height;
+        img->height = org_width;
+        img->row_size_bytes = row_size_bytes(
+            img->width, img->colorMode == RGB24 ? 24 : img->bit_depth_in);
+    }
+    move_pixels(img, move, org_width, org_height, org_row_size,
+                "Error: Rotation buffer initialization.\n");
+}
 
+// Run a tile chain over the pixels of the image, the result then is the
+// image. Tiles hold no padding: it goes through pad_map (indexed, the
+// stage's pointwise steps) like the rest of a row would, or is copied if
+// pad_map is NULL.
+static void run_chain(Image_Data *img, Tile_Chain *chain,
+                      const uint8_t *pad_map) {
+    uint32_t row_size = row_size_bytes(img->width, img->bit_depth_in);
+    uint8_t **src = img->pixelDataRows;
+    uint8_t **dst = NULL;
+    chain->channels = 3;
     if (img->colorMode == INDEXED) {
-        output_buffer1 = create_buffer1(image_size);
-
-        if (degrees == 0) {
-            for (int r = 0; r < rows; r++) {
-                for (int c = 0; c < cols; c++) {
-                    output_buffer1[r * cols + c] =
-                        img->pixel_data[r * cols + c];
-                }
-            }
-        } else if (degrees == -90 || degrees == 270) {
-            for (int r = 0; r < rows; r++) {
-                for (int c = 0; c < cols; c++) {
-                    output_buffer1[c * rows + (rows - 1 - r)] =
-                        img->pixel_data[r * cols + c];
-                }
-            }
-        } else if (degrees == 180 || degrees == -180) {
-            for (int r = 0; r < rows; r++) {
-                for (int c = 0; c < cols; c++) {
-                    output_buffer1[(rows - 1 - r) * cols + (cols - 1 - c)] =
-                        img->pixel_data[r * cols + c];
-                }
-            }
-        } else if (degrees == -270 || degrees == 90) {
-            for (int r = 0; r < rows; r++) {
-                for (int c = 0; c < cols; c++) {
-                    output_buffer1[(cols - 1 - c) * rows + r] =
-                        img->pixel_data[r * cols + c];
-                }
-            }
-        }
-
-        free(img->pixel_data);
-        img->pixel_data = output_buffer1;
-
-    } else if (img->colorMode == RGB24) {
+        // Rows are walked by stride so padded widths stay aligned.
+        src = NULL;
+        chain->channels = 1;
+        buffer1_to_2D(img->arena, img->pixel_data, &src, img->height,
+                      row_size);
+    }
+    // Every row is written, the spare is not zeroed first
+    uint8_t *spare =
+        spare_buffer(img, img->image_byte_count, img->height, row_size, false);
+    if (spare && img->colorMode == INDEXED) {
+        buffer1_to_2D(img->arena, spare, &dst, img->height, row_size);
+    } else if (spare) {
+        dst = img->spare_rows;
+    }
+    if (!src || !dst) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                   "Error: Could not allocate the tile rows.\n");
+        return;
+    }
+    chain->src = src;
+    chain->dst = dst;
+    chain->width = img->width;
+    chain->height = img->height;
+    DEBUG_LOG("Tiles of %u rows, halo %u\n", tile_rows(chain),
+              tile_chain_halo(chain));
+    if (!tile_run(chain)) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY, "Error: Tiles failed.\n");
+        return;
+    }
 
-        create_buffer3(&output_buffer3, img->height, img->row_size_bytes);
-        // 0 degrees test
-        if (degrees == 0) {
-            for (int y = 0; y < org_height; y++) {
-                for (int x = 0; x < 3 * org_width; x += 3) {
-                    //      for (int rgb = 0; rgb < 3; rgb++) {
-                    output_buffer3[y][x] = img->pixelDataRows[y][x];
-                }
-            }
-        }
-        // image1(y,x) = image2(x, height - y, )
-        else if (degrees == 90 || degrees == -270) {
-            for (int y = 0; y < org_height; y++) {
-                for (int x = 0; x < org_width; x++) {
-                    for (int rgb = 0; rgb < 3; rgb++) {
-                        output_buffer3[x][(org_height - y - 1) * 3 + rgb] =
-                            img->pixelDataRows[y][x * 3 + rgb];
-                    }
-                }
+    size_t pixel_bytes = (size_t)img->width * chain->channels;
+    for (uint32_t y = 0; y < img->height; y++) {
+        if (pad_map) {
+            for (size_t x = pixel_bytes; x < row_size; x++) {
+                dst[y][x] = pad_map[src[y][x]];
             }
-        } else if (degrees == 180 || degrees == -180) {
-            for (int y = 0; y < org_height; y++) {
-                for (int x = 0; x < org_width; x++) {
-                    for (int rgb = 0; rgb < 3; rgb++) {
-                        output_buffer3[img->height - 1 - y]
-                                      [(img->width - 1 - x) * 3 + rgb] =
-                                          img->pixelDataRows[y][x * 3 + rgb];
-                    }
-                }
-            }
-        } else if (degrees == 270 || degrees == -90) {
-            for (int y = 0; y < org_height; y++) {
-                for (int x = 0; x < org_width; x++) {
-                    for (int rgb = 0; rgb < 3; rgb++) {
-                        output_buffer3[org_width - 1 - x][y * 3 + rgb] =
-                            img->pixelDataRows[y][x * 3 + rgb];
-                    }
-                }
-            }
-        }
-
-        for (int y = 0; y < org_height; y++) {
-            free(img->pixelDataRows[y]);
+        } else {
+            memcpy(dst[y] + pixel_bytes, src[y] + pixel_bytes,
+                   row_size - pixel_bytes);
         }
-        free(img->pixelDataRows);
-
-        img->pixelDataRows = output_buffer3;
-
-    } else {
-        fprintf(stderr, "Error: Rotation buffer initialization.\n");
-        exit(EXIT_FAILURE);
     }
+    swap_spare(img, img->image_byte_count, img->height);
 }
 
-void blur1(Image_Data *img) {
-    printf("Inside blur1\n");
-
-    uint32_t rows = img->height;
-    uint32_t cols = img->width;
-    uint32_t image_size = rows * cols;
-
-    // height / rows / y
-    // width / cols / x
-
-    // uint8_t *buf1 = img->pixel_data;
-    uint8_t **buf1_2D = NULL;
-    buffer1_to_2D(img->pixel_data, &buf1_2D, rows, cols);
-
-    uint8_t *buf2 = create_buffer1(image_size);
-    uint8_t **buf2_2D = NULL;
-    buffer1_to_2D(buf2, &buf2_2D, rows, cols);
-
-    float kernal2D[3][3];
-    float v;
-    float sum;
-
-    for (int blur = 0; blur < img->blur_level; blur++) {
-        printf("Blur %d\n", blur);
-
-        v = 1.0 / 9.0;
-        for (int i = 0; i < 9; i++) {
-            kernal2D[i / 3][i % 3] = v;
-        }
-
-        // Center/main area, average 1 pixel + 8 neighbors.
-        for (size_t r = 1; r < rows - 1; r++) {
-            for (size_t c = 1; c < cols - 1; c++) {
-                sum = 0.0;
-
-                for (int8_t r1 = -1; r1 <= 1; r1++) {
-                    for (int8_t c1 = -1; c1 <= 1; c1++) {
-                        sum +=
-                            kernal2D[r1 + 1][c1 + 1] * buf1_2D[r + r1][c + c1];
-                        // sum += v*buf1_2D[r + r1][c + c1];
-                    }
-                }
-
-                // sum = sum * (1.0/9.0);
-                buf2_2D[r][c] =
-                    (uint8_t)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
-            }
-        }
-
-        // Sides
-        // Average 1 pixel + 5 neighbors
-        v = 1.0 / 6.0;
-        for (int i = 0; i < 9; i++) {
-            kernal2D[i / 3][i % 3] = v;
-        }
-
-        // Left side, c = 0
-        for (size_t r = 1, c = 0; r < rows - 1; r++) {
-            sum = 0.0;
-
-            for (int8_t r1 = -1; r1 <= 1; r1++) {
-                for (int8_t c1 = 0; c1 <= 1; c1++) {
-                    sum += kernal2D[r1 + 1][c1 + 1] * buf1_2D[r + r1][c + c1];
-                    // sum += v * buf1_2D[r + r1][c + c1];
-                }
-            }
-            buf2_2D[r][c] = (uint8_t)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
-        }
-
-        // Right side, c = cols - 1
-        for (size_t r = 1, c = cols - 1; r < rows - 1; r++) {
-            sum = 0.0;
-
-            for (int8_t r1 = -1; r1 <= 1; r1++) {
-                for (int8_t c1 = -1; c1 <= 0; c1++) {
-                    sum += kernal2D[r1 + 1][c1 + 1] * buf1_2D[r + r1][c + c1];
-                }
-            }
-            buf2_2D[r][c] = (uint8_t)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
-        }
-
-        // Top side, r = 0
-        for (size_t r = 0, c = 1; c < cols - 1; c++) {
-            sum = 0.0;
+// Blur of indexed or interleaved 24-bit rows, a chain of one op
+static void blur_tiled(Image_Data *img) {
+    Stencil stencil = {0};
+    Tile_Chain chain = {0};
+    Tile_Op op = stencil_op(img, &stencil);
+    tile_chain_add(&chain, &op);
+    run_chain(img, &chain, NULL);
+}
 
-            for (int8_t r1 = 0; r1 <= 1; r1++) {
-                for (int8_t c1 = -1; c1 <= 1; c1++) {
-                    sum += kernal2D[r1 + 1][c1 + 1] * buf1_2D[r + r1][c + c1];
-                }
-            }
-            buf2_2D[r][c] = (uint8_t)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
-        }
+void blur1(Image_Data *img) {
+    DEBUG_LOG("Inside blur1\n");
+    blur_tiled(img);
+}
 
-        // Bottom side, r = rows - 1
-        for (size_t r = rows - 1, c = 1; c < cols - 1; c++) {
-            sum = 0.0;
+//---
 
-            for (int8_t r1 = -1; r1 <= 0; r1++) {
-                for (int8_t c1 = -1; c1 <= 1; c1++) {
-                    sum += kernal2D[r1 + 1][c1 + 1] * buf1_2D[r + r1][c + c1];
-                }
+void blur3(Image_Data *img) {
+    DEBUG_LOG("Inside blur3\n");
+
+    if (img->layout == LAYOUT_PLANAR) {
+        // Three 1 channel blurs, each on contiguous rows
+        for (int c = 0; c < 3; c++) {
+            uint8_t **rows = NULL;
+            buffer1_to_2D(img->arena, img->planes[c], &rows, img->height,
+                          img->plane_stride);
+            if (!rows || !box_blur_level(rows, img->width, img->height, 1,
+                                         img->blur_level)) {
+                image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                           "Error: Blur failed.\n");
+                return;
             }
-            buf2_2D[r][c] = (uint8_t)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
-        }
-
-        // Corners
-        // Average 1 pixel + 3 neighbors
-        v = 1.0 / 4.0;
-        for (int i = 0; i < 9; i++) {
-            kernal2D[i / 3][i % 3] = v;
         }
+        return;
+    }
+    blur_tiled(img);
+}
 
-        // Bottom left
-        size_t r = 0, c = 0;
-        sum = 0.0;
+void sepia3(Image_Data *img) {
+    DEBUG_LOG("Sepia\n");
 
-        for (int8_t r1 = 0; r1 <= 1; r1++) {
-            for (int8_t c1 = 0; c1 <= 1; c1++) {
-                sum += kernal2D[r1 + 1][c1 + 1] * buf1_2D[r + r1][c + c1];
-            }
+    for (size_t y = 0; y < img->height; y++) {
+        for (size_t x = 0; x < img->width * 3; x += 3) {
+            pixel_sepia(img->pixelDataRows[y] + x);
         }
-        buf2_2D[r][c] = (uint8_t)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
+    }
+}
 
-        // Top left
-        r = rows - 1, c = 0;
-        sum = 0.0;
+void filter1(Image_Data *img) {
+    DEBUG_LOG("Inside filter1\n");
+    // char *filter_name = img->filter_name;
+    int filter_index = img->filter_index;
 
-        for (int8_t r1 = -1; r1 <= 0; r1++) {
-            for (int8_t c1 = 0; c1 <= 1; c1++) {
-                sum += kernal2D[r1 + 1][c1 + 1] * buf1_2D[r + r1][c + c1];
-            }
-        }
-        buf2_2D[r][c] = (uint8_t)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
+    // The convolution reads one byte per pixel
+    if (img->bit_depth_in != 8) {
+        image_fail(img, IMAGECOPY_ERROR_UNSUPPORTED,
+                   "Error: Filter needs an 8-bit image, got %d.\n",
+                   img->bit_depth_in);
+        return;
+    }
 
-        // Top right
-        r = rows - 1, c = cols - 1;
-        sum = 0.0;
+    Convolution *c1 = arena_alloc(img->arena, sizeof(Convolution));
+    if (!c1) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                   "Error: Could not allocate the convolution.\n");
+        return;
+    }
+    c1->input = img->pixel_data; // Pointer to the input image buffer
+    c1->height = img->height;    // Image height
+    c1->width = img->width;      // Image width
+    c1->stride = img->row_size_bytes;
+    // A --kernel from the command line replaces the built-in list. A
+    // built-in kernel is copied, kernel_factor caches its factoring in the
+    // Kernel and the list is shared by every job.
+    Kernel builtin;
+    if (!img->kernel) {
+        builtin = kernel_list[filter_index];
+    }
+    c1->kernel = img->kernel ? img->kernel : &builtin;
+    c1->map = NULL;
+    // The result goes to the spare, which then becomes the image
+    c1->output = spare_buffer(img, img->image_byte_count, 0, 0, true);
+    if (!c1->output) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                   "Error: Could not allocate the filter output.\n");
+        return;
+    }
 
-        for (int8_t r1 = -1; r1 <= 0; r1++) {
-            for (int8_t c1 = -1; c1 <= 0; c1++) {
-                sum += kernal2D[r1 + 1][c1 + 1] * buf1_2D[r + r1][c + c1];
-            }
-        }
-        buf2_2D[r][c] = (uint8_t)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
+    DEBUG_LOG("Kernel: %s\n", c1->kernel->name);
 
-        // Bottom right
-        r = 0, c = cols - 1;
-        sum = 0.0;
+    for (int i = 0; c1->kernel->array && i < c1->kernel->size; i++) {
+        DEBUG_LOG("%d ", c1->kernel->array[i]);
+    }
+    DEBUG_LOG("\n");
 
-        for (int8_t r1 = 0; r1 <= 1; r1++) {
-            for (int8_t c1 = -1; c1 <= 0; c1++) {
-                sum += kernal2D[r1 + 1][c1 + 1] * buf1_2D[r + r1][c + c1];
-            }
-        }
-        buf2_2D[r][c] = (uint8_t)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
+    DEBUG_LOG("Before conv1\n");
+    for (int i = 0; i < 10; i++) {
+        DEBUG_LOG("I:%d,O:%d ", c1->input[i], c1->output[i]);
+    }
+    DEBUG_LOG("\n");
 
-        // Dst, Src
-        memcpy(img->pixel_data, buf2, image_size);
+    if (!conv1(c1)) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY, "Error: Filter failed.\n");
+        return;
     }
+    DEBUG_LOG("After conv1\n");
 
-    free(buf2);
-    free(buf1_2D);
-    free(buf2_2D);
+    // Row padding is not filtered, it is kept as it was
+    for (uint32_t y = 0; y < img->height; y++) {
+        size_t row = (size_t)y * img->row_size_bytes;
+        memcpy(c1->output + row + img->width, c1->input + row + img->width,
+               img->row_size_bytes - img->width);
+    }
+    swap_spare(img, img->image_byte_count, img->height);
 }
 
-//---
-
-void blur3(Image_Data *img) {
-    printf("Inside blur3\n");
-
-    float kernel2D[3][3];
-    float v;
-
-    uint32_t rows = img->height;
-    uint32_t cols = img->width;
-
-    uint8_t **buf1 = img->pixelDataRows;
-    uint8_t **buf2 = NULL;
-    create_buffer3(&buf2, rows, img->row_size_bytes);
-    // printf("Rows: %d, PW: %d\n", rows, img->row_size_bytes);
-    float sum[3];
-
-    for (int blur = 0; blur < img->blur_level; blur++) {
-        printf("Blur %d\n", blur);
-
-        v = 1.0 / 9.0;
-        for (int i = 0; i < 9; i++) {
-            kernel2D[i / 3][i % 3] = v;
-        }
-
-        // Center/main area, average 1 pixel + 8 neighbors.
-        for (size_t r = 1; r < rows - 1; r++) {
-            for (size_t c = 3; c < (cols - 1) * 3; c += 3) {
-                sum[0] = sum[1] = sum[2] = 0.0;
-                for (int8_t r1 = -1; r1 <= 1; r1++) {
-                    for (int8_t c1 = -1; c1 <= 1; c1++) {
-                        sum[0] += kernel2D[r1 + 1][c1 + 1] *
-                                  buf1[r + r1][c + c1 * 3 + 0];
-                        sum[1] += kernel2D[r1 + 1][c1 + 1] *
-                                  buf1[r + r1][c + c1 * 3 + 1];
-                        sum[2] += kernel2D[r1 + 1][c1 + 1] *
-                                  buf1[r + r1][c + c1 * 3 + 2];
-                    }
-                }
-                buf2[r][c + 0] =
-                    (uint8_t)(sum[0] < 0 ? 0 : (sum[0] > 255 ? 255 : sum[0]));
-                buf2[r][c + 1] =
-                    (uint8_t)(sum[1] < 0 ? 0 : (sum[1] > 255 ? 255 : sum[1]));
-                buf2[r][c + 2] =
-                    (uint8_t)(sum[2] < 0 ? 0 : (sum[2] > 255 ? 255 : sum[2]));
-            }
-        }
-
-        // Sides
-        // Average 1 pixel + 5 neighbors
-        v = 1.0 / 6.0;
-        for (int i = 0; i < 9; i++) {
-            kernel2D[i / 3][i % 3] = v;
+// Each channel filtered on its own, as a plane. The result of a plane goes
+// to a scratch plane that then takes its place.
+void filter3(Image_Data *img) {
+    DEBUG_LOG("Inside filter3\n");
+    image_set_layout(img, LAYOUT_PLANAR);
+    uint8_t *scratch = img->layout == LAYOUT_PLANAR
+                           ? arena_alloc(img->arena, img->plane_bytes)
+                           : NULL;
+    if (!scratch) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                   "Error: Could not allocate the filter planes.\n");
+        return;
+    }
+    // A built-in kernel is copied, as in filter1
+    Kernel builtin;
+    if (!img->kernel) {
+        builtin = kernel_list[img->filter_index];
+    }
+    for (int c = 0; c < 3; c++) {
+        // Planes are top-down, conv1 takes rows bottom row first
+        size_t last_row = (size_t)(img->height - 1) * img->plane_stride;
+        Convolution conv = {
+            .input = img->planes[c] + last_row,
+            .output = scratch + last_row,
+            .height = img->height,
+            .width = img->width,
+            .stride = -(ptrdiff_t)img->plane_stride,
+            .kernel = img->kernel ? img->kernel : &builtin,
+        };
+        if (!conv1(&conv)) {
+            image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                       "Error: Filter failed.\n");
+            return;
         }
+        scratch = img->planes[c];
+        img->planes[c] = conv.output - last_row;
+    }
+}
 
-        // Left side, c = 0
-        for (size_t r = 1, c = 0; r < rows - 1; r++) {
-            sum[0] = sum[1] = sum[2] = 0.0;
 
-            for (int8_t r1 = -1; r1 <= 1; r1++) {
-                for (int8_t c1 = 0; c1 <= 1; c1++) {
-                    sum[0] += kernel2D[r1 + 1][c1 + 1] *
-                              buf1[r + r1][(c + c1) * 3 + 0];
-                    sum[1] += kernel2D[r1 + 1][c1 + 1] *
-                              buf1[r + r1][(c + c1) * 3 + 1];
-                    sum[2] += kernel2D[r1 + 1][c1 + 1] *
-                              buf1[r + r1][(c + c1) * 3 + 2];
-                }
+// Tone chain. Brightness, equalize, invert and monochrome steps are all
+// value -> value maps, so they compose into one table per channel before
+// the image is touched, and the pixels are mapped in a single pass no
+// matter how long the chain is.
+
+// Table of a 24-bit chain, without its final mono step. Only an equalize
+// step reads the image.
+static void tone_lut3(Image_Data *img, Lut3 *plan) {
+    uint8_t step_lut[LUT_SIZE];
+    bool counted = false; // the source histogram, once per chain
+    lut_identity(plan->channel[0]);
+    lut3_from_lut(plan, plan->channel[0]);
+
+    for (uint8_t i = 0; i < img->tone_step_count; i++) {
+        const Tone_Step *step = &img->tone_steps[i];
+        if (step->op == TONE_BRIGHT || step->op == TONE_INV) {
+            if (step->op == TONE_BRIGHT) {
+                lut_brightness(step_lut, step->value);
+            } else {
+                lut_invert(step_lut);
             }
-            buf2[r][c + 0] =
-                (uint8_t)(sum[0] < 0 ? 0 : (sum[0] > 255 ? 255 : sum[0]));
-            buf2[r][c + 1] =
-                (uint8_t)(sum[1] < 0 ? 0 : (sum[1] > 255 ? 255 : sum[1]));
-            buf2[r][c + 2] =
-                (uint8_t)(sum[2] < 0 ? 0 : (sum[2] > 255 ? 255 : sum[2]));
-        }
-
-        // Right side, c = cols - 1
-        for (size_t r = 1, c = (cols - 1) * 3; r < rows - 1; r++) {
-            sum[0] = sum[1] = sum[2] = 0.0;
-
-            for (int8_t r1 = -1; r1 <= 1; r1++) {
-                for (int8_t c1 = -1; c1 <= 0; c1++) {
-                    sum[0] +=
-                        kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 0];
-                    sum[1] +=
-                        kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 1];
-                    sum[2] +=
-                        kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 2];
-                }
+            for (uint8_t rgb = 0; rgb < 3; rgb++) {
+                lut_compose(plan->channel[rgb], step_lut);
             }
-            buf2[r][c + 0] =
-                (uint8_t)(sum[0] < 0 ? 0 : (sum[0] > 255 ? 255 : sum[0]));
-            buf2[r][c + 1] =
-                (uint8_t)(sum[1] < 0 ? 0 : (sum[1] > 255 ? 255 : sum[1]));
-            buf2[r][c + 2] =
-                (uint8_t)(sum[2] < 0 ? 0 : (sum[2] > 255 ? 255 : sum[2]));
-        }
-
-        // Bottom side, r = 0
-        for (size_t r = 0, c = 3; c < (cols - 1) * 3; c += 3) {
-            sum[0] = sum[1] = sum[2] = 0.0;
-
-            for (int8_t r1 = 0; r1 <= 1; r1++) {
-                for (int8_t c1 = -1; c1 <= 1; c1++) {
-                    sum[0] +=
-                        kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 0];
-                    sum[1] +=
-                        kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 1];
-                    sum[2] +=
-                        kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 2];
+        } else if (step->op == TONE_EQUAL) {
+            // Histogram of the image as it would be at this step, from
+            // the source histogram pushed through the plan so far.
+            if (!counted) {
+                hist3(img);
+                if (img->status) {
+                    return;
                 }
+                counted = true;
             }
-            buf2[r][c + 0] =
-                (uint8_t)(sum[0] < 0 ? 0 : (sum[0] > 255 ? 255 : sum[0]));
-            buf2[r][c + 1] =
-                (uint8_t)(sum[1] < 0 ? 0 : (sum[1] > 255 ? 255 : sum[1]));
-            buf2[r][c + 2] =
-                (uint8_t)(sum[2] < 0 ? 0 : (sum[2] > 255 ? 255 : sum[2]));
-        }
-
-        // Top side, r = rows - 1
-        for (size_t r = rows - 1, c = 3; c < (cols - 1) * 3; c += 3) {
-            sum[0] = sum[1] = sum[2] = 0.0;
-
-            for (int8_t r1 = -1; r1 <= 0; r1++) {
-                for (int8_t c1 = -1; c1 <= 1; c1++) {
-                    sum[0] +=
-                        kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 0];
-                    sum[1] +=
-                        kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 1];
-                    sum[2] +=
-                        kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 2];
+            for (uint8_t rgb = 0; rgb < 3; rgb++) {
+                uint64_t histogram[LUT_SIZE] = {0};
+                for (int v = 0; v < LUT_SIZE; v++) {
+                    histogram[plan->channel[rgb][v]] +=
+                        img->histogram3[rgb][v];
                 }
-            }
-            buf2[r][c + 0] =
-                (uint8_t)(sum[0] < 0 ? 0 : (sum[0] > 255 ? 255 : sum[0]));
-            buf2[r][c + 1] =
-                (uint8_t)(sum[1] < 0 ? 0 : (sum[1] > 255 ? 255 : sum[1]));
-            buf2[r][c + 2] =
-                (uint8_t)(sum[2] < 0 ? 0 : (sum[2] > 255 ? 255 : sum[2]));
-        }
-
-        // Corners
-        // Average 1 pixel + 3 neighbors
-        v = 1.0 / 4.0;
-        for (int i = 0; i < 9; i++) {
-            kernel2D[i / 3][i % 3] = v;
-        }
-
-        // Bottom left
-        size_t r = 0, c = 0;
-        sum[0] = sum[1] = sum[2] = 0.0;
-
-        for (int8_t r1 = 0; r1 <= 1; r1++) {
-            for (int8_t c1 = 0; c1 <= 1; c1++) {
-                sum[0] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 0];
-                sum[1] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 1];
-                sum[2] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 2];
+                lut_equalize(step_lut, histogram);
+                lut_compose(plan->channel[rgb], step_lut);
             }
         }
-        buf2[r][c + 0] =
-            (uint8_t)(sum[0] < 0 ? 0 : (sum[0] > 255 ? 255 : sum[0]));
-        buf2[r][c + 1] =
-            (uint8_t)(sum[1] < 0 ? 0 : (sum[1] > 255 ? 255 : sum[1]));
-        buf2[r][c + 2] =
-            (uint8_t)(sum[2] < 0 ? 0 : (sum[2] > 255 ? 255 : sum[2]));
-
-        // Top left
-        r = rows - 1, c = 0;
-        sum[0] = sum[1] = sum[2] = 0.0;
-
-        for (int8_t r1 = -1; r1 <= 0; r1++) {
-            for (int8_t c1 = 0; c1 <= 1; c1++) {
-                sum[0] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 0];
-                sum[1] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 1];
-                sum[2] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 2];
-            }
-        }
-        buf2[r][c + 0] =
-            (uint8_t)(sum[0] < 0 ? 0 : (sum[0] > 255 ? 255 : sum[0]));
-        buf2[r][c + 1] =
-            (uint8_t)(sum[1] < 0 ? 0 : (sum[1] > 255 ? 255 : sum[1]));
-        buf2[r][c + 2] =
-            (uint8_t)(sum[2] < 0 ? 0 : (sum[2] > 255 ? 255 : sum[2]));
-
-        // Top right
-        r = rows - 1, c = (cols - 1) * 3;
-        sum[0] = sum[1] = sum[2] = 0.0;
-
-        for (int8_t r1 = -1; r1 <= 0; r1++) {
-            for (int8_t c1 = -1; c1 <= 0; c1++) {
-                sum[0] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 0];
-                sum[1] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 1];
-                sum[2] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 2];
+    }
+}
+
+// Index map of an 8-bit chain. Equalize works on the index bytes, like
+// equal1. Brightness and invert rewrite the color table here and now, like
+// bright134 and inv1, and a final mono step sets the black / white table.
+static void tone_index_map(Image_Data *img, uint8_t *plan) {
+    bool mono = img->tone_step_count &&
+                img->tone_steps[img->tone_step_count - 1].op == TONE_MONO;
+    uint8_t threshold = (uint8_t)(WHITE * img->mono_threshold + 0.5f);
+    uint8_t step_lut[LUT_SIZE];
+    bool counted = false; // the source histogram, once per chain
+    lut_identity(plan);
+
+    for (uint8_t i = 0; i < img->tone_step_count; i++) {
+        const Tone_Step *step = &img->tone_steps[i];
+        if (step->op == TONE_BRIGHT) {
+            // Brightness lives in the color table for indexed images.
+            bright_offset134(img, step->value);
+        } else if (step->op == TONE_INV) {
+            inv1(img);
+        } else if (step->op == TONE_EQUAL) {
+            if (!counted) {
+                hist1(img);
+                if (img->status) {
+                    return;
+                }
+                counted = true;
             }
-        }
-        buf2[r][c + 0] =
-            (uint8_t)(sum[0] < 0 ? 0 : (sum[0] > 255 ? 255 : sum[0]));
-        buf2[r][c + 1] =
-            (uint8_t)(sum[1] < 0 ? 0 : (sum[1] > 255 ? 255 : sum[1]));
-        buf2[r][c + 2] =
-            (uint8_t)(sum[2] < 0 ? 0 : (sum[2] > 255 ? 255 : sum[2]));
-
-        // Bottom right
-        r = 0, c = (cols - 1) * 3;
-        sum[0] = sum[1] = sum[2] = 0.0;
-
-        for (int8_t r1 = 0; r1 <= 1; r1++) {
-            for (int8_t c1 = -1; c1 <= 0; c1++) {
-                sum[0] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 0];
-                sum[1] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 1];
-                sum[2] +=
-                    kernel2D[r1 + 1][c1 + 1] * buf1[r + r1][c + c1 * 3 + 2];
+            uint64_t histogram[LUT_SIZE] = {0};
+            for (int v = 0; v < LUT_SIZE; v++) {
+                histogram[plan[v]] += img->histogram1[v];
             }
-        }
-        buf2[r][c + 0] =
-            (uint8_t)(sum[0] < 0 ? 0 : (sum[0] > 255 ? 255 : sum[0]));
-        buf2[r][c + 1] =
-            (uint8_t)(sum[1] < 0 ? 0 : (sum[1] > 255 ? 255 : sum[1]));
-        buf2[r][c + 2] =
-            (uint8_t)(sum[2] < 0 ? 0 : (sum[2] > 255 ? 255 : sum[2]));
-
-        // Copy buf2 to buf1 for the next iteration
-        for (size_t r = 0; r < rows; r++) {
-            memcpy(buf1[r], buf2[r], img->row_size_bytes);
+            lut_equalize(step_lut, histogram);
+            lut_compose(plan, step_lut);
         }
     }
 
-    // Free the temporary buffer
-    for (size_t i = 0; i < rows; i++) {
-        free(buf2[i]);
-    }
-    free(buf2);
-}
-
-void sepia3(Image_Data *img) {
-    printf("Sepia\n");
-    // const uint8_t WHITE = 255;
-
-    // sepia kernal
-    float sepia[3][3] = {
-        {0.272, 0.534, 0.131}, {0.349, 0.686, 0.168}, {0.393, 0.769, 0.189}};
-
-    float r = 0.0;
-    float g = 0.0;
-    float b = 0.0;
-
-    for (size_t y = 0; y < img->height; y++) {
-        for (size_t x = 0; x < img->width * 3; x += 3) {
-            r = g = b = 0.0;
-
-            r = img->pixelDataRows[y][x + 0] * sepia[0][0] +
-                img->pixelDataRows[y][x + 1] * sepia[0][1] +
-                img->pixelDataRows[y][x + 2] * sepia[0][2];
-            g = img->pixelDataRows[y][x + 0] * sepia[1][0] +
-                img->pixelDataRows[y][x + 1] * sepia[1][1] +
-                img->pixelDataRows[y][x + 2] * sepia[1][2];
-            b = img->pixelDataRows[y][x + 0] * sepia[2][0] +
-                img->pixelDataRows[y][x + 1] * sepia[2][1] +
-                img->pixelDataRows[y][x + 2] * sepia[2][2];
-
-            img->pixelDataRows[y][x + 0] = (r > WHITE) ? WHITE : r;
-            img->pixelDataRows[y][x + 1] = (g > WHITE) ? WHITE : g;
-            img->pixelDataRows[y][x + 2] = (b > WHITE) ? WHITE : b;
+    // Fold the threshold into the table, index -> black (0) / white (1).
+    if (mono) {
+        for (int v = 0; v < LUT_SIZE; v++) {
+            uint32_t offset = plan[v] * 4;
+            uint8_t lum = get_luminance(img->colorTable[offset + 2],
+                                        img->colorTable[offset + 1],
+                                        img->colorTable[offset + 0]);
+            plan[v] = (lum >= threshold) ? 1 : 0;
         }
+        set_mono_palette(img);
     }
 }
 
-void filter1(Image_Data *img) {
-    printf("Inside filter1\n");
-    // char *filter_name = img->filter_name;
-    int filter_index = img->filter_index;
-
-    Convolution *c1 = malloc(sizeof(Convolution));
-    c1->input = img->pixel_data; // Pointer to the input image buffer
-    c1->height = img->height;    // Image height
-    c1->width = img->width;      // Image width
-    c1->kernel = &kernel_list[filter_index];
-    c1->output = create_buffer1(
-        img->image_byte_count); // Pointer to the output image buffer
-
-    printf("Kernel: %s\n", c1->kernel->name);
-
-    for (int i = 0; i < c1->kernel->size; i++) {
-        printf("%d ", c1->kernel->array[i]);
-    }
-    printf("\n");
+void tone13(Image_Data *img) {
+    DEBUG_LOG("Tone chain: %d steps\n", img->tone_step_count);
 
-    printf("Before conv1\n");
-    for (int i = 0; i < 10; i++) {
-        printf("I:%d,O:%d ", c1->input[i], c1->output[i]);
+    // Monochrome collapses the channels, so it can only end a chain.
+    for (uint8_t i = 0; i + 1 < img->tone_step_count; i++) {
+        if (img->tone_steps[i].op == TONE_MONO) {
+            image_fail(img, IMAGECOPY_ERROR_ARGUMENT,
+                       "Error: Monochrome must be the last tone step.\n");
+            return;
+        }
     }
-    printf("\n");
+    bool mono = img->tone_step_count &&
+                img->tone_steps[img->tone_step_count - 1].op == TONE_MONO;
+    uint8_t threshold = (uint8_t)(WHITE * img->mono_threshold + 0.5f);
 
-    conv1(c1);
-    printf("After conv1\n");
+    if (img->colorMode == RGB24) {
+        Lut3 plan;
+        tone_lut3(img, &plan);
+        if (img->status) {
+            return;
+        }
 
-    // transfer back to the original input buffer.
-    for (int i = 0; i < img->image_byte_count; i++) {
-        if (i < 10) {
-            printf("I:%d,O:%d", c1->input[i], c1->output[i]);
+        if (mono) {
+            image_set_layout(img, LAYOUT_INTERLEAVED);
+            apply_lut3_threshold(img->pixelDataRows, img->width, img->height,
+                                 &plan, threshold);
+            img->colors_used_actual = 2;
+        } else if (img->layout == LAYOUT_PLANAR) {
+            apply_lut_planes(img, &plan);
+        } else {
+            apply_lut3(img->pixelDataRows, img->width, img->height, &plan);
         }
 
-        c1->input[i] = c1->output[i];
-    }
-    printf("\n");
-    free(c1->output);
-}
+    } else if (img->colorMode == INDEXED) {
+        if (img->bit_depth_in != 8) {
+            image_fail(img, IMAGECOPY_ERROR_UNSUPPORTED,
+                       "Error: Tone chain needs an 8-bit image, got %d.\n",
+                       img->bit_depth_in);
+            return;
+        }
 
-// Simple structure to hold a color and its count
-typedef struct {
-    uint32_t color;
-    uint32_t count;
-} ColorCount;
-
-// Build a 24-bit histogram from a flat, padded pixel buffer
-void build_histogram(const uint8_t *buf, uint32_t width, uint32_t height,
-                     uint32_t *hist) {
-    size_t row_size = (((size_t)width * 3) + 3) & ~3u;
-    for (uint32_t y = 0; y < height; y++) {
-        const uint8_t *row = buf + y * row_size;
-        for (uint32_t x = 0; x < width; x++) {
-            uint32_t b = row[x * 3 + 0];
-            uint32_t g = row[x * 3 + 1];
-            uint32_t r = row[x * 3 + 2];
-            uint32_t key = (r << 16) | (g << 8) | b;
-            hist[key]++;
+        uint8_t plan[LUT_SIZE];
+        tone_index_map(img, plan);
+        if (img->status) {
+            return;
         }
+        apply_lut1(img->pixel_data, img->image_byte_count, plan);
     }
 }
 
-// Compare function for sorting descending by count
-int cmp_colorcount(const void *a, const void *b) {
-    const ColorCount *A = a;
-    const ColorCount *B = b;
-    return (B->count > A->count) - (B->count < A->count);
-}
-
 void convert_indexed_with_padding(const uint8_t *rgb_buf, int width, int height,
                                   int row_stride, int bits, int max_colors,
                                   int dither_flag, uint8_t **out_idx_padded,
@@ -1914,21 +2300,21 @@ void convert_indexed_with_padding(const uint8_t *rgb_buf, int width, int height,
     Color *palette;
     uint16_t psize;
     convert_24_to_indexed_tight(rgb_buf, width, height, row_stride, bits,
-                                max_colors, dither_flag, &idx_tight, &palette,
-                                &psize);
+                                max_colors, dither_flag, QUANT_MEDIAN,
+                                &idx_tight, &palette, &psize);
 
     // 2) Compute padded stride and buffer
     *out_row_stride = ((width + 3) / 4) * 4;
-    *out_idx_padded = malloc((*out_row_stride) * height);
+    *out_idx_padded = malloc((size_t)(*out_row_stride) * height);
     for (int y = 0; y < height; y++) {
-        uint8_t *dst = *out_idx_padded + y * (*out_row_stride);
-        uint8_t *src = idx_tight + y * width;
+        uint8_t *dst = *out_idx_padded + (size_t)y * (*out_row_stride);
+        uint8_t *src = idx_tight + (size_t)y * width;
         memcpy(dst, src, width);
         memset(dst + width, 0, (*out_row_stride) - width);
     }
 
     // 3) Cleanup tight buffer, output palette & size
-    free(idx_tight);
+    pool_release(idx_tight);
     *out_pal = palette;
     *out_psize = psize;
 }
@@ -1939,7 +2325,7 @@ void convert_indexed_with_padding(const uint8_t *rgb_buf, int width, int height,
 //         return;
 //     }
 //     if (img.bit_depth_in != 24) {
-//         fprintf(stderr, "[%s] Not a 24-bit BMP\n", function_name);
+//         report_error("[%s] Not a 24-bit BMP\n", function_name);
 //         return;
 //     }
 
@@ -1952,8 +2338,9 @@ void convert_indexed_with_padding(const uint8_t *rgb_buf, int width, int height,
 
 //     return ;
 // }
-
-// if colors not low enough, need to reduce colors before reduce bit depth.
+// Repack indices to bit_depth_out when the colours in use fit. Any depth
+// pair among 1, 2, 4 and 8 bits, whole rows at a time (repack.h).
+// If colors not low enough, need to reduce colors before reduce bit depth.
 void convert_bit_depth_if_color_count_matches(Image_Data *img) {
 
     char *function_name =
@@ -1963,115 +2350,146 @@ void convert_bit_depth_if_color_count_matches(Image_Data *img) {
     // already 0 for 24 bit
     uint16_t colors_used_actual = img->colors_used_actual;
 
-    if (bit_depth_new == bit_depth_old) {
-        fprintf(stderr, "%s Did not convert to same bit depth: %d=%d\n",
-                function_name, bit_depth_old, bit_depth_new);
+    // Nothing to do, or not an indexed to indexed conversion
+    if (bit_depth_new == bit_depth_old || bit_depth_old > 8 ||
+        bit_depth_new > 8) {
         return;
     }
 
-    // uint32_t width = img->width;
     uint32_t height = img->height;
     uint32_t width = img->width;
+    uint32_t ct_max_color_count_new = ct_max_color_count(bit_depth_new);
+
+    if (colors_used_actual > ct_max_color_count_new) {
+        image_fail(img, IMAGECOPY_ERROR_UNSUPPORTED,
+                   "%s Error: Colors used (%d) are greater than the new bit "
+                   "depth (%d) will allow (%d), did not convert.\n",
+                   function_name, colors_used_actual, bit_depth_new,
+                   ct_max_color_count_new);
+        return;
+    }
+
+    uint32_t row_size_bytes_new = row_size_bytes(width, bit_depth_new);
+    size_t buffer1_new_size_bytes =
+        calculate_buffer1_byte_count(width, height, bit_depth_new);
+    uint8_t *color_table_new =
+        create_buffer1(img->arena, ct_byte_count(bit_depth_new));
+    uint8_t *buffer1_new = create_buffer1(img->arena, buffer1_new_size_bytes);
+    if (!color_table_new || !buffer1_new) {
+        image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                   "%s Error: Could not create the new buffers.\n",
+                   function_name);
+        return;
+    }
 
-    uint32_t row_size_bytes_new = row_size_bytes(img->width, bit_depth_new);
+    // Entries past the new table size are unused
+    uint32_t ct_copy_count = ct_byte_count(bit_depth_old);
+    if (ct_copy_count > ct_byte_count(bit_depth_new)) {
+        ct_copy_count = ct_byte_count(bit_depth_new);
+    }
+    memcpy(color_table_new, img->colorTable, ct_copy_count);
 
-    uint16_t ct_byte_count_new = 0;
-    uint32_t ct_max_color_count_new = 0;
-    uint8_t *color_table_new = NULL;
-    uint32_t buffer1_new_size_bytes = 0;
-    uint8_t *buffer1_new = NULL;
+    int64_t wide = repack_rows(img->pixel_data, img->row_size_bytes,
+                               bit_depth_old, buffer1_new, row_size_bytes_new,
+                               bit_depth_new, width, height, NULL);
+    if (wide < 0) {
+        image_fail(img, IMAGECOPY_ERROR_UNSUPPORTED,
+                   "%s Error: Could not repack %d-bit to %d-bit.\n",
+                   function_name, bit_depth_old, bit_depth_new);
+        return;
+    }
+    if (wide > 0) {
+        DEBUG_LOG(
+                "%s Warning: %lld pixels use indices past %d colors.\n",
+                function_name, (long long)wide, ct_max_color_count_new);
+    }
+    DEBUG_LOG("%s Repacked %d-bit to %d-bit, %zu bytes.\n", function_name,
+           bit_depth_old, bit_depth_new, buffer1_new_size_bytes);
 
-    if ((bit_depth_new >= 1) && (bit_depth_new <= 8)) {
-        ct_byte_count_new = ct_byte_count(bit_depth_new);
-        ct_max_color_count_new = ct_max_color_count(bit_depth_new);
-        color_table_new = create_buffer1(ct_byte_count_new);
+    img->colorTable = color_table_new;
+    img->pixel_data = buffer1_new;
+    img->image_byte_count = buffer1_new_size_bytes;
+    img->row_size_bytes = row_size_bytes_new;
+    img->ct_max_color_count = ct_max_color_count_new;
+}
 
-        if (!color_table_new) {
-            fprintf(stderr, "[%s] Could not create new color table! %d\n",
-                    function_name, ct_byte_count_new);
+// --optimize-depth: pick the smallest of 1, 4, 8 and 24 bits that keeps
+// every colour and set bit_depth_out to it. 24-bit images with at most 256
+// colours are left to reduce_24_to_indexed, whose exact palette keeps them
+// all. Indexed images have their used entries moved to the front of the
+// table, then convert_bit_depth_if_color_count_matches repacks them.
+void optimize_bit_depth(Image_Data *img) {
+    const char *function_name = "optimize_bit_depth";
+    uint32_t width = img->width;
+    uint32_t height = img->height;
+    uint32_t colors = 0;
+
+    if (img->bit_depth_in == 24) {
+        colors = count_colors_upto(img->pixel_data, width, height,
+                                   img->row_size_bytes, 256);
+        if (!colors) {
+            image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                       "[%s] Error: Could not count the colors.\n",
+                       function_name);
             return;
         }
-
-        buffer1_new_size_bytes =
-            calculate_buffer1_byte_count(width, height, bit_depth_new);
-
-        printf("%s buffer1_new_size_bytes : %u \n", function_name,
-               buffer1_new_size_bytes);
-
-        buffer1_new = create_buffer1(buffer1_new_size_bytes);
-
-        printf("New CT buffer created.\n");
-        if (!buffer1_new) {
-            free(color_table_new);
-            fprintf(stderr, "[%s] Could not create new image buffer! %d\n",
-                    function_name, ct_byte_count_new);
+        // Exact palette, no reduction
+        img->output_color_count = 0;
+    } else if (img->bit_depth_in <= 8 && img->colorTable) {
+        // Indices actually used, from an 8-bit copy of the rows
+        uint8_t *plane = arena_alloc(img->arena, (size_t)width * height);
+        if (!plane) {
+            image_fail(img, IMAGECOPY_ERROR_MEMORY,
+                       "[%s] Error: Could not allocate the index plane.\n",
+                       function_name);
             return;
         }
-        printf("New image buffer created.\n");
-
-    } else if (bit_depth_new == 24) {
-    }
-
-    // By this point the new buffers are created
-
-    if ((bit_depth_old <= 8)) {
-        if (bit_depth_new <= 8) {
-
-            if (colors_used_actual > ct_max_color_count_new) {
-                fprintf(
-                    stderr,
-                    "[%s] Error: Colors used (%d)are greater than the new bit "
-                    "depth (%d) will allow(%d), did not convert.\n"
-                    "Did not convert!\n",
-                    function_name, colors_used_actual, bit_depth_new,
-                    ct_max_color_count_new);
-                return;
-            }
-
-            // uint32_t row_size_bytes_new = row_size_bytes(img->width,
-            // bit_depth_new); uint32_t img_byte_count_new = row_size_bytes_new
-            // * img->height;
-            printf("Bit_depth_new: %d\n", bit_depth_new);
-
-            uint8_t value = 0;
-
-            // Copying old ct array into the new
-            for (uint16_t i = 0; i < colors_used_actual * 4; ++i) {
-                color_table_new[i] = img->colorTable[i];
+        repack_rows(img->pixel_data, img->row_size_bytes, img->bit_depth_in,
+                    plane, width, 8, width, height, NULL);
+        bool used[256] = {false};
+        for (size_t i = 0; i < (size_t)width * height; i++) {
+            used[plane[i]] = true;
+        }
+
+        // Compact the used entries, in table order
+        uint8_t map[256];
+        bool identity = true;
+        uint16_t ct_max = ct_max_color_count(img->bit_depth_in);
+        for (uint16_t i = 0; i < ct_max; i++) {
+            map[i] = (uint8_t)colors;
+            if (used[i]) {
+                identity = identity && colors == i;
+                memmove(img->colorTable + colors * 4, img->colorTable + i * 4,
+                        4);
+                colors++;
             }
-
-            printf("Old color table:\n");
-            printColorTable(img->colorTable, 2);
-            printf("New color table:\n");
-            printColorTable(color_table_new, 2);
-
-            for (uint32_t y = 0; y < height; ++y) {
-
-                for (uint32_t x = 0; x < width; ++x) {
-                    value = read_pixel1(img->pixel_data, width, height, x, y,
-                                        bit_depth_old);
-                    // assert((value == 0) || (value == 1));
-                    if ((value != 0) && (value != 1)) {
-                        printf("Bad value: %d ", value);
-                    }
-                    write_pixel1(buffer1_new, width, height, x, y,
-                                 bit_depth_new, value);
-                }
-            }
-
-            // img->bit_depth = bit_depth_new;
-            img->image_byte_count = buffer1_new_size_bytes;
-            img->row_size_bytes = row_size_bytes_new;
-
-            free(img->colorTable);
-            img->colorTable = NULL;
-            free(img->pixel_data);
-            img->pixel_data = NULL;
-
-            img->pixel_data = buffer1_new;
-            img->colorTable = color_table_new;
         }
+        if (!identity) {
+            repack_rows(plane, width, 8, img->pixel_data, img->row_size_bytes,
+                        img->bit_depth_in, width, height, map);
+        }
+        memset(img->colorTable + colors * 4, 0, (ct_max - colors) * 4);
+        img->colors_used_actual = colors;
+    } else {
         return;
     }
-    return;
-}
\ No newline at end of file
+
+    uint8_t depth = 24;
+    if (colors <= 2) {
+        depth = 1;
+    } else if (colors <= 16) {
+        depth = 4;
+    } else if (colors <= 256) {
+        depth = 8;
+    }
+    // 2-bit input with 3 or 4 colours stays 2-bit
+    if (depth > img->bit_depth_in) {
+        depth = img->bit_depth_in;
+    }
+    if (colors > 256) {
+        DEBUG_LOG("Optimize depth: more than 256 colors, %d-bit\n", depth);
+    } else {
+        DEBUG_LOG("Optimize depth: %u colors, %d-bit\n", colors, depth);
+    }
+    img->bit_depth_out = depth;
+}
@@ -2,8 +2,11 @@
 #define IMAGE_HANDLER_H
 
 
+#include "arena.h"
+#include "imagecopy.h"
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -34,6 +37,8 @@ typedef struct {
 // } RGBEntry;
 
 
+struct Kernel; // convolution.h
+
 enum ImageType { INDEXED = 1, RGB24 = 3, RGBA32 = 4 };
 enum Mode {
     NO_MODE = 0,
@@ -53,33 +58,77 @@ enum Mode {
     FLIP,
     BLUR,
     SEPIA,
-    FILTER
+    FILTER,
+    TONE
 };
 enum Invert { RGB_INVERT = 1, HSV_INVERT = 2 };
+// Where the current 24-bit pixels are: BGR rows, or one plane per channel
+enum Layout { LAYOUT_INTERLEAVED = 0, LAYOUT_PLANAR };
 enum Dir { H = 1, V = 2 };
 
+// Pointwise tone operations that can be chained in one run (TONE mode).
+// Each maps a value to a value, so the chain composes into one table.
+enum ToneOp { TONE_BRIGHT = 1, TONE_EQUAL, TONE_INV, TONE_MONO };
+#define TONE_OPS_MAX 16
+
+typedef struct {
+    enum ToneOp op;
+    int16_t value; // TONE_BRIGHT: offset -255 to 255, unused otherwise
+} Tone_Step;
+
+// One op of a pipeline (--ops) with the settings it runs with, loaded into
+// the Image_Data fields of the same names before the op runs
+typedef struct {
+    enum Mode mode;
+    float_t mono_threshold;
+    uint8_t dither_mode; // DITHER
+    int16_t degrees;
+    enum Dir direction;
+    uint16_t blur_level;
+    int8_t filter_index; // FILTER, in kernel_list
+    Tone_Step tone_steps[TONE_OPS_MAX];
+    uint8_t tone_step_count;
+} Op_Step;
+#define OP_STEPS_MAX 16
+
+// A window onto pixel rows, no copy. 'base' is the first byte of the top
+// row of the window and rows are 'stride' bytes apart, negative for
+// bottom-up BMP rows. For 1, 2 and 4-bit pixels the window starts
+// 'bit_offset' bits into that byte.
+typedef struct {
+    uint8_t *base;
+    ptrdiff_t stride;
+    uint32_t x, y; // top left corner in the full image
+    uint32_t width;
+    uint32_t height;
+    uint8_t bit_depth;
+    uint8_t bit_offset;
+} Image_View;
+
 typedef struct {
     //unsigned char header[HEADER_SIZE];
     uint32_t width;
     uint32_t height;
+    // One row is at most 4 GB (load_bitmap checks), the image is not
     uint32_t row_size_bytes;
-    uint32_t image_pixel_count;
-    uint32_t image_byte_count;
+    uint64_t image_pixel_count;
+    size_t image_byte_count;
     uint8_t bit_depth_in;
     uint8_t bit_depth_out;
     uint8_t colorMode;
     float_t mono_threshold; // 0.0 to 1.0 inclusive
     bool dither;
+    uint8_t dither_mode; // Dither_Mode from dither.h, -d / --dither
+    bool dither_serpentine; // --serpentine, for the error diffusion modes
     bool brightness_mode;
     int16_t bright_value;   // -255 to 255 inclusive
     float_t bright_percent; // -1.0 to 1.0 inclusive
-    uint8_t *histogram1; // In the raw color range (hist1) or equalized (equal1),
-    uint8_t **histogram3; // In the raw color range (hist1) or equalized (equal1),
-                        // [0..255]
+    uint64_t *histogram1; // Pixel counts per value (hist1), [0..255]
+    uint64_t **histogram3; // Pixel counts per value per BGR channel (hist3)
     float_t *histogram_n; // Normalized to [0..1]
     uint16_t HIST_RANGE_MAX;    // 256 for 8 bit images, set by calling hist1
-    uint8_t hist_max_value1;
-    uint8_t hist_max_value3[3];
+    uint64_t hist_max_value1;
+    uint64_t hist_max_value3[3];
     int16_t degrees;
     uint16_t blur_level;
     bool CT_EXISTS;
@@ -87,14 +136,44 @@ typedef struct {
     unsigned char *colorTable;
     unsigned char *pixel_data; //[imgSize], 1 channel for 8-bit images or less
     unsigned char **pixelDataRows; //[imgSize][3], 3 channel for rgb
+    // 24-bit only. With LAYOUT_PLANAR the pixels are in planes[] (B, G, R,
+    // planar.h) and pixel_data is stale until image_set_layout converts
+    // back to LAYOUT_INTERLEAVED.
+    enum Layout layout;
+    uint8_t *planes[3];
+    uint32_t plane_stride;
+    size_t plane_bytes; // allocated size of each plane
     enum Dir direction;           // Flip direction, <H>orizontal or <V>ertical
     enum Mode mode;
     enum Invert invert;
     char* filter_name;
     int8_t filter_index;
+    struct Kernel *kernel; // --kernel, used by FILTER instead of filter_index
     char* mode_suffix;
     uint16_t colors_used_actual;
     uint16_t output_color_count;
+    uint8_t quantizer; // Quantizer from reduce_colors_24.h, --quantizer
+    bool crop; // --crop x,y,w,h, only the window is read from the file
+    uint32_t crop_x, crop_y, crop_width, crop_height;
+    bool optimize_depth; // --optimize-depth, smallest lossless bit_depth_out
+    // Every buffer above comes from the job's arena and lives until the
+    // owner of the arena resets it. Set before loading.
+    Arena *arena;
+    Tone_Step tone_steps[TONE_OPS_MAX]; // TONE mode, in command line order
+    uint8_t tone_step_count;
+    // A pipeline: the steps run in order in place of mode, which ends up as
+    // the mode of the last step
+    Op_Step steps[OP_STEPS_MAX];
+    uint8_t step_count;
+    // Ping-pong partner of pixel_data. Ops that cannot work in place (flip,
+    // rotate, filter) write into it and the two swap, so a pipeline of them
+    // goes back and forth between the same two buffers.
+    uint8_t *spare;
+    size_t spare_bytes;
+    uint8_t **spare_rows; // 24-bit, rows of spare like pixelDataRows
+    uint32_t spare_row_count;
+    // First failure of the job, ops after it are skipped
+    Imagecopy_Status status;
 
 } Image_Data;
 
@@ -104,10 +183,33 @@ void printColorTable(uint8_t* colorTable, size_t numColors);
 char *get_suffix(Image_Data *img);
 char *get_mode_string(enum Mode mode);
 void init_image(Image_Data *img);
-uint8_t *create_buffer1(uint32_t image_byte_count);
-void create_buffer3(uint8_t ***buffer, uint32_t rows, uint32_t cols);
-uint8_t **pixel_data_to_buffer3(uint8_t *pixel_data, uint32_t width, uint32_t height);
+// Record a failure of the job: the first status sticks, the message goes
+// to report_error (report.h)
+void image_fail(Image_Data *img, Imagecopy_Status status, const char *format,
+                ...)
+#if defined(__GNUC__)
+    __attribute__((format(printf, 3, 4)))
+#endif
+    ;
+uint8_t *create_buffer1(Arena *arena, size_t image_byte_count);
+uint8_t **get_pixel_rows(Arena *arena, uint8_t *pixel_data, uint32_t width,
+                         uint32_t height, uint8_t bit_depth);
+uint8_t **pixel_data_to_buffer3(Arena *arena, uint8_t *pixel_data,
+                                uint32_t width, uint32_t height);
 void process_image(Image_Data *img);
+
+// The whole image as a view, top row first
+Image_View image_view(const Image_Data *img);
+// Window of a view, false if it is empty or reaches outside the view
+bool view_crop(const Image_View *view, uint32_t x, uint32_t y, uint32_t width,
+               uint32_t height, Image_View *out);
+static inline uint8_t *view_row(const Image_View *view, uint32_t y) {
+    return view->base + (ptrdiff_t)y * view->stride;
+}
+// Copy a view out to BMP rows (bottom-up) of 'dst_row_size' bytes, with
+// zeroed padding
+void view_copy(const Image_View *view, uint8_t *dst, uint32_t dst_row_size);
+void image_set_layout(Image_Data *img, enum Layout layout);
 void free_img(Image_Data *img);
 void copy13(Image_Data *img);
 void gray13(Image_Data *img); // *new*
@@ -132,7 +234,11 @@ void rot13(Image_Data *img);
 
 void blur1(Image_Data *img);
 void blur3(Image_Data *img);
+void sepia1(Image_Data *img);
 void sepia3(Image_Data *img);
 void filter1(Image_Data *img);
+void filter3(Image_Data *img);
+void tone13(Image_Data *img);
 void convert_bit_depth_if_color_count_matches(Image_Data *img);
+void optimize_bit_depth(Image_Data *img);
 #endif
@@ -0,0 +1,604 @@
+#include "imagecopy.h"
+#include "bmp_file_handler.h"
+#include "convolution.h"
+#include "dither.h"
+#include "image_data_handler.h"
+#include "pool.h"
+#include "reduce_colors_24.h"
+#include "report.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#define close _close
+#define dup _dup
+#define fdopen _fdopen
+#define read _read
+#else
+#include <unistd.h>
+#endif
+
+#define IMAGECOPY_ERROR_MAX 256
+#define IMAGECOPY_SUFFIX_MAX 512
+
+struct Imagecopy {
+    // Every buffer of the current image, reset by each load
+    Arena arena;
+    Bitmap bmp;
+    Image_Data img;
+    Imagecopy_Options options;
+    Kernel *kernel;      // options.kernel, loaded by set_options
+    int8_t filter_index; // options.filter in kernel_list
+    int8_t step_filters[IMAGECOPY_STEPS_MAX]; // the same for the steps
+    uint8_t bit_depth_in; // of the loaded file, the op may change img's
+    bool loaded;
+    bool processed;
+    char suffix[IMAGECOPY_SUFFIX_MAX];
+    char error[IMAGECOPY_ERROR_MAX];
+};
+
+// Imagecopy_Op to the internal mode
+static const enum Mode op_modes[] = {
+    [IMAGECOPY_COPY] = COPY,
+    [IMAGECOPY_GRAY] = GRAY,
+    [IMAGECOPY_MONO] = MONO,
+    [IMAGECOPY_DITHER] = DITHER,
+    [IMAGECOPY_INVERT] = INV,
+    [IMAGECOPY_INVERT_RGB] = INV_RGB,
+    [IMAGECOPY_INVERT_HSV] = INV_HSV,
+    [IMAGECOPY_HIST] = HIST,
+    [IMAGECOPY_HIST_NORMALIZED] = HIST_N,
+    [IMAGECOPY_EQUALIZE] = EQUAL,
+    [IMAGECOPY_ROTATE] = ROT,
+    [IMAGECOPY_FLIP] = FLIP,
+    [IMAGECOPY_BLUR] = BLUR,
+    [IMAGECOPY_SEPIA] = SEPIA,
+    [IMAGECOPY_FILTER] = FILTER,
+    [IMAGECOPY_TONE] = TONE,
+};
+#define OP_COUNT (sizeof(op_modes) / sizeof(op_modes[0]))
+
+_Static_assert((int)IMAGECOPY_TONE_BRIGHT == TONE_BRIGHT &&
+                   (int)IMAGECOPY_TONE_EQUALIZE == TONE_EQUAL &&
+                   (int)IMAGECOPY_TONE_INVERT == TONE_INV &&
+                   (int)IMAGECOPY_TONE_MONO == TONE_MONO,
+               "Tone ops are passed through as they are");
+_Static_assert(IMAGECOPY_TONE_MAX == TONE_OPS_MAX, "Tone step count");
+
+// Every entry point clears the thread's message first and keeps the first
+// one of a failure
+static Imagecopy_Status finish(Imagecopy *ctx, Imagecopy_Status status) {
+    if (status == IMAGECOPY_OK) {
+        ctx->error[0] = '\0';
+        return status;
+    }
+    const char *message = report_last_error();
+    snprintf(ctx->error, sizeof(ctx->error), "%s",
+             *message ? message : imagecopy_status_string(status));
+    return status;
+}
+
+static Imagecopy_Status fail(Imagecopy *ctx, Imagecopy_Status status,
+                             const char *message) {
+    report_error("%s", message);
+    return finish(ctx, status);
+}
+
+void imagecopy_options_init(Imagecopy_Options *options) {
+    memset(options, 0, sizeof(*options));
+    options->op = IMAGECOPY_COPY;
+    options->mono_threshold = IMAGECOPY_MONO_THRESHOLD;
+    options->dither_mode = DITHER_FS;
+    options->quantizer = QUANT_MEDIAN;
+    for (int i = 0; i < IMAGECOPY_STEPS_MAX; i++) {
+        options->steps[i].op = IMAGECOPY_COPY;
+        options->steps[i].mono_threshold = IMAGECOPY_MONO_THRESHOLD;
+        options->steps[i].dither_mode = DITHER_FS;
+    }
+}
+
+Imagecopy *imagecopy_create(void) {
+    Imagecopy *ctx = calloc(1, sizeof(Imagecopy));
+    if (!ctx) {
+        return NULL;
+    }
+    arena_init(&ctx->arena);
+    imagecopy_options_init(&ctx->options);
+    ctx->filter_index = -1;
+    return ctx;
+}
+
+void imagecopy_destroy(Imagecopy *ctx) {
+    if (!ctx) {
+        return;
+    }
+    kernel_free(ctx->kernel);
+    arena_free(&ctx->arena);
+    free(ctx);
+}
+
+// The single op of the options as a step
+static Imagecopy_Step options_step(const Imagecopy_Options *o) {
+    Imagecopy_Step step = {
+        .op = o->op,
+        .mono_threshold = o->mono_threshold,
+        .dither_mode = o->dither_mode,
+        .degrees = o->degrees,
+        .flip_vertical = o->flip_vertical,
+        .blur_level = o->blur_level,
+        .filter = o->filter,
+        .tone_step_count = o->tone_step_count,
+    };
+    memcpy(step.tone_steps, o->tone_steps, sizeof(step.tone_steps));
+    return step;
+}
+
+// NULL if the settings the op reads are valid, the message if not
+static const char *check_step(const Imagecopy_Step *step) {
+    if ((unsigned)step->op >= OP_COUNT) {
+        return "Error: Unknown op.";
+    }
+    if (step->mono_threshold < 0.0f || step->mono_threshold > 1.0f) {
+        return "Error: Monochrome threshold must be 0.0 to 1.0.";
+    }
+    if (step->dither_mode < DITHER_FS || step->dither_mode > DITHER_BLUENOISE) {
+        return "Error: Unknown dither mode.";
+    }
+    if (step->op == IMAGECOPY_ROTATE &&
+        (step->degrees % 90 || step->degrees < -270 || step->degrees > 270)) {
+        return "Error: Rotation must be a multiple of 90, -270 to 270.";
+    }
+    if (step->op == IMAGECOPY_BLUR &&
+        (step->blur_level < 1 || step->blur_level > 255)) {
+        return "Error: Blur level must be 1 to 255.";
+    }
+    if (step->op == IMAGECOPY_TONE &&
+        (step->tone_step_count == 0 ||
+         step->tone_step_count > IMAGECOPY_TONE_MAX)) {
+        return "Error: A tone chain needs 1 to 16 steps.";
+    }
+    return NULL;
+}
+
+// -1 if there is no built-in filter of that name
+static int8_t find_filter(const char *name) {
+    for (int i = 0; name && kernel_list[i].name; i++) {
+        if (strcmp(name, kernel_list[i].name) == 0) {
+            return (int8_t)i;
+        }
+    }
+    return -1;
+}
+
+Imagecopy_Status imagecopy_set_options(Imagecopy *ctx,
+                                       const Imagecopy_Options *options) {
+    if (!ctx || !options) {
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    report_clear();
+    const Imagecopy_Options *o = options;
+
+    if (o->step_count > IMAGECOPY_STEPS_MAX) {
+        return fail(ctx, IMAGECOPY_ERROR_ARGUMENT,
+                    "Error: A pipeline has at most 16 steps.");
+    }
+    if (!o->step_count) {
+        Imagecopy_Step single = options_step(o);
+        const char *message = check_step(&single);
+        if (message) {
+            return fail(ctx, IMAGECOPY_ERROR_ARGUMENT, message);
+        }
+    }
+    int8_t step_filters[IMAGECOPY_STEPS_MAX];
+    for (uint8_t i = 0; i < o->step_count; i++) {
+        const Imagecopy_Step *step = &o->steps[i];
+        const char *message = check_step(step);
+        if (message) {
+            return fail(ctx, IMAGECOPY_ERROR_ARGUMENT, message);
+        }
+        if ((step->op == IMAGECOPY_HIST ||
+             step->op == IMAGECOPY_HIST_NORMALIZED) &&
+            i + 1 < o->step_count) {
+            return fail(ctx, IMAGECOPY_ERROR_ARGUMENT,
+                        "Error: A histogram can only be the last step.");
+        }
+        step_filters[i] = -1;
+        if (step->op == IMAGECOPY_FILTER) {
+            step_filters[i] = find_filter(step->filter);
+            if (step_filters[i] < 0) {
+                return fail(ctx, IMAGECOPY_ERROR_ARGUMENT,
+                            "Error: Unknown filter.");
+            }
+        }
+    }
+    // Dithers the reduction to indexed colour with a pipeline too
+    if (o->dither_mode < DITHER_FS || o->dither_mode > DITHER_BLUENOISE) {
+        return fail(ctx, IMAGECOPY_ERROR_ARGUMENT, "Error: Unknown dither mode.");
+    }
+    if (o->quantizer < QUANT_MEDIAN || o->quantizer > QUANT_KMEANS) {
+        return fail(ctx, IMAGECOPY_ERROR_ARGUMENT, "Error: Unknown quantizer.");
+    }
+    if ((o->bright_value && o->bright_percent != 0.0f) ||
+        o->bright_value < -255 || o->bright_value > 255 ||
+        o->bright_percent < -1.0f || o->bright_percent > 1.0f) {
+        return fail(ctx, IMAGECOPY_ERROR_ARGUMENT,
+                    "Error: Brightness is one offset -255 to 255 or one fraction "
+                    "-1.0 to 1.0.");
+    }
+    if (o->bit_depth != 0 && o->bit_depth != 1 && o->bit_depth != 4 &&
+        o->bit_depth != 8 && o->bit_depth != 24) {
+        return fail(ctx, IMAGECOPY_ERROR_ARGUMENT,
+                    "Error: Can only set depth to 1, 4, 8 or 24.");
+    }
+    if (o->colors == 1 || o->colors > 256) {
+        return fail(ctx, IMAGECOPY_ERROR_ARGUMENT,
+                    "Error: Colors must be 2 to 256.");
+    }
+    if (o->crop && (!o->crop_width || !o->crop_height)) {
+        return fail(ctx, IMAGECOPY_ERROR_ARGUMENT, "Error: Empty crop.");
+    }
+
+    // The filter is looked up and the kernel parsed once, not per image
+    int8_t filter_index = -1;
+    Kernel *kernel = NULL;
+    if (o->op == IMAGECOPY_FILTER && !o->step_count) {
+        if (o->kernel) {
+            kernel = kernel_load(o->kernel);
+            if (!kernel) {
+                return finish(ctx, IMAGECOPY_ERROR_ARGUMENT);
+            }
+        } else {
+            filter_index = find_filter(o->filter);
+            if (filter_index < 0) {
+                return fail(ctx, IMAGECOPY_ERROR_ARGUMENT, "Error: Unknown filter.");
+            }
+        }
+    }
+
+    kernel_free(ctx->kernel);
+    ctx->kernel = kernel;
+    ctx->filter_index = filter_index;
+    memcpy(ctx->step_filters, step_filters,
+           o->step_count * sizeof(step_filters[0]));
+    ctx->options = *o;
+    // Pointers of the caller are not kept
+    ctx->options.filter = NULL;
+    ctx->options.kernel = NULL;
+    for (int i = 0; i < IMAGECOPY_STEPS_MAX; i++) {
+        ctx->options.steps[i].filter = NULL;
+    }
+    return finish(ctx, IMAGECOPY_OK);
+}
+
+// Image_Data settings for the options, as the command line sets them
+static void apply_options(Imagecopy *ctx, Image_Data *img) {
+    const Imagecopy_Options *o = &ctx->options;
+    img->mode = op_modes[o->op];
+    img->dither = o->dither || o->op == IMAGECOPY_DITHER;
+    img->dither_mode = (uint8_t)o->dither_mode;
+    img->dither_serpentine = o->serpentine;
+    if (o->bright_value || o->bright_percent != 0.0f) {
+        img->brightness_mode = true;
+        img->bright_value = o->bright_value;
+        img->bright_percent = o->bright_percent;
+    }
+    if (o->op == IMAGECOPY_MONO || o->op == IMAGECOPY_TONE) {
+        img->mono_threshold = o->mono_threshold;
+    }
+    img->degrees = o->degrees;
+    img->direction = o->flip_vertical ? V : H;
+    img->blur_level = o->blur_level;
+    if (o->op == IMAGECOPY_FILTER && !o->step_count) {
+        img->kernel = ctx->kernel;
+        img->filter_index = ctx->filter_index;
+        img->filter_name = ctx->kernel
+                               ? "kernel"
+                               : (char *)kernel_list[ctx->filter_index].name;
+    }
+    for (uint8_t i = 0; i < o->tone_step_count; i++) {
+        img->tone_steps[i].op = (enum ToneOp)o->tone_steps[i].op;
+        img->tone_steps[i].value = o->tone_steps[i].value;
+    }
+    img->tone_step_count = o->tone_step_count;
+    for (uint8_t i = 0; i < o->step_count; i++) {
+        const Imagecopy_Step *step = &o->steps[i];
+        Op_Step *op_step = &img->steps[i];
+        op_step->mode = op_modes[step->op];
+        op_step->mono_threshold = step->mono_threshold;
+        op_step->dither_mode = (uint8_t)step->dither_mode;
+        op_step->degrees = step->degrees;
+        op_step->direction = step->flip_vertical ? V : H;
+        op_step->blur_level = step->blur_level;
+        op_step->filter_index = ctx->step_filters[i];
+        for (uint8_t t = 0; t < step->tone_step_count; t++) {
+            op_step->tone_steps[t].op = (enum ToneOp)step->tone_steps[t].op;
+            op_step->tone_steps[t].value = step->tone_steps[t].value;
+        }
+        op_step->tone_step_count = step->tone_step_count;
+    }
+    img->step_count = o->step_count;
+    if (o->step_count) {
+        // The writer goes by the mode the image ends with
+        img->mode = img->steps[o->step_count - 1].mode;
+    }
+    img->bit_depth_out = o->bit_depth;
+    img->output_color_count = o->colors;
+    img->quantizer = (uint8_t)o->quantizer;
+    img->optimize_depth = o->optimize_depth;
+    img->crop = o->crop;
+    img->crop_x = o->crop_x;
+    img->crop_y = o->crop_y;
+    img->crop_width = o->crop_width;
+    img->crop_height = o->crop_height;
+}
+
+// A new job: the last image's memory is reused for this one
+static void begin_load(Imagecopy *ctx) {
+    report_clear();
+    arena_reset(&ctx->arena);
+    init_bitmap(&ctx->bmp);
+    init_image(&ctx->img);
+    ctx->img.arena = &ctx->arena;
+    ctx->bmp.image_data = &ctx->img;
+    apply_options(ctx, &ctx->img);
+    ctx->loaded = false;
+    ctx->processed = false;
+}
+
+static Imagecopy_Status end_load(Imagecopy *ctx, Imagecopy_Status status) {
+    ctx->loaded = status == IMAGECOPY_OK;
+    ctx->bit_depth_in = ctx->img.bit_depth_in;
+    return finish(ctx, status);
+}
+
+Imagecopy_Status imagecopy_load_file(Imagecopy *ctx, const char *path) {
+    if (!ctx || !path) {
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    begin_load(ctx);
+    return end_load(ctx, load_bitmap(&ctx->bmp, (char *)path));
+}
+
+Imagecopy_Status imagecopy_load_memory(Imagecopy *ctx, const void *data,
+                                       size_t size) {
+    if (!ctx || !data) {
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    begin_load(ctx);
+    return end_load(ctx, load_bitmap_memory(&ctx->bmp, data, size));
+}
+
+// A pipe or socket cannot seek, its bytes are read into memory first
+static Imagecopy_Status load_unseekable(Imagecopy *ctx, int fd) {
+    size_t capacity = (size_t)1 << 20;
+    size_t size = 0;
+    uint8_t *data = pool_alloc(capacity, NULL);
+    while (data) {
+        if (size == capacity) {
+            uint8_t *grown = pool_alloc(capacity * 2, NULL);
+            if (grown) {
+                memcpy(grown, data, size);
+                capacity *= 2;
+            }
+            pool_release(data);
+            data = grown;
+            continue;
+        }
+        size_t want = capacity - size;
+        int got = read(fd, data + size, want < 1u << 30 ? want : 1u << 30);
+        if (got < 0) {
+            pool_release(data);
+            report_error("Error: Could not read the input.");
+            return IMAGECOPY_ERROR_IO;
+        }
+        if (got == 0) {
+            break;
+        }
+        size += (size_t)got;
+    }
+    if (!data) {
+        report_error("Error: Out of memory reading the input.");
+        return IMAGECOPY_ERROR_MEMORY;
+    }
+    Imagecopy_Status status = load_bitmap_memory(&ctx->bmp, data, size);
+    pool_release(data);
+    return status;
+}
+
+Imagecopy_Status imagecopy_load_fd(Imagecopy *ctx, int fd) {
+    if (!ctx || fd < 0) {
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    begin_load(ctx);
+    // A stream of its own, closing it leaves the caller's descriptor open
+    int own_fd = dup(fd);
+    FILE *file = own_fd >= 0 ? fdopen(own_fd, "rb") : NULL;
+    if (!file) {
+        if (own_fd >= 0) {
+            close(own_fd);
+        }
+        report_error("Error: Could not open descriptor %d.", fd);
+        return end_load(ctx, IMAGECOPY_ERROR_IO);
+    }
+    Imagecopy_Status status = ftell(file) < 0
+                                  ? load_unseekable(ctx, own_fd)
+                                  : load_bitmap_stream(&ctx->bmp, file);
+    fclose(file);
+    return end_load(ctx, status);
+}
+
+Imagecopy_Status imagecopy_process(Imagecopy *ctx) {
+    if (!ctx) {
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    report_clear();
+    if (!ctx->loaded || ctx->processed) {
+        return fail(ctx, IMAGECOPY_ERROR_ARGUMENT,
+                    ctx->loaded ? "Error: The image was already processed."
+                                : "Error: No image loaded.");
+    }
+    ctx->processed = true;
+    return finish(ctx, process_bmp(&ctx->bmp));
+}
+
+static Imagecopy_Status check_processed(Imagecopy *ctx) {
+    if (!ctx->processed || ctx->img.status) {
+        return fail(ctx, IMAGECOPY_ERROR_ARGUMENT,
+                    "Error: No processed image to write.");
+    }
+    return IMAGECOPY_OK;
+}
+
+Imagecopy_Status imagecopy_write_file(Imagecopy *ctx, const char *path) {
+    if (!ctx || !path) {
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    report_clear();
+    Imagecopy_Status status = check_processed(ctx);
+    if (status) {
+        return status;
+    }
+    return finish(ctx, write_bitmap(&ctx->bmp, (char *)path));
+}
+
+Imagecopy_Status imagecopy_write_memory(Imagecopy *ctx, const void **data,
+                                        size_t *size) {
+    if (!ctx || !data || !size) {
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    report_clear();
+    Imagecopy_Status status = check_processed(ctx);
+    if (status) {
+        return status;
+    }
+    const uint8_t *bytes = NULL;
+    status = write_bitmap_memory(&ctx->bmp, &bytes, size);
+    *data = bytes;
+    return finish(ctx, status);
+}
+
+Imagecopy_Status imagecopy_write_fd(Imagecopy *ctx, int fd) {
+    if (!ctx || fd < 0) {
+        return IMAGECOPY_ERROR_ARGUMENT;
+    }
+    report_clear();
+    Imagecopy_Status status = check_processed(ctx);
+    if (status) {
+        return status;
+    }
+    int own_fd = dup(fd);
+    FILE *file = own_fd >= 0 ? fdopen(own_fd, "wb") : NULL;
+    if (!file) {
+        if (own_fd >= 0) {
+            close(own_fd);
+        }
+        report_error("Error: Could not open descriptor %d.", fd);
+        return finish(ctx, IMAGECOPY_ERROR_IO);
+    }
+    status = write_bitmap_stream(&ctx->bmp, file);
+    if (fclose(file) != 0 && status == IMAGECOPY_OK) {
+        report_error("Error: Could not write descriptor %d.", fd);
+        status = IMAGECOPY_ERROR_IO;
+    }
+    return finish(ctx, status);
+}
+
+const char *imagecopy_error(const Imagecopy *ctx) {
+    return ctx ? ctx->error : "No context.";
+}
+
+const char *imagecopy_status_string(Imagecopy_Status status) {
+    switch (status) {
+    case IMAGECOPY_OK:
+        return "OK";
+    case IMAGECOPY_ERROR_ARGUMENT:
+        return "Invalid argument";
+    case IMAGECOPY_ERROR_IO:
+        return "I/O error";
+    case IMAGECOPY_ERROR_FORMAT:
+        return "Not a supported BMP file";
+    case IMAGECOPY_ERROR_MEMORY:
+        return "Out of memory";
+    case IMAGECOPY_ERROR_UNSUPPORTED:
+        return "Not supported for this image";
+    }
+    return "Unknown status";
+}
+
+const char *imagecopy_op_name(Imagecopy_Op op) {
+    return (unsigned)op < OP_COUNT ? get_mode_string(op_modes[op])
+                                   : "Unknown op";
+}
+
+void imagecopy_get_info(const Imagecopy *ctx, Imagecopy_Info *info) {
+    memset(info, 0, sizeof(*info));
+    if (ctx && ctx->loaded) {
+        info->width = ctx->img.width;
+        info->height = ctx->img.height;
+        info->bit_depth_in = ctx->bit_depth_in;
+        info->bit_depth_out = ctx->img.bit_depth_out;
+        info->colors_used = ctx->img.colors_used_actual;
+        info->file_bytes_in = ctx->bmp.file_size_read;
+        info->crop_row_bytes = ctx->bmp.crop_row_bytes;
+    }
+    if (ctx && ctx->processed && !ctx->img.status) {
+        info->file_bytes_out = ctx->bmp.file_header.offset_bytes +
+                               (uint64_t)ctx->img.image_byte_count;
+    }
+    if (ctx) {
+        info->arena_bytes = ctx->arena.used;
+        info->arena_blocks = ctx->arena.block_count;
+    }
+
+    Pool_Stats pool_stats;
+    pool_get_stats(&pool_stats);
+    info->pool_fresh_count = pool_stats.fresh_count;
+    info->pool_reuse_count = pool_stats.reuse_count;
+    info->pool_cached_bytes = pool_stats.cached_bytes;
+}
+
+const char *imagecopy_suffix(Imagecopy *ctx) {
+    if (!ctx) {
+        return NULL;
+    }
+    // get_suffix reads the mode settings only, a scratch Image_Data does
+    Image_Data img;
+    init_image(&img);
+    img.arena = &ctx->arena;
+    apply_options(ctx, &img);
+    char *suffix = get_suffix(&img);
+    if (!suffix) {
+        return NULL;
+    }
+    // Creates a suffix with the amount of blur levels.
+    if (!img.step_count && img.mode == BLUR && img.blur_level > 0) {
+        snprintf(ctx->suffix, sizeof(ctx->suffix), "%s_%d", suffix,
+                 img.blur_level);
+    } else {
+        snprintf(ctx->suffix, sizeof(ctx->suffix), "%s", suffix);
+    }
+    return ctx->suffix;
+}
+
+int imagecopy_dither_from_name(const char *name) {
+    return dither_from_name(name);
+}
+
+int imagecopy_quantizer_from_name(const char *name) {
+    return quantizer_from_name(name);
+}
+
+const char *imagecopy_filter_name(int index) {
+    for (int i = 0; i <= index; i++) {
+        if (!kernel_list[i].name) {
+            return NULL;
+        }
+    }
+    return index >= 0 ? kernel_list[index].name : NULL;
+}
+
+void imagecopy_set_hugepages(bool enable) { pool_set_hugepages(enable); }
+
+void imagecopy_trim(size_t keep_bytes) { pool_trim(keep_bytes); }
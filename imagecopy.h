@@ -0,0 +1,188 @@
+#ifndef IMAGECOPY_H
+#define IMAGECOPY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// libimagecopy, the BMP processing behind the imagecopy command as a
+// library. One Imagecopy context runs one image at a time: load, process,
+// write, and load again to reuse its memory for the next image.
+//
+// Reentrant. A context holds all the state of its job, contexts on
+// different threads never touch each other, one context must not be used
+// by two threads at once. The only shared state is the process-wide buffer
+// pool (pool.h) that the contexts take their memory from, it has its own
+// lock. Nothing is written to stdout or stderr, every call returns a
+// status and imagecopy_error() has the message.
+
+typedef struct Imagecopy Imagecopy;
+
+typedef enum {
+    IMAGECOPY_OK = 0,
+    IMAGECOPY_ERROR_ARGUMENT,    // bad option or call order
+    IMAGECOPY_ERROR_IO,          // open, read or write failed
+    IMAGECOPY_ERROR_FORMAT,      // not a BMP this library reads
+    IMAGECOPY_ERROR_MEMORY,      // out of memory
+    IMAGECOPY_ERROR_UNSUPPORTED  // op not available for the bit depth
+} Imagecopy_Status;
+
+typedef enum {
+    IMAGECOPY_COPY = 0,
+    IMAGECOPY_GRAY,
+    IMAGECOPY_MONO,       // threshold at mono_threshold
+    IMAGECOPY_DITHER,     // monochrome with dither_mode
+    IMAGECOPY_INVERT,
+    IMAGECOPY_INVERT_RGB,
+    IMAGECOPY_INVERT_HSV,
+    IMAGECOPY_HIST,       // text output, counts per value [0..255], 24-bit
+                          // has red, green and blue columns
+    IMAGECOPY_HIST_NORMALIZED, // text output, counts scaled to [0..1]
+    IMAGECOPY_EQUALIZE,
+    IMAGECOPY_ROTATE,     // by degrees
+    IMAGECOPY_FLIP,       // horizontal, or vertical with flip_vertical
+    IMAGECOPY_BLUR,       // blur_level iterated 3x3 averages
+    IMAGECOPY_SEPIA,
+    IMAGECOPY_FILTER,     // filter or kernel
+    IMAGECOPY_TONE        // tone_steps as one pass
+} Imagecopy_Op;
+
+// Pointwise steps of IMAGECOPY_TONE, mono can only be the last one
+typedef enum {
+    IMAGECOPY_TONE_BRIGHT = 1, // value: offset -255 to 255
+    IMAGECOPY_TONE_EQUALIZE,
+    IMAGECOPY_TONE_INVERT,
+    IMAGECOPY_TONE_MONO        // threshold at mono_threshold
+} Imagecopy_Tone_Op;
+
+#define IMAGECOPY_TONE_MAX 16
+// Default mono_threshold
+#define IMAGECOPY_MONO_THRESHOLD 0.5f
+
+typedef struct {
+    Imagecopy_Tone_Op op;
+    int16_t value;
+} Imagecopy_Tone_Step;
+
+#define IMAGECOPY_STEPS_MAX 16
+
+// One op of a pipeline with the settings of its own, the fields of
+// Imagecopy_Options of the same names. Fields the op does not read are
+// ignored.
+typedef struct {
+    Imagecopy_Op op;
+    float mono_threshold;   // MONO, TONE ending in mono
+    int dither_mode;        // DITHER
+    int16_t degrees;        // ROTATE
+    bool flip_vertical;     // FLIP
+    uint16_t blur_level;    // BLUR
+    const char *filter;     // FILTER, a built-in filter only
+    Imagecopy_Tone_Step tone_steps[IMAGECOPY_TONE_MAX]; // TONE
+    uint8_t tone_step_count;
+} Imagecopy_Step;
+
+typedef struct {
+    Imagecopy_Op op;
+    float mono_threshold; // 0.0 to 1.0
+    // Dithers IMAGECOPY_DITHER and the reduction of 24-bit images to
+    // indexed colour. dither_mode from imagecopy_dither_from_name.
+    bool dither;
+    int dither_mode;
+    bool serpentine;
+    // Brightness before the op, an offset (-255 to 255) or a fraction
+    // (-1.0 to 1.0). At most one of them is not 0.
+    int16_t bright_value;
+    float bright_percent;
+    int16_t degrees; // multiple of 90, -270 to 270
+    bool flip_vertical;
+    uint16_t blur_level; // 1 to 255
+    // IMAGECOPY_FILTER: a built-in filter (imagecopy_filter_name), or a
+    // kernel file or inline weights "w w w; w w w; w w w" with optional
+    // divisor=<f> and bias=<f>. The kernel wins if both are set.
+    const char *filter;
+    const char *kernel;
+    uint8_t bit_depth;  // output depth 1, 4, 8 or 24, 0 keeps the input's
+    uint16_t colors;    // 2 to 256 when reducing 24-bit, 0 for all
+    int quantizer;      // imagecopy_quantizer_from_name
+    bool optimize_depth; // smallest lossless depth, overrides the two above
+    // Only the crop_width x crop_height window at crop_x, crop_y (top
+    // left) is read from the file
+    bool crop;
+    uint32_t crop_x, crop_y, crop_width, crop_height;
+    Imagecopy_Tone_Step tone_steps[IMAGECOPY_TONE_MAX];
+    uint8_t tone_step_count;
+    // A pipeline: with step_count > 0 the steps run in order on the image
+    // in memory and op and its settings above are ignored. Brightness,
+    // dither (for the reduction), depth, colors and crop are still of the
+    // job as a whole. A histogram can only be the last step.
+    Imagecopy_Step steps[IMAGECOPY_STEPS_MAX];
+    uint8_t step_count;
+} Imagecopy_Options;
+
+typedef struct {
+    uint32_t width, height; // after a crop or a rotation
+    uint8_t bit_depth_in, bit_depth_out;
+    uint16_t colors_used;
+    uint64_t file_bytes_in;  // size of the loaded file
+    uint64_t file_bytes_out; // size of the BMP write would produce
+    uint32_t crop_row_bytes; // crop: bytes read of each of 'height' rows
+    // Memory of the context, and of the shared pool
+    size_t arena_bytes;
+    uint32_t arena_blocks;
+    uint64_t pool_fresh_count, pool_reuse_count;
+    size_t pool_cached_bytes;
+} Imagecopy_Info;
+
+// Copy, threshold 0.5, Floyd–Steinberg when dithering, median cut. The
+// steps get the same defaults.
+void imagecopy_options_init(Imagecopy_Options *options);
+
+// NULL if out of memory
+Imagecopy *imagecopy_create(void);
+void imagecopy_destroy(Imagecopy *ctx);
+
+// Checked and copied, the options apply from the next load
+Imagecopy_Status imagecopy_set_options(Imagecopy *ctx,
+                                       const Imagecopy_Options *options);
+
+// Load a BMP, replacing the context's previous image. A descriptor is read
+// from its current position and is not closed.
+Imagecopy_Status imagecopy_load_file(Imagecopy *ctx, const char *path);
+Imagecopy_Status imagecopy_load_memory(Imagecopy *ctx, const void *data,
+                                       size_t size);
+Imagecopy_Status imagecopy_load_fd(Imagecopy *ctx, int fd);
+
+// Run the op on the loaded image
+Imagecopy_Status imagecopy_process(Imagecopy *ctx);
+
+// The result: a BMP, or text for the histogram ops. The memory of
+// imagecopy_write_memory belongs to the context and lives until the next
+// load. A descriptor is written at its current position and not closed.
+Imagecopy_Status imagecopy_write_file(Imagecopy *ctx, const char *path);
+Imagecopy_Status imagecopy_write_memory(Imagecopy *ctx, const void **data,
+                                        size_t *size);
+Imagecopy_Status imagecopy_write_fd(Imagecopy *ctx, int fd);
+
+// Message of the last failed call on the context, "" after a success
+const char *imagecopy_error(const Imagecopy *ctx);
+const char *imagecopy_status_string(Imagecopy_Status status);
+// "Grayscale", "Rotate", ...
+const char *imagecopy_op_name(Imagecopy_Op op);
+// With a NULL context only the pool fields are filled in
+void imagecopy_get_info(const Imagecopy *ctx, Imagecopy_Info *info);
+
+// Output name suffix for the options, "_gray", "_blur_3", ... Lives until
+// the next call, NULL if out of memory
+const char *imagecopy_suffix(Imagecopy *ctx);
+
+// -1 if the name is unknown
+int imagecopy_dither_from_name(const char *name);
+int imagecopy_quantizer_from_name(const char *name);
+// Built-in filter names in order, NULL past the last one
+const char *imagecopy_filter_name(int index);
+
+// Process-wide pool settings, see pool.h
+void imagecopy_set_hugepages(bool enable);
+void imagecopy_trim(size_t keep_bytes);
+
+#endif
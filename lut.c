@@ -0,0 +1,317 @@
+#include "lut.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LUT_X86 1
+#include <immintrin.h>
+#endif
+
+// --- Table builders ---
+
+void lut_identity(uint8_t *lut) {
+    for (int i = 0; i < LUT_SIZE; i++) {
+        lut[i] = (uint8_t)i;
+    }
+}
+
+void lut_invert(uint8_t *lut) {
+    for (int i = 0; i < LUT_SIZE; i++) {
+        lut[i] = (uint8_t)(255 - i);
+    }
+}
+
+// offset is -255 to 255, results are clamped to [0..255]
+void lut_brightness(uint8_t *lut, int offset) {
+    for (int i = 0; i < LUT_SIZE; i++) {
+        int v = i + offset;
+        lut[i] = (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+    }
+}
+
+// gamma > 1.0 brightens the midtones, gamma < 1.0 darkens them.
+void lut_gamma(uint8_t *lut, float gamma) {
+    if (gamma <= 0.0f) {
+        lut_identity(lut);
+        return;
+    }
+    for (int i = 0; i < LUT_SIZE; i++) {
+        float v = 255.0f * powf(i / 255.0f, 1.0f / gamma) + 0.5f;
+        lut[i] = (uint8_t)(v > 255.0f ? 255.0f : v);
+    }
+}
+
+// Piecewise linear curve through (in, out) control points sorted by input.
+// Inputs before the first point or after the last one are held flat.
+void lut_curve(uint8_t *lut, const uint8_t (*points)[2], uint8_t point_count) {
+    if (!points || point_count == 0) {
+        lut_identity(lut);
+        return;
+    }
+    uint8_t p = 0;
+    for (int i = 0; i < LUT_SIZE; i++) {
+        while (p + 1 < point_count && i > points[p + 1][0]) {
+            p++;
+        }
+        if (i <= points[0][0]) {
+            lut[i] = points[0][1];
+        } else if (p + 1 >= point_count) {
+            lut[i] = points[point_count - 1][1];
+        } else {
+            int x0 = points[p][0], y0 = points[p][1];
+            int x1 = points[p + 1][0], y1 = points[p + 1][1];
+            int dx = x1 - x0;
+            lut[i] = (uint8_t)(dx ? y0 + ((y1 - y0) * (i - x0) + dx / 2) / dx
+                                  : y1);
+        }
+    }
+}
+
+// Histogram equalization table from a 256 bin histogram.
+void lut_equalize(uint8_t *lut, const uint64_t *histogram) {
+    // cumulative distribution function
+    uint64_t cdf[LUT_SIZE];
+    cdf[0] = histogram[0];
+    for (int i = 1; i < LUT_SIZE; i++) {
+        cdf[i] = histogram[i] + cdf[i - 1];
+    }
+
+    // Find the minimum (first) non-zero CDF value
+    uint64_t min_cdf = cdf[0];
+    for (int i = 1; min_cdf == 0 && i < LUT_SIZE; i++) {
+        min_cdf = cdf[i];
+    }
+
+    // A single value image has nothing to spread out.
+    if (cdf[LUT_SIZE - 1] == min_cdf) {
+        lut_identity(lut);
+        return;
+    }
+
+    // Normalize the CDF to map the pixel values to [0, 255]
+    for (int i = 0; i < LUT_SIZE; i++) {
+        if (cdf[i] >= min_cdf) {
+            lut[i] = (uint8_t)(((float)(LUT_SIZE - 1) * (cdf[i] - min_cdf)) /
+                               (cdf[LUT_SIZE - 1] - min_cdf));
+        } else {
+            lut[i] = 0;
+        }
+    }
+}
+
+void lut_compose(uint8_t *first, const uint8_t *second) {
+    for (int i = 0; i < LUT_SIZE; i++) {
+        first[i] = second[first[i]];
+    }
+}
+
+void lut3_from_lut(Lut3 *lut3, const uint8_t *lut) {
+    for (int c = 0; c < 3; c++) {
+        memcpy(lut3->channel[c], lut, LUT_SIZE);
+    }
+}
+
+// --- SIMD kernels ---
+// Each kernel handles the largest multiple of its vector width and returns
+// the number of bytes done, the scalar loop finishes the tail.
+
+#ifdef LUT_X86
+
+// AVX-512 VBMI: vpermb over two 128 byte halves of the table, the high bit
+// of each input byte picks the half.
+__attribute__((target("avx512f,avx512bw,avx512vbmi"))) static size_t
+lut1_vbmi(uint8_t *buffer, size_t byte_count, const uint8_t *lut) {
+    const __m512i t0 = _mm512_loadu_si512((const void *)(lut + 0));
+    const __m512i t1 = _mm512_loadu_si512((const void *)(lut + 64));
+    const __m512i t2 = _mm512_loadu_si512((const void *)(lut + 128));
+    const __m512i t3 = _mm512_loadu_si512((const void *)(lut + 192));
+
+    size_t i = 0;
+    for (; i + 64 <= byte_count; i += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(buffer + i));
+        __m512i lo = _mm512_permutex2var_epi8(t0, v, t1);
+        __m512i hi = _mm512_permutex2var_epi8(t2, v, t3);
+        __mmask64 high_bit = _mm512_movepi8_mask(v);
+        _mm512_storeu_si512((void *)(buffer + i),
+                            _mm512_mask_blend_epi8(high_bit, lo, hi));
+    }
+    return i;
+}
+
+// Three tables at once for BGR rows. 64 bytes is 1 mod 3, so the channel of
+// byte i in vector j of a 192 byte block is (i + j) % 3.
+__attribute__((target("avx512f,avx512bw,avx512vbmi"))) static size_t
+lut3_vbmi(uint8_t *row, size_t byte_count, const Lut3 *lut3) {
+    __m512i t[3][4];
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < 4; k++) {
+            t[c][k] = _mm512_loadu_si512((const void *)(lut3->channel[c] +
+                                                         64 * k));
+        }
+    }
+
+    // mask[j][c]: bytes of vector j that belong to channel c
+    __mmask64 mask[3][3];
+    for (int j = 0; j < 3; j++) {
+        for (int c = 0; c < 3; c++) {
+            uint64_t m = 0;
+            for (int i = 0; i < 64; i++) {
+                if ((i + j) % 3 == c) {
+                    m |= (uint64_t)1 << i;
+                }
+            }
+            mask[j][c] = (__mmask64)m;
+        }
+    }
+
+    size_t i = 0;
+    for (; i + 192 <= byte_count; i += 192) {
+        for (int j = 0; j < 3; j++) {
+            uint8_t *p = row + i + 64 * j;
+            __m512i v = _mm512_loadu_si512((const void *)p);
+            __mmask64 high_bit = _mm512_movepi8_mask(v);
+            __m512i out = _mm512_setzero_si512();
+            for (int c = 0; c < 3; c++) {
+                __m512i lo = _mm512_permutex2var_epi8(t[c][0], v, t[c][1]);
+                __m512i hi = _mm512_permutex2var_epi8(t[c][2], v, t[c][3]);
+                __m512i r = _mm512_mask_blend_epi8(high_bit, lo, hi);
+                out = _mm512_mask_blend_epi8(mask[j][c], out, r);
+            }
+            _mm512_storeu_si512((void *)p, out);
+        }
+    }
+    return i;
+}
+
+// AVX2: split each byte into nibbles, pshufb the low nibble through each of
+// the 16 sixteen-entry rows of the table and keep the row matching the high
+// nibble.
+__attribute__((target("avx2"))) static size_t
+lut1_avx2(uint8_t *buffer, size_t byte_count, const uint8_t *lut) {
+    __m256i rows[16];
+    for (int k = 0; k < 16; k++) {
+        rows[k] = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)(lut + 16 * k)));
+    }
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    size_t i = 0;
+    for (; i + 32 <= byte_count; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        __m256i lo = _mm256_and_si256(v, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+        __m256i out = _mm256_setzero_si256();
+        for (int k = 0; k < 16; k++) {
+            __m256i select = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(k));
+            __m256i r = _mm256_shuffle_epi8(rows[k], lo);
+            out = _mm256_or_si256(out, _mm256_and_si256(select, r));
+        }
+        _mm256_storeu_si256((__m256i *)(buffer + i), out);
+    }
+    return i;
+}
+
+#endif // LUT_X86
+
+static bool cpu_has_vbmi(void) {
+#ifdef LUT_X86
+    return __builtin_cpu_supports("avx512vbmi") &&
+           __builtin_cpu_supports("avx512bw");
+#else
+    return false;
+#endif
+}
+
+static bool cpu_has_avx2(void) {
+#ifdef LUT_X86
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+// --- Apply ---
+
+void apply_lut1(uint8_t *buffer, size_t byte_count, const uint8_t *lut) {
+    if (!buffer || !lut) {
+        return;
+    }
+    size_t i = 0;
+#ifdef LUT_X86
+    if (cpu_has_vbmi()) {
+        i = lut1_vbmi(buffer, byte_count, lut);
+    } else if (cpu_has_avx2()) {
+        i = lut1_avx2(buffer, byte_count, lut);
+    }
+#endif
+    for (; i < byte_count; i++) {
+        buffer[i] = lut[buffer[i]];
+    }
+}
+
+void apply_lut3(uint8_t **rows, uint32_t width, uint32_t height,
+                const Lut3 *lut3) {
+    if (!rows || !lut3) {
+        return;
+    }
+    const size_t row_bytes = (size_t)width * 3;
+    const uint8_t *lb = lut3->channel[0];
+    const uint8_t *lg = lut3->channel[1];
+    const uint8_t *lr = lut3->channel[2];
+
+    // Same table on every channel, the bytes can be treated as gray.
+    if (memcmp(lb, lg, LUT_SIZE) == 0 && memcmp(lb, lr, LUT_SIZE) == 0) {
+        for (uint32_t y = 0; y < height; y++) {
+            apply_lut1(rows[y], row_bytes, lb);
+        }
+        return;
+    }
+
+    bool vbmi = cpu_has_vbmi();
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = rows[y];
+        size_t x = 0;
+#ifdef LUT_X86
+        if (vbmi) {
+            x = lut3_vbmi(row, row_bytes, lut3);
+        }
+#else
+        (void)vbmi;
+#endif
+        // x is always a multiple of 3 here.
+        for (; x < row_bytes; x += 3) {
+            row[x + 0] = lb[row[x + 0]];
+            row[x + 1] = lg[row[x + 1]];
+            row[x + 2] = lr[row[x + 2]];
+        }
+    }
+}
+
+void apply_lut3_threshold(uint8_t **rows, uint32_t width, uint32_t height,
+                          const Lut3 *lut3, uint8_t threshold) {
+    if (!rows || !lut3) {
+        return;
+    }
+    // Weighted tables, summed in the same order as the luminance in
+    // image_data_handler.c so both paths threshold identically.
+    float lum_b[LUT_SIZE], lum_g[LUT_SIZE], lum_r[LUT_SIZE];
+    for (int i = 0; i < LUT_SIZE; i++) {
+        lum_b[i] = 0.114f * lut3->channel[0][i];
+        lum_g[i] = 0.587f * lut3->channel[1][i];
+        lum_r[i] = 0.299f * lut3->channel[2][i];
+    }
+
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = rows[y];
+        for (size_t x = 0; x < (size_t)width * 3; x += 3) {
+            uint8_t lum = (uint8_t)(lum_r[row[x + 2]] + lum_g[row[x + 1]] +
+                                    lum_b[row[x + 0]] + 0.5f);
+            uint8_t out = (lum >= threshold) ? 255 : 0;
+            row[x + 0] = out;
+            row[x + 1] = out;
+            row[x + 2] = out;
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef LUT_H
+#define LUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every 8-bit tone map (equalize, invert, brightness, gamma, curves) is a
+// 256 entry table. Build the table once, then apply it in a single pass.
+#define LUT_SIZE 256
+
+// Per-channel tables for interleaved BGR data, in BMP byte order:
+// channel[0] = blue, channel[1] = green, channel[2] = red.
+typedef struct {
+    uint8_t channel[3][LUT_SIZE];
+} Lut3;
+
+// Table builders
+void lut_identity(uint8_t *lut);
+void lut_invert(uint8_t *lut);
+void lut_brightness(uint8_t *lut, int offset);
+void lut_gamma(uint8_t *lut, float gamma);
+void lut_curve(uint8_t *lut, const uint8_t (*points)[2], uint8_t point_count);
+void lut_equalize(uint8_t *lut, const uint64_t *histogram);
+void lut3_from_lut(Lut3 *lut3, const uint8_t *lut);
+
+// Apply a single table to every byte of a buffer (gray / index data).
+void apply_lut1(uint8_t *buffer, size_t byte_count, const uint8_t *lut);
+
+// Apply per-channel tables to BGR rows in one interleaved pass.
+void apply_lut3(uint8_t **rows, uint32_t width, uint32_t height,
+                const Lut3 *lut3);
+
+// Apply per-channel tables, then threshold the luminance of the result to
+// BLACK/WHITE in the same pass. Used when a tone chain ends in monochrome.
+void apply_lut3_threshold(uint8_t **rows, uint32_t width, uint32_t height,
+                          const Lut3 *lut3, uint8_t threshold);
+
+// Compose tables so that out = second[first[v]], result stored in first.
+void lut_compose(uint8_t *first, const uint8_t *second);
+
+#endif
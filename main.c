@@ -1,6 +1,4 @@
-#include "bmp_file_handler.h"
-#include "convolution.h"
-#include "image_data_handler.h"
+#include "imagecopy.h"
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
@@ -15,6 +13,14 @@
 
 #define VERSION "0.???\n"
 
+const char *get_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    const char *backslash = strrchr(path, '\\');
+
+    const char *last = slash > backslash ? slash : backslash;
+    return last ? last + 1 : path;
+}
+
 /**  Returns true if a filename ends with the given extension,
  *   false otherwise.
  */
@@ -35,9 +41,14 @@ bool ends_with(char *str, const char *ext) {
     return strcmp(str + len_str - len_ext, ext) == 0;
 }
 
-char *get_filename_ext(char *filename, enum Mode mode) {
+// Histograms are written as text
+bool is_text_op(Imagecopy_Op op) {
+    return op == IMAGECOPY_HIST || op == IMAGECOPY_HIST_NORMALIZED;
+}
 
-    if (mode == HIST || mode == HIST_N) {
+char *get_filename_ext(char *filename, Imagecopy_Op op) {
+
+    if (is_text_op(op)) {
         if (ends_with(filename, ".txt")) {
             return ".txt";
         } else if (ends_with(filename, ".dat")) {
@@ -52,8 +63,8 @@ char *get_filename_ext(char *filename, enum Mode mode) {
 }
 
 // returns the default file extension for a mode.
-char *get_default_ext(enum Mode mode) {
-    if (mode == HIST || mode == HIST_N) {
+char *get_default_ext(Imagecopy_Op op) {
+    if (is_text_op(op)) {
         return ".txt";
     } else {
         return ".bmp";
@@ -74,7 +85,15 @@ void print_usage(const char *app_name) {
            "                       - A float between 0.0 and 1.0\n"
            "                       - An integer between 0 and 255\n"
            "                       Defaults to %.1f if none entered.\n"
-           "  -d                   Dithered, monochrome."
+           "  -d                   Dithered, monochrome.\n"
+           "  --dither=<name>      Dither method for -m and for reducing\n"
+           "                       24-bit to indexed. Error diffusion: fs\n"
+           "                       (Floyd–Steinberg, the -d default),\n"
+           "                       atkinson, jarvis, stucki or sierra.\n"
+           "                       Ordered: bayer2, bayer4, bayer8 or\n"
+           "                       bluenoise. Implies -d.\n"
+           "  --serpentine         Error diffusion scans every other row\n"
+           "                       right to left.\n"
            "  -b <value>           Brightness, increase (positive) or\n"
            "                       decrease (negative).\n"
            "                       Value can be:\n"
@@ -87,7 +106,31 @@ void print_usage(const char *app_name) {
            "  -n                   Calculate normalized histogram [0..1] "
            "and "
            "write to .txt file.\n"
+           "                       24-bit images get one column per channel,\n"
+           "                       red, green and blue.\n"
            "  -e                   Equalize image contrast.\n"
+           "                       -b, -e, -i and -m can be combined, they\n"
+           "                       run in the order given as one pass.\n"
+           "  --quantizer=<name>   Palette builder when reducing 24-bit to\n"
+           "                       indexed: median (default), octree or\n"
+           "                       kmeans.\n"
+           "  --optimize-depth     Write the smallest bit depth (1, 4, 8\n"
+           "                       or 24) that keeps every color and\n"
+           "                       report the bytes saved. Overrides\n"
+           "                       --set-depth and --set-colors.\n"
+           "  --crop=x,y,w,h       Work on the w x h window at x,y (from the\n"
+           "                       top left) only. Just its rows are read\n"
+           "                       from the file. Alone it writes the crop.\n"
+           "  --ops=<steps>        Run several ops in order on the image in\n"
+           "                       memory, for example\n"
+           "                       --ops=gray,blur:3,filter:sharpen,rot:90\n"
+           "                       Steps: copy, gray, mono[:t],\n"
+           "                       dither[:name], inv[:r|h], bright:<v>,\n"
+           "                       equal, rot:<deg>, flip:<h|v>,\n"
+           "                       blur[:n], sepia, filter:<name>, and\n"
+           "                       hist or histn as the last step.\n"
+           "  --hugepages          Back large buffers with transparent\n"
+           "                       huge pages (Linux).\n"
            "Information modes:\n"
            "  -h, --help           Show this help message and exit\n"
            "  -v, --verbose        Enable verbose output\n"
@@ -104,7 +147,7 @@ void print_usage(const char *app_name) {
            "  %s -m 0.5 input.bmp      // monochrome\n"
            "  %s -b -0.5 input.bmp     // brightness\n"
            "  %s -b 200 input.bmp      // brightness\n",
-           app_name, M_FLAG_DEFAULT, app_name, app_name, app_name, app_name,
+           app_name, IMAGECOPY_MONO_THRESHOLD, app_name, app_name, app_name, app_name,
            app_name, app_name);
 }
 
@@ -121,6 +164,19 @@ bool get_valid_float(char *str, float *result) {
     return true;
 }
 
+// Whole string as an int, unlike is_valid_int
+bool get_valid_int(const char *str, int *result) {
+    char *endptr;
+    errno = 0;
+    long value = strtol(str, &endptr, 10);
+    if (errno != 0 || str == endptr || *endptr != '\0' || value < INT_MIN ||
+        value > INT_MAX) {
+        return false;
+    }
+    *result = (int)value;
+    return true;
+}
+
 bool is_valid_int(char *str, int *result) {
     char *endptr;
     errno = 0;                             // Clear previous errors
@@ -156,6 +212,181 @@ bool starts_like_float(const char *s) {
     return false;
 }
 
+// Record a tone flag in command line order.
+void add_tone_step(Imagecopy_Tone_Step *steps, uint8_t *count,
+                   Imagecopy_Tone_Op op, int value) {
+    if (*count >= IMAGECOPY_TONE_MAX) {
+        fprintf(stderr, "Error: More than %d tone operations.\n",
+                IMAGECOPY_TONE_MAX);
+        exit(EXIT_FAILURE);
+    }
+    steps[*count].op = op;
+    steps[*count].value = value;
+    (*count)++;
+}
+
+void remove_tone_step(Imagecopy_Tone_Step *steps, uint8_t *count,
+                      Imagecopy_Tone_Op op) {
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < *count; i++) {
+        if (steps[i].op != op) {
+            steps[kept++] = steps[i];
+        }
+    }
+    *count = kept;
+}
+
+// One --ops step, the op name and the text after its ':' (NULL if there is
+// none). The ranges the library checks are left to it.
+bool parse_step(const char *name, const char *value, Imagecopy_Step *step) {
+    int number = 0;
+    float fraction = 0.0f;
+
+    if (strcmp(name, "copy") == 0 && !value) {
+        step->op = IMAGECOPY_COPY;
+    } else if (strcmp(name, "gray") == 0 && !value) {
+        step->op = IMAGECOPY_GRAY;
+    } else if (strcmp(name, "mono") == 0) {
+        step->op = IMAGECOPY_MONO;
+        if (value) {
+            if (!get_valid_float((char *)value, &fraction)) {
+                return false;
+            }
+            step->mono_threshold = fraction;
+        }
+    } else if (strcmp(name, "dither") == 0) {
+        step->op = IMAGECOPY_DITHER;
+        if (value) {
+            step->dither_mode = imagecopy_dither_from_name(value);
+            if (step->dither_mode < 0) {
+                return false;
+            }
+        }
+    } else if (strcmp(name, "inv") == 0) {
+        if (!value) {
+            step->op = IMAGECOPY_INVERT;
+        } else if (strcmp(value, "r") == 0) {
+            step->op = IMAGECOPY_INVERT_RGB;
+        } else if (strcmp(value, "h") == 0) {
+            step->op = IMAGECOPY_INVERT_HSV;
+        } else {
+            return false;
+        }
+    } else if (strcmp(name, "bright") == 0 && value) {
+        // A one step tone chain, an offset or a fraction like -b
+        if (strchr(value, '.')) {
+            if (!get_valid_float((char *)value, &fraction) ||
+                fraction < -1.0f || fraction > 1.0f) {
+                return false;
+            }
+            number = (int)(fraction * 255.0f);
+        } else if (!get_valid_int(value, &number) || number < -255 ||
+                   number > 255) {
+            return false;
+        }
+        step->op = IMAGECOPY_TONE;
+        step->tone_steps[0].op = IMAGECOPY_TONE_BRIGHT;
+        step->tone_steps[0].value = number;
+        step->tone_step_count = 1;
+    } else if (strcmp(name, "equal") == 0 && !value) {
+        step->op = IMAGECOPY_EQUALIZE;
+    } else if (strcmp(name, "rot") == 0 && value) {
+        if (!get_valid_int(value, &number)) {
+            return false;
+        }
+        step->op = IMAGECOPY_ROTATE;
+        step->degrees = number;
+    } else if (strcmp(name, "flip") == 0 && value) {
+        if (strcmp(value, "h") != 0 && strcmp(value, "v") != 0) {
+            return false;
+        }
+        step->op = IMAGECOPY_FLIP;
+        step->flip_vertical = value[0] == 'v';
+    } else if (strcmp(name, "blur") == 0) {
+        step->op = IMAGECOPY_BLUR;
+        step->blur_level = 1;
+        if (value) {
+            if (!get_valid_int(value, &number) || number < 1 ||
+                number > 255) {
+                return false;
+            }
+            step->blur_level = number;
+        }
+    } else if (strcmp(name, "sepia") == 0 && !value) {
+        step->op = IMAGECOPY_SEPIA;
+    } else if (strcmp(name, "filter") == 0 && value) {
+        step->op = IMAGECOPY_FILTER;
+        step->filter = NULL;
+        for (int i = 0; imagecopy_filter_name(i); i++) {
+            if (strcmp(value, imagecopy_filter_name(i)) == 0) {
+                step->filter = imagecopy_filter_name(i);
+            }
+        }
+        if (!step->filter) {
+            return false;
+        }
+    } else if (strcmp(name, "hist") == 0 && !value) {
+        step->op = IMAGECOPY_HIST;
+    } else if (strcmp(name, "histn") == 0 && !value) {
+        step->op = IMAGECOPY_HIST_NORMALIZED;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// --ops "gray,blur:3,filter:sharpen,rot:90", the steps of a pipeline in
+// order. False with a message if a step is not understood.
+bool parse_ops(const char *spec, Imagecopy_Options *options) {
+    const char *next = spec;
+    options->step_count = 0;
+    while (*next) {
+        size_t length = strcspn(next, ",");
+        char text[64];
+        if (length == 0 || length >= sizeof(text)) {
+            fprintf(stderr, "--ops value error: \"%s\"\n", spec);
+            return false;
+        }
+        memcpy(text, next, length);
+        text[length] = '\0';
+        next += length;
+        if (*next == ',') {
+            next++;
+        }
+
+        if (options->step_count == IMAGECOPY_STEPS_MAX) {
+            fprintf(stderr, "Error: More than %d --ops steps.\n",
+                    IMAGECOPY_STEPS_MAX);
+            return false;
+        }
+        char *value = strchr(text, ':');
+        if (value) {
+            *value++ = '\0';
+        }
+        if (!parse_step(text, value, &options->steps[options->step_count])) {
+            fprintf(stderr, "--ops step error: \"%s%s%s\"\n", text,
+                    value ? ":" : "", value ? value : "");
+            return false;
+        }
+        options->step_count++;
+    }
+    if (!options->step_count) {
+        fprintf(stderr, "--ops value error: \"%s\"\n", spec);
+        return false;
+    }
+    return true;
+}
+
+// The op, or the ops of a pipeline in order
+void print_mode(const Imagecopy_Options *options) {
+    if (!options->step_count) {
+        printf("%s", imagecopy_op_name(options->op));
+    }
+    for (uint8_t i = 0; i < options->step_count; i++) {
+        printf("%s%s", i ? ", " : "",
+               imagecopy_op_name(options->steps[i].op));
+    }
+}
 
 int main(int argc, char *argv[]) {
 
@@ -167,13 +398,9 @@ int main(int argc, char *argv[]) {
         exit(EXIT_SUCCESS);
     }
 
-    Bitmap bitmap;
-    Bitmap *bmp = &bitmap;
-    init_bitmap(bmp);
-    Image_Data image;
-    Image_Data *img = &image;
-    bmp->image_data = img;
-    init_image(img);
+    // The options fill in as the flags are parsed, the library checks them
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
 
     char *filename1 = NULL;
     char *filename2 = NULL;
@@ -192,21 +419,27 @@ int main(int argc, char *argv[]) {
         i_flag = false,       // invert v
         l_flag = false,       // blur
         s_flag = false,       // sepia
+        ops_flag = false,     // pipeline
         v_flag = false,       // verbose
         filter_flag = false,  // filter
         version_flag = false; // version
 
     // Monochrome value with default
-    float m_flag_value = M_FLAG_DEFAULT;
+    float m_flag_value = IMAGECOPY_MONO_THRESHOLD;
     float b_flag_float = 0.0;
     int b_flag_int = 0;
     int l_flag_int = 0;
     int r_flag_int = 0;
 
-    char *filter_name = NULL;
+    const char *filter_name = NULL;
     int filter_index = -1;
-    enum Dir flip_dir = 0;
-    enum Invert invert_mode = 0;
+    const char *kernel_spec = NULL;
+    char flip_dir = 0;    // 'h' or 'v'
+    char invert_mode = 0; // 'r' RGB or 'h' HSV, 0 for the value invert
+
+    // Pointwise tone flags (-b, -e, -i, -m) in the order they were given.
+    Imagecopy_Tone_Step tone_steps[IMAGECOPY_TONE_MAX];
+    uint8_t tone_step_count = 0;
 
     struct option long_options[] = {
         {"help", no_argument, NULL, 'h'},
@@ -216,8 +449,16 @@ int main(int argc, char *argv[]) {
         {"hist", no_argument, NULL, 0},
         {"histn", no_argument, NULL, 0},
         {"filter", optional_argument, NULL, 0},
+        {"kernel", required_argument, NULL, 0},
         {"set-depth", required_argument, NULL, 0},
         {"set-colors", required_argument, NULL, 0},
+        {"quantizer", required_argument, NULL, 0},
+        {"dither", required_argument, NULL, 0},
+        {"serpentine", no_argument, NULL, 0},
+        {"optimize-depth", no_argument, NULL, 0},
+        {"hugepages", no_argument, NULL, 0},
+        {"crop", required_argument, NULL, 0},
+        {"ops", required_argument, NULL, 0},
         {
             0,
             0,
@@ -261,7 +502,7 @@ int main(int argc, char *argv[]) {
                     if ((input_value == 1) ||
                         /*(input_value == 2) || */ (input_value == 4) ||
                         (input_value == 8) || (input_value == 24)) {
-                        img->bit_depth_out = input_value;
+                        options.bit_depth = input_value;
                         printf("--set-depth=%d\n", input_value);
                     } else {
                         printf("Can only set depth to 1, 4, or 8 \n");
@@ -292,7 +533,7 @@ int main(int argc, char *argv[]) {
                     printf("--set-colors: %d\n", input_value);
 
                     if ((input_value >= 2) && (input_value <= 256)) {
-                        img->output_color_count = input_value;
+                        options.colors = input_value;
                         printf("--set-colors=%d\n", input_value);
                     }
 
@@ -304,6 +545,58 @@ int main(int argc, char *argv[]) {
                     optind--;
                 }
 
+            } else if (strcmp("quantizer", long_options[long_index].name) ==
+                       0) {
+                int quantizer = imagecopy_quantizer_from_name(optarg);
+                if (quantizer < 0) {
+                    fprintf(stderr,
+                            "Invalid input to --quantizer %s, use median, "
+                            "octree or kmeans\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                options.quantizer = quantizer;
+                printf("--quantizer=%s\n", optarg);
+            } else if (strcmp("dither", long_options[long_index].name) ==
+                       0) {
+                int dither_mode = imagecopy_dither_from_name(optarg);
+                if (dither_mode < 0) {
+                    fprintf(stderr,
+                            "Invalid input to --dither %s, use fs, "
+                            "atkinson, jarvis, stucki, sierra, bayer2, "
+                            "bayer4, bayer8 or bluenoise\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                options.dither_mode = dither_mode;
+                d_flag = true;
+                printf("--dither=%s\n", optarg);
+            } else if (strcmp("serpentine", long_options[long_index].name) ==
+                       0) {
+                options.serpentine = true;
+            } else if (strcmp("optimize-depth",
+                              long_options[long_index].name) == 0) {
+                options.optimize_depth = true;
+            } else if (strcmp("hugepages", long_options[long_index].name) ==
+                       0) {
+                imagecopy_set_hugepages(true);
+            } else if (strcmp("crop", long_options[long_index].name) == 0) {
+                char extra;
+                if (sscanf(optarg, "%u,%u,%u,%u%c", &options.crop_x,
+                           &options.crop_y, &options.crop_width, &options.crop_height,
+                           &extra) != 4 ||
+                    !options.crop_width || !options.crop_height) {
+                    fprintf(stderr, "--crop value error: \"%s\", use "
+                                    "x,y,width,height\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                options.crop = true;
+            } else if (strcmp("ops", long_options[long_index].name) == 0) {
+                if (!parse_ops(optarg, &options)) {
+                    exit(EXIT_FAILURE);
+                }
+                ops_flag = true;
             } else if (strcmp("test", long_options[long_index].name) == 0) {
                 printf("DEPTH\n");
                 exit(EXIT_SUCCESS);
@@ -323,18 +616,15 @@ int main(int argc, char *argv[]) {
                        0) { // histn
                 filter_flag = true;
 
-                uint8_t filter_list_size = 0;
-                char **filter_name_list =
-                    get_filter_name_list(kernel_list, &filter_list_size);
-
                 printf("Optarg: %s\n", optarg);
                 if (optarg) {
                     for (int i = 0;
-                         (i < filter_list_size) && filter_index == -1; i++) {
-                        if (strcmp(optarg, filter_name_list[i]) == 0) {
+                         imagecopy_filter_name(i) && filter_index == -1;
+                         i++) {
+                        if (strcmp(optarg, imagecopy_filter_name(i)) == 0) {
                             printf("Filter %s found at %d.",
-                                   filter_name_list[i], i);
-                            filter_name = filter_name_list[i];
+                                   imagecopy_filter_name(i), i);
+                            filter_name = imagecopy_filter_name(i);
                             filter_index = i;
                         }
                     }
@@ -351,18 +641,22 @@ int main(int argc, char *argv[]) {
                            app_name);
                     printf("Available filter names:\n");
 
-                    for (int i = 0; i < filter_list_size; i++) {
-                        printf(" %s\n", filter_name_list[i]);
+                    for (int i = 0; imagecopy_filter_name(i); i++) {
+                        printf(" %s\n", imagecopy_filter_name(i));
                     }
                 }
 
-                free(filter_name_list);
-                filter_name_list = NULL;
-
                 if (filter_index == -1 || filter_name == NULL ||
                     *filter_name == '\0') {
                     exit(EXIT_FAILURE);
                 }
+            } else if (strcmp("kernel", long_options[long_index].name) ==
+                       0) {
+                printf("Optarg: %s\n", optarg);
+                // Parsed by imagecopy_set_options
+                kernel_spec = optarg;
+                filter_flag = true;
+                filter_name = "kernel";
             }
 
             break;
@@ -399,6 +693,7 @@ int main(int argc, char *argv[]) {
                 }
                 // m_flag_value stays at its default (already initialized)
             }
+            add_tone_step(tone_steps, &tone_step_count, IMAGECOPY_TONE_MONO, 0);
             break;
 
         case 'd': // mode: DITHER, monochrome dither
@@ -450,17 +745,22 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "-b value error: \"%s\"\n", optarg);
                 exit(EXIT_FAILURE);
             }
+            add_tone_step(tone_steps, &tone_step_count, IMAGECOPY_TONE_BRIGHT,
+                          b_flag_int ? b_flag_int
+                                     : (int)(b_flag_float * 255.0f));
             break;
         case 'e': // equalize
             e_flag = true;
+            add_tone_step(tone_steps, &tone_step_count, IMAGECOPY_TONE_EQUALIZE,
+                          0);
             break;
         case 'i':
             i_flag = true;
             if (optarg && !optarg[1]) {
                 if (optarg[0] == 'r' || optarg[0] == 'R') {
-                    invert_mode = RGB_INVERT;
+                    invert_mode = 'r';
                 } else if (optarg[0] == 'h' || optarg[0] == 'H') {
-                    invert_mode = HSV_INVERT;
+                    invert_mode = 'h';
                 } else {
                     fprintf(stderr, "-i value error: \"%c\"\n", optarg[0]);
                     fprintf(stderr,
@@ -472,6 +772,11 @@ int main(int argc, char *argv[]) {
                 // non-option argument
                 optind--;
             }
+            // HSV invert mixes the channels, it is not a per value map.
+            if (invert_mode != 'h') {
+                add_tone_step(tone_steps, &tone_step_count,
+                              IMAGECOPY_TONE_INVERT, 0);
+            }
             break;
 
             // flip
@@ -479,13 +784,13 @@ int main(int argc, char *argv[]) {
             f_flag = true;
             if (optarg && optarg[0] && !optarg[1]) {
                 if (optarg[0] == 'h' || optarg[0] == 'H') {
-                    flip_dir = H;
+                    flip_dir = 'h';
                 } else if (optarg[0] == 'v' || optarg[0] == 'V') {
-                    flip_dir = V;
+                    flip_dir = 'v';
                 }
             }
 
-            if (flip_dir != H && flip_dir != V) {
+            if (!flip_dir) {
                 fprintf(stderr, "-f value error: \"%c\"\n", optarg[0]);
                 exit(EXIT_FAILURE);
             }
@@ -579,74 +884,116 @@ int main(int argc, char *argv[]) {
     } // End getopt while loop
     // printf("Option: %d\n", option);
 
+    // Dithering is not a per value map, drop it from the tone steps.
+    if (d_flag) {
+        remove_tone_step(tone_steps, &tone_step_count, IMAGECOPY_TONE_MONO);
+    }
+
+    // Two or more tone flags with no other mode form a tone chain, run as
+    // a single lookup table pass.
+    bool tone_chain = (tone_step_count > 1) &&
+                      (c_flag + g_flag + d_flag + hist_flag + histn_flag +
+                           r_flag + f_flag + l_flag + s_flag + filter_flag +
+                           ops_flag ==
+                       0);
+
     // set the mode and make sure only one mode is true.
     // b_flag excluded, can be run anytime
-    if (c_flag + g_flag + m_flag + i_flag + hist_flag + histn_flag +
-            e_flag + r_flag + f_flag + l_flag + s_flag + filter_flag >
-        1) {
+    if (!tone_chain &&
+        c_flag + g_flag + m_flag + i_flag + hist_flag + histn_flag +
+                e_flag + r_flag + f_flag + l_flag + s_flag + filter_flag +
+                ops_flag >
+            1) {
         fprintf(stderr, "%s",
-                "Error: Only one processing mode permitted at a time.\n");
+                "Error: Only one processing mode permitted at a time, "
+                "--ops runs several in order.\n");
         exit(EXIT_FAILURE);
     }
 
+    // -d also dithers the reduction of 24-bit images to indexed colour
+    options.dither = d_flag;
+
     if (b_flag) {
-        bitmap.image_data->brightness_mode = true;
-        img->bright_percent = b_flag_float;
-        img->bright_value = b_flag_int;
+        options.bright_percent = b_flag_float;
+        options.bright_value = b_flag_int;
     }
 
-    if (c_flag) {
-        bitmap.image_data->mode = COPY;
+    if (ops_flag) {
+        // The library runs the steps. The output is text or a bitmap by the
+        // op the image ends with.
+        options.op = options.steps[options.step_count - 1].op;
+    } else if (tone_chain) {
+        options.op = IMAGECOPY_TONE;
+        memcpy(options.tone_steps, tone_steps, sizeof(tone_steps));
+        options.tone_step_count = tone_step_count;
+        options.mono_threshold = m_flag_value;
+    } else if (c_flag) {
+        options.op = IMAGECOPY_COPY;
     } else if (g_flag) {
-        bitmap.image_data->mode = GRAY;
+        options.op = IMAGECOPY_GRAY;
     } else if (m_flag) {
         if (d_flag) {
-            bitmap.image_data->mode = DITHER;
-            bitmap.image_data->dither = true;
+            options.op = IMAGECOPY_DITHER;
         } else {
-            bitmap.image_data->mode = MONO;
-            img->mono_threshold = m_flag_value;
+            options.op = IMAGECOPY_MONO;
+            options.mono_threshold = m_flag_value;
         }
     } else if (i_flag) {
         if (invert_mode == 0) {
-            bitmap.image_data->mode = INV;
-        } else if (invert_mode == RGB_INVERT) {
-            bitmap.image_data->mode = INV_RGB;
-        } else if (invert_mode == HSV_INVERT) {
-            bitmap.image_data->mode = INV_HSV;
+            options.op = IMAGECOPY_INVERT;
+        } else if (invert_mode == 'r') {
+            options.op = IMAGECOPY_INVERT_RGB;
+        } else if (invert_mode == 'h') {
+            options.op = IMAGECOPY_INVERT_HSV;
         }
     } else if (hist_flag) {
-        bitmap.image_data->mode = HIST;
+        options.op = IMAGECOPY_HIST;
     } else if (histn_flag) {
-        bitmap.image_data->mode = HIST_N;
+        options.op = IMAGECOPY_HIST_NORMALIZED;
     } else if (e_flag) {
-        bitmap.image_data->mode = EQUAL;
+        options.op = IMAGECOPY_EQUALIZE;
     } else if (r_flag) {
-        bitmap.image_data->mode = ROT;
-        img->degrees = r_flag_int;
+        options.op = IMAGECOPY_ROTATE;
+        options.degrees = r_flag_int;
     } else if (f_flag) {
-        bitmap.image_data->mode = FLIP;
-        img->direction = flip_dir;
+        options.op = IMAGECOPY_FLIP;
+        options.flip_vertical = flip_dir == 'v';
     } else if (l_flag) {
-        bitmap.image_data->mode = BLUR;
-        img->blur_level = l_flag_int;
+        options.op = IMAGECOPY_BLUR;
+        options.blur_level = l_flag_int;
     } else if (s_flag) {
-        bitmap.image_data->mode = SEPIA;
+        options.op = IMAGECOPY_SEPIA;
     } else if (filter_flag) {
-        bitmap.image_data->mode = FILTER;
-        img->filter_name = filter_name;
-        img->filter_index = filter_index;
+        options.op = IMAGECOPY_FILTER;
+        options.filter = filter_name;
+        options.kernel = kernel_spec;
     } else {
-        bitmap.image_data->mode = COPY;
+        options.op = IMAGECOPY_COPY;
+    }
+
+    // One context for the run. A batch or daemon would keep it and load
+    // file after file into the same memory.
+    Imagecopy *ctx = imagecopy_create();
+    if (!ctx) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (imagecopy_set_options(ctx, &options) != IMAGECOPY_OK) {
+        fprintf(stderr, "%s\n", imagecopy_error(ctx));
+        if (kernel_spec) {
+            printf("Usage:\n");
+            printf(">%s --kernel=<file | \"w w w; w w w; w w w\">"
+                   " <input_filename> [opt_output_filename]\n",
+                   app_name);
+            printf("Odd N x N weights, optional divisor=<f> and "
+                   "bias=<f>\n");
+        }
+        exit(EXIT_FAILURE);
     }
 
     // Check for required filename argument
     if (optind < argc) {
-        filename1 = strdup(argv[optind]);
-        if (filename1 == NULL) {
-            perror("Error copying input filename");
-            exit(EXIT_FAILURE);
-        }
+        filename1 = argv[optind];
         optind++;
     } else {
         print_usage(app_name);
@@ -655,15 +1002,12 @@ int main(int argc, char *argv[]) {
 
     // Check for optional filename argument
     if (optind < argc) {
-        filename2 = strdup(argv[optind]);
-        if (filename2 == NULL) {
-            perror("Error copying output filename");
-            exit(EXIT_FAILURE);
-        }
+        filename2 = argv[optind];
     }
 
-    printf("Filename1: %s, and mode: %s.\n", filename1,
-           get_mode_string(img->mode));
+    printf("Filename1: %s, and mode: ", filename1);
+    print_mode(&options);
+    printf(".\n");
 
     // confirm filename1 ends with ".bmp"
     if (!ends_with(filename1, ".bmp")) {
@@ -674,11 +1018,12 @@ int main(int argc, char *argv[]) {
     // if there is a filename2 we have to confirm the extension.
 
     char *ext2;
+    char *filename2_created = NULL;
     if (filename2) {
-        ext2 = get_filename_ext(filename2, img->mode);
+        ext2 = get_filename_ext(filename2, options.op);
         if (!ext2) { // if wrong extention for mode, print a message for that
                      // error
-            if (img->mode == HIST || img->mode == HIST_N) {
+            if (is_text_op(options.op)) {
                 printf("Error: Output file %s does not end with %s or "
                        "%s\n",
                        filename2, ".txt", ".dat");
@@ -693,32 +1038,18 @@ int main(int argc, char *argv[]) {
     else { // create filename2 with proper suffix from mode
         // Find the last position of the  '.' in the filename
         char *dot_pos = strrchr(filename1, '.');
-        ext2 = get_default_ext(img->mode);
+        ext2 = get_default_ext(options.op);
         if (dot_pos == NULL) {
             fprintf(stderr, "\".\" not found in filename: %s\n", filename1);
             exit(EXIT_FAILURE);
         }
 
-        char *suffix = NULL;
-
-        // Creates a suffix with the amount of blur levels.
-        if ((img->mode == BLUR) && (l_flag_int > 0)) {
-            char *suffix_temp = get_suffix(img);
-            size_t suffix_size =
-                snprintf(NULL, 0, "%s_%d", suffix_temp, l_flag_int) + 1;
-            suffix = malloc(suffix_size);
-            if (!suffix) {
-                fprintf(stderr, "Error: Could not create blur suffix.");
-            }
-            snprintf(suffix, suffix_size, "%s_%d", suffix_temp, l_flag_int);
-            free(suffix_temp);
-        } else {
-            // create a suffix for anything other than a multi blur
-            suffix = get_suffix(img);
-        }
+        // Includes the amount of blur levels
+        const char *suffix = imagecopy_suffix(ctx);
         if (!suffix) {
             fprintf(stderr, "Error: Could not create %s filename suffix.",
-                    get_mode_string(img->mode));
+                    imagecopy_op_name(options.op));
+            exit(EXIT_FAILURE);
         }
 
         // Calculate the length of the parts to create filename2
@@ -726,8 +1057,8 @@ int main(int argc, char *argv[]) {
         size_t suffix_len = strlen(suffix);
         size_t extention_len = strlen(ext2);
 
-        filename2 = (char *)malloc(sizeof(char) *
-                                   (base_len + suffix_len + extention_len + 1));
+        filename2 = filename2_created =
+            malloc(base_len + suffix_len + extention_len + 1);
         if (filename2 == NULL) {
             perror("Error creating output filename");
             exit(EXIT_FAILURE);
@@ -739,7 +1070,6 @@ int main(int argc, char *argv[]) {
         // use ptr math to copy suffix to filename2ptr's + position +
         // (can't use strcat because strncpy doesn't null terminate.)
         strcpy(filename2 + base_len, suffix);
-        free(suffix);
         strcpy(filename2 + base_len + suffix_len, ext2);
     }
     printf("Filename 2: %s\n", filename2);
@@ -768,44 +1098,72 @@ int main(int argc, char *argv[]) {
         printf("filename1: %s\n", filename1);
         if (filename2)
             printf("filename2: %s\n", filename2);
-        printf("mode: %s\n", get_mode_string(img->mode));
+        printf("mode: ");
+        print_mode(&options);
+        printf("\n");
     }
 
-    int32_t imageRead = load_bitmap(bmp, filename1);
-    free(filename1);
-    filename1 = NULL;
-    if (imageRead != 0) {
-        fprintf(stderr, "Image read fail Error val = %d.\n", imageRead);
+    Imagecopy_Info info;
+    Imagecopy_Status status = imagecopy_load_file(ctx, filename1);
+    if (status != IMAGECOPY_OK) {
+        fprintf(stderr, "%s\n", imagecopy_error(ctx));
         exit(EXIT_FAILURE);
     }
 
-    printf("width: %d\n", img->width);
-    printf("height: %d\n", img->height);
-    printf("bit_depth_in: %d\n", img->bit_depth_in);
-    printf("bit_depth_out: %d\n", img->bit_depth_out);
-    process_bmp(bmp);
-    // write_image(img, filename2);
-    write_bitmap(bmp, filename2);
-    free(filename2);
-    filename2 = NULL;
-    printf("Planes: %d\n", bmp->info_header.bi_planes);
-    printf("width: %d\n", img->width);
-    printf("height: %d\n", img->height);
-
-    free_bitmap(bmp);
-    bmp = NULL;
-    /*
-        // free filename memory if it was allocated
-        if (filename1 != NULL) {
-            free(filename1);
-            filename1 = NULL;
-        }
-        if (filename2 != NULL) {
-            free(filename2);
-            filename2 = NULL;
-        }
+    imagecopy_get_info(ctx, &info);
+    printf("width: %d\n", info.width);
+    printf("height: %d\n", info.height);
+    printf("bit_depth_in: %d\n", info.bit_depth_in);
+    printf("bit_depth_out: %d\n", info.bit_depth_out);
+    if (options.crop) {
+        printf("Crop: %ux%u at %u,%u, read %u rows of %u bytes.\n",
+               info.width, info.height, options.crop_x, options.crop_y,
+               info.height, info.crop_row_bytes);
+    }
 
-        free_img(img);
-     */
-    return 0;
+    status = imagecopy_process(ctx);
+    if (status == IMAGECOPY_OK) {
+        status = imagecopy_write_file(ctx, filename2);
+    }
+    if (status != IMAGECOPY_OK) {
+        fprintf(stderr, "%s\n", imagecopy_error(ctx));
+    }
+    free(filename2_created);
+    filename2 = filename2_created = NULL;
+
+    imagecopy_get_info(ctx, &info);
+    if (status == IMAGECOPY_OK && options.optimize_depth) {
+        int64_t saved =
+            (int64_t)info.file_bytes_in - (int64_t)info.file_bytes_out;
+        printf("Optimize depth: %d-bit -> %d-bit, %llu -> %llu bytes, saved "
+               "%lld bytes (%.1f%%)\n",
+               info.bit_depth_in, info.bit_depth_out,
+               (unsigned long long)info.file_bytes_in,
+               (unsigned long long)info.file_bytes_out, (long long)saved,
+               info.file_bytes_in ? 100.0 * saved / info.file_bytes_in
+                                  : 0.0);
+    }
+    printf("width: %d\n", info.width);
+    printf("height: %d\n", info.height);
+
+    // End of the job. A batch or daemon loop would load the next file into
+    // the same context here.
+    if (v_flag) {
+        printf("Arena: %zu bytes in %u block allocations.\n",
+               info.arena_bytes, info.arena_blocks);
+    }
+    imagecopy_destroy(ctx);
+    ctx = NULL;
+
+    // A batch would keep the pool between files and trim it to what one
+    // file needs, a single run gives it all back
+    if (v_flag) {
+        imagecopy_get_info(NULL, &info);
+        printf("Pool: %llu fresh buffers, %llu reused, %zu bytes cached.\n",
+               (unsigned long long)info.pool_fresh_count,
+               (unsigned long long)info.pool_reuse_count,
+               info.pool_cached_bytes);
+    }
+    imagecopy_trim(0);
+    return status == IMAGECOPY_OK ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,69 @@
+#include "op_kernels.h"
+#include <string.h>
+
+// The pixel moves for pixels of 'ch' bytes. With ch a constant the memcpy
+// of a pixel is one or two plain moves.
+#define MOVE_KERNELS(ch)                                                       \
+    static void rot_90_##ch(uint8_t *const *src, uint8_t *const *dst,          \
+                            uint32_t width, uint32_t height) {                 \
+        for (uint32_t y = 0; y < height; y++) {                                \
+            const size_t to = (size_t)(height - 1 - y) * (ch);                 \
+            for (uint32_t x = 0; x < width; x++) {                             \
+                memcpy(dst[x] + to, src[y] + (size_t)x * (ch), (ch));          \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+    static void rot_180_##ch(uint8_t *const *src, uint8_t *const *dst,         \
+                             uint32_t width, uint32_t height) {                \
+        for (uint32_t y = 0; y < height; y++) {                                \
+            uint8_t *out = dst[height - 1 - y];                                \
+            for (uint32_t x = 0; x < width; x++) {                             \
+                memcpy(out + (size_t)(width - 1 - x) * (ch),                   \
+                       src[y] + (size_t)x * (ch), (ch));                       \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+    static void rot_270_##ch(uint8_t *const *src, uint8_t *const *dst,         \
+                             uint32_t width, uint32_t height) {                \
+        for (uint32_t y = 0; y < height; y++) {                                \
+            const size_t to = (size_t)y * (ch);                                \
+            for (uint32_t x = 0; x < width; x++) {                             \
+                memcpy(dst[width - 1 - x] + to, src[y] + (size_t)x * (ch),     \
+                       (ch));                                                  \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+    static void flip_h_##ch(uint8_t *const *src, uint8_t *const *dst,          \
+                            uint32_t width, uint32_t height) {                 \
+        for (uint32_t y = 0; y < height; y++) {                                \
+            for (uint32_t x = 0; x < width; x++) {                             \
+                memcpy(dst[y] + (size_t)(width - 1 - x) * (ch),                \
+                       src[y] + (size_t)x * (ch), (ch));                       \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+    static void flip_v_##ch(uint8_t *const *src, uint8_t *const *dst,          \
+                            uint32_t width, uint32_t height) {                 \
+        for (uint32_t y = 0; y < height; y++) {                                \
+            memcpy(dst[height - 1 - y], src[y], (size_t)width * (ch));         \
+        }                                                                      \
+    }
+
+MOVE_KERNELS(1)
+MOVE_KERNELS(3)
+
+#define MOVE_KERNEL_ROW(ch)                                                    \
+    {rot_90_##ch, rot_180_##ch, rot_270_##ch, flip_h_##ch, flip_v_##ch}
+
+// [channels == 3][move]
+static const Move_Kernel move_kernels[2][MOVE_COUNT] = {
+    MOVE_KERNEL_ROW(1),
+    MOVE_KERNEL_ROW(3),
+};
+
+Move_Kernel move_kernel(enum Move move, uint8_t channels) {
+    if (move >= MOVE_COUNT || (channels != 1 && channels != 3)) {
+        return NULL;
+    }
+    return move_kernels[channels == 3][move];
+}
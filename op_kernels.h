@@ -0,0 +1,94 @@
+#ifndef OP_KERNELS_H
+#define OP_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernels specialised at compile time. Each generator below is instantiated
+// once per bit depth or pixel size, so inside a kernel the depth and the
+// channel count are constants: the inner loop has no branch on them, field
+// shifts are fixed and a pixel copy is a plain move. A caller picks the
+// instantiation once, from the lookups, before its loop.
+
+// --- Packed indices ---
+// Pixel x of a row of 1, 2, 4 or 8-bit indices, in BMP order (the first
+// pixel of a byte in its most significant bits).
+
+#define INDEX_KERNELS(bits)                                                    \
+    static inline uint8_t index_get_##bits(const uint8_t *row, uint32_t x) {   \
+        const uint32_t bit = x * (bits);                                       \
+        return (uint8_t)((row[bit >> 3] >> (8 - (bits) - (bit & 7))) &         \
+                         ((1u << (bits)) - 1));                                \
+    }                                                                          \
+    static inline void index_set_##bits(uint8_t *row, uint32_t x,              \
+                                        uint8_t value) {                       \
+        const uint32_t bit = x * (bits);                                       \
+        const unsigned shift = 8 - (bits) - (bit & 7);                         \
+        const unsigned mask = ((1u << (bits)) - 1) << shift;                   \
+        row[bit >> 3] =                                                        \
+            (uint8_t)((row[bit >> 3] & ~mask) | (((unsigned)value << shift) &  \
+                                                 mask));                       \
+    }
+
+INDEX_KERNELS(1)
+INDEX_KERNELS(2)
+INDEX_KERNELS(4)
+INDEX_KERNELS(8)
+
+typedef uint8_t (*Index_Get)(const uint8_t *row, uint32_t x);
+typedef void (*Index_Set)(uint8_t *row, uint32_t x, uint8_t value);
+
+// NULL for a depth other than 1, 2, 4 or 8
+static inline Index_Get index_getter(uint8_t depth) {
+    switch (depth) {
+    case 1:
+        return index_get_1;
+    case 2:
+        return index_get_2;
+    case 4:
+        return index_get_4;
+    case 8:
+        return index_get_8;
+    default:
+        return NULL;
+    }
+}
+
+static inline Index_Set index_setter(uint8_t depth) {
+    switch (depth) {
+    case 1:
+        return index_set_1;
+    case 2:
+        return index_set_2;
+    case 4:
+        return index_set_4;
+    case 8:
+        return index_set_8;
+    default:
+        return NULL;
+    }
+}
+
+// --- Pixel moves ---
+// Rotations and flips of whole pixels. src holds 'height' rows of 'width'
+// pixels, top row first, dst the rows of the result in the same order (a
+// 90 or 270 degree turn swaps width and height). Only pixel bytes are
+// written, the row padding of dst is left alone.
+
+enum Move {
+    MOVE_ROT_90 = 0, // clockwise
+    MOVE_ROT_180,
+    MOVE_ROT_270,
+    MOVE_FLIP_H, // mirror left to right
+    MOVE_FLIP_V, // upside down
+    MOVE_COUNT
+};
+
+typedef void (*Move_Kernel)(uint8_t *const *src, uint8_t *const *dst,
+                            uint32_t width, uint32_t height);
+
+// NULL for a pixel size without kernels, there are kernels for 1 byte
+// (8-bit indices) and 3 byte (BGR) pixels
+Move_Kernel move_kernel(enum Move move, uint8_t channels);
+
+#endif
@@ -0,0 +1,63 @@
+#include "palette.h"
+#include "report.h"
+#include <stdio.h>
+
+void palette_luminance(const uint8_t *color_table, uint16_t count,
+                       uint8_t *lum) {
+    for (uint16_t i = 0; i < count; i++) {
+        const uint8_t *entry = color_table + i * 4;
+        lum[i] = (uint8_t)(0.299f * entry[2] + 0.587f * entry[1] +
+                           0.114f * entry[0] + 0.5f);
+    }
+}
+
+void palette_apply_lut3(uint8_t *color_table, uint16_t count,
+                        const Lut3 *lut3) {
+    for (uint16_t i = 0; i < count; i++) {
+        uint8_t *entry = color_table + i * 4;
+        for (int c = 0; c < 3; c++) {
+            entry[c] = lut3->channel[c][entry[c]];
+        }
+    }
+}
+
+// Same matrix and byte order as sepia3, so an indexed image and its 24-bit
+// copy come out alike.
+void palette_sepia(uint8_t *color_table, uint16_t count) {
+    const float sepia[3][3] = {
+        {0.272, 0.534, 0.131}, {0.349, 0.686, 0.168}, {0.393, 0.769, 0.189}};
+
+    for (uint16_t i = 0; i < count; i++) {
+        uint8_t *entry = color_table + i * 4;
+        float in[3] = {entry[0], entry[1], entry[2]};
+        for (int c = 0; c < 3; c++) {
+            float v = in[0] * sepia[c][0] + in[1] * sepia[c][1] +
+                      in[2] * sepia[c][2];
+            entry[c] = (v > 255.0f) ? 255 : (uint8_t)v;
+        }
+    }
+}
+
+void palette_remap(uint8_t *pixels, size_t byte_count, uint8_t bit_depth,
+                   const uint8_t *map) {
+    if (bit_depth == 8) {
+        apply_lut1(pixels, byte_count, map);
+        return;
+    }
+    if (bit_depth != 1 && bit_depth != 2 && bit_depth != 4) {
+        report_error("Error: Cannot remap %d-bit indices.\n", bit_depth);
+        return;
+    }
+
+    // Every field of a byte goes through the map on its own
+    const uint8_t mask = (uint8_t)((1 << bit_depth) - 1);
+    uint8_t byte_map[LUT_SIZE];
+    for (int b = 0; b < LUT_SIZE; b++) {
+        uint8_t out = 0;
+        for (int shift = 0; shift < 8; shift += bit_depth) {
+            out |= (uint8_t)((map[(b >> shift) & mask] & mask) << shift);
+        }
+        byte_map[b] = out;
+    }
+    apply_lut1(pixels, byte_count, byte_map);
+}
@@ -0,0 +1,30 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include "lut.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Palette-domain operations for indexed (1, 2, 4 and 8-bit) images. An
+// indexed image has at most 256 colours, so a per pixel colour operation is
+// done once per colour table entry. The pixels then either keep their
+// indices (only the table changes) or go through one index -> index map,
+// applied to the packed bytes in a single table pass.
+// Color tables are in BMP order, 4 bytes per entry: blue, green, red, 0.
+
+// Luminance of each entry, lum[i] for i < count
+void palette_luminance(const uint8_t *color_table, uint16_t count,
+                       uint8_t *lum);
+
+// Rewrite the entries in place
+void palette_apply_lut3(uint8_t *color_table, uint16_t count,
+                        const Lut3 *lut3);
+void palette_sepia(uint8_t *color_table, uint16_t count);
+
+// Replace every index i of a packed pixel buffer by map[i]. Below 8 bits
+// the map is first expanded to a table over whole bytes, so every depth
+// is one apply_lut1 pass.
+void palette_remap(uint8_t *pixels, size_t byte_count, uint8_t bit_depth,
+                   const uint8_t *map);
+
+#endif
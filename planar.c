@@ -0,0 +1,152 @@
+#include "planar.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// pshufb on 16-byte vectors, x86 only
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PLANAR_X86 1
+#include <immintrin.h>
+#endif
+
+uint32_t planar_stride(uint32_t width) { return (width + 63) & ~63u; }
+
+static bool cpu_has_ssse3(void) {
+#ifdef PLANAR_X86
+    return __builtin_cpu_supports("ssse3");
+#else
+    return false;
+#endif
+}
+
+// --- SSSE3 ---
+// 16 pixels are 48 bytes, three vectors. Each output vector is the OR of
+// three shuffles, one per input vector, -1 lanes come out zero.
+
+#ifdef PLANAR_X86
+// split_mask[c][v]: lanes of channel c that come from input vector v
+static const int8_t split_mask[3][3][16] = {
+    {{0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13}},
+    {{1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14}},
+    {{2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15}}};
+
+// merge_mask[v][c]: lanes of output vector v that come from plane c
+static const int8_t merge_mask[3][3][16] = {
+    {{0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5},
+     {-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1},
+     {-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1}},
+    {{-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1},
+     {5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10},
+     {-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1}},
+    {{-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1},
+     {-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1},
+     {10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15}}};
+
+// Both return how many pixels they did, a multiple of 16
+__attribute__((target("ssse3"))) static uint32_t
+split_row_ssse3(const uint8_t *row, uint8_t *b, uint8_t *g, uint8_t *r,
+                uint32_t width) {
+    __m128i mask[3][3];
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 3; v++) {
+            mask[c][v] = _mm_loadu_si128((const __m128i *)split_mask[c][v]);
+        }
+    }
+    uint8_t *out[3] = {b, g, r};
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i in[3];
+        for (int v = 0; v < 3; v++) {
+            in[v] = _mm_loadu_si128((const __m128i *)(row + x * 3 + v * 16));
+        }
+        for (int c = 0; c < 3; c++) {
+            __m128i p = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(in[0], mask[c][0]),
+                             _mm_shuffle_epi8(in[1], mask[c][1])),
+                _mm_shuffle_epi8(in[2], mask[c][2]));
+            _mm_storeu_si128((__m128i *)(out[c] + x), p);
+        }
+    }
+    return x;
+}
+
+__attribute__((target("ssse3"))) static uint32_t
+merge_row_ssse3(const uint8_t *b, const uint8_t *g, const uint8_t *r,
+                uint8_t *row, uint32_t width) {
+    __m128i mask[3][3];
+    for (int v = 0; v < 3; v++) {
+        for (int c = 0; c < 3; c++) {
+            mask[v][c] = _mm_loadu_si128((const __m128i *)merge_mask[v][c]);
+        }
+    }
+    const uint8_t *plane[3] = {b, g, r};
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i in[3];
+        for (int c = 0; c < 3; c++) {
+            in[c] = _mm_loadu_si128((const __m128i *)(plane[c] + x));
+        }
+        for (int v = 0; v < 3; v++) {
+            __m128i p = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(in[0], mask[v][0]),
+                             _mm_shuffle_epi8(in[1], mask[v][1])),
+                _mm_shuffle_epi8(in[2], mask[v][2]));
+            _mm_storeu_si128((__m128i *)(row + x * 3 + v * 16), p);
+        }
+    }
+    return x;
+}
+#endif
+
+void planar_split(uint8_t *const *rows, uint32_t width, uint32_t height,
+                  uint8_t *const planes[3], uint32_t stride) {
+    const bool ssse3 = cpu_has_ssse3();
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < (int)height; y++) {
+        const uint8_t *row = rows[y];
+        uint8_t *b = planes[0] + (size_t)y * stride;
+        uint8_t *g = planes[1] + (size_t)y * stride;
+        uint8_t *r = planes[2] + (size_t)y * stride;
+        uint32_t x = 0;
+#ifdef PLANAR_X86
+        if (ssse3) {
+            x = split_row_ssse3(row, b, g, r, width);
+        }
+#endif
+        for (; x < width; x++) {
+            b[x] = row[x * 3 + 0];
+            g[x] = row[x * 3 + 1];
+            r[x] = row[x * 3 + 2];
+        }
+    }
+}
+
+void planar_merge(uint8_t *const planes[3], uint32_t stride, uint32_t width,
+                  uint32_t height, uint8_t *const *rows) {
+    const bool ssse3 = cpu_has_ssse3();
+
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < (int)height; y++) {
+        uint8_t *row = rows[y];
+        const uint8_t *b = planes[0] + (size_t)y * stride;
+        const uint8_t *g = planes[1] + (size_t)y * stride;
+        const uint8_t *r = planes[2] + (size_t)y * stride;
+        uint32_t x = 0;
+#ifdef PLANAR_X86
+        if (ssse3) {
+            x = merge_row_ssse3(b, g, r, row, width);
+        }
+#endif
+        for (; x < width; x++) {
+            row[x * 3 + 0] = b[x];
+            row[x * 3 + 1] = g[x];
+            row[x * 3 + 2] = r[x];
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef PLANAR_H
+#define PLANAR_H
+
+#include <stdint.h>
+
+// Planar (one plane per channel) copies of 24-bit BGR images. Channel-wise
+// ops (tables, histograms, blurs) run on a plane as plain contiguous byte
+// loops, without stepping over the other two channels of each pixel.
+//
+// planes[0] = blue, planes[1] = green, planes[2] = red, in BMP byte order.
+// Rows are top-down like pixelDataRows, 'stride' bytes apart. A stride
+// from planar_stride keeps every row on a cache line boundary.
+
+// Row stride for planes of 'width' pixels, a multiple of 64
+uint32_t planar_stride(uint32_t width);
+
+// BGR rows to three planes
+void planar_split(uint8_t *const *rows, uint32_t width, uint32_t height,
+                  uint8_t *const planes[3], uint32_t stride);
+
+// Three planes back to BGR rows. Row padding is left alone.
+void planar_merge(uint8_t *const planes[3], uint32_t stride, uint32_t width,
+                  uint32_t height, uint8_t *const *rows);
+
+#endif
@@ -0,0 +1,78 @@
+#include "pointwise.h"
+#include <string.h>
+
+void pixel_program_init(Pixel_Program *program) { program->count = 0; }
+
+void pixel_program_add(Pixel_Program *program, enum Pixel_Op op,
+                       uint8_t threshold) {
+    if (program->count >= PIXEL_PROGRAM_MAX) {
+        return;
+    }
+    Pixel_Step *step = &program->steps[program->count++];
+    step->op = op;
+    step->threshold = threshold;
+}
+
+void pixel_program_add_lut(Pixel_Program *program, const Lut3 *lut) {
+    if (program->count &&
+        program->steps[program->count - 1].op == PIXEL_LUT) {
+        Lut3 *last = &program->steps[program->count - 1].lut;
+        for (int c = 0; c < 3; c++) {
+            lut_compose(last->channel[c], lut->channel[c]);
+        }
+        return;
+    }
+    if (program->count >= PIXEL_PROGRAM_MAX) {
+        return;
+    }
+    Pixel_Step *step = &program->steps[program->count++];
+    step->op = PIXEL_LUT;
+    step->lut = *lut;
+}
+
+void pixel_program_row(uint8_t *row, uint32_t width, void *program) {
+    const Pixel_Program *p = program;
+    const size_t row_bytes = (size_t)width * 3;
+
+    // One op over the whole row at a time, each inner loop has no branch
+    // on the op
+    for (uint8_t i = 0; i < p->count; i++) {
+        const Pixel_Step *step = &p->steps[i];
+        switch (step->op) {
+        case PIXEL_LUT:
+            apply_lut3(&row, width, 1, &step->lut);
+            break;
+        case PIXEL_GRAY:
+            for (size_t x = 0; x < row_bytes; x += 3) {
+                pixel_gray(row + x);
+            }
+            break;
+        case PIXEL_THRESHOLD:
+            for (size_t x = 0; x < row_bytes; x += 3) {
+                pixel_threshold(row + x, step->threshold);
+            }
+            break;
+        case PIXEL_SEPIA:
+            for (size_t x = 0; x < row_bytes; x += 3) {
+                pixel_sepia(row + x);
+            }
+            break;
+        case PIXEL_INV_HSV:
+            for (size_t x = 0; x < row_bytes; x += 3) {
+                pixel_inv_hsv(row + x);
+            }
+            break;
+        }
+    }
+}
+
+void pixel_program_run(const Pixel_Program *program, uint8_t **rows,
+                       uint32_t width, uint32_t height) {
+    if (!program->count) {
+        return;
+    }
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < (int)height; y++) {
+        pixel_program_row(rows[y], width, (void *)program);
+    }
+}
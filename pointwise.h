@@ -0,0 +1,103 @@
+#ifndef POINTWISE_H
+#define POINTWISE_H
+
+#include "lut.h"
+#include <math.h>
+#include <stdint.h>
+
+// Pointwise ops on 24-bit BGR pixels, each output pixel depends on its
+// input pixel only. The single ops in image_data_handler.c and the fused
+// programs below run the same code, so both give the same bytes.
+//
+// p points at the blue byte of a pixel: p[0] = blue, p[1] = green,
+// p[2] = red.
+
+static inline uint8_t pixel_luminance(const uint8_t *p) {
+    return (uint8_t)(0.299f * p[2] + 0.587f * p[1] + 0.114f * p[0] + 0.5f);
+}
+
+static inline void pixel_gray(uint8_t *p) {
+    uint8_t gray = pixel_luminance(p);
+    p[0] = gray;
+    p[1] = gray;
+    p[2] = gray;
+}
+
+// Black or white at the luminance threshold
+static inline void pixel_threshold(uint8_t *p, uint8_t threshold) {
+    uint8_t out = (pixel_luminance(p) >= threshold) ? 255 : 0;
+    p[0] = out;
+    p[1] = out;
+    p[2] = out;
+}
+
+static inline void pixel_sepia(uint8_t *p) {
+    static const float sepia[3][3] = {
+        {0.272, 0.534, 0.131}, {0.349, 0.686, 0.168}, {0.393, 0.769, 0.189}};
+
+    float r = p[0] * sepia[0][0] + p[1] * sepia[0][1] + p[2] * sepia[0][2];
+    float g = p[0] * sepia[1][0] + p[1] * sepia[1][1] + p[2] * sepia[1][2];
+    float b = p[0] * sepia[2][0] + p[1] * sepia[2][1] + p[2] * sepia[2][2];
+
+    p[0] = (r > 255) ? 255 : r;
+    p[1] = (g > 255) ? 255 : g;
+    p[2] = (b > 255) ? 255 : b;
+}
+
+// Invert the value (V of HSV), hue and saturation stay
+static inline void pixel_inv_hsv(uint8_t *p) {
+    float r = p[0] / 255.0;
+    float g = p[1] / 255.0;
+    float b = p[2] / 255.0;
+
+    float max = fmaxf(fmaxf(r, g), b);
+    float v = 1.0 - max;
+    float scale = v / max;
+
+    p[0] = (uint8_t)(r * scale * 255);
+    p[1] = (uint8_t)(g * scale * 255);
+    p[2] = (uint8_t)(b * scale * 255);
+}
+
+// --- Fused programs ---
+// A run of pointwise ops as one pass: each row goes through every op in
+// turn while it is in cache, instead of each op going over the whole
+// image. Tables next to each other are composed into one.
+
+enum Pixel_Op {
+    PIXEL_LUT = 1, // per channel table
+    PIXEL_GRAY,
+    PIXEL_THRESHOLD,
+    PIXEL_SEPIA,
+    PIXEL_INV_HSV
+};
+
+// One op per pipeline step at most (OP_STEPS_MAX)
+#define PIXEL_PROGRAM_MAX 16
+
+typedef struct {
+    enum Pixel_Op op;
+    uint8_t threshold; // PIXEL_THRESHOLD
+    Lut3 lut;          // PIXEL_LUT
+} Pixel_Step;
+
+typedef struct {
+    Pixel_Step steps[PIXEL_PROGRAM_MAX];
+    uint8_t count;
+} Pixel_Program;
+
+void pixel_program_init(Pixel_Program *program);
+// Append an op. Nothing is added to a full program.
+void pixel_program_add(Pixel_Program *program, enum Pixel_Op op,
+                       uint8_t threshold);
+void pixel_program_add_lut(Pixel_Program *program, const Lut3 *lut);
+
+// 'width' pixels of one row, in place. The signature of a blur row hook
+// (box_blur.h), with the program as the context.
+void pixel_program_row(uint8_t *row, uint32_t width, void *program);
+
+// Every row, rows in parallel
+void pixel_program_run(const Pixel_Program *program, uint8_t **rows,
+                       uint32_t width, uint32_t height);
+
+#endif
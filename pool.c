@@ -0,0 +1,320 @@
+#include "pool.h"
+#include "report.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <threads.h>
+
+// Large buffers are anonymous mappings, fresh pages come zeroed
+#if defined(__linux__)
+#define POOL_MMAP 1
+#include <sys/mman.h>
+#endif
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+// In front of every buffer, a whole cache line so the data stays aligned
+typedef struct Pool_Header {
+    struct Pool_Header *next; // free list link while cached
+    size_t bytes;             // class size, header included
+    uint16_t size_class;
+    bool mapped;
+} Pool_Header;
+
+#define HEADER_BYTES                                                           \
+    ((sizeof(Pool_Header) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+// Class 0 is MIN_BYTES, then 4 classes per power of two up to 2^63
+#define MIN_SHIFT   12
+#define MIN_BYTES   ((size_t)1 << MIN_SHIFT)
+#define CLASS_COUNT (1 + (63 - MIN_SHIFT) * 4)
+
+// The lists, cached_bytes and limit are only touched under the lock
+static Pool_Header *free_lists[CLASS_COUNT];
+static size_t cached_bytes;
+static size_t limit = POOL_DEFAULT_LIMIT;
+static bool hugepages;
+static _Atomic uint64_t fresh_count;
+static _Atomic uint64_t reuse_count;
+
+static once_flag init_once = ONCE_FLAG_INIT;
+static mtx_t lock;
+
+// One buffer per small class, only ever touched by its own thread. The key
+// hands it to flush_cache when the thread exits.
+typedef struct {
+    Pool_Header *buffers[CLASS_COUNT];
+} Thread_Cache;
+
+static tss_t cache_key;
+static bool cache_ready;
+static _Thread_local Thread_Cache *thread_cache;
+
+// Class of a request of 'bytes' (header included) and its rounded size
+static uint16_t size_class(size_t bytes, size_t *class_bytes) {
+    if (bytes <= MIN_BYTES) {
+        *class_bytes = MIN_BYTES;
+        return 0;
+    }
+    // 2^p < bytes <= 2^(p + 1), in quarters of 2^p
+    int p = 63 - __builtin_clzll((unsigned long long)(bytes - 1));
+    size_t step = (size_t)1 << (p - 2);
+    size_t q = (bytes + step - 1) / step; // 5 to 8
+    *class_bytes = q * step;
+    return (uint16_t)(1 + (p - MIN_SHIFT) * 4 + (q - 5));
+}
+
+#ifdef POOL_MMAP
+// With huge pages on, map a huge page more and trim it to an aligned range
+// so the whole buffer can be backed by them
+static void *map_buffer(size_t bytes) {
+    size_t extra = hugepages ? POOL_LARGE : 0;
+    uint8_t *p = mmap(NULL, bytes + extra, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    if (extra) {
+        uint8_t *aligned =
+            (uint8_t *)(((uintptr_t)p + extra - 1) & ~(uintptr_t)(extra - 1));
+        size_t head = (size_t)(aligned - p);
+        if (head) {
+            munmap(p, head);
+        }
+        munmap(aligned + bytes, extra - head);
+#ifdef MADV_HUGEPAGE
+        madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+        p = aligned;
+    }
+    return p;
+}
+#endif
+
+static void flush_cache(void *cache);
+
+static void pool_init(void) {
+    if (mtx_init(&lock, mtx_plain) != thrd_success) {
+        // Nothing to fall back on, every caller would race on the lists
+        report_error("Error: Pool could not create its lock.\n");
+        abort();
+    }
+    cache_ready = tss_create(&cache_key, flush_cache) == thrd_success;
+}
+
+static void pool_lock(void) {
+    call_once(&init_once, pool_init);
+    mtx_lock(&lock);
+}
+
+static void pool_unlock(void) { mtx_unlock(&lock); }
+
+// The calling thread's cache, made on first use. NULL if there is none.
+static Thread_Cache *own_cache(void) {
+    if (thread_cache || !cache_ready) {
+        return thread_cache;
+    }
+    Thread_Cache *cache = calloc(1, sizeof(*cache));
+    if (cache && tss_set(cache_key, cache) != thrd_success) {
+        free(cache);
+        cache = NULL;
+    }
+    thread_cache = cache;
+    return cache;
+}
+
+static Pool_Header *os_alloc(size_t bytes, bool *zeroed) {
+    Pool_Header *h = NULL;
+    bool mapped = false;
+#ifdef POOL_MMAP
+    if (bytes >= POOL_LARGE) {
+        h = map_buffer(bytes);
+        mapped = h != NULL;
+    }
+#endif
+    if (!mapped) {
+#if defined(_WIN32)
+        h = _aligned_malloc(bytes, POOL_ALIGN);
+#else
+        h = aligned_alloc(POOL_ALIGN, bytes);
+#endif
+    }
+    if (!h) {
+        return NULL;
+    }
+    h->next = NULL;
+    h->bytes = bytes;
+    h->mapped = mapped;
+    *zeroed = mapped;
+    return h;
+}
+
+static void os_free(Pool_Header *h) {
+#ifdef POOL_MMAP
+    if (h->mapped) {
+        munmap(h, h->bytes);
+        return;
+    }
+#endif
+#if defined(_WIN32)
+    _aligned_free(h);
+#else
+    free(h);
+#endif
+}
+
+void *pool_alloc(size_t byte_count, bool *zeroed) {
+    if (byte_count > SIZE_MAX / 2) {
+        report_error("Error: Pool request of %zu bytes is too large.\n",
+                byte_count);
+        return NULL;
+    }
+    size_t class_bytes;
+    uint16_t c =
+        size_class(HEADER_BYTES + (byte_count ? byte_count : 1), &class_bytes);
+
+    Pool_Header *h = NULL;
+    if (thread_cache && thread_cache->buffers[c]) {
+        h = thread_cache->buffers[c];
+        thread_cache->buffers[c] = NULL;
+    } else {
+        pool_lock();
+        h = free_lists[c];
+        if (h) {
+            free_lists[c] = h->next;
+            cached_bytes -= h->bytes;
+        }
+        pool_unlock();
+    }
+
+    bool fresh_zero = false;
+    if (h) {
+        atomic_fetch_add_explicit(&reuse_count, 1, memory_order_relaxed);
+    } else {
+        h = os_alloc(class_bytes, &fresh_zero);
+        if (!h) {
+            report_error("Error: Pool could not allocate %zu bytes.\n",
+                    class_bytes);
+            return NULL;
+        }
+        h->size_class = c;
+        atomic_fetch_add_explicit(&fresh_count, 1, memory_order_relaxed);
+    }
+    h->next = NULL;
+    if (zeroed) {
+        *zeroed = fresh_zero;
+    }
+    return (uint8_t *)h + HEADER_BYTES;
+}
+
+void *pool_calloc(size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    bool zeroed = false;
+    void *p = pool_alloc(count * size, &zeroed);
+    if (p && !zeroed) {
+        memset(p, 0, count * size);
+    }
+    return p;
+}
+
+// Onto the shared lists while under the limit, back to the OS past it
+static void release_shared(Pool_Header *h) {
+    bool kept = false;
+    pool_lock();
+    if (cached_bytes + h->bytes <= limit) {
+        h->next = free_lists[h->size_class];
+        free_lists[h->size_class] = h;
+        cached_bytes += h->bytes;
+        kept = true;
+    }
+    pool_unlock();
+    if (!kept) {
+        os_free(h);
+    }
+}
+
+// Runs on the exiting thread, its buffers go to the shared lists
+static void flush_cache(void *cache) {
+    Thread_Cache *own = cache;
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        if (own->buffers[c]) {
+            release_shared(own->buffers[c]);
+        }
+    }
+    thread_cache = NULL;
+    free(own);
+}
+
+void pool_release(void *p) {
+    if (!p) {
+        return;
+    }
+    Pool_Header *h = (Pool_Header *)((uint8_t *)p - HEADER_BYTES);
+    uint16_t c = h->size_class;
+    if (h->bytes < POOL_LARGE) {
+        Thread_Cache *cache = own_cache();
+        if (cache && !cache->buffers[c]) {
+            cache->buffers[c] = h;
+            return;
+        }
+    }
+    release_shared(h);
+}
+
+void pool_set_limit(size_t byte_count) {
+    pool_lock();
+    limit = byte_count;
+    pool_unlock();
+    pool_trim(byte_count);
+}
+
+void pool_set_hugepages(bool enable) {
+#ifdef POOL_MMAP
+    hugepages = enable;
+#else
+    if (enable) {
+        report_error("Warning: Huge pages are not supported here.\n");
+    }
+#endif
+}
+
+void pool_trim(size_t keep_bytes) {
+    for (int c = 0; thread_cache && c < CLASS_COUNT; c++) {
+        if (thread_cache->buffers[c]) {
+            os_free(thread_cache->buffers[c]);
+            thread_cache->buffers[c] = NULL;
+        }
+    }
+
+    // Unlink under the lock, give back outside it
+    Pool_Header *trimmed = NULL;
+    pool_lock();
+    for (int c = CLASS_COUNT - 1; c >= 0 && cached_bytes > keep_bytes; c--) {
+        while (free_lists[c] && cached_bytes > keep_bytes) {
+            Pool_Header *h = free_lists[c];
+            free_lists[c] = h->next;
+            cached_bytes -= h->bytes;
+            h->next = trimmed;
+            trimmed = h;
+        }
+    }
+    pool_unlock();
+    while (trimmed) {
+        Pool_Header *next = trimmed->next;
+        os_free(trimmed);
+        trimmed = next;
+    }
+}
+
+void pool_get_stats(Pool_Stats *stats) {
+    stats->fresh_count = atomic_load(&fresh_count);
+    stats->reuse_count = atomic_load(&reuse_count);
+    pool_lock();
+    stats->cached_bytes = cached_bytes;
+    pool_unlock();
+}
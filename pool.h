@@ -0,0 +1,59 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Size-class buffer pool. A released buffer is kept and handed out again
+// for the next request of its class, so a batch of images of one size runs
+// on the same memory instead of faulting in and zeroing new pages for
+// every file. Arena blocks and the quantizer scratch come from here.
+//
+// Classes are 4 KB, then four steps per power of two (5/4, 6/4, 7/4 and
+// 2x), a buffer is at most 25% larger than asked for. Buffers of
+// POOL_LARGE bytes and up are mapped straight from the OS, and can be
+// backed by huge pages.
+//
+// Thread-safe, from any thread. The shared lists sit behind a mutex and
+// hold at most the pool limit. Every thread also keeps one released buffer
+// per class below POOL_LARGE for itself, taking it back needs no lock; when
+// the thread exits those go to the shared lists. Large buffers always go to
+// the shared lists.
+
+// Every buffer starts on a cache line
+#define POOL_ALIGN 64
+// Smallest class mapped from the OS, also the huge page size
+#define POOL_LARGE ((size_t)2 << 20)
+// Bytes the shared lists keep by default
+#define POOL_DEFAULT_LIMIT ((size_t)512 << 20)
+
+typedef struct {
+    uint64_t fresh_count; // buffers that came from the OS
+    uint64_t reuse_count; // buffers handed out again
+    size_t cached_bytes;  // in the shared lists, ready for reuse
+} Pool_Stats;
+
+// POOL_ALIGN aligned, contents undefined. NULL if out of memory. 'zeroed'
+// may be NULL, otherwise it is set when the buffer is fresh zero pages.
+void *pool_alloc(size_t byte_count, bool *zeroed);
+
+// Zeroed, like calloc. Fresh zero pages are not cleared again.
+void *pool_calloc(size_t count, size_t size);
+
+// Keep the buffer for reuse, or give it back past the limit. NULL is fine.
+void pool_release(void *p);
+
+// Most bytes the shared lists keep, 0 keeps nothing
+void pool_set_limit(size_t byte_count);
+
+// madvise(MADV_HUGEPAGE) on new large buffers, Linux only
+void pool_set_hugepages(bool enable);
+
+// Give cached buffers back to the OS, largest first, until at most
+// 'keep_bytes' are left. Also empties the calling thread's own cache.
+void pool_trim(size_t keep_bytes);
+
+void pool_get_stats(Pool_Stats *stats);
+
+#endif
@@ -1,15 +1,39 @@
 
 
 #include "reduce_colors_24.h"
+#include "dither.h"
+#include "pool.h"
+#include "report.h"
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdio.h>
 
-//typedef struct { uint8_t r, g, b; } Color;
+// Colours are binned at HIST_BITS per channel before any cutting, so the
+// work after the first pass depends on the number of occupied cells (at
+// most 32K), not on the pixel count.
+#define HIST_BITS  5
+#define HIST_SHIFT (8 - HIST_BITS)
+#define HIST_CELLS (1 << (3 * HIST_BITS))
+
+// Nearest palette index is cached per CACHE_BITS cell for the mapping pass.
+#define CACHE_BITS  6
+#define CACHE_SHIFT (8 - CACHE_BITS)
+#define CACHE_CELLS (1 << (3 * CACHE_BITS))
+
+// One occupied histogram cell
 typedef struct {
-    int     start, end;
-    Color   min, max;
+    Color    mean;      // average colour of the pixels in the cell
+    uint64_t count;     // pixels in the cell
+    uint64_t sum[3];    // channel sums, for exact box averages
+} Cell;
+
+typedef struct {
+    int      start, end;  // range of cells
+    Color    min, max;    // bounds of the cell means
+    uint64_t count;       // pixels in the box
 } Box;
 
 // Clamp an integer to [0,255]
@@ -19,19 +43,46 @@ static inline uint8_t clamp_int(int v) {
 
 // Compare functions for qsort
 static int cmp_r(const void *a, const void *b) {
-    return ((const Color*)a)->r - ((const Color*)b)->r;
+    return ((const Cell*)a)->mean.r - ((const Cell*)b)->mean.r;
 }
 static int cmp_g(const void *a, const void *b) {
-    return ((const Color*)a)->g - ((const Color*)b)->g;
+    return ((const Cell*)a)->mean.g - ((const Cell*)b)->mean.g;
 }
 static int cmp_b(const void *a, const void *b) {
-    return ((const Color*)a)->b - ((const Color*)b)->b;
+    return ((const Cell*)a)->mean.b - ((const Cell*)b)->mean.b;
+}
+
+static inline uint32_t hist_key(uint8_t r, uint8_t g, uint8_t b) {
+    return ((uint32_t)(r >> HIST_SHIFT) << (2 * HIST_BITS)) |
+           ((uint32_t)(g >> HIST_SHIFT) << HIST_BITS) |
+           (uint32_t)(b >> HIST_SHIFT);
 }
 
-// Find the box with the largest range in any channel
+// Recompute the bounds and pixel count of a box from its cells
+static void box_update(Box *box, const Cell *cells) {
+    box->min.r = box->min.g = box->min.b = 255;
+    box->max.r = box->max.g = box->max.b = 0;
+    box->count = 0;
+    for (int j = box->start; j < box->end; j++) {
+        Color c = cells[j].mean;
+        if (c.r < box->min.r) box->min.r = c.r;
+        if (c.g < box->min.g) box->min.g = c.g;
+        if (c.b < box->min.b) box->min.b = c.b;
+        if (c.r > box->max.r) box->max.r = c.r;
+        if (c.g > box->max.g) box->max.g = c.g;
+        if (c.b > box->max.b) box->max.b = c.b;
+        box->count += cells[j].count;
+    }
+}
+
+// Find the splittable box with the largest range in any channel, -1 if
+// every box is down to a single cell
 static int find_widest_box(Box *boxes, int nboxes) {
-    int best = 0, best_range = -1;
+    int best = -1, best_range = -1;
     for (int i = 0; i < nboxes; i++) {
+        if (boxes[i].end - boxes[i].start < 2) {
+            continue;
+        }
         int dr = boxes[i].max.r - boxes[i].min.r;
         int dg = boxes[i].max.g - boxes[i].min.g;
         int db = boxes[i].max.b - boxes[i].min.b;
@@ -46,60 +97,48 @@ static int find_widest_box(Box *boxes, int nboxes) {
     return best;
 }
 
-// Median-cut: split boxes until we reach target_boxes
+// Median-cut over histogram cells: split boxes until we reach target_boxes.
+// The split point is the pixel weighted median, so the result follows the
+// pixels and not just the set of distinct colours.
 static void median_cut(
-    Color *pixels,
-    int     npix,
+    Cell  *cells,
     Box   *boxes,
-    int    *nboxes,
-    int     target_boxes)
+    int   *nboxes,
+    int    target_boxes)
 {
     while (*nboxes < target_boxes) {
         int idx = find_widest_box(boxes, *nboxes);
+        if (idx < 0) break;
         Box  b   = boxes[idx];
         int  len = b.end - b.start;
-        if (len < 2) break;
 
         // choose channel with max span
         int dr = b.max.r - b.min.r;
         int dg = b.max.g - b.min.g;
         int db = b.max.b - b.min.b;
-        int (*cmp)(const void*, const void*) = 
+        int (*cmp)(const void*, const void*) =
             dr >= dg && dr >= db ? cmp_r :
             (dg >= dr && dg >= db ? cmp_g : cmp_b);
 
-        qsort(pixels + b.start, len, sizeof(Color), cmp);
-        int mid = b.start + len/2;
+        qsort(cells + b.start, len, sizeof(Cell), cmp);
+
+        // first cell past half of the pixels, keeping both halves non-empty
+        uint64_t half = b.count / 2, seen = 0;
+        int mid = b.start + 1;
+        for (int j = b.start; j < b.end - 1; j++) {
+            seen += cells[j].count;
+            mid = j + 1;
+            if (seen >= half) break;
+        }
 
         // new box [mid, end)
         boxes[*nboxes].start = mid;
         boxes[*nboxes].end   = b.end;
-        boxes[*nboxes].min   = pixels[mid];
-        boxes[*nboxes].max   = pixels[mid];
+        box_update(&boxes[*nboxes], cells);
 
         // shrink old box to [start, mid)
         boxes[idx].end = mid;
-        boxes[idx].min = boxes[idx].max = pixels[b.start];
-
-        // recompute bounds for both boxes
-        for (int j = boxes[idx].start; j < boxes[idx].end; j++) {
-            Color c = pixels[j];
-            if (c.r < boxes[idx].min.r) boxes[idx].min.r = c.r;
-            if (c.g < boxes[idx].min.g) boxes[idx].min.g = c.g;
-            if (c.b < boxes[idx].min.b) boxes[idx].min.b = c.b;
-            if (c.r > boxes[idx].max.r) boxes[idx].max.r = c.r;
-            if (c.g > boxes[idx].max.g) boxes[idx].max.g = c.g;
-            if (c.b > boxes[idx].max.b) boxes[idx].max.b = c.b;
-        }
-        for (int j = boxes[*nboxes].start; j < boxes[*nboxes].end; j++) {
-            Color c = pixels[j];
-            if (c.r < boxes[*nboxes].min.r) boxes[*nboxes].min.r = c.r;
-            if (c.g < boxes[*nboxes].min.g) boxes[*nboxes].min.g = c.g;
-            if (c.b < boxes[*nboxes].min.b) boxes[*nboxes].min.b = c.b;
-            if (c.r > boxes[*nboxes].max.r) boxes[*nboxes].max.r = c.r;
-            if (c.g > boxes[*nboxes].max.g) boxes[*nboxes].max.g = c.g;
-            if (c.b > boxes[*nboxes].max.b) boxes[*nboxes].max.b = c.b;
-        }
+        box_update(&boxes[idx], cells);
 
         (*nboxes)++;
     }
@@ -107,19 +146,19 @@ static void median_cut(
 
 // Average colors in each box to form the palette
 static void compute_palette(
-    Color *pixels,
-    Box   *boxes,
-    int     nboxes,
-    Color *palette)
+    const Cell *cells,
+    Box        *boxes,
+    int         nboxes,
+    Color      *palette)
 {
     for (int i = 0; i < nboxes; i++) {
-        uint32_t sr = 0, sg = 0, sb = 0;
-        int cnt = boxes[i].end - boxes[i].start;
+        uint64_t sr = 0, sg = 0, sb = 0;
         for (int j = boxes[i].start; j < boxes[i].end; j++) {
-            sr += pixels[j].r;
-            sg += pixels[j].g;
-            sb += pixels[j].b;
+            sr += cells[j].sum[0];
+            sg += cells[j].sum[1];
+            sb += cells[j].sum[2];
         }
+        uint64_t cnt = boxes[i].count;
         palette[i].r = sr / cnt;
         palette[i].g = sg / cnt;
         palette[i].b = sb / cnt;
@@ -142,53 +181,537 @@ static int find_nearest(Color c, Color *palette, int psz) {
     return best;
 }
 
-// Floyd–Steinberg dithering
-static void apply_dither(
-    Color *img,
-    int    w,
-    int    h,
-    Color *palette,
-    int    psz,
-    uint8_t *out_idx)
+// Nearest index through the per-cell cache, each cell is searched once
+// using its center colour
+static inline uint8_t lookup_nearest(
+    Color    c,
+    Color   *palette,
+    int      psz,
+    int16_t *cache)
 {
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            int i = y*w + x;
-            Color old = img[i];
-            int pi = find_nearest(old, palette, psz);
-            Color neu = palette[pi];
-            out_idx[i] = (uint8_t)pi;
-
-            int er = (int)old.r - neu.r;
-            int eg = (int)old.g - neu.g;
-            int eb = (int)old.b - neu.b;
-
-            #define PROP(dx,dy,wt) do {                                    \
-                int nx = x + (dx), ny = y + (dy);                          \
-                if (nx >= 0 && nx < w && ny >= 0 && ny < h) {              \
-                    int ni = ny*w + nx;                                   \
-                    img[ni].r = clamp_int(img[ni].r + er * (wt) / 16);    \
-                    img[ni].g = clamp_int(img[ni].g + eg * (wt) / 16);    \
-                    img[ni].b = clamp_int(img[ni].b + eb * (wt) / 16);    \
-                }                                                          \
-            } while(0)
-
-            PROP(+1,  0, 7);
-            PROP(-1, +1, 3);
-            PROP( 0, +1, 5);
-            PROP(+1, +1, 1);
-            #undef PROP
+    uint32_t key = ((uint32_t)(c.r >> CACHE_SHIFT) << (2 * CACHE_BITS)) |
+                   ((uint32_t)(c.g >> CACHE_SHIFT) << CACHE_BITS) |
+                   (uint32_t)(c.b >> CACHE_SHIFT);
+    if (cache[key] < 0) {
+        const uint8_t mask   = (uint8_t)(0xFF << CACHE_SHIFT);
+        const uint8_t center = (1 << CACHE_SHIFT) / 2;
+        Color cell = { (c.r & mask) | center, (c.g & mask) | center,
+                       (c.b & mask) | center };
+        cache[key] = (int16_t)find_nearest(cell, palette, psz);
+    }
+    return (uint8_t)cache[key];
+}
+
+// Error diffusion callback, nearest index through the cache. The engine
+// reads the palette as 3 bytes per entry.
+_Static_assert(sizeof(Color) == 3, "Color must be 3 packed bytes");
+
+typedef struct {
+    Color   *palette;
+    int      psz;
+    int16_t *cache;
+} Nearest_Ctx;
+
+static uint8_t nearest_cached(void *ctx, const uint8_t *color) {
+    Nearest_Ctx *n = ctx;
+    Color c = { color[0], color[1], color[2] };
+    return lookup_nearest(c, n->palette, n->psz, n->cache);
+}
+
+// Typical gap between palette colours, the mean distance from each entry
+// to its nearest neighbour. Ordered dither offsets are scaled to it.
+static int palette_spread(const Color *palette, int psz) {
+    if (psz < 2) {
+        return 0;
+    }
+    double total = 0.0;
+    for (int i = 0; i < psz; i++) {
+        int bd = INT_MAX;
+        for (int j = 0; j < psz; j++) {
+            int dr = (int)palette[i].r - palette[j].r;
+            int dg = (int)palette[i].g - palette[j].g;
+            int db = (int)palette[i].b - palette[j].b;
+            int d  = dr*dr + dg*dg + db*db;
+            if (j != i && d < bd) {
+                bd = d;
+            }
+        }
+        total += sqrt((double)bd);
+    }
+    return (int)(total / psz + 0.5);
+}
+
+// Ordered dithering: each pixel is offset by its tile threshold, scaled to
+// the palette spread, then mapped to the nearest entry. No error is carried
+// between pixels, so rows are split across threads, each thread with its
+// own nearest-index cache.
+static void apply_ordered_dither(
+    const uint8_t *rgb_buf,
+    uint32_t       width,
+    uint32_t       height,
+    uint32_t       row_stride,
+    Dither_Mode    mode,
+    Color         *palette,
+    int            psz,
+    uint8_t       *out_idx)
+{
+    int spread = palette_spread(palette, psz);
+
+    #pragma omp parallel
+    {
+        int16_t *cache = pool_alloc(CACHE_CELLS * sizeof(int16_t), NULL);
+        if (cache) {
+            memset(cache, 0xFF, CACHE_CELLS * sizeof(int16_t));
+        }
+        uint8_t pattern[DITHER_PATTERN];
+        int     offset[DITHER_PATTERN];
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < (int)height; y++) {
+            const uint8_t *row = rgb_buf + (size_t)y * row_stride;
+            uint8_t *out = out_idx + (size_t)y * width;
+            dither_pattern_row(mode, 128, y, pattern);
+            for (int i = 0; i < DITHER_PATTERN; i++) {
+                offset[i] = ((int)pattern[i] - 128) * spread / 256;
+            }
+            for (uint32_t x = 0; x < width; x++) {
+                int o = offset[x % DITHER_PATTERN];
+                Color c = { clamp_int(row[x*3 + 0] - o),
+                            clamp_int(row[x*3 + 1] - o),
+                            clamp_int(row[x*3 + 2] - o) };
+                out[x] = cache ? lookup_nearest(c, palette, psz, cache)
+                               : (uint8_t)find_nearest(c, palette, psz);
+            }
         }
+        pool_release(cache);
     }
 }
 
+// Histogram of the padded rows, returned as the compact list of occupied
+// cells
+static Cell *build_cells(
+    const uint8_t *rgb_buf,
+    uint32_t       width,
+    uint32_t       height,
+    uint32_t       row_stride,
+    int           *out_ncells)
+{
+    uint64_t *hist_count = pool_calloc(HIST_CELLS, sizeof(uint64_t));
+    uint64_t (*hist_sum)[3] = pool_calloc(HIST_CELLS, sizeof(*hist_sum));
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = rgb_buf + (size_t)y * row_stride;
+        for (uint32_t x = 0; x < width; x++) {
+            uint8_t r = row[x*3 + 0], g = row[x*3 + 1], b = row[x*3 + 2];
+            uint32_t key = hist_key(r, g, b);
+            hist_count[key]++;
+            hist_sum[key][0] += r;
+            hist_sum[key][1] += g;
+            hist_sum[key][2] += b;
+        }
+    }
+
+    int ncells = 0;
+    for (int k = 0; k < HIST_CELLS; k++) {
+        if (hist_count[k]) ncells++;
+    }
+    Cell *cells = malloc((ncells ? ncells : 1) * sizeof(Cell));
+    for (int k = 0, i = 0; k < HIST_CELLS; k++) {
+        uint64_t cnt = hist_count[k];
+        if (!cnt) continue;
+        cells[i].count  = cnt;
+        cells[i].sum[0] = hist_sum[k][0];
+        cells[i].sum[1] = hist_sum[k][1];
+        cells[i].sum[2] = hist_sum[k][2];
+        cells[i].mean.r = (uint8_t)(hist_sum[k][0] / cnt);
+        cells[i].mean.g = (uint8_t)(hist_sum[k][1] / cnt);
+        cells[i].mean.b = (uint8_t)(hist_sum[k][2] / cnt);
+        i++;
+    }
+    pool_release(hist_count);
+    pool_release(hist_sum);
+
+    *out_ncells = ncells;
+    return cells;
+}
+
+// Median cut palette over the cells, returns the palette size
+static int median_cut_palette(
+    Cell   *cells,
+    int     ncells,
+    int     target_boxes,
+    Color **out_pal)
+{
+    Box *boxes = malloc(target_boxes * sizeof(Box));
+    boxes[0].start = 0;
+    boxes[0].end   = ncells;
+    box_update(&boxes[0], cells);
+
+    int nboxes = ncells ? 1 : 0;
+    median_cut(cells, boxes, &nboxes, target_boxes);
+
+    Color *palette = malloc((nboxes ? nboxes : 1) * sizeof(Color));
+    compute_palette(cells, boxes, nboxes, palette);
+    free(boxes);
+
+    *out_pal = palette;
+    return nboxes;
+}
+
+// --- Octree ---
+// Single streaming pass, the tree never holds more than max_leaves leaves
+// (plus one partial merge), so memory is bounded by the palette size and
+// not by the image. Rows are fed one at a time.
+
+#define OCTREE_DEPTH 8
+
+typedef struct {
+    uint64_t sum[3];
+    uint64_t count;
+    int32_t  child[8];
+    int32_t  next;      // next reducible node on the same level
+    uint8_t  level;
+    uint8_t  leaf;
+} Octree_Node;
+
+typedef struct {
+    Octree_Node *nodes;
+    int32_t      capacity;
+    int32_t      used;
+    int32_t      free_list;     // released nodes, chained through next
+    int32_t      reducible[OCTREE_DEPTH];
+    int          leaf_count;
+    int          max_leaves;
+} Octree;
+
+static int32_t octree_new_node(Octree *tree, uint8_t level) {
+    int32_t n;
+    if (tree->free_list >= 0) {
+        n = tree->free_list;
+        tree->free_list = tree->nodes[n].next;
+    } else {
+        n = tree->used++;
+    }
+    Octree_Node *node = &tree->nodes[n];
+    memset(node, 0, sizeof(*node));
+    memset(node->child, 0xFF, sizeof(node->child));
+    node->next  = -1;
+    node->level = level;
+    if (level == OCTREE_DEPTH) {
+        node->leaf = 1;
+        tree->leaf_count++;
+    } else {
+        node->next = tree->reducible[level];
+        tree->reducible[level] = n;
+    }
+    return n;
+}
+
+// Fold the children of the most recent node on the deepest level with
+// internal nodes into it. Those children are all leaves.
+static void octree_reduce(Octree *tree) {
+    int level = OCTREE_DEPTH - 1;
+    while (level > 0 && tree->reducible[level] < 0) {
+        level--;
+    }
+    int32_t n = tree->reducible[level];
+    Octree_Node *node = &tree->nodes[n];
+    tree->reducible[level] = node->next;
+
+    int merged = 0;
+    for (int i = 0; i < 8; i++) {
+        int32_t c = node->child[i];
+        if (c < 0) continue;
+        Octree_Node *child = &tree->nodes[c];
+        node->sum[0] += child->sum[0];
+        node->sum[1] += child->sum[1];
+        node->sum[2] += child->sum[2];
+        node->count  += child->count;
+        child->next = tree->free_list;
+        tree->free_list = c;
+        node->child[i] = -1;
+        merged++;
+    }
+    node->leaf = 1;
+    tree->leaf_count -= merged - 1;
+}
+
+static void octree_add_row(Octree *tree, const uint8_t *row, uint32_t width) {
+    for (uint32_t x = 0; x < width; x++) {
+        uint8_t r = row[x*3 + 0], g = row[x*3 + 1], b = row[x*3 + 2];
+        int32_t n = 0;
+        while (!tree->nodes[n].leaf) {
+            uint8_t level = tree->nodes[n].level;
+            int shift = 7 - level;
+            int i = (((r >> shift) & 1) << 2) | (((g >> shift) & 1) << 1) |
+                    ((b >> shift) & 1);
+            if (tree->nodes[n].child[i] < 0) {
+                int32_t c = octree_new_node(tree, level + 1);
+                tree->nodes[n].child[i] = c;
+            }
+            n = tree->nodes[n].child[i];
+        }
+        Octree_Node *leaf = &tree->nodes[n];
+        leaf->sum[0] += r;
+        leaf->sum[1] += g;
+        leaf->sum[2] += b;
+        leaf->count++;
+
+        while (tree->leaf_count > tree->max_leaves) {
+            octree_reduce(tree);
+        }
+    }
+}
+
+static void octree_collect(
+    const Octree *tree,
+    int32_t       n,
+    Color        *palette,
+    int          *count)
+{
+    const Octree_Node *node = &tree->nodes[n];
+    if (node->leaf) {
+        if (node->count) {
+            palette[*count].r = node->sum[0] / node->count;
+            palette[*count].g = node->sum[1] / node->count;
+            palette[*count].b = node->sum[2] / node->count;
+            (*count)++;
+        }
+        return;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (node->child[i] >= 0) {
+            octree_collect(tree, node->child[i], palette, count);
+        }
+    }
+}
+
+// Octree palette, returns the palette size
+static int octree_palette(
+    const uint8_t *rgb_buf,
+    uint32_t       width,
+    uint32_t       height,
+    uint32_t       row_stride,
+    int            max_leaves,
+    Color        **out_pal)
+{
+    Octree tree;
+    // Every leaf hangs off at most OCTREE_DEPTH internal nodes, and one
+    // insert can add a full path before the next reduce.
+    tree.capacity   = (max_leaves + 1) * (OCTREE_DEPTH + 1) + 1;
+    tree.nodes      = malloc(tree.capacity * sizeof(Octree_Node));
+    tree.used       = 0;
+    tree.free_list  = -1;
+    tree.leaf_count = 0;
+    tree.max_leaves = max_leaves;
+    for (int i = 0; i < OCTREE_DEPTH; i++) {
+        tree.reducible[i] = -1;
+    }
+    octree_new_node(&tree, 0);
+
+    for (uint32_t y = 0; y < height; y++) {
+        octree_add_row(&tree, rgb_buf + (size_t)y * row_stride, width);
+    }
+
+    Color *palette = malloc((tree.leaf_count ? tree.leaf_count : 1) *
+                            sizeof(Color));
+    int count = 0;
+    if (width && height) {
+        octree_collect(&tree, 0, palette, &count);
+    }
+    free(tree.nodes);
+
+    *out_pal = palette;
+    return count;
+}
+
+// --- k-means ---
+// Lloyd iterations over the histogram cells, weighted by pixel count,
+// seeded with the median cut palette. A center j is skipped when
+// d(best, j) >= 2 d(x, best), it cannot be closer than the current best
+// (triangle inequality). Assignment is split across threads.
+
+#define KMEANS_MAX_ITER 16
+
+static void kmeans_refine(
+    const Cell *cells,
+    int         ncells,
+    Color      *palette,
+    int         k)
+{
+    if (k < 2 || ncells <= k) {
+        return;
+    }
+    float (*center)[3] = malloc(k * sizeof(*center));
+    float *quarter_dist = malloc((size_t)k * k * sizeof(float));
+    int *assign = malloc(ncells * sizeof(int));
+    uint64_t (*sum)[3] = malloc(k * sizeof(*sum));
+    uint64_t *count = malloc(k * sizeof(uint64_t));
+
+    for (int j = 0; j < k; j++) {
+        center[j][0] = palette[j].r;
+        center[j][1] = palette[j].g;
+        center[j][2] = palette[j].b;
+    }
+    for (int i = 0; i < ncells; i++) {
+        assign[i] = 0;
+    }
+
+    for (int iter = 0; iter < KMEANS_MAX_ITER; iter++) {
+        // (d(a, b) / 2)^2 between every pair of centers
+        for (int a = 0; a < k; a++) {
+            for (int b = 0; b < k; b++) {
+                float dr = center[a][0] - center[b][0];
+                float dg = center[a][1] - center[b][1];
+                float db = center[a][2] - center[b][2];
+                quarter_dist[a * k + b] = 0.25f * (dr*dr + dg*dg + db*db);
+            }
+        }
+
+        int changed = 0;
+        #pragma omp parallel for schedule(static) reduction(+:changed)
+        for (int i = 0; i < ncells; i++) {
+            float x[3] = { cells[i].mean.r, cells[i].mean.g, cells[i].mean.b };
+            int best = assign[i];
+            float dr = x[0] - center[best][0];
+            float dg = x[1] - center[best][1];
+            float db = x[2] - center[best][2];
+            float best_d = dr*dr + dg*dg + db*db;
+            for (int j = 0; j < k; j++) {
+                if (j == best || quarter_dist[best * k + j] >= best_d) {
+                    continue;
+                }
+                dr = x[0] - center[j][0];
+                dg = x[1] - center[j][1];
+                db = x[2] - center[j][2];
+                float d = dr*dr + dg*dg + db*db;
+                if (d < best_d) {
+                    best_d = d;
+                    best = j;
+                }
+            }
+            if (best != assign[i]) {
+                assign[i] = best;
+                changed++;
+            }
+        }
+        if (iter > 0 && changed == 0) {
+            break;
+        }
+
+        memset(sum, 0, k * sizeof(*sum));
+        memset(count, 0, k * sizeof(uint64_t));
+        for (int i = 0; i < ncells; i++) {
+            int j = assign[i];
+            sum[j][0] += cells[i].sum[0];
+            sum[j][1] += cells[i].sum[1];
+            sum[j][2] += cells[i].sum[2];
+            count[j]  += cells[i].count;
+        }
+        // Empty clusters keep their old center
+        for (int j = 0; j < k; j++) {
+            if (count[j]) {
+                center[j][0] = (float)sum[j][0] / count[j];
+                center[j][1] = (float)sum[j][1] / count[j];
+                center[j][2] = (float)sum[j][2] / count[j];
+            }
+        }
+    }
+
+    for (int j = 0; j < k; j++) {
+        palette[j].r = (uint8_t)(center[j][0] + 0.5f);
+        palette[j].g = (uint8_t)(center[j][1] + 0.5f);
+        palette[j].b = (uint8_t)(center[j][2] + 0.5f);
+    }
+
+    free(center);
+    free(quarter_dist);
+    free(assign);
+    free(sum);
+    free(count);
+}
+
+// --- Exact palette ---
+// Charts and screenshots often hold fewer colours than the palette has
+// room for. One pass over the pixels fills a small open-addressing hash of
+// the colours seen so far and writes the indices as it goes. It gives up as
+// soon as one colour too many shows up, so photos only pay for the first
+// few rows.
+
+static inline uint32_t exact_slot(uint32_t key, uint32_t mask) {
+    return ((key * 0x9E3779B1u) >> 16) & mask;
+}
+
+// Returns the palette size, or 0 if the image has more than max_colors
+static int exact_palette(
+    const uint8_t *rgb_buf,
+    uint32_t       width,
+    uint32_t       height,
+    uint32_t       row_stride,
+    int            max_colors,
+    uint8_t       *indices,
+    Color        **out_pal)
+{
+    // at most 1/4 full, keys are colour + 1 so 0 marks an empty slot
+    uint32_t slots = 16;
+    while (slots < 4u * max_colors) slots <<= 1;
+    const uint32_t mask = slots - 1;
+    uint32_t *keys  = calloc(slots, sizeof(uint32_t));
+    uint8_t  *value = malloc(slots);
+    Color *palette  = malloc(max_colors * sizeof(Color));
+
+    int count = 0;
+    uint32_t last_key = 0;
+    uint8_t  last_index = 0;
+    size_t i = 0;
+    for (uint32_t y = 0; y < height && count >= 0; y++) {
+        const uint8_t *row = rgb_buf + (size_t)y * row_stride;
+        for (uint32_t x = 0; x < width; x++, i++) {
+            uint32_t key = ((uint32_t)row[x*3 + 0] |
+                            (uint32_t)row[x*3 + 1] << 8 |
+                            (uint32_t)row[x*3 + 2] << 16) + 1;
+            // runs of one colour are the common case
+            if (key != last_key) {
+                uint32_t s = exact_slot(key, mask);
+                while (keys[s] && keys[s] != key) s = (s + 1) & mask;
+                if (!keys[s]) {
+                    if (count == max_colors) {
+                        count = -1;
+                        break;
+                    }
+                    keys[s]  = key;
+                    value[s] = (uint8_t)count;
+                    palette[count].r = row[x*3 + 0];
+                    palette[count].g = row[x*3 + 1];
+                    palette[count].b = row[x*3 + 2];
+                    count++;
+                }
+                last_key   = key;
+                last_index = value[s];
+            }
+            indices[i] = last_index;
+        }
+    }
+    free(keys);
+    free(value);
+
+    if (count <= 0) {
+        free(palette);
+        return 0;
+    }
+    *out_pal = palette;
+    return count;
+}
+
 // Self-contained indexed conversion for padded 24-bit input
 // rgb_buf     : input buffer, each row is 'row_stride' bytes (padded to 4-byte boundary)
 // width/height: image dimensions
 // bits        : bit depth (1…8), defines max palette capacity = (1<<bits)
 // max_colors  : if >0 and < capacity, use this many colors instead
-// dither_flag : 0 = no dither, 1 = Floyd–Steinberg
-// out_idx     : *malloc’d [width*height] palette indices
+// dither_flag : Dither_Mode, 0 = no dither, 1 = Floyd–Steinberg, any
+//               other diffusion or ordered mode, | DITHER_SERPENTINE
+// quantizer   : palette builder, see Quantizer
+// out_idx     : *pool_alloc’d [width*height] palette indices, give back
+//               with pool_release
 // out_pal     : *malloc’d palette entries
 // out_psize   : actual number of palette entries used
 void convert_24_to_indexed_tight(
@@ -199,6 +722,7 @@ void convert_24_to_indexed_tight(
     uint8_t        bits,
     uint16_t       max_colors,
     uint8_t        dither_flag,
+    Quantizer      quantizer,
     uint8_t      **out_idx,
     Color        **out_pal,
     uint16_t      *out_psize)
@@ -206,59 +730,71 @@ void convert_24_to_indexed_tight(
     int capacity    = 1 << bits;
     int target_boxes= (max_colors > 0 && max_colors < capacity)
                        ? max_colors : capacity;
-    int npix        = width * height;
-
-    // 1) unpack padded rows into a contiguous Color array
-    Color *pixels = malloc(npix * sizeof(Color));
-    for (int y = 0, i = 0; y < height; y++) {
-        const uint8_t *row = rgb_buf + y * row_stride;
-        for (int x = 0; x < width; x++, i++) {
-            pixels[i].r = row[x*3 + 0];
-            pixels[i].g = row[x*3 + 1];
-            pixels[i].b = row[x*3 + 2];
+    size_t npix     = (size_t)width * height;
+
+    uint8_t *indices = pool_alloc(npix, NULL);
+    if (!indices) {
+        report_error("Error: Could not allocate %zu palette indices.\n",
+                npix);
+        *out_idx   = NULL;
+        *out_pal   = NULL;
+        *out_psize = 0;
+        return;
+    }
+
+    // 0) few enough colours to keep them all, nothing to quantize
+    Color *palette = NULL;
+    int nboxes = exact_palette(rgb_buf, width, height, row_stride,
+                               target_boxes, indices, &palette);
+    if (nboxes > 0) {
+        DEBUG_LOG("Exact palette: %d colors\n", nboxes);
+        *out_idx   = indices;
+        *out_pal   = palette;
+        *out_psize = nboxes;
+        return;
+    }
+
+    // 1) palette
+    if (quantizer == QUANT_OCTREE) {
+        nboxes = octree_palette(rgb_buf, width, height, row_stride,
+                                target_boxes, &palette);
+    } else {
+        int ncells = 0;
+        Cell *cells = build_cells(rgb_buf, width, height, row_stride,
+                                  &ncells);
+        nboxes = median_cut_palette(cells, ncells, target_boxes, &palette);
+        if (quantizer == QUANT_KMEANS) {
+            kmeans_refine(cells, ncells, palette, nboxes);
         }
+        free(cells);
     }
 
-    // 2) initialize one box covering all pixels
-    Box *boxes = malloc(capacity * sizeof(Box));
-    boxes[0].start = 0;
-    boxes[0].end   = npix;
-    boxes[0].min.r = boxes[0].min.g = boxes[0].min.b = 255;
-    boxes[0].max.r = boxes[0].max.g = boxes[0].max.b =   0;
-    for (int i = 0; i < npix; i++) {
-        Color c = pixels[i];
-        if (c.r < boxes[0].min.r) boxes[0].min.r = c.r;
-        if (c.g < boxes[0].min.g) boxes[0].min.g = c.g;
-        if (c.b < boxes[0].min.b) boxes[0].min.b = c.b;
-        if (c.r > boxes[0].max.r) boxes[0].max.r = c.r;
-        if (c.g > boxes[0].max.g) boxes[0].max.g = c.g;
-        if (c.b > boxes[0].max.b) boxes[0].max.b = c.b;
-    }
-
-    // 3) median-cut to build up to target_boxes
-    int nboxes = 1;
-    median_cut(pixels, npix, boxes, &nboxes, target_boxes);
-
-    // 4) compute palette
-    Color *palette = malloc(nboxes * sizeof(Color));
-    compute_palette(pixels, boxes, nboxes, palette);
-
-    // 5) map pixels to indices
-    uint8_t *indices = malloc(npix);
-    if (dither_flag) {
-        Color *work = malloc(npix * sizeof(Color));
-        memcpy(work, pixels, npix * sizeof(Color));
-        apply_dither(work, width, height, palette, nboxes, indices);
-        free(work);
+    // 2) map pixels to indices through the nearest-index cache
+    int16_t *cache = pool_alloc(CACHE_CELLS * sizeof(int16_t), NULL);
+    memset(cache, 0xFF, CACHE_CELLS * sizeof(int16_t));
+    Dither_Mode dither = (Dither_Mode)(dither_flag & DITHER_MODE_MASK);
+    if (dither_is_ordered(dither)) {
+        apply_ordered_dither(rgb_buf, width, height, row_stride, dither,
+                             palette, nboxes, indices);
+    } else if (dither_is_diffusion(dither)) {
+        Nearest_Ctx ctx = { palette, nboxes, cache };
+        Dither_Palette dp = { (const uint8_t *)palette, nearest_cached, &ctx };
+        bool serpentine = (dither_flag & DITHER_SERPENTINE) != 0;
+        dither_diffuse_palette(rgb_buf, row_stride, indices, width, width,
+                               height, dither, serpentine, &dp);
     } else {
-        for (int i = 0; i < npix; i++) {
-            indices[i] = (uint8_t)find_nearest(pixels[i], palette, nboxes);
+        size_t i = 0;
+        for (uint32_t y = 0; y < height; y++) {
+            const uint8_t *row = rgb_buf + (size_t)y * row_stride;
+            for (uint32_t x = 0; x < width; x++, i++) {
+                Color c = { row[x*3 + 0], row[x*3 + 1], row[x*3 + 2] };
+                indices[i] = lookup_nearest(c, palette, nboxes, cache);
+            }
         }
     }
 
-    // 6) cleanup & output
-    free(pixels);
-    free(boxes);
+    // 3) cleanup & output
+    pool_release(cache);
 
     *out_idx   = indices;
     *out_pal   = palette;
@@ -295,4 +831,21 @@ uint8_t *pad_indexed_buffer(const uint8_t *src, uint32_t width, uint32_t height,
 
     // Return the padded buffer
     return dst;
-}
\ No newline at end of file
+}
+
+const char *quantizer_name(Quantizer quantizer) {
+    switch (quantizer) {
+    case QUANT_OCTREE: return "octree";
+    case QUANT_KMEANS: return "kmeans";
+    default:           return "median";
+    }
+}
+
+int quantizer_from_name(const char *name) {
+    for (int q = QUANT_MEDIAN; q <= QUANT_KMEANS; q++) {
+        if (name && strcmp(name, quantizer_name((Quantizer)q)) == 0) {
+            return q;
+        }
+    }
+    return -1;
+}
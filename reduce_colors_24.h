@@ -5,12 +5,25 @@
 #include <stdint.h>
 typedef struct { uint8_t r,g,b; } RGB;
 typedef struct { uint8_t r, g, b; } Color;
+
+// Palette builders for --quantizer
+typedef enum {
+    QUANT_MEDIAN = 0, // median cut on the colour histogram
+    QUANT_OCTREE,     // streaming octree, one pass, bounded memory
+    QUANT_KMEANS      // median cut refined with k-means
+} Quantizer;
+
+const char *quantizer_name(Quantizer quantizer);
+int quantizer_from_name(const char *name); // -1 if unknown
+
 // Pure-C indexed conversion
 // rgb_buf   : input 24-bit RGB buffer (size = 3*width*height)
 // width,hgt : dimensions
 // bits      : target bits (1…8)
-// dither    : 0=no dithering, 1=Floyd–Steinberg
-// out_idx   : *malloc’d output indices [w*h]
+// dither    : Dither_Mode, 0=no dithering, 1=Floyd–Steinberg, any other
+//             mode from dither.h, | DITHER_SERPENTINE
+// quantizer : palette builder
+// out_idx   : *pool_alloc’d output indices [w*h], pool_release them
 // out_pal   : *malloc’d palette [1<<bits]
 // out_psize : actual palette size
 void convert_24_to_indexed_tight(
@@ -21,6 +34,7 @@ void convert_24_to_indexed_tight(
     uint8_t        bits,
     uint16_t       max_colors,
     uint8_t        dither_flag,
+    Quantizer      quantizer,
     uint8_t      **out_idx,
     Color        **out_pal,
     uint16_t      *out_psize);
@@ -0,0 +1,262 @@
+#include "repack.h"
+#include "lut.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// pdep / pext on 64-bit words, x86-64 only
+#if defined(__GNUC__) && defined(__x86_64__)
+#define REPACK_X86 1
+#include <immintrin.h>
+#endif
+
+static bool valid_depth(uint8_t depth) {
+    return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+}
+
+static bool cpu_has_bmi2(void) {
+#ifdef REPACK_X86
+    return __builtin_cpu_supports("bmi2");
+#else
+    return false;
+#endif
+}
+
+// Eight pixels of a 1, 2 or 4-bit row are 'depth' bytes, little-endian in
+// a word. Reversing the fields inside each byte puts pixel k at bits
+// k * depth, the order pdep scatters from and pext gathers to. The swap is
+// its own inverse.
+static inline __attribute__((always_inline)) uint64_t
+swap_fields(uint64_t x, uint8_t depth) {
+    if (depth <= 4) {
+        x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) |
+            ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    }
+    if (depth <= 2) {
+        x = ((x >> 2) & 0x3333333333333333ULL) |
+            ((x & 0x3333333333333333ULL) << 2);
+    }
+    if (depth == 1) {
+        x = ((x >> 1) & 0x5555555555555555ULL) |
+            ((x & 0x5555555555555555ULL) << 1);
+    }
+    return x;
+}
+
+// Low 'depth' bits of every byte
+static inline uint64_t lane_mask(uint8_t depth) {
+    return 0x0101010101010101ULL * ((1u << depth) - 1);
+}
+
+static inline uint8_t get_pixel(const uint8_t *row, uint8_t depth,
+                                uint32_t x) {
+    uint32_t bit = x * depth;
+    return (row[bit >> 3] >> (8 - depth - (bit & 7))) & ((1u << depth) - 1);
+}
+
+// --- BMI2 ---
+// Both return how many pixels they did, a multiple of 8. The bodies are
+// inlined with a constant depth so the 1, 2 or 4 byte loads and stores are
+// plain moves.
+
+#ifdef REPACK_X86
+__attribute__((target("bmi2"), always_inline)) static inline uint32_t
+unpack_bmi2_depth(const uint8_t *src, uint8_t *idx, uint32_t width,
+                  const uint8_t depth) {
+    const uint64_t mask = lane_mask(depth);
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint64_t bits = 0;
+        memcpy(&bits, src + x / 8 * depth, depth);
+        uint64_t pixels = _pdep_u64(swap_fields(bits, depth), mask);
+        memcpy(idx + x, &pixels, 8);
+    }
+    return x;
+}
+
+__attribute__((target("bmi2"), always_inline)) static inline uint32_t
+pack_bmi2_depth(const uint8_t *idx, uint8_t *dst, uint32_t width,
+                const uint8_t depth) {
+    const uint64_t mask = lane_mask(depth);
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint64_t pixels;
+        memcpy(&pixels, idx + x, 8);
+        uint64_t bits = swap_fields(_pext_u64(pixels, mask), depth);
+        memcpy(dst + x / 8 * depth, &bits, depth);
+    }
+    return x;
+}
+
+__attribute__((target("bmi2"))) static uint32_t
+unpack_bmi2(const uint8_t *src, uint8_t depth, uint8_t *idx, uint32_t width) {
+    switch (depth) {
+    case 1:
+        return unpack_bmi2_depth(src, idx, width, 1);
+    case 2:
+        return unpack_bmi2_depth(src, idx, width, 2);
+    default:
+        return unpack_bmi2_depth(src, idx, width, 4);
+    }
+}
+
+__attribute__((target("bmi2"))) static uint32_t
+pack_bmi2(const uint8_t *idx, uint8_t *dst, uint8_t depth, uint32_t width) {
+    switch (depth) {
+    case 1:
+        return pack_bmi2_depth(idx, dst, width, 1);
+    case 2:
+        return pack_bmi2_depth(idx, dst, width, 2);
+    default:
+        return pack_bmi2_depth(idx, dst, width, 4);
+    }
+}
+#endif
+
+// --- Table fallback ---
+
+// The 8 / depth pixels of every byte value, already through the map
+typedef uint8_t Unpack_Table[256][8];
+
+static void build_unpack_table(Unpack_Table table, uint8_t depth,
+                               const uint8_t *map) {
+    uint32_t per_byte = 8 / depth;
+    for (int b = 0; b < 256; b++) {
+        uint8_t byte = (uint8_t)b;
+        for (uint32_t i = 0; i < per_byte; i++) {
+            uint8_t v = get_pixel(&byte, depth, i);
+            table[b][i] = map ? map[v] : v;
+        }
+    }
+}
+
+static uint32_t unpack_table(const uint8_t *src, uint8_t depth, uint8_t *idx,
+                             uint32_t width, const Unpack_Table table) {
+    uint32_t per_byte = 8 / depth;
+    uint32_t x = 0;
+    for (; x + per_byte <= width; x += per_byte) {
+        memcpy(idx + x, table[src[x / per_byte]], per_byte);
+    }
+    return x;
+}
+
+// --- Rows ---
+
+// 'table' is NULL when BMI2 is used
+static void unpack_row(const uint8_t *src, uint8_t depth, uint8_t *idx,
+                       uint32_t width, const uint8_t *map,
+                       const Unpack_Table table) {
+    if (depth == 8) {
+        memcpy(idx, src, width);
+        apply_lut1(idx, width, map);
+        return;
+    }
+    uint32_t x = 0;
+    if (table) {
+        x = unpack_table(src, depth, idx, width, table);
+        for (; x < width; x++) {
+            uint8_t v = get_pixel(src, depth, x);
+            idx[x] = map ? map[v] : v;
+        }
+        return;
+    }
+#ifdef REPACK_X86
+    x = unpack_bmi2(src, depth, idx, width);
+#endif
+    for (; x < width; x++) {
+        idx[x] = get_pixel(src, depth, x);
+    }
+    apply_lut1(idx, width, map);
+}
+
+static void pack_row(const uint8_t *idx, uint8_t *dst, uint8_t depth,
+                     uint32_t width, bool bmi2) {
+    if (depth == 8) {
+        memcpy(dst, idx, width);
+        return;
+    }
+    uint32_t x = 0;
+#ifdef REPACK_X86
+    if (bmi2) {
+        x = pack_bmi2(idx, dst, depth, width);
+    }
+#endif
+    // Whole bytes of pixels, the last one zero-filled past 'width'
+    const uint8_t mask = (uint8_t)((1u << depth) - 1);
+    const uint32_t per_byte = 8 / depth;
+    for (; x < width; x += per_byte) {
+        uint8_t byte = 0;
+        for (uint32_t i = 0; i < per_byte; i++) {
+            uint8_t v = (x + i < width) ? idx[x + i] & mask : 0;
+            byte |= (uint8_t)(v << (8 - depth * (i + 1)));
+        }
+        dst[x / per_byte] = byte;
+    }
+}
+
+static uint32_t count_wide(const uint8_t *idx, uint32_t width,
+                           uint8_t depth) {
+    uint32_t n = 0;
+    for (uint32_t x = 0; x < width; x++) {
+        n += (idx[x] >> depth) != 0;
+    }
+    return n;
+}
+
+int64_t repack_rows(const uint8_t *src, uint32_t src_row_size,
+                    uint8_t src_depth, uint8_t *dst, uint32_t dst_row_size,
+                    uint8_t dst_depth, uint32_t width, uint32_t height,
+                    const uint8_t *map) {
+    if (!src || !dst || !valid_depth(src_depth) || !valid_depth(dst_depth)) {
+        return -1;
+    }
+    const uint32_t dst_used = (width * dst_depth + 7) / 8;
+    if (dst_row_size < dst_used) {
+        return -1;
+    }
+
+    const bool bmi2 = cpu_has_bmi2();
+    Unpack_Table table;
+    if (src_depth < 8 && !bmi2) {
+        build_unpack_table(table, src_depth, map);
+    }
+    // 8-bit sources without a map are packed straight from the source row
+    const bool direct = src_depth == 8 && !map;
+
+    int64_t wide = 0;
+    bool failed = false;
+
+#pragma omp parallel reduction(+ : wide)
+    {
+        // 8-bit destinations unpack in place, others need a row of indices
+        uint8_t *idx = (dst_depth == 8 || direct) ? NULL : malloc(width + 1);
+
+#pragma omp for schedule(static)
+        for (int y = 0; y < (int)height; y++) {
+            const uint8_t *s = src + (size_t)y * src_row_size;
+            uint8_t *d = dst + (size_t)y * dst_row_size;
+            const uint8_t *pixels = s;
+
+            if (!direct) {
+                uint8_t *out = (dst_depth == 8) ? d : idx;
+                if (!out) {
+#pragma omp atomic write
+                    failed = true;
+                    continue;
+                }
+                unpack_row(s, src_depth, out, width, map,
+                           (src_depth < 8 && !bmi2) ? table : NULL);
+                pixels = out;
+            }
+            if (dst_depth < 8) {
+                wide += count_wide(pixels, width, dst_depth);
+            }
+            if (pixels != d) {
+                pack_row(pixels, d, dst_depth, width, bmi2);
+            }
+            memset(d + dst_used, 0, dst_row_size - dst_used);
+        }
+        free(idx);
+    }
+    return failed ? -1 : wide;
+}
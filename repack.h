@@ -0,0 +1,26 @@
+#ifndef REPACK_H
+#define REPACK_H
+
+#include <stdint.h>
+
+// Bulk conversion of packed index rows between 1, 2, 4 and 8 bits per
+// pixel. Pixels are in BMP order, the first pixel of a byte in its most
+// significant bits. Each row is unpacked to one byte per pixel, optionally
+// remapped through a 256 entry table, and packed to the new depth. With
+// BMI2 both directions move eight pixels per pdep / pext, otherwise the
+// unpack is a byte -> pixels table and the pack is shifts. 8-bit planes
+// are just rows of a different size, so the same call turns indices into
+// an 8-bit plane and back.
+
+// Convert 'height' rows, split into bands across threads. Row sizes are in
+// bytes and include the padding, which is zeroed in the destination.
+// map : index -> index table applied on the way, 256 entries, or NULL
+// Returns the number of pixels whose (mapped) index does not fit in
+// dst_depth, they keep their low bits. -1 for an unsupported depth or an
+// allocation failure.
+int64_t repack_rows(const uint8_t *src, uint32_t src_row_size,
+                    uint8_t src_depth, uint8_t *dst, uint32_t dst_row_size,
+                    uint8_t dst_depth, uint32_t width, uint32_t height,
+                    const uint8_t *map);
+
+#endif
@@ -0,0 +1,34 @@
+#include "report.h"
+#include <stdarg.h>
+#include <string.h>
+
+#define REPORT_MAX 256
+
+// One message per thread, jobs on other threads never see it
+static _Thread_local char last_error[REPORT_MAX];
+
+void report_error(const char *format, ...) {
+    char message[REPORT_MAX];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+#ifdef IMAGECOPY_DEBUG
+    fprintf(stderr, "%s", message);
+#endif
+    // The first error is the cause, later ones are what it broke
+    if (last_error[0]) {
+        return;
+    }
+    memcpy(last_error, message, sizeof(message));
+
+    // Messages are written like lines, the newline is not part of them
+    size_t len = strlen(last_error);
+    while (len && last_error[len - 1] == '\n') {
+        last_error[--len] = '\0';
+    }
+}
+
+const char *report_last_error(void) { return last_error; }
+
+void report_clear(void) { last_error[0] = '\0'; }
@@ -0,0 +1,37 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdio.h>
+
+// Diagnostics for the library code, which never writes to the console on
+// its own.
+//
+// DEBUG_LOG is printf in builds with -DIMAGECOPY_DEBUG (make DEBUG=1) and
+// compiles to nothing otherwise, the arguments are still type checked.
+//
+// report_error keeps the first error message since report_clear for the
+// calling thread. The API clears it on entry and copies it into the
+// context, imagecopy_error() hands it out. Debug builds print every
+// message to stderr as well.
+
+#ifdef IMAGECOPY_DEBUG
+#define DEBUG_LOG(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_LOG(...)                                                         \
+    do {                                                                       \
+        if (0) {                                                               \
+            printf(__VA_ARGS__);                                               \
+        }                                                                      \
+    } while (0)
+#endif
+
+#if defined(__GNUC__)
+__attribute__((format(printf, 1, 2)))
+#endif
+void report_error(const char *format, ...);
+
+// First report_error message on this thread since report_clear, or ""
+const char *report_last_error(void);
+void report_clear(void);
+
+#endif
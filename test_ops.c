@@ -0,0 +1,792 @@
+// Self-consistency tests of the ops, through the library API on BMPs built
+// in memory. make test builds and runs them.
+//
+// - A fused --ops pipeline against the same steps run one at a time.
+// - Every form of the 24-bit invert against the others.
+// - Blur and filter on the tile engine against the whole-image routines,
+//   on images tall enough for several tiles and with padded rows.
+// - The 24-bit filter, channel by channel, against the 8-bit one.
+// - Rotate and flip at every bit depth against the pixel mapping they
+//   stand for, with the file size checked against the header.
+// - The orientation of --kernel weights.
+// - The 24-bit histogram against the pixel values.
+// - A crop of a file that ends early.
+// - Headers that would make an op write past its buffers are refused.
+
+#include "box_blur.h"
+#include "imagecopy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                       \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                        \
+            printf(__VA_ARGS__);                                               \
+            printf("\n");                                                      \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+} Bmp;
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t row_size(uint32_t width, uint8_t depth) {
+    return (uint32_t)(((uint64_t)width * depth + 31) / 32) * 4;
+}
+
+static uint32_t bmp_width(const Bmp *bmp) { return get_u32(bmp->data + 18); }
+static uint32_t bmp_height(const Bmp *bmp) { return get_u32(bmp->data + 22); }
+static uint8_t bmp_depth(const Bmp *bmp) { return bmp->data[28]; }
+
+// Row y from the top
+static uint8_t *bmp_row(const Bmp *bmp, uint32_t y) {
+    uint32_t height = bmp_height(bmp);
+    return bmp->data + get_u32(bmp->data + 10) +
+           (size_t)(height - 1 - y) *
+               row_size(bmp_width(bmp), bmp_depth(bmp));
+}
+
+// Index, or BGR as 0xRRGGBB, of pixel x, y from the top left
+static uint32_t bmp_pixel(const Bmp *bmp, uint32_t x, uint32_t y) {
+    const uint8_t *row = bmp_row(bmp, y);
+    uint8_t depth = bmp_depth(bmp);
+    if (depth == 24) {
+        row += (size_t)x * 3;
+        return row[0] | row[1] << 8 | (uint32_t)row[2] << 16;
+    }
+    uint32_t bit = x * depth;
+    return (row[bit / 8] >> (8 - depth - bit % 8)) & ((1u << depth) - 1);
+}
+
+// A width x height image of the given depth, a gray color table for the
+// indexed ones. The pixels are a mix of gradients and a pattern so no two
+// neighbours agree in every direction.
+static Bmp make_bmp(uint32_t width, uint32_t height, uint8_t depth) {
+    uint32_t colors = depth <= 8 ? 1u << depth : 0;
+    uint32_t offset = 14 + 40 + colors * 4;
+    uint32_t stride = row_size(width, depth);
+    Bmp bmp = {.size = offset + (size_t)stride * height};
+    bmp.data = calloc(bmp.size, 1);
+    if (!bmp.data) {
+        return bmp;
+    }
+    uint8_t *d = bmp.data;
+    d[0] = 'B';
+    d[1] = 'M';
+    put_u32(d + 2, (uint32_t)bmp.size);
+    put_u32(d + 10, offset);
+    put_u32(d + 14, 40);
+    put_u32(d + 18, width);
+    put_u32(d + 22, height);
+    d[26] = 1;
+    d[28] = depth;
+    put_u32(d + 34, stride * height);
+    put_u32(d + 38, 2835);
+    put_u32(d + 42, 2835);
+    put_u32(d + 46, colors);
+    for (uint32_t i = 0; i < colors; i++) {
+        uint8_t v = (uint8_t)(i * 255 / (colors - 1));
+        memset(d + 54 + i * 4, v, 3);
+    }
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = bmp_row(&bmp, y);
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t v = x * 7 + y * 13 + (x * y) % 11 + (x ^ y) % 5;
+            if (depth == 24) {
+                row[x * 3 + 0] = (uint8_t)v;
+                row[x * 3 + 1] = (uint8_t)(x * 3 + y);
+                row[x * 3 + 2] = (uint8_t)(255 - y * 5 + x);
+            } else {
+                uint32_t bit = x * depth;
+                v &= (1u << depth) - 1;
+                row[bit / 8] |= (uint8_t)(v << (8 - depth - bit % 8));
+            }
+        }
+    }
+    return bmp;
+}
+
+// The result of running the options on the image, NULL data on failure
+static Bmp run(const Bmp *in, const Imagecopy_Options *options) {
+    Bmp out = {0};
+    Imagecopy *ctx = imagecopy_create();
+    const void *data = NULL;
+    size_t size = 0;
+    if (!ctx) {
+        return out;
+    }
+    if (imagecopy_set_options(ctx, options) ||
+        imagecopy_load_memory(ctx, in->data, in->size) ||
+        imagecopy_process(ctx) ||
+        imagecopy_write_memory(ctx, &data, &size)) {
+        printf("  %s\n", imagecopy_error(ctx));
+    } else if ((out.data = malloc(size))) {
+        memcpy(out.data, data, size);
+        out.size = size;
+    }
+    imagecopy_destroy(ctx);
+    return out;
+}
+
+// The file is as long as its header says, and the pixel array is the rows
+// the header describes
+static bool header_matches(const Bmp *bmp, const char *what) {
+    uint32_t pixels = row_size(bmp_width(bmp), bmp_depth(bmp)) *
+                      bmp_height(bmp);
+    bool ok = bmp->size == get_u32(bmp->data + 2) &&
+              get_u32(bmp->data + 34) == pixels &&
+              bmp->size == get_u32(bmp->data + 10) + (size_t)pixels;
+    CHECK(ok, "%s: %zu bytes, header %u, pixel array %u of %u", what,
+          bmp->size, get_u32(bmp->data + 2), get_u32(bmp->data + 34),
+          pixels);
+    return ok;
+}
+
+static bool same_bytes(const Bmp *a, const Bmp *b, const char *what) {
+    if (!a->data || !b->data) {
+        CHECK(false, "%s: no result", what);
+        return false;
+    }
+    if (a->size != b->size) {
+        CHECK(false, "%s: %zu bytes against %zu", what, a->size, b->size);
+        return false;
+    }
+    for (size_t i = 0; i < a->size; i++) {
+        if (a->data[i] != b->data[i]) {
+            CHECK(false, "%s: first difference at byte %zu", what, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The pixel arrays only, for a result against a BMP built here
+static bool same_pixels(const Bmp *a, const Bmp *b, const char *what) {
+    if (!a->data || !b->data) {
+        CHECK(false, "%s: no result", what);
+        return false;
+    }
+    Bmp pixels_a = {a->data + get_u32(a->data + 10),
+                    a->size - get_u32(a->data + 10)};
+    Bmp pixels_b = {b->data + get_u32(b->data + 10),
+                    b->size - get_u32(b->data + 10)};
+    return same_bytes(&pixels_a, &pixels_b, what);
+}
+
+// --- Fused against sequential ---
+
+// Options of the single op that runs a step
+static void step_options(const Imagecopy_Step *step,
+                         Imagecopy_Options *options) {
+    imagecopy_options_init(options);
+    options->op = step->op;
+    options->mono_threshold = step->mono_threshold;
+    options->degrees = step->degrees;
+    options->flip_vertical = step->flip_vertical;
+    options->blur_level = step->blur_level;
+    options->filter = step->filter;
+    memcpy(options->tone_steps, step->tone_steps,
+           sizeof(options->tone_steps));
+    options->tone_step_count = step->tone_step_count;
+}
+
+static void test_pipeline(const Bmp *in, const Imagecopy_Step *steps,
+                          uint8_t step_count, const char *what) {
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
+    memcpy(options.steps, steps, step_count * sizeof(*steps));
+    options.step_count = step_count;
+    Bmp fused = run(in, &options);
+
+    Bmp sequential = {0};
+    for (uint8_t i = 0; i < step_count; i++) {
+        step_options(&steps[i], &options);
+        Bmp next = run(i ? &sequential : in, &options);
+        free(sequential.data);
+        sequential = next;
+        if (!sequential.data) {
+            break;
+        }
+    }
+    if (same_bytes(&fused, &sequential, what)) {
+        header_matches(&fused, what);
+    }
+    free(fused.data);
+    free(sequential.data);
+}
+
+static Imagecopy_Step step(Imagecopy_Op op) {
+    Imagecopy_Options defaults;
+    imagecopy_options_init(&defaults);
+    Imagecopy_Step s = {
+        .op = op,
+        .mono_threshold = defaults.mono_threshold,
+        .dither_mode = defaults.dither_mode,
+    };
+    return s;
+}
+
+static Imagecopy_Step blur_step(uint16_t level) {
+    Imagecopy_Step s = step(IMAGECOPY_BLUR);
+    s.blur_level = level;
+    return s;
+}
+
+static Imagecopy_Step filter_step(const char *name) {
+    Imagecopy_Step s = step(IMAGECOPY_FILTER);
+    s.filter = name;
+    return s;
+}
+
+static Imagecopy_Step rotate_step(int16_t degrees) {
+    Imagecopy_Step s = step(IMAGECOPY_ROTATE);
+    s.degrees = degrees;
+    return s;
+}
+
+static Imagecopy_Step bright_step(int16_t value) {
+    Imagecopy_Step s = step(IMAGECOPY_TONE);
+    s.tone_steps[0].op = IMAGECOPY_TONE_BRIGHT;
+    s.tone_steps[0].value = value;
+    s.tone_step_count = 1;
+    return s;
+}
+
+static void test_fused(void) {
+    // 77 pixels: 8-bit rows carry 3 bytes of padding, 24-bit rows 1
+    Bmp indexed = make_bmp(77, 31, 8);
+    Bmp rgb = make_bmp(77, 31, 24);
+
+    Imagecopy_Step blur_filter[] = {
+        step(IMAGECOPY_INVERT), blur_step(2),  filter_step("sharpen"),
+        bright_step(20),        blur_step(1),
+    };
+    test_pipeline(&indexed, blur_filter, 5, "8-bit invert, blur, filter");
+
+    Imagecopy_Step filters[] = {
+        filter_step("emboss"),
+        step(IMAGECOPY_INVERT),
+        filter_step("edge"),
+    };
+    test_pipeline(&indexed, filters, 3, "8-bit filter, invert, filter");
+
+    Imagecopy_Step barriers[] = {
+        rotate_step(90),
+        blur_step(1),
+        step(IMAGECOPY_FLIP),
+        step(IMAGECOPY_INVERT),
+    };
+    test_pipeline(&indexed, barriers, 4, "8-bit rotate, blur, flip");
+
+    Imagecopy_Step rgb_steps[] = {
+        step(IMAGECOPY_GRAY),       blur_step(1), step(IMAGECOPY_SEPIA),
+        step(IMAGECOPY_INVERT_RGB), blur_step(3),
+    };
+    test_pipeline(&rgb, rgb_steps, 5, "24-bit gray, blur, sepia, blur");
+
+    Imagecopy_Step rgb_barriers[] = {
+        bright_step(-30),
+        rotate_step(270),
+        blur_step(2),
+        step(IMAGECOPY_INVERT_HSV),
+    };
+    test_pipeline(&rgb, rgb_barriers, 4, "24-bit rotate, blur, invert");
+
+    // The example of the --ops help text
+    Imagecopy_Step example[] = {
+        step(IMAGECOPY_GRAY),
+        blur_step(3),
+        filter_step("sharpen"),
+        rotate_step(90),
+    };
+    test_pipeline(&rgb, example, 4, "24-bit gray,blur:3,filter:sharpen,rot:90");
+    test_pipeline(&indexed, example, 4,
+                  "8-bit gray,blur:3,filter:sharpen,rot:90");
+
+    // Plain invert on 24-bit is the RGB invert, fused like it
+    Imagecopy_Step rgb_invert[] = {
+        step(IMAGECOPY_INVERT),
+        blur_step(1),
+        step(IMAGECOPY_INVERT),
+    };
+    test_pipeline(&rgb, rgb_invert, 3, "24-bit invert, blur, invert");
+
+    free(indexed.data);
+    free(rgb.data);
+}
+
+// -i, inv:r and a tone chain invert give the same 24-bit image
+static void test_invert_rgb(void) {
+    Bmp in = make_bmp(77, 31, 24);
+    if (!in.data) {
+        CHECK(false, "out of memory");
+        return;
+    }
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
+    options.op = IMAGECOPY_INVERT_RGB;
+    Bmp rgb = run(&in, &options);
+
+    options.op = IMAGECOPY_INVERT;
+    Bmp plain = run(&in, &options);
+    if (same_bytes(&plain, &rgb, "24-bit invert against inv:r")) {
+        header_matches(&plain, "24-bit invert");
+    }
+
+    options.op = IMAGECOPY_TONE;
+    options.tone_steps[0].op = IMAGECOPY_TONE_INVERT;
+    options.tone_step_count = 1;
+    Bmp tone = run(&in, &options);
+    same_bytes(&tone, &rgb, "24-bit tone invert against inv:r");
+
+    free(tone.data);
+    free(plain.data);
+    free(rgb.data);
+    free(in.data);
+}
+
+// --- Tiled against whole image ---
+
+// Taller than the tiles of any usual L2, so the chain runs on several
+static void test_tiled_blur(uint8_t depth, uint32_t height) {
+    Bmp in = make_bmp(77, height, depth);
+    uint8_t channels = depth == 24 ? 3 : 1;
+    Imagecopy_Step steps[] = {blur_step(2), step(IMAGECOPY_COPY)};
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
+    memcpy(options.steps, steps, sizeof(steps));
+    options.step_count = 2;
+    Bmp tiled = run(&in, &options);
+
+    // The whole-image blur on the rows of the input, in place
+    uint8_t **rows = malloc(height * sizeof(uint8_t *));
+    for (uint32_t y = 0; rows && y < height; y++) {
+        rows[y] = bmp_row(&in, y);
+    }
+    bool ok = rows && box_blur_level(rows, 77, height, channels, 2);
+    CHECK(ok, "%u-bit whole-image blur failed", depth);
+
+    char what[64];
+    snprintf(what, sizeof(what), "%u-bit 77x%u blur, tiled", depth, height);
+    if (ok && same_pixels(&tiled, &in, what)) {
+        header_matches(&tiled, what);
+    }
+    free(rows);
+    free(tiled.data);
+    free(in.data);
+}
+
+static void test_tiled_filter(const char *name, uint32_t width,
+                              uint32_t height) {
+    Bmp in = make_bmp(width, height, 8);
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
+    options.op = IMAGECOPY_FILTER;
+    options.filter = name;
+    Bmp whole = run(&in, &options);
+
+    Imagecopy_Step steps[] = {filter_step(name), step(IMAGECOPY_COPY)};
+    imagecopy_options_init(&options);
+    memcpy(options.steps, steps, sizeof(steps));
+    options.step_count = 2;
+    Bmp tiled = run(&in, &options);
+
+    char what[64];
+    snprintf(what, sizeof(what), "8-bit %ux%u %s, tiled", width, height,
+             name);
+    if (same_bytes(&tiled, &whole, what)) {
+        header_matches(&tiled, what);
+    }
+    free(whole.data);
+    free(tiled.data);
+    free(in.data);
+}
+
+// A 24-bit filter runs on each channel the way the 8-bit filter runs on
+// indices: an 8-bit gray image and its copy with each index in all three
+// channels give the same values.
+static void test_filter_channels(const char *name) {
+    const uint32_t width = 77, height = 31;
+    Bmp indexed = make_bmp(width, height, 8);
+    Bmp rgb = make_bmp(width, height, 24);
+    for (uint32_t y = 0; indexed.data && rgb.data && y < height; y++) {
+        uint8_t *row = bmp_row(&rgb, y);
+        for (uint32_t x = 0; x < width; x++) {
+            memset(row + x * 3, (int)bmp_pixel(&indexed, x, y), 3);
+        }
+    }
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
+    options.op = IMAGECOPY_FILTER;
+    options.filter = name;
+    Bmp filtered1 = run(&indexed, &options);
+    Bmp filtered3 = run(&rgb, &options);
+
+    char what[64];
+    snprintf(what, sizeof(what), "24-bit %s against 8-bit", name);
+    if (!filtered1.data || !filtered3.data) {
+        CHECK(false, "%s: no result", what);
+    } else if (header_matches(&filtered3, what)) {
+        uint32_t wrong = 0;
+        for (uint32_t y = 0; y < height; y++) {
+            for (uint32_t x = 0; x < width; x++) {
+                uint32_t v = bmp_pixel(&filtered1, x, y);
+                wrong += bmp_pixel(&filtered3, x, y) != (v | v << 8 | v << 16);
+            }
+        }
+        CHECK(!wrong, "%s: %u pixels differ", what, wrong);
+    }
+    free(filtered1.data);
+    free(filtered3.data);
+    free(indexed.data);
+    free(rgb.data);
+}
+
+// --- Rotate and flip ---
+
+enum { ROT_90, ROT_180, ROT_270, FLIP_H, FLIP_V };
+
+// Where pixel x, y of a width x height image lands
+static void moved_to(int move, uint32_t width, uint32_t height, uint32_t x,
+                     uint32_t y, uint32_t *to_x, uint32_t *to_y) {
+    switch (move) {
+    case ROT_90: // clockwise
+        *to_x = height - 1 - y;
+        *to_y = x;
+        break;
+    case ROT_180:
+        *to_x = width - 1 - x;
+        *to_y = height - 1 - y;
+        break;
+    case ROT_270:
+        *to_x = y;
+        *to_y = width - 1 - x;
+        break;
+    case FLIP_H:
+        *to_x = width - 1 - x;
+        *to_y = y;
+        break;
+    default:
+        *to_x = x;
+        *to_y = height - 1 - y;
+        break;
+    }
+}
+
+static void test_move(uint8_t depth, int move) {
+    static const char *names[] = {"rot 90", "rot 180", "rot 270", "flip h",
+                                  "flip v"};
+    // Neither side a multiple of 4 or of 8, so every depth pads its rows
+    // both before and after a quarter turn
+    const uint32_t width = 37, height = 23;
+    Bmp in = make_bmp(width, height, depth);
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
+    if (move <= ROT_270) {
+        options.op = IMAGECOPY_ROTATE;
+        options.degrees = (int16_t)(90 * (move + 1));
+    } else {
+        options.op = IMAGECOPY_FLIP;
+        options.flip_vertical = move == FLIP_V;
+    }
+    Bmp out = run(&in, &options);
+
+    char what[64];
+    snprintf(what, sizeof(what), "%u-bit %s", depth, names[move]);
+    if (!out.data) {
+        CHECK(false, "%s: no result", what);
+    } else if (header_matches(&out, what)) {
+        bool quarter = move == ROT_90 || move == ROT_270;
+        CHECK(bmp_width(&out) == (quarter ? height : width) &&
+                  bmp_height(&out) == (quarter ? width : height),
+              "%s: %ux%u", what, bmp_width(&out), bmp_height(&out));
+        uint32_t wrong = 0;
+        for (uint32_t y = 0; y < height; y++) {
+            for (uint32_t x = 0; x < width; x++) {
+                uint32_t to_x, to_y;
+                moved_to(move, width, height, x, y, &to_x, &to_y);
+                wrong += bmp_pixel(&out, to_x, to_y) != bmp_pixel(&in, x, y);
+            }
+        }
+        CHECK(!wrong, "%s: %u pixels in the wrong place", what, wrong);
+    }
+    free(out.data);
+    free(in.data);
+}
+
+// --- Kernel orientation ---
+
+// A --kernel with a single weight of 1 at row ky, column kx of its n x n
+// block (as written, top row first) outputs the pixel that sits at that
+// place around each output pixel, 0 past the edges. A second weight at
+// the opposite corner keeps a large kernel off the separable path.
+static void test_kernel_orientation(uint32_t n, uint32_t ky, uint32_t kx,
+                                    bool corner) {
+    const uint32_t width = 45, height = 29;
+    Bmp in = make_bmp(width, height, 8);
+    char *spec = malloc((size_t)n * n * 3 + 32);
+    if (!spec || !in.data) {
+        CHECK(false, "out of memory");
+        free(spec);
+        free(in.data);
+        return;
+    }
+    uint32_t cy = n - 1 - ky;
+    uint32_t cx = n - 1 - kx;
+    char *p = spec;
+    for (uint32_t y = 0; y < n; y++) {
+        for (uint32_t x = 0; x < n; x++) {
+            bool one = (y == ky && x == kx) || (corner && y == cy && x == cx);
+            p += sprintf(p, "%d%c", one, x + 1 < n ? ' ' : ';');
+        }
+    }
+    sprintf(p, " divisor=1");
+
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
+    options.op = IMAGECOPY_FILTER;
+    options.kernel = spec;
+    Bmp out = run(&in, &options);
+
+    char what[64];
+    snprintf(what, sizeof(what), "%ux%u kernel, weight at row %u col %u",
+             n, n, ky, kx);
+    if (!out.data) {
+        CHECK(false, "%s: no result", what);
+    } else {
+        int32_t r = (int32_t)n / 2;
+        uint32_t wrong = 0;
+        for (int32_t y = 0; y < (int32_t)height; y++) {
+            for (int32_t x = 0; x < (int32_t)width; x++) {
+                uint32_t sum = 0;
+                for (int c = 0; c <= corner; c++) {
+                    int32_t sy = y + (int32_t)(c ? cy : ky) - r;
+                    int32_t sx = x + (int32_t)(c ? cx : kx) - r;
+                    if (sy >= 0 && sy < (int32_t)height && sx >= 0 &&
+                        sx < (int32_t)width) {
+                        sum += bmp_pixel(&in, sx, sy);
+                    }
+                }
+                wrong += bmp_pixel(&out, x, y) != (sum > 255 ? 255 : sum);
+            }
+        }
+        CHECK(!wrong, "%s: %u pixels wrong", what, wrong);
+        header_matches(&out, what);
+    }
+    free(out.data);
+    free(in.data);
+    free(spec);
+}
+
+// --- Untrusted headers ---
+
+// Status of loading the image, then processing it if the load passes
+static Imagecopy_Status load_status(const Bmp *in,
+                                    const Imagecopy_Options *options) {
+    Imagecopy *ctx = imagecopy_create();
+    if (!ctx) {
+        return IMAGECOPY_ERROR_MEMORY;
+    }
+    Imagecopy_Status status = imagecopy_set_options(ctx, options);
+    if (!status) {
+        status = imagecopy_load_memory(ctx, in->data, in->size);
+    }
+    if (!status) {
+        status = imagecopy_process(ctx);
+    }
+    imagecopy_destroy(ctx);
+    return status;
+}
+
+// A colors used count past what the depth can index is refused, the
+// palette ops would otherwise run past the color table
+static void test_colors_used(void) {
+    const uint8_t depths[] = {1, 4, 8};
+    for (int d = 0; d < 3; d++) {
+        Bmp in = make_bmp(9, 5, depths[d]);
+        if (!in.data) {
+            CHECK(false, "out of memory");
+            return;
+        }
+        put_u32(in.data + 46, 5000);
+        Imagecopy_Options options;
+        imagecopy_options_init(&options);
+        options.bright_value = 40;
+        Imagecopy_Status status = load_status(&in, &options);
+        CHECK(status == IMAGECOPY_ERROR_FORMAT,
+              "%u-bit, 5000 colors used: status %d", depths[d], status);
+        free(in.data);
+    }
+}
+
+// Three columns, red, green and blue, each counting every pixel once
+static void test_histogram24(void) {
+    const uint32_t width = 37, height = 11;
+    Bmp in = make_bmp(width, height, 24);
+    if (!in.data) {
+        CHECK(false, "out of memory");
+        return;
+    }
+    uint64_t expected[3][256] = {{0}};
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = bmp_row(&in, y);
+        for (uint32_t x = 0; x < width; x++) {
+            for (int c = 0; c < 3; c++) {
+                expected[c][row[x * 3 + 2 - c]]++;
+            }
+        }
+    }
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
+    options.op = IMAGECOPY_HIST;
+    Bmp out = run(&in, &options);
+    CHECK(out.data, "24-bit histogram failed");
+    if (out.data) {
+        // NUL terminated for sscanf
+        char *text = calloc(out.size + 1, 1);
+        const char *line = text;
+        int lines = 0;
+        if (text) {
+            memcpy(text, out.data, out.size);
+            unsigned long long r, g, b;
+            int used;
+            while (lines < 256 &&
+                   sscanf(line, "%llu %llu %llu\n%n", &r, &g, &b, &used) ==
+                       3) {
+                if (r != expected[0][lines] || g != expected[1][lines] ||
+                    b != expected[2][lines]) {
+                    CHECK(false, "24-bit histogram, value %d: %llu %llu %llu",
+                          lines, r, g, b);
+                    break;
+                }
+                line += used;
+                lines++;
+            }
+        }
+        CHECK(lines == 256 && *line == '\0',
+              "24-bit histogram: %d lines read", lines);
+        free(text);
+    }
+    free(out.data);
+    free(in.data);
+}
+
+// A crop of a file that ends early reads what is there and zeros for the
+// rest, like a full load. 'x' picks the read: whole rows at 0 and the full
+// width, a read per row, or at 4 bits an odd x shifted into place.
+static void test_crop_short(uint8_t depth, uint32_t x, uint32_t crop_width) {
+    const uint32_t width = 40, height = 20;
+    Bmp full = make_bmp(width, height, depth);
+    if (!full.data) {
+        CHECK(false, "out of memory");
+        return;
+    }
+    uint32_t offset = get_u32(full.data + 10);
+    uint32_t stride = row_size(width, depth);
+    // The file ends 7 bytes into the 6th row from the bottom
+    Bmp cut = {full.data, offset + (size_t)stride * 5 + 7};
+
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
+    options.crop = true;
+    options.crop_x = x;
+    options.crop_y = 0;
+    options.crop_width = crop_width;
+    options.crop_height = height;
+    Bmp out = run(&cut, &options);
+    CHECK(out.data, "%u-bit crop of a short file failed", depth);
+    for (uint32_t cy = 0; out.data && cy < height; cy++) {
+        for (uint32_t cx = 0; cx < crop_width; cx++) {
+            size_t byte = offset + (size_t)(height - 1 - cy) * stride +
+                          (size_t)(x + cx) * depth / 8;
+            uint32_t expected =
+                byte < cut.size ? bmp_pixel(&full, x + cx, cy) : 0;
+            uint32_t got = bmp_pixel(&out, cx, cy);
+            if (got != expected) {
+                CHECK(false, "%u-bit crop at %u of a short file, pixel %u,%u: "
+                      "%u, expected %u", depth, x, cx, cy, got, expected);
+                cy = height;
+                break;
+            }
+        }
+    }
+    free(out.data);
+    free(full.data);
+}
+
+// A depth too small for the colors in use is refused by the process step,
+// not left for the writer to trip over
+static void test_set_depth_refused(void) {
+    Bmp in = make_bmp(9, 5, 8);
+    if (!in.data) {
+        CHECK(false, "out of memory");
+        return;
+    }
+    Imagecopy_Options options;
+    imagecopy_options_init(&options);
+    options.bit_depth = 1;
+    Imagecopy_Status status = load_status(&in, &options);
+    CHECK(status == IMAGECOPY_ERROR_UNSUPPORTED,
+          "8-bit, 256 colors to 1-bit: status %d", status);
+    free(in.data);
+}
+
+int main(void) {
+    test_fused();
+    test_invert_rgb();
+
+    test_tiled_blur(8, 40000);
+    test_tiled_blur(24, 12000);
+    test_tiled_filter("emboss", 77, 40000);
+    test_tiled_filter("sharpen", 301, 9000);
+    test_filter_channels("emboss");
+    test_filter_channels("edge");
+
+    const uint8_t depths[] = {1, 2, 4, 8, 24};
+    for (int d = 0; d < 5; d++) {
+        for (int move = ROT_90; move <= FLIP_V; move++) {
+            test_move(depths[d], move);
+        }
+    }
+
+    // 3x3 taps one by one (separable), a non-separable 3x3 and a large
+    // kernel, direct or FFT depending on the cost model
+    for (uint32_t ky = 0; ky < 3; ky++) {
+        for (uint32_t kx = 0; kx < 3; kx++) {
+            test_kernel_orientation(3, ky, kx, false);
+        }
+    }
+    test_kernel_orientation(3, 0, 1, true);
+    test_kernel_orientation(31, 2, 20, true);
+
+    test_colors_used();
+    test_set_depth_refused();
+    test_histogram24();
+    test_crop_short(8, 0, 40);
+    test_crop_short(8, 3, 30);
+    test_crop_short(4, 5, 30);
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All tests passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+#include "tile.h"
+#include "report.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// When the L2 size is not known
+#define TILE_CACHE_DEFAULT (1024 * 1024)
+// Fewest rows of a tile, below this the halos cost more than they save
+#define TILE_ROWS_MIN 8
+// Fewest rows of a tile per halo row
+#define TILE_HALO_SHARE 16
+
+static size_t l2_size(void) {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (size > 0) {
+        return (size_t)size;
+    }
+#endif
+    return TILE_CACHE_DEFAULT;
+}
+
+bool tile_chain_add(Tile_Chain *chain, const Tile_Op *op) {
+    if (chain->op_count >= TILE_CHAIN_MAX || op->shape == TILE_BARRIER) {
+        return false;
+    }
+    Tile_Op *added = &chain->ops[chain->op_count++];
+    *added = *op;
+    if (added->shape == TILE_POINTWISE) {
+        added->halo = 0;
+    }
+    return true;
+}
+
+uint32_t tile_chain_halo(const Tile_Chain *chain) {
+    uint64_t halo = 0;
+    for (uint8_t i = 0; i < chain->op_count; i++) {
+        halo += chain->ops[i].halo;
+    }
+    return halo < chain->height ? (uint32_t)halo : chain->height;
+}
+
+uint32_t tile_rows(const Tile_Chain *chain) {
+    size_t cache = chain->cache_bytes ? chain->cache_bytes : l2_size();
+    size_t stride = (size_t)chain->width * chain->channels;
+    uint64_t halo = tile_chain_halo(chain);
+
+    // The two tile buffers fill the cache, the ops' own scratch is a few
+    // rows. The halo rows of a tile are worked on by every op and then
+    // thrown away, a tile keeps at least TILE_HALO_SHARE times as many
+    // rows as its halos even if it then spills to the next cache level.
+    uint64_t fit = cache / 2 / (stride ? stride : 1);
+    uint64_t rows = (fit > 2 * halo) ? fit - 2 * halo : 0;
+    if (rows < TILE_HALO_SHARE * 2 * halo) {
+        rows = TILE_HALO_SHARE * 2 * halo;
+    }
+    if (rows < TILE_ROWS_MIN) {
+        rows = TILE_ROWS_MIN;
+    }
+    if (rows > chain->height) {
+        rows = chain->height;
+    }
+    return (uint32_t)rows;
+}
+
+// One tile, output rows y0 to y1 - 1. The input rows within the halo of
+// the whole chain are copied in, and each op then gets the rows that the
+// ops after it still need, which shrink by its halo.
+static bool run_tile(const Tile_Chain *chain, uint32_t y0, uint32_t y1,
+                     uint32_t halo, uint8_t **cur, uint8_t **other) {
+    const size_t stride = (size_t)chain->width * chain->channels;
+    const uint32_t height = chain->height;
+    const uint32_t lo = (y0 > halo) ? y0 - halo : 0;
+    const uint32_t hi =
+        ((uint64_t)y1 + halo < height) ? y1 + halo : height;
+
+    for (uint32_t y = lo; y < hi; y++) {
+        memcpy(cur[y - lo], chain->src[y], stride);
+    }
+
+    uint32_t remaining = halo;
+    uint32_t a = lo;
+    uint32_t b = hi;
+    for (uint8_t i = 0; i < chain->op_count; i++) {
+        const Tile_Op *op = &chain->ops[i];
+        Tile tile = {
+            .rows = cur + (a - lo),
+            .out = other + (a - lo),
+            .width = chain->width,
+            .height = b - a,
+            .first_row = a,
+            .image_height = height,
+            .channels = chain->channels,
+        };
+        if (!op->run(op->context, &tile)) {
+            return false;
+        }
+        if (op->out_of_place) {
+            uint8_t **swap = cur;
+            cur = other;
+            other = swap;
+        }
+        remaining -= (op->halo < remaining) ? op->halo : remaining;
+        a = (y0 > remaining) ? y0 - remaining : 0;
+        b = ((uint64_t)y1 + remaining < height) ? y1 + remaining : height;
+    }
+
+    for (uint32_t y = y0; y < y1; y++) {
+        memcpy(chain->dst[y], cur[y - lo], stride);
+    }
+    return true;
+}
+
+bool tile_run(const Tile_Chain *chain) {
+    if (!chain->width || !chain->height) {
+        return true;
+    }
+    const size_t stride = (size_t)chain->width * chain->channels;
+    const uint32_t halo = tile_chain_halo(chain);
+    const uint32_t rows = tile_rows(chain);
+    const uint32_t tile_count = (chain->height + rows - 1) / rows;
+    uint64_t span = (uint64_t)rows + 2 * (uint64_t)halo;
+    if (span > chain->height) {
+        span = chain->height;
+    }
+    bool ok = true;
+
+#pragma omp parallel
+    {
+        // Each thread has its own pair of tile buffers. The rows of a
+        // buffer are contiguous, so an op can also take them as one block.
+        uint8_t *buffer[2] = {malloc(span * stride), malloc(span * stride)};
+        uint8_t **buffer_rows[2] = {malloc(span * sizeof(uint8_t *)),
+                                    malloc(span * sizeof(uint8_t *))};
+        bool have = buffer[0] && buffer[1] && buffer_rows[0] && buffer_rows[1];
+        if (have) {
+            for (int k = 0; k < 2; k++) {
+                for (uint64_t y = 0; y < span; y++) {
+                    buffer_rows[k][y] = buffer[k] + y * stride;
+                }
+            }
+        } else {
+#pragma omp atomic write
+            ok = false;
+        }
+
+#pragma omp for schedule(dynamic)
+        for (int t = 0; t < (int)tile_count; t++) {
+            if (!have) {
+                continue;
+            }
+            uint32_t y0 = (uint32_t)t * rows;
+            uint32_t y1 = (y0 + rows < chain->height) ? y0 + rows
+                                                      : chain->height;
+            if (!run_tile(chain, y0, y1, halo, buffer_rows[0],
+                          buffer_rows[1])) {
+#pragma omp atomic write
+                ok = false;
+            }
+        }
+
+        for (int k = 0; k < 2; k++) {
+            free(buffer[k]);
+            free(buffer_rows[k]);
+        }
+    }
+
+    if (!ok) {
+        report_error("Error: Could not run the tiles.\n");
+    }
+    return ok;
+}
@@ -0,0 +1,81 @@
+#ifndef TILE_H
+#define TILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Tiled execution of a chain of ops. The image is cut into tiles that fit
+// the L2 cache and each tile goes through every op of the chain before the
+// next tile starts, so the intermediate results stay in cache instead of
+// going through memory once per op. Tiles run in parallel.
+//
+// A tile is a band of whole rows. The ops here are row-local across a
+// row (pointwise ops, or stencils run as separable passes), so a band
+// needs a halo above and below only, and its left and right ends are the
+// image's.
+
+// What an op needs of the image, declared by each op of a chain
+typedef enum {
+    TILE_POINTWISE = 1, // each output pixel from the same input pixel
+    TILE_STENCIL,       // each output pixel from the rows within 'halo'
+    TILE_BARRIER        // needs the whole image, cannot be tiled
+} Tile_Shape;
+
+// The rows of one tile as an op gets them: 'height' rows of 'width'
+// pixels of 'channels' bytes, image rows first_row onwards. The rows are
+// contiguous, rows[i] == rows[0] + i * width * channels, so they are also
+// one block. 'out' rows of the same size are there for ops that cannot
+// write in place.
+typedef struct {
+    uint8_t **rows;
+    uint8_t **out;
+    uint32_t width, height;
+    uint32_t first_row;
+    uint32_t image_height;
+    uint8_t channels;
+} Tile;
+
+typedef struct {
+    Tile_Shape shape;
+    // Rows above and below each output row the op reads (TILE_STENCIL)
+    uint32_t halo;
+    // Result in tile->out instead of in place, the engine then swaps
+    bool out_of_place;
+    // false on failure (out of memory). Rows within 'halo' of an end of
+    // the tile that is not an end of the image come out wrong, the engine
+    // only keeps the rows that had their whole neighbourhood.
+    bool (*run)(void *context, const Tile *tile);
+    void *context;
+} Tile_Op;
+
+#define TILE_CHAIN_MAX 32
+
+typedef struct {
+    // Image rows top-down (any order, as long as both agree), the result
+    // goes to dst, src is only read. width * channels bytes of each row
+    // are written, padding is left alone.
+    uint8_t *const *src;
+    uint8_t *const *dst;
+    uint32_t width, height;
+    uint8_t channels;
+    Tile_Op ops[TILE_CHAIN_MAX];
+    uint8_t op_count;
+    // Working set of a tile, 0 for the size of the L2 cache
+    size_t cache_bytes;
+} Tile_Chain;
+
+// Append an op, false if the chain is full or the op is a barrier
+bool tile_chain_add(Tile_Chain *chain, const Tile_Op *op);
+
+// Sum of the halos of the ops
+uint32_t tile_chain_halo(const Tile_Chain *chain);
+
+// Rows per tile for the chain's working set
+uint32_t tile_rows(const Tile_Chain *chain);
+
+// Run the chain over every tile. false if a tile buffer could not be
+// allocated or an op failed, dst is then incomplete.
+bool tile_run(const Tile_Chain *chain);
+
+#endif